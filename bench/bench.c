@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include "bench.h"
+
+bool connectPair(SOCKET* a, SOCKET* b) {
+    /**
+     * @brief Two ends of a loopback TCP connection
+     */
+    struct sockaddr_in addr = {0};
+    int addr_len = sizeof(addr);
+    SOCKET l = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (l == INVALID_SOCKET
+            || bind(l, (struct sockaddr*) &addr, sizeof(addr)) == SOCKET_ERROR
+            || getsockname(l, (struct sockaddr*) &addr, &addr_len) == SOCKET_ERROR
+            || listen(l, 1) == SOCKET_ERROR) {
+        if (l != INVALID_SOCKET) closesocket(l);
+        return FALSE;
+    }
+    *a = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (*a == INVALID_SOCKET || connect(*a, (struct sockaddr*) &addr, sizeof(addr)) == SOCKET_ERROR) {
+        closesocket(l);
+        return FALSE;
+    }
+    *b = accept(l, NULL, NULL);
+    closesocket(l);
+    return *b != INVALID_SOCKET;
+}
+
+SOCKET connectServer(const char* host, const char* port) {
+    /**
+     * @brief TCP connection to `host`:`port`, or AF_UNIX connection to path `host` if `port` is NULL
+     */
+    ADDRINFOA hints = {0};
+    ADDRINFOA* res = NULL;
+    struct sockaddr_un local = {0};
+    SOCKET sock;
+    int err, one = 1;
+
+    if (!port) {
+        if (strlen(host) >= sizeof(local.sun_path)) return INVALID_SOCKET;
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, host);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+        err = connect(sock, (struct sockaddr*) &local, sizeof(local));
+    }
+    else {
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if (getaddrinfo(host, port, &hints, &res) != 0) return INVALID_SOCKET;
+        sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (sock == INVALID_SOCKET) {
+            freeaddrinfo(res);
+            return INVALID_SOCKET;
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*) &one, sizeof(one));
+        err = connect(sock, res->ai_addr, (int) res->ai_addrlen);
+        freeaddrinfo(res);
+    }
+    if (err == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+double elapsedMs(const LARGE_INTEGER* start) {
+    /**
+     * @brief Milliseconds since QueryPerformanceCounter() gave `start`
+     */
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double) (now.QuadPart - start->QuadPart) * 1000.0 / (double) freq.QuadPart;
+}
+
+double runPosters(DWORD n, void (*poster)()) {
+    /**
+     * @brief Start `n` threads running `poster` at once, wait for all
+     * @return seconds
+     */
+    HANDLE* threads = calloc(n, sizeof(HANDLE));
+    LARGE_INTEGER freq, start, end;
+    DWORD dwt, started = 0;
+
+    if (!threads) return 0;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (; started < n; started++) {
+        threads[started] = CreateThread(NULL, 0, (LPVOID) poster, NULL, 0, &dwt);
+        if (!threads[started]) break;
+    }
+    for (DWORD i = 0; i < started; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    QueryPerformanceCounter(&end);
+    free(threads);
+    return started == n ? (double) (end.QuadPart - start.QuadPart) / (double) freq.QuadPart : 0;
+}
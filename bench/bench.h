@@ -0,0 +1,20 @@
+#ifndef LAB6_BENCH_H
+#define LAB6_BENCH_H
+
+#include <winsock2.h>
+#include <windows.h>
+
+/*
+ *      Helpers shared by tests and benchmarks
+ */
+
+
+bool connectPair(SOCKET* a, SOCKET* b);
+SOCKET connectServer(const char* host, const char* port);
+double elapsedMs(const LARGE_INTEGER* start);
+double runPosters(DWORD n, void (*poster)());
+
+LONGLONG baseline_recvuntil(char delim, char **ptr, SOCKET sock);
+LONGLONG baseline_recvlen(ULONGLONG len, char **ptr, SOCKET sock);
+
+#endif //LAB6_BENCH_H
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../client/include/client.h"
+#include "../client/include/render.h"
+#include "bench.h"
+
+/*
+ *      Client output of a long catch-up (benchmark)
+ *
+ *      Builds /sync responses as the server sends them, SYNC_BATCH messages each from senders of
+ *      different colors, and passes them to recvMessages(): records are split, colored by sender
+ *      and queued for render.c, which writes them out. Only output is measured, no network.
+ *      Lines go to stdout, time to stderr: run it in a console, then with output redirected.
+ *
+ *      client_render.exe [messages]                console
+ *      client_render.exe [messages] > out.txt      redirected to file
+ */
+
+#define DEFAULT_MESSAGES 100000
+#define SYNC_BATCH 1000                 // Messages per /sync response
+#define SENDERS 7                       // Sender #ids cycle through that many colors
+#define RECORD_MAX 128                  // Longest record built
+
+
+int main(int argc, char** argv) {
+    ULONGLONG messages = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+    ULONGLONG responses = (messages + SYNC_BATCH - 1) / SYNC_BATCH;
+    char* buf = malloc(messages * RECORD_MAX + responses);
+    ULONGLONG* ends = calloc(responses + 1, sizeof(ULONGLONG));
+    const char* mode;
+    LARGE_INTEGER start;
+    ULONGLONG id = 1, len = 0;
+    DWORD console_mode;
+    double ms;
+
+    if (!messages || !buf || !ends) return 2;
+
+    // Responses are built first: records end with \0, response with an empty one
+    for (ULONGLONG r = 0; r < responses; r++) {
+        for (DWORD k = 0; k < SYNC_BATCH && id <= messages; k++, id++)
+            len += sprintf(buf + len, "#%llu [12:%02llu]  Anonim #%llu: catch-up message number %llu with some text",
+                           id, id / SYNC_BATCH % 60, id % SENDERS + 1, id) + 1;
+        buf[len++] = '\0';
+        ends[r + 1] = len;
+    }
+
+    renderInit();
+    if (!GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &console_mode)) mode = "redirected";
+    else mode = console_mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING ? "console (VT)" : "console (legacy)";
+
+    QueryPerformanceCounter(&start);
+    for (ULONGLONG r = 0; r < responses; r++)
+        recvMessages(buf + ends[r], (LONGLONG) (ends[r + 1] - ends[r]), TRUE);
+    renderFlush();
+    ms = elapsedMs(&start);
+
+    fprintf(stderr, "%-16s %llu messages (%llu bytes) in %.0f ms: %.0f msg/s\r\n",
+            mode, messages, len, ms, ms > 0 ? (double) messages * 1000.0 / ms : 0.0);
+    free(buf);
+    free(ends);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../server/include/config.h"
+#include "../server/include/model.h"
+#include "../server/include/blob.h"
+#include "bench.h"
+
+/*
+ *      Message History append: lock-free slots against one lock and a List (benchmark)
+ *
+ *      THREADS posters append PER_THREAD messages each to one board, as messageController()
+ *      threads do. Baseline is the former append: take a lock, number the message, append
+ *      it to a List. Afterwards every #id of the board must hold the message of that #id.
+ *
+ *      history_append.exe [threads] [per thread]
+ */
+
+#define DEFAULT_THREADS 32
+#define DEFAULT_PER_THREAD 200000
+#define BENCH_TEXT "benchmark message"
+
+static DWORD per_thread;
+static Board* board;
+static CRITICAL_SECTION cs_list;        // Baseline: lock ...
+static List* list_history;              //   ... and List of messages
+static ULONGLONG list_next_id = 1;
+
+
+static void slotPoster() {
+    for (DWORD i = 0; i < per_thread; i++)
+        appendMessage(board, newMessage(1, BENCH_TEXT, sizeof(BENCH_TEXT) - 1));
+}
+
+static void listPoster() {
+    Message* m;
+    for (DWORD i = 0; i < per_thread; i++) {
+        m = newMessage(1, BENCH_TEXT, sizeof(BENCH_TEXT) - 1);
+        EnterCriticalSection(&cs_list);
+        m->msg_id = list_next_id++;
+        list_append(list_history, m);
+        LeaveCriticalSection(&cs_list);
+    }
+}
+
+int main(int argc, char** argv) {
+    char* args[] = {argv[0], NULL};
+    SYSTEM_INFO si;
+    DWORD threads = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_THREADS;
+    ULONGLONG total, last;
+    double t_list, t_slots;
+    Message* m;
+
+    per_thread = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_PER_THREAD;
+    total = (ULONGLONG) threads * per_thread;
+    if (!threads || !per_thread || !parseServerArgs(1, args)) return 2;
+    initBlobStore();
+    initBoards();
+    board = getBoard(DEFAULT_BOARD, FALSE);
+    InitializeCriticalSection(&cs_list);
+    list_history = list();
+    if (!board || !list_history) return 2;
+
+    // Baseline first, its messages are freed before the board gets as many
+    t_list = runPosters(threads, listPoster);
+    while ((m = list_pop(list_history, 0)) != NULL) freeMessage(m);
+    t_slots = runPosters(threads, slotPoster);
+    if (t_list <= 0 || t_slots <= 0) return 2;
+
+    last = getLastMessageId(board);
+    for (ULONGLONG id = 1; id <= last; id++)
+        if (!(m = getMessage(board, id)) || m->msg_id != id) {
+            printf("#%llu is missing or has #id %llu\r\n", id, m ? m->msg_id : 0);
+            return 1;
+        }
+
+    GetSystemInfo(&si);
+    printf("%lu posters x %lu messages, %lu CPUs\r\n", threads, per_thread, si.dwNumberOfProcessors);
+    printf("lock + List:       %9.0f msg/s\r\n", (double) total / t_list);
+    printf("lock-free slots:   %9.0f msg/s, #1..#%llu contiguous\r\n", (double) total / t_slots, last);
+
+    free(list_history);
+    DeleteCriticalSection(&cs_list);
+    return last == total ? 0 : 1;
+}
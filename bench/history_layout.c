@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include <psapi.h>
+#include "../server/include/config.h"
+#include "../server/include/model.h"
+#include "../server/include/blob.h"
+#include "bench.h"
+
+/*
+ *      Message History layout: memory per message, sync formatting and header scan (benchmark)
+ *
+ *      Posts MESSAGES short text messages (TEXT_MIN..TEXT_MAX bytes) to one board in-process, then:
+ *        - bytes per message: growth of the working set over the posts, divided by their count
+ *        - sync formatting: every message formatted into a record of its own, as
+ *          sendMessageToClient() does for a sync ('#id [hh:mm]  Anonim #id: ' and body)
+ *        - header scan: every message looked up and its header fields read, as a sync walks
+ *          the history before it formats anything
+ *      Each pass runs PASSES times, best one is printed.
+ *
+ *      history_layout.exe [messages]
+ */
+
+#define DEFAULT_MESSAGES 10000000
+#define TEXT_MIN 25
+#define TEXT_MAX 70
+#define SENDERS 7                       // Sender #ids cycle through that many
+#define PASSES 3
+#define HEADER_LEN 128                  // As MSG_HEADER_LEN of service.c
+
+
+static SIZE_T workingSet() {
+    PROCESS_MEMORY_COUNTERS pmc = {0};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.WorkingSetSize;
+}
+
+static double formatPass(Board* b, ULONGLONG last, ULONGLONG* bytes) {
+    /**
+     * @brief Format #1..last as sync records, each in a buffer of its own
+     * @return milliseconds taken
+     */
+    LARGE_INTEGER start;
+    char header[HEADER_LEN], *record;
+    const char* body;
+    ULONGLONG header_len;
+    Message* m;
+    WORD hh, mm;
+
+    *bytes = 0;
+    QueryPerformanceCounter(&start);
+    EnterCriticalSection(&b->cs_mh);
+    for (ULONGLONG id = 1; id <= last; id++) {
+        if (!(m = getMessage(b, id)) || !(body = getMessageBody(m))) continue;
+        hh = (WORD) (m->timestamp / STAMP_MINUTE % 1440 / 60);
+        mm = (WORD) (m->timestamp / STAMP_MINUTE % 60);
+        header_len = sprintf(header, "#%llu [%02hu:%02hu]  Anonim #%lu: ", m->msg_id, hh, mm, m->src_id);
+        record = malloc(header_len + m->msg_len + 1);
+        if (!record) break;
+        memcpy(record, header, header_len);
+        memcpy(record + header_len, body, m->msg_len);
+        record[header_len + m->msg_len] = '\0';
+        *bytes += header_len + m->msg_len + 1;
+        free(record);
+    }
+    LeaveCriticalSection(&b->cs_mh);
+    return elapsedMs(&start);
+}
+
+static double scanPass(Board* b, ULONGLONG last, ULONGLONG* sum) {
+    /**
+     * @brief Look up #1..last and read #id, stamp, sender and length of each
+     * @return milliseconds taken
+     */
+    LARGE_INTEGER start;
+    Message* m;
+
+    *sum = 0;
+    QueryPerformanceCounter(&start);
+    EnterCriticalSection(&b->cs_mh);
+    for (ULONGLONG id = 1; id <= last; id++) {
+        if (!(m = getMessage(b, id))) continue;
+        *sum += m->msg_id ^ m->timestamp ^ m->src_id ^ m->msg_len;
+    }
+    LeaveCriticalSection(&b->cs_mh);
+    return elapsedMs(&start);
+}
+
+int main(int argc, char** argv) {
+    char* args[] = {argv[0], NULL};
+    char text[TEXT_MAX];
+    ULONGLONG messages = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+    ULONGLONG last, bytes, sum;
+    SIZE_T ws_before, ws_after;
+    double ms, best_format = 0, best_scan = 0;
+    DWORD len;
+    Board* b;
+    Message* m;
+
+    if (!messages || !parseServerArgs(1, args)) return 2;
+    initBlobStore();
+    initBoards();
+    if (!(b = getBoard(DEFAULT_BOARD, FALSE))) return 2;
+    memset(text, 'x', sizeof(text));
+
+    ws_before = workingSet();
+    for (ULONGLONG i = 0; i < messages; i++) {
+        len = TEXT_MIN + (DWORD) (i * 2654435761u % (TEXT_MAX - TEXT_MIN + 1));
+        m = newMessage((DWORD) (i % SENDERS) + 1, text, len);
+        if (!m || !appendMessage(b, m)) {
+            printf("Post %llu of %llu failed\r\n", i + 1, messages);
+            return 1;
+        }
+    }
+    ws_after = workingSet();
+    last = getLastMessageId(b);
+
+    for (DWORD pass = 0; pass < PASSES; pass++) {
+        ms = formatPass(b, last, &bytes);
+        if (ms > 0 && (best_format == 0 || ms < best_format)) best_format = ms;
+        ms = scanPass(b, last, &sum);
+        if (ms > 0 && (best_scan == 0 || ms < best_scan)) best_scan = ms;
+    }
+
+    printf("%llu messages of %d-%d bytes, %zu-byte header\r\n", last, TEXT_MIN, TEXT_MAX, sizeof(Message));
+    printf("bytes per message (working set): %.1f\r\n", (double) (ws_after - ws_before) / (double) last);
+    printf("sync formatting: %6.2f M msg/s (%llu bytes)\r\n", best_format > 0 ? (double) last / best_format / 1000.0 : 0.0, bytes);
+    printf("header scan:     %6.2f M msg/s (%llx)\r\n", best_scan > 0 ? (double) last / best_scan / 1000.0 : 0.0, sum);
+
+    destroyBoards();
+    destroyBlobStore();
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "../utils/include/mux.h"
+#include "../utils/include/recvbuf.h"
+#include "bench.h"
+
+/*
+ *      Chat latency during bulk transfer (test)
+ *
+ *      One connection over loopback, as between client and server: a bulk transfer on its own
+ *      stream, kept BULK_WINDOW bytes ahead of the socket until the last chat message arrives,
+ *      and a short chat message every PING_EVERY_MS on the control stream. Receiver measures how
+ *      long each chat message took. With round-robin framing a chat message waits for at most one
+ *      chunk of the transfer, not for all the data queued before it.
+ *
+ *      mux_latency.exe [limit ms]     fails if a chat message took longer than limit
+ */
+
+#define BULK_PIECE (1 << 20)            // Transfer is queued in pieces of 1 MB ...
+#define BULK_WINDOW (32 << 20)          //   ... up to 32 MB not sent yet
+#define PINGS 50
+#define PING_EVERY_MS 20
+#define DEFAULT_LIMIT_MS 100
+
+typedef struct Ping {
+    LONGLONG sent;                      // QueryPerformanceCounter() at sender
+    DWORD seq;
+} Ping;
+
+static volatile LONG bulk_queued;       // Bytes of transfer not sent yet
+static volatile bool chat_done;         // Receiver got every chat message, transfer ends
+
+
+static void bulkSent(void* ctx) {
+    InterlockedExchangeAdd(&bulk_queued, -BULK_PIECE);
+}
+
+static void bulkThread(Mux* m) {
+    /**
+     * @brief Sender side: transfer on a stream of its own until chat is over, then FIN
+     */
+    static char piece[BULK_PIECE];
+    DWORD stream_id = mux_openstream(m);
+
+    for (DWORD i = 0; i < BULK_PIECE; i++) piece[i] = (char) (i * 2654435761u >> 13);
+    while (!chat_done) {
+        if (bulk_queued >= BULK_WINDOW) {
+            Sleep(1);
+            continue;
+        }
+        InterlockedExchangeAdd(&bulk_queued, BULK_PIECE);
+        if (!mux_sendref(m, stream_id, piece, BULK_PIECE, FALSE, bulkSent, NULL)) return;
+    }
+    mux_send(m, stream_id, NULL, 0, TRUE);
+}
+
+static void chatThread(Mux* m) {
+    /**
+     * @brief Sender side: chat messages while the transfer is queued
+     */
+    LARGE_INTEGER now;
+    Ping p;
+
+    for (p.seq = 0; p.seq < PINGS; p.seq++) {
+        Sleep(PING_EVERY_MS);
+        QueryPerformanceCounter(&now);
+        p.sent = now.QuadPart;
+        mux_send(m, MUX_STREAM_CONTROL, (const char*) &p, sizeof(p), TRUE);
+    }
+}
+
+int main(int argc, char** argv) {
+    WSADATA wsa;
+    SOCKET a, b;
+    Mux *tx, *rx;
+    MuxFrame f;
+    HANDLE bulk, chat;
+    LARGE_INTEGER start, sent;
+    char *msg;
+    LONGLONG res;
+    ULONGLONG bulk_got = 0;
+    DWORD dwt, pings = 0, limit_ms = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_LIMIT_MS;
+    double ms, worst = 0, total = 0, bulk_ms = 0;
+    bool bulk_done = FALSE;
+
+    if (WSAStartup(0x0202, &wsa) != 0 || !connectPair(&a, &b)) {
+        fprintf(stderr, "Cannot open loopback connection\r\n");
+        return 2;
+    }
+    tx = mux_init(a);
+    rx = mux_init(b);
+    if (!tx || !rx) {
+        fprintf(stderr, "Cannot start multiplexer\r\n");
+        return 2;
+    }
+
+    QueryPerformanceCounter(&start);
+    bulk = CreateThread(NULL, 0, (LPVOID) bulkThread, (LPVOID) tx, 0, &dwt);
+    chat = CreateThread(NULL, 0, (LPVOID) chatThread, (LPVOID) tx, 0, &dwt);
+    if (!bulk || !chat) return 2;
+
+    // Receiver side: reassemble both streams, time chat messages
+    while (!bulk_done) {
+        if (mux_recvframe(rx, &f) <= 0) break;
+        if (f.stream_id != MUX_STREAM_CONTROL) {
+            bulk_got += f.len;
+            free(f.buf);
+            if (f.flags & FRAME_FIN) {
+                bulk_ms = elapsedMs(&start);
+                bulk_done = TRUE;
+            }
+            continue;
+        }
+        res = mux_collect(rx, &f, &msg);
+        if (res != sizeof(Ping)) continue;
+        sent.QuadPart = ((Ping*) msg)->sent;
+        ms = elapsedMs(&sent);
+        free(msg);
+        total += ms;
+        if (ms > worst) worst = ms;
+        if (++pings == PINGS) chat_done = TRUE;
+    }
+
+    WaitForSingleObject(chat, INFINITE);
+    WaitForSingleObject(bulk, INFINITE);
+    CloseHandle(chat);
+    CloseHandle(bulk);
+    printf("Bulk: %llu bytes in %.0f ms (%.0f MB/s), up to %d MB queued ahead of chat\r\n", bulk_got, bulk_ms,
+           bulk_ms > 0 ? (double) bulk_got / 1048576.0 * 1000.0 / bulk_ms : 0.0, BULK_WINDOW >> 20);
+    printf("Chat: %lu of %d messages, average %.2f ms, worst %.2f ms (limit %lu ms)\r\n",
+           pings, PINGS, pings ? total / pings : 0.0, worst, limit_ms);
+
+    closesocket(a);
+    closesocket(b);
+    mux_close(tx);
+    mux_close(rx);
+    recvrelease();
+    WSACleanup();
+    return bulk_done && pings == PINGS && worst <= limit_ms ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "../utils/include/recvbuf.h"
+#include "../utils/include/scan.h"
+#include "bench.h"
+
+/*
+ *      recvuntil() / recvlen() and the delimiter scanner (benchmark, test with --check)
+ *
+ *      Data is sent over a loopback connection in SEND_CHUNK writes, as a peer would:
+ *        - one message of 1..95 MB read with recvuntil('\0')
+ *        - 100k pipelined mux frames (9-byte header, 100-byte payload) read with recvlen()
+ *      each with the former implementation (recv_baseline.c) and the current one. Then, in memory:
+ *        - 100 MB of 100-byte records split with a memchr() loop and with scan_split()
+ *        - one delimiter at the end of 100 MB, memchr() and scan_find()
+ *
+ *      recv_scan.exe            benchmark (checks scanner first)
+ *      recv_scan.exe --check    scanner against a byte loop on random buffers only
+ */
+
+#define SEND_CHUNK 65536
+#define FRAMES 100000
+#define FRAME_HEAD 9
+#define FRAME_BODY 100
+#define RECORDS_LEN (100ULL << 20)
+#define RECORD_LEN 100
+#define CHECK_ROUNDS 20000
+#define CHECK_LEN 300
+
+typedef struct Feed {
+    SOCKET sock;
+    const char* buf;
+    ULONGLONG len;
+} Feed;
+
+
+static void feedThread(Feed* f) {
+    /**
+     * @brief Send whole buffer in SEND_CHUNK writes, then close
+     */
+    int n;
+    for (ULONGLONG pos = 0; pos < f->len; pos += n) {
+        n = send(f->sock, f->buf + pos, (int) (f->len - pos < SEND_CHUNK ? f->len - pos : SEND_CHUNK), 0);
+        if (n <= 0) break;
+    }
+    closesocket(f->sock);
+    free(f);
+}
+
+static SOCKET startFeed(const char* buf, ULONGLONG len) {
+    /**
+     * @brief Receiving end of a connection that `buf` is being sent to
+     */
+    Feed* f = calloc(1, sizeof(Feed));
+    SOCKET rx;
+    HANDLE h;
+    DWORD dwt;
+
+    if (!f || !connectPair(&f->sock, &rx)) {
+        free(f);
+        return INVALID_SOCKET;
+    }
+    f->buf = buf;
+    f->len = len;
+    h = CreateThread(NULL, 0, (LPVOID) feedThread, (LPVOID) f, 0, &dwt);
+    if (!h) {
+        closesocket(f->sock);
+        closesocket(rx);
+        free(f);
+        return INVALID_SOCKET;
+    }
+    CloseHandle(h);
+    return rx;
+}
+
+static bool checkScanner() {
+    /**
+     * @brief scan_find() and scan_split() against a byte loop, random buffers and delimiter sets
+     */
+    const char all[SCAN_DELIMS_MAX] = {'\0', '\n', ';', ','};
+    char buf[CHECK_LEN];
+    ULONGLONG offs[CHECK_LEN], expect[CHECK_LEN], n, n_expect, max, found;
+    DWORD len, n_delims;
+
+    srand(7);
+    for (DWORD round = 0; round < CHECK_ROUNDS; round++) {
+        len = rand() % CHECK_LEN;
+        n_delims = 1 + rand() % SCAN_DELIMS_MAX;
+        max = 1 + rand() % 50;
+        for (DWORD i = 0; i < len; i++)
+            buf[i] = rand() % 8 == 0 ? all[rand() % SCAN_DELIMS_MAX] : (char) ('a' + rand() % 26);
+
+        n_expect = 0;
+        for (DWORD i = 0; i < len && n_expect < max; i++)
+            if (memchr(all, buf[i], n_delims)) expect[n_expect++] = i;
+
+        n = scan_split(buf, len, all, n_delims, offs, max);
+        found = scan_find(buf, len, all, n_delims);
+        if (n != n_expect || memcmp(offs, expect, n * sizeof(ULONGLONG)) != 0
+                || found != (n_expect ? expect[0] : len)) {
+            printf("Scanner is wrong: round %lu, %lu bytes, %lu delimiters\r\n", round, len, n_delims);
+            return FALSE;
+        }
+    }
+    printf("Scanner: %d random buffers match byte loop\r\n", CHECK_ROUNDS);
+    return TRUE;
+}
+
+static void benchRecvuntil() {
+    ULONGLONG sizes[] = {1ULL << 20, 10ULL << 20, 50ULL << 20, 95ULL << 20};
+    LARGE_INTEGER start;
+    double t_base, t_cur;
+    char *msg, *r;
+    LONGLONG n_base, n_cur;
+
+    for (DWORD i = 0; i < sizeof(sizes) / sizeof(ULONGLONG); i++) {
+        msg = malloc(sizes[i] + 1);
+        if (!msg) return;
+        memset(msg, 'x', sizes[i]);
+        msg[sizes[i]] = '\0';
+
+        QueryPerformanceCounter(&start);
+        n_base = baseline_recvuntil('\0', &r, startFeed(msg, sizes[i] + 1));
+        t_base = elapsedMs(&start);
+        if (n_base > 1) free(r);
+
+        QueryPerformanceCounter(&start);
+        n_cur = recvuntil('\0', &r, startFeed(msg, sizes[i] + 1));
+        t_cur = elapsedMs(&start);
+        if (n_cur > 1) free(r);
+        recvrelease();
+
+        printf("recvuntil %3llu MB                         %8.1f ms -> %7.1f ms%s\r\n", sizes[i] >> 20, t_base, t_cur,
+               n_base == n_cur && (ULONGLONG) n_cur == sizes[i] + 1 ? "" : "  (lengths differ!)");
+        free(msg);
+    }
+}
+
+static void benchRecvlen() {
+    char *frames = malloc(FRAMES * (FRAME_HEAD + FRAME_BODY)), *r;
+    LARGE_INTEGER start;
+    double t[2];
+    SOCKET s;
+
+    if (!frames) return;
+    for (ULONGLONG i = 0; i < FRAMES * (FRAME_HEAD + FRAME_BODY); i++) frames[i] = (char) i;
+    for (DWORD v = 0; v < 2; v++) {
+        s = startFeed(frames, FRAMES * (FRAME_HEAD + FRAME_BODY));
+        QueryPerformanceCounter(&start);
+        for (DWORD i = 0; i < FRAMES; i++) {
+            if ((v ? recvlen(FRAME_HEAD, &r, s) : baseline_recvlen(FRAME_HEAD, &r, s)) != FRAME_HEAD) break;
+            free(r);
+            if ((v ? recvlen(FRAME_BODY, &r, s) : baseline_recvlen(FRAME_BODY, &r, s)) != FRAME_BODY) break;
+            free(r);
+        }
+        t[v] = elapsedMs(&start);
+        closesocket(s);
+    }
+    recvrelease();
+    printf("recvlen %dk pipelined %d-byte frames    %8.1f ms -> %7.1f ms\r\n", FRAMES / 1000, FRAME_HEAD + FRAME_BODY, t[0], t[1]);
+    free(frames);
+}
+
+static void benchScan() {
+    char* rec = malloc(RECORDS_LEN);
+    const char *p, *q;
+    ULONGLONG offs[64], n, count_memchr = 0, count_scan = 0, off = 0;
+    LARGE_INTEGER start;
+    double t_memchr, t_scan;
+
+    if (!rec) return;
+    for (ULONGLONG i = 0; i < RECORDS_LEN; i++) rec[i] = i % RECORD_LEN == RECORD_LEN - 1 ? '\0' : 'a';
+
+    QueryPerformanceCounter(&start);
+    for (p = rec; p < rec + RECORDS_LEN && (q = memchr(p, '\0', rec + RECORDS_LEN - p)) != NULL; p = q + 1)
+        count_memchr++;
+    t_memchr = elapsedMs(&start);
+    QueryPerformanceCounter(&start);
+    while (off < RECORDS_LEN && (n = scan_split(rec + off, RECORDS_LEN - off, "", 1, offs, 64)) != 0) {
+        count_scan += n;
+        off += offs[n-1] + 1;
+    }
+    t_scan = elapsedMs(&start);
+    printf("split %llu MB of %d-byte records         memchr loop %.1f ms, scan_split %.1f ms%s\r\n",
+           RECORDS_LEN >> 20, RECORD_LEN, t_memchr, t_scan, count_memchr == count_scan ? "" : "  (counts differ!)");
+
+    memset(rec, 'a', RECORDS_LEN - 1);
+    QueryPerformanceCounter(&start);
+    p = memchr(rec, '\0', RECORDS_LEN);
+    t_memchr = elapsedMs(&start);
+    QueryPerformanceCounter(&start);
+    off = scan_find(rec, RECORDS_LEN, "", 1);
+    t_scan = elapsedMs(&start);
+    printf("one delimiter at end of %llu MB          memchr %.1f ms, scan_find %.1f ms%s\r\n",
+           RECORDS_LEN >> 20, t_memchr, t_scan, p && off == (ULONGLONG) (p - rec) ? "" : "  (offsets differ!)");
+    free(rec);
+}
+
+int main(int argc, char** argv) {
+    WSADATA wsa;
+
+    if (!checkScanner()) return 1;
+    if (argc > 1 && !strcmp(argv[1], "--check")) return 0;
+    if (WSAStartup(0x0202, &wsa) != 0) return 2;
+    benchRecvuntil();
+    benchRecvlen();
+    benchScan();
+    WSACleanup();
+    return 0;
+}
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "../utils/include/mux.h"
+#include "../utils/include/recvbuf.h"
+#include "bench.h"
+
+/*
+ *      Replication on loopback: primary and replica, post through the replica (test)
+ *
+ *      Starts the server executable twice on 127.0.0.1: a primary with a new --repl-key and a
+ *      replica of it with the same key. Posts a message through the replica, which forwards it to
+ *      the primary and gets it back with its #id through replication. Then:
+ *        - /sync of both servers holds the message, as the same record ('#id [hh:mm]  Anonim #id: ')
+ *        - /stats of the replica falls to 0 messages behind, the primary's slowest replica too
+ *      Both servers are stopped with Enter. Their output goes to repl_loopback-<pid>-*.log,
+ *      which is kept if the test fails.
+ *
+ *      repl_loopback.exe <server.exe> [port]      replica listens on port + 1
+ */
+
+#define HOST "127.0.0.1"
+#define WAIT_MS 10000                   // Longest wait for a server to start, replicate or stop
+#define POLL_MS 100
+
+typedef struct Server {
+    const char* role;
+    char port[8];
+    char log[MAX_PATH];                 // stdout and stderr of server
+    HANDLE process;
+    HANDLE enter;                       // Write end of stdin: Enter stops server
+} Server;
+
+
+static bool launchServer(Server* s, const char* exe, const char* args) {
+    /**
+     * @brief Start `exe` listening on HOST:s->port with `args`, stdin from a pipe, output to s->log
+     */
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+    STARTUPINFOA si = {0};
+    PROCESS_INFORMATION pi;
+    char cmd[3 * MAX_PATH];
+    HANDLE stdin_rd, log;
+    BOOL ok;
+
+    snprintf(cmd, sizeof(cmd), "\"%s\" %s %s %s", exe, HOST, s->port, args);
+    log = CreateFileA(s->log, GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (log == INVALID_HANDLE_VALUE) return FALSE;
+    if (!CreatePipe(&stdin_rd, &s->enter, &sa, 0)) {
+        CloseHandle(log);
+        return FALSE;
+    }
+    SetHandleInformation(s->enter, HANDLE_FLAG_INHERIT, 0);
+
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = stdin_rd;
+    si.hStdOutput = log;
+    si.hStdError = log;
+    ok = CreateProcessA(NULL, cmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+    CloseHandle(stdin_rd);
+    CloseHandle(log);
+    if (!ok) {
+        CloseHandle(s->enter);
+        s->enter = NULL;
+        return FALSE;
+    }
+    CloseHandle(pi.hThread);
+    s->process = pi.hProcess;
+    printf("%s: %s\r\n", s->role, cmd);
+    return TRUE;
+}
+
+static bool stopServer(Server* s) {
+    /**
+     * @brief Press Enter in server, kill it if it does not exit in WAIT_MS
+     */
+    DWORD written;
+    bool ok;
+
+    if (!s->process) return TRUE;
+    WriteFile(s->enter, "\n", 1, &written, NULL);
+    ok = WaitForSingleObject(s->process, WAIT_MS) == WAIT_OBJECT_0;
+    if (!ok) {
+        printf("%s did not stop, killed\r\n", s->role);
+        TerminateProcess(s->process, 1);
+        WaitForSingleObject(s->process, INFINITE);
+    }
+    CloseHandle(s->enter);
+    CloseHandle(s->process);
+    s->process = NULL;
+    return ok;
+}
+
+static Mux* connectTo(Server* s, SOCKET* sock) {
+    /**
+     * @brief Client connection to server, retried while it starts
+     */
+    ULONGLONG deadline = GetTickCount64() + WAIT_MS;
+    DWORD code;
+    Mux* m;
+
+    while ((*sock = connectServer(HOST, s->port)) == INVALID_SOCKET) {
+        if (GetTickCount64() > deadline || !GetExitCodeProcess(s->process, &code) || code != STILL_ACTIVE) {
+            printf("Cannot connect to %s at %s:%s\r\n", s->role, HOST, s->port);
+            return NULL;
+        }
+        Sleep(POLL_MS);
+    }
+    m = mux_init(*sock);
+    if (!m) closesocket(*sock);
+    return m;
+}
+
+static char* request(Mux* m, const char* text, ULONGLONG* len) {
+    /**
+     * @brief Send `text` on a new stream and collect the reply until its last frame
+     * @details Frames of other streams (greeting, messages pushed to the control stream) are dropped.
+     * @return reply (records separated by \0, \0 appended), NULL if the connection is lost
+     */
+    DWORD stream_id = mux_openstream(m);
+    char *reply = malloc(1), *grown;
+    MuxFrame f;
+
+    *len = 0;
+    if (!reply || !mux_send(m, stream_id, text, strlen(text) + 1, TRUE)) {
+        free(reply);
+        return NULL;
+    }
+    while (mux_recvframe(m, &f) > 0) {
+        if (f.stream_id != stream_id) {
+            free(f.buf);
+            continue;
+        }
+        grown = realloc(reply, *len + f.len + 1);
+        if (!grown) break;
+        reply = grown;
+        memcpy(reply + *len, f.buf, f.len);
+        *len += f.len;
+        free(f.buf);
+        if (f.flags & FRAME_FIN) {
+            reply[*len] = '\0';
+            return reply;
+        }
+    }
+    free(reply);
+    return NULL;
+}
+
+static bool waitReply(Mux* m, const char* text, const char* needle, char* found, DWORD found_len) {
+    /**
+     * @brief Repeat request `text` until a record of its reply contains `needle`
+     * @details Record is copied to `found` (if not NULL).
+     */
+    ULONGLONG deadline = GetTickCount64() + WAIT_MS, len;
+    const char* rec;
+    char* reply;
+
+    while (TRUE) {
+        if (!(reply = request(m, text, &len))) return FALSE;
+        for (rec = reply; rec < reply + len; rec += strlen(rec) + 1)
+            if (strstr(rec, needle)) {
+                if (found) snprintf(found, found_len, "%s", rec);
+                free(reply);
+                return TRUE;
+            }
+        if (GetTickCount64() > deadline) break;
+        free(reply);
+        Sleep(POLL_MS);
+    }
+
+    // Last reply, records on lines of their own
+    for (ULONGLONG i = 0; i < len; i++)
+        if (reply[i] == '\0') reply[i] = '\n';
+    printf("No '%s' in reply to %s:\r\n%s\r\n", needle, text, reply);
+    free(reply);
+    return FALSE;
+}
+
+int main(int argc, char** argv) {
+    WSADATA wsa;
+    char key[MAX_PATH], args[2 * MAX_PATH], text[64], on_primary[256] = "", on_replica[256] = "";
+    Server primary = {.role = "primary"}, replica = {.role = "replica"};
+    DWORD pid = GetCurrentProcessId(), port;
+    SOCKET p_sock = INVALID_SOCKET, r_sock = INVALID_SOCKET;
+    Mux *p_mux = NULL, *r_mux = NULL;
+    bool ok;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <server.exe> [port]\r\n", argv[0]);
+        return 2;
+    }
+    port = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000 + pid % 10000 * 2;
+    snprintf(primary.port, sizeof(primary.port), "%lu", port);
+    snprintf(replica.port, sizeof(replica.port), "%lu", port + 1);
+    snprintf(primary.log, sizeof(primary.log), "repl_loopback-%lu-primary.log", pid);
+    snprintf(replica.log, sizeof(replica.log), "repl_loopback-%lu-replica.log", pid);
+    snprintf(key, sizeof(key), "repl_loopback-%lu.key", pid);
+    snprintf(text, sizeof(text), "posted through replica by test %lu", pid);
+    if (WSAStartup(0x0202, &wsa) != 0) return 2;
+
+    // Primary creates the key file, it exists once primary accepts connections
+    snprintf(args, sizeof(args), "--repl-key %s", key);
+    ok = launchServer(&primary, argv[1], args) && (p_mux = connectTo(&primary, &p_sock)) != NULL;
+    snprintf(args, sizeof(args), "--repl-key %s --replica-of %s:%s", key, HOST, primary.port);
+    ok = ok && launchServer(&replica, argv[1], args) && (r_mux = connectTo(&replica, &r_sock)) != NULL;
+
+    // Post only once replica is subscribed, otherwise it turns the post away
+    ok = ok && waitReply(r_mux, "/stats", ": connected,", NULL, 0);
+    if (ok) ok = mux_send(r_mux, MUX_STREAM_CONTROL, text, strlen(text) + 1, TRUE);
+    ok = ok && waitReply(p_mux, "/sync", text, on_primary, sizeof(on_primary))
+            && waitReply(r_mux, "/sync", text, on_replica, sizeof(on_replica));
+    printf("primary: %s\r\nreplica: %s\r\n", on_primary, on_replica);
+    ok = ok && on_primary[0] == '#' && !strcmp(on_primary, on_replica);
+
+    ok = ok && waitReply(r_mux, "/stats", ", 0 behind", NULL, 0)
+            && waitReply(p_mux, "/stats", "slowest is 0 messages behind", NULL, 0);
+    printf("lag %s\r\n", ok ? "fell to 0" : "did not fall to 0");
+
+    if (r_mux) {
+        closesocket(r_sock);
+        mux_close(r_mux);
+    }
+    if (p_mux) {
+        closesocket(p_sock);
+        mux_close(p_mux);
+    }
+    ok = stopServer(&replica) && ok;
+    ok = stopServer(&primary) && ok;
+    recvrelease();
+    WSACleanup();
+
+    DeleteFileA(key);
+    if (ok) {
+        DeleteFileA(primary.log);
+        DeleteFileA(replica.log);
+    }
+    else printf("Output of servers: %s, %s\r\n", primary.log, replica.log);
+    printf("%s\r\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
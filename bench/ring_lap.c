@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../utils/include/ring.h"
+
+/*
+ *      Shared-memory ring: wrap-around, lapped consumers and torn records (test)
+ *
+ *      A writer publishes RECORDS records with bodies of 0..RING_BODY_MAX bytes (longer ones are cut)
+ *      into a RING_SIZE ring, so data wraps around many times. Consumers read them with ring_read():
+ *        - a fast one, which may still be lapped when it is not scheduled for a while
+ *        - a slow one, which sleeps every SLOW_EVERY records and is lapped for sure
+ *      Every record a consumer accepts must be whole: #ids grow, body is the pattern of its #id,
+ *      skipped bytes are counted in `lost`. Then, in one thread: a record at the end of data is
+ *      overwritten with a header claiming the largest body there can be, as a newer post would
+ *      do before ring_next() notices. ring_read() must not copy past the end of data.
+ *
+ *      ring_lap.exe
+ */
+
+#define RING_SIZE 16384
+#define RECORDS 200000
+#define SLOW_EVERY 500
+#define MAX_BODY 5000                   // Above RING_BODY_MAX(RING_SIZE): some bodies are cut
+
+typedef struct Reader {
+    const char* name;
+    DWORD sleep_every;                  // Sleep 1 ms every that many records (0 = never)
+    ULONGLONG read;                     // Records accepted
+    ULONGLONG laps;                     // Times #ids jumped (lapped)
+    ULONGLONG lost;                     // Bytes skipped
+    ULONGLONG bad;                      // Records accepted with wrong content
+} Reader;
+
+static volatile bool writer_done;
+
+
+static DWORD bodyLen(ULONGLONG id) {
+    return (DWORD) (id * 2654435761u % (MAX_BODY + 1));
+}
+
+static char bodyByte(ULONGLONG id, DWORD i) {
+    return (char) ('a' + (id + i) % 26);
+}
+
+static bool checkRecord(const RingRecord* rec, const char* body, ULONGLONG cap) {
+    /**
+     * @brief Record is the one written for its #id, body cut to what fits
+     */
+    DWORD expect = bodyLen(rec->msg_id);
+
+    if (rec->msg_len != expect || rec->body_len != (expect < cap ? expect : cap)) return FALSE;
+    for (DWORD i = 0; i < rec->body_len; i++)
+        if (body[i] != bodyByte(rec->msg_id, i)) return FALSE;
+    return TRUE;
+}
+
+static void readerThread(Reader* rd) {
+    Ring* r = ring_open(rd->name);
+    DWORD cap;
+    char* body;
+    RingRecord rec;
+    ULONGLONG last = 0;
+
+    if (!r) return;
+    cap = (DWORD) RING_BODY_MAX(r->hdr->size);
+    body = malloc(cap);
+    if (!body) return;
+    while (TRUE) {
+        if (!ring_read(r, &rec, body, cap)) {
+            if (writer_done) break;
+            ring_wait(r, 10);
+            continue;
+        }
+        if (rec.msg_id <= last || !checkRecord(&rec, body, cap)) rd->bad++;
+        if (last && rec.msg_id != last + 1) rd->laps++;
+        last = rec.msg_id;
+        rd->read++;
+        if (rd->sleep_every && rd->read % rd->sleep_every == 0) Sleep(1);
+    }
+    rd->lost = r->lost;
+    free(body);
+    ring_close(r);
+}
+
+static bool checkTornHeader(Ring* w, const char* name) {
+    /**
+     * @brief Record at the end of data is overwritten before it is read: copy stays within data
+     */
+    Ring* r = ring_open(name);
+    char* body = malloc(RING_SIZE);
+    RingRecord rec = {0}, *fake;
+    ULONGLONG off;
+    bool ok;
+
+    if (!r || !body) return FALSE;
+
+    // Small records until the next one starts in the last record length of data
+    do {
+        rec.msg_id++;
+        rec.body_len = 0;
+        ring_write(w, &rec, body);
+        while (ring_read(r, &rec, body, RING_SIZE));
+        off = w->hdr->head & (RING_SIZE - 1);
+    } while (off < RING_SIZE - 2 * sizeof(RingRecord) || off + sizeof(RingRecord) > RING_SIZE);
+    rec.body_len = 0;
+    ring_write(w, &rec, body);
+
+    // Writer side scribbles over it: header of a record with the largest body a lap could leave there
+    fake = (RingRecord*) (w->data + off);
+    fake->body_len = (DWORD) RING_BODY_MAX(RING_SIZE);
+    ok = ring_read(r, &rec, body, RING_SIZE) && rec.body_len <= RING_SIZE - off - sizeof(RingRecord);
+    printf("Torn header at %llu of %d: body of %lu bytes claimed, %lu copied\r\n",
+           off, RING_SIZE, fake->body_len, rec.body_len);
+
+    free(body);
+    ring_close(r);
+    return ok;
+}
+
+int main() {
+    char name[64];
+    Reader readers[2] = {{.sleep_every = 0}, {.sleep_every = SLOW_EVERY}};
+    HANDLE threads[2];
+    DWORD dwt;
+    Ring* w;
+    RingRecord rec = {0};
+    char* body = malloc(MAX_BODY);
+    bool ok = TRUE;
+
+    snprintf(name, sizeof(name), "6chan-ring-test-%lu", GetCurrentProcessId());
+    w = ring_create(name, RING_SIZE);
+    if (!w || !body) {
+        fprintf(stderr, "Cannot create ring\r\n");
+        return 2;
+    }
+    for (int i = 0; i < 2; i++) {
+        readers[i].name = name;
+        threads[i] = CreateThread(NULL, 0, (LPVOID) readerThread, &readers[i], 0, &dwt);
+        if (!threads[i]) return 2;
+    }
+    Sleep(50);
+
+    for (rec.msg_id = 1; rec.msg_id <= RECORDS; rec.msg_id++) {
+        rec.type = RING_TYPE_MSG;
+        rec.msg_len = rec.body_len = bodyLen(rec.msg_id);
+        for (DWORD i = 0; i < rec.body_len; i++) body[i] = bodyByte(rec.msg_id, i);
+        ring_write(w, &rec, body);
+    }
+    writer_done = TRUE;
+    WaitForMultipleObjects(2, threads, TRUE, INFINITE);
+    CloseHandle(threads[0]);
+    CloseHandle(threads[1]);
+
+    printf("%d records through a %d-byte ring, %llu wraps\r\n", RECORDS, RING_SIZE, w->hdr->head / RING_SIZE);
+    for (int i = 0; i < 2; i++) {
+        printf("%s consumer: %llu read, lapped %llu times, %llu bytes skipped, %llu bad\r\n",
+               i ? "slow" : "fast", readers[i].read, readers[i].laps, readers[i].lost, readers[i].bad);
+        ok &= readers[i].bad == 0 && readers[i].read > 0;
+    }
+    ok &= readers[1].laps > 0 && readers[1].lost > 0;
+
+    ok &= checkTornHeader(w, name);
+    free(body);
+    ring_close(w);
+    printf("%s\r\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+#include "../utils/include/mux.h"
+#include "../utils/include/recvbuf.h"
+#include "bench.h"
+
+/*
+ *      Request round trip and download rate of a running server (benchmark)
+ *
+ *      Connects as a client does and sends ROUND_TRIPS `/who` requests one after another, each on a
+ *      stream of its own, timing each until the last frame of its reply. With a file #id, also
+ *      downloads it DOWNLOADS times. Run it against the same server started with and without
+ *      --affinity / --numa to compare placement.
+ *
+ *      server_rtt.exe [host] <port> [file #id]
+ *      server_rtt.exe --unix <path> [file #id]
+ */
+
+#define ROUND_TRIPS 5000
+#define DOWNLOADS 5
+#define DEFAULT_HOST "127.0.0.1"
+
+
+static LONGLONG request(Mux* m, const char* text) {
+    /**
+     * @brief Send `text` on a new stream and read until the last frame of the reply
+     * @details Frames of other streams (notices, messages of other clients) are dropped.
+     * @return bytes of the reply, -1 if the connection is lost
+     */
+    DWORD stream_id = mux_openstream(m);
+    LONGLONG got = 0;
+    MuxFrame f;
+
+    if (!mux_send(m, stream_id, text, strlen(text) + 1, TRUE)) return -1;
+    while (mux_recvframe(m, &f) > 0) {
+        free(f.buf);
+        if (f.stream_id != stream_id) continue;
+        got += f.len;
+        if (f.flags & FRAME_FIN) return got;
+    }
+    return -1;
+}
+
+static int compareMs(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    WSADATA wsa;
+    const char *host = DEFAULT_HOST, *port = NULL, *file_id = NULL;
+    char cmd[64];
+    double* rtt = calloc(ROUND_TRIPS, sizeof(double));
+    double dl_ms;
+    LARGE_INTEGER start;
+    LONGLONG n, dl_bytes = 0;
+    SOCKET sock;
+    Mux* m;
+
+    if (argc > 2 && !strcmp(argv[1], "--unix")) {
+        host = argv[2];
+        file_id = argc > 3 ? argv[3] : NULL;
+    }
+    else if (argc > 1 && argv[1][strspn(argv[1], "0123456789")] == '\0') {
+        port = argv[1];
+        file_id = argc > 2 ? argv[2] : NULL;
+    }
+    else if (argc > 2) {
+        host = argv[1];
+        port = argv[2];
+        file_id = argc > 3 ? argv[3] : NULL;
+    }
+    else {
+        fprintf(stderr, "Usage: %s [host] <port> [file #id] | --unix <path> [file #id]\r\n", argv[0]);
+        return 2;
+    }
+
+    if (!rtt || WSAStartup(0x0202, &wsa) != 0) return 2;
+    sock = connectServer(host, port);
+    if (sock == INVALID_SOCKET || !(m = mux_init(sock))) {
+        fprintf(stderr, "Cannot connect to server\r\n");
+        return 2;
+    }
+
+    // First request also waits out the greeting and history the server sends on connect
+    if (request(m, "/stats") < 0) return 1;
+    for (DWORD i = 0; i < ROUND_TRIPS; i++) {
+        QueryPerformanceCounter(&start);
+        if (request(m, "/who") < 0) return 1;
+        rtt[i] = elapsedMs(&start);
+    }
+    qsort(rtt, ROUND_TRIPS, sizeof(double), compareMs);
+    printf("%-4s /who round trip: p50 %.1f us, p99 %.1f us (%d requests)\r\n", port ? "tcp" : "unix",
+           rtt[ROUND_TRIPS / 2] * 1000.0, rtt[ROUND_TRIPS * 99 / 100] * 1000.0, ROUND_TRIPS);
+
+    if (file_id) {
+        snprintf(cmd, sizeof(cmd), "/dl %s", file_id);
+        QueryPerformanceCounter(&start);
+        for (DWORD i = 0; i < DOWNLOADS; i++) {
+            if ((n = request(m, cmd)) < 0) return 1;
+            dl_bytes += n;
+        }
+        dl_ms = elapsedMs(&start);
+        printf("%-4s download: %lld bytes in %.1f ms (%.0f MB/s)\r\n", port ? "tcp" : "unix", dl_bytes, dl_ms,
+               dl_ms > 0 ? (double) dl_bytes / 1048576.0 * 1000.0 / dl_ms : 0.0);
+    }
+
+    closesocket(sock);
+    mux_close(m);
+    recvrelease();
+    WSACleanup();
+    free(rtt);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "../server/include/config.h"
+#include "../server/include/model.h"
+#include "../server/include/blob.h"
+#include "../server/include/snapshot.h"
+
+/*
+ *      Snapshot: restore, save, restore, save (test)
+ *
+ *      Runs the start and shutdown sequence of the server GENERATIONS times in one process:
+ *      restore snapshot, check every message saved so far, post MSGS_PER_GEN more (short and
+ *      long texts, files; cold ones are compressed), save, destroy boards and blob store,
+ *      unmap the old snapshot and replace it. Then restores and checks once more. From the second
+ *      generation on, long bodies, segments and files point into the view of the old snapshot
+ *      while the new one is saved.
+ *
+ *      snapshot_cycle.exe
+ */
+
+#define GENERATIONS 4
+#define MSGS_PER_GEN 300
+#define FILE_EVERY 10                   // Every that many #ids is a file
+#define BODY_MAX 400                    // Longer than MSG_INLINE_MAX: some bodies get an allocation of their own
+
+
+static DWORD makeBody(ULONGLONG id, char* buf) {
+    /**
+     * @brief Body of message #id: length and content follow from #id
+     */
+    DWORD len = (DWORD) (id * 37 % BODY_MAX) + 1;
+    for (DWORD i = 0; i < len; i++) buf[i] = (char) ('a' + (id * 7 + i) % 26);
+    return len;
+}
+
+static bool checkBoard(Board* b, ULONGLONG expect) {
+    /**
+     * @brief Board holds messages #1..expect, each with the body made for its #id
+     */
+    char body[BODY_MAX];
+    const char* got;
+    Message* m;
+    DWORD len;
+    bool ok = getLastMessageId(b) == expect;
+
+    EnterCriticalSection(&b->cs_mh);
+    for (ULONGLONG id = 1; ok && id <= expect; id++) {
+        m = getMessage(b, id);
+        len = makeBody(id, body);
+        ok = m && messageLen(m) == len && (got = getMessageBody(m)) != NULL && memcmp(got, body, len) == 0
+             && (m->msg_type == MSG_TYPE_FILE) == (id % FILE_EVERY == 0);
+        if (!ok) printf("#%llu of %llu does not match\r\n", id, expect);
+    }
+    LeaveCriticalSection(&b->cs_mh);
+    return ok;
+}
+
+static bool postMessages(Board* b, DWORD n) {
+    char body[BODY_MAX];
+    ULONGLONG id;
+    Message* m;
+    DWORD len;
+
+    for (DWORD i = 0; i < n; i++) {
+        id = getLastMessageId(b) + 1;
+        len = makeBody(id, body);
+        m = id % FILE_EVERY == 0 ? newFileMessage(1, "file.txt", putBlob(body, len)) : newMessage(1, body, len);
+        if (!m || appendMessage(b, m) != id) return FALSE;
+        compactMessageHistory(b);
+    }
+    return TRUE;
+}
+
+int main(int argc, char** argv) {
+    char snap_path[MAX_PATH], key_path[MAX_PATH], tmp_path[MAX_PATH];
+    char* args[] = {argv[0], "--snapshot", snap_path, "--snapshot-key", key_path, "--compress-history", "--hot", "16"};
+    Board* b;
+    bool ok = TRUE;
+
+    (void) argc;
+    snprintf(snap_path, sizeof(snap_path), "snapshot_cycle-%lu.snap", GetCurrentProcessId());
+    snprintf(key_path, sizeof(key_path), "snapshot_cycle-%lu.key", GetCurrentProcessId());
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", snap_path);
+    if (!parseServerArgs(sizeof(args) / sizeof(args[0]), args)) return 2;
+
+    // Last generation only restores and checks what the one before saved
+    for (DWORD gen = 0; ok && gen <= GENERATIONS; gen++) {
+        initBlobStore();
+        initBoards();
+        initSessions();
+        ok = loadSnapshot() && (b = getBoard(DEFAULT_BOARD, FALSE)) != NULL;
+        ok = ok && checkBoard(b, (ULONGLONG) gen * MSGS_PER_GEN);
+        if (gen < GENERATIONS) ok = ok && postMessages(b, MSGS_PER_GEN) && saveSnapshot();
+        destroySessions();
+        destroyBoards();
+        destroyBlobStore();
+        closeSnapshot();
+        if (gen < GENERATIONS) ok = ok && replaceSnapshot() && GetFileAttributesA(tmp_path) == INVALID_FILE_ATTRIBUTES;
+        printf("Generation %lu: %llu messages restored%s\r\n", gen, (ULONGLONG) gen * MSGS_PER_GEN,
+               !ok ? ", FAILED" : gen < GENERATIONS ? ", saved and replaced" : "");
+    }
+
+    DeleteFileA(snap_path);
+    DeleteFileA(tmp_path);
+    DeleteFileA(key_path);
+    return ok ? 0 : 1;
+}
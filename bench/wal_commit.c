@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "../server/include/config.h"
+#include "../server/include/model.h"
+#include "../server/include/blob.h"
+#include "../server/include/wal.h"
+#include "bench.h"
+
+/*
+ *      Write-ahead log: group commit against one flush per message (benchmark)
+ *
+ *      For 1, 10 and 100 posters, each posts its share of MESSAGES as postMessage() does:
+ *      appendMessage(), then walAppend() waits until the record is on disk. Baseline writes
+ *      each record with its own WriteFile() and FlushFileBuffers() under a lock.
+ *      Run it on the disk the log is meant for: flush latency is what is measured.
+ *
+ *      wal_commit.exe [log path]      log and baseline file are deleted afterwards
+ */
+
+#define MESSAGES 2000
+#define MIN_PER_POSTER 20
+#define BENCH_TEXT "benchmark message of moderate length, about sixty-four bytes."
+#define RECORD_LEN 128                  // Baseline record, about the size of a logged post
+
+static DWORD per_poster;
+static Board* board;
+static HANDLE flat_file;                // Baseline: ...
+static CRITICAL_SECTION cs_flat;        //   ... one record, one flush, under lock
+
+
+static void walPoster() {
+    Message* m;
+    for (DWORD i = 0; i < per_poster; i++) {
+        m = newMessage(1, BENCH_TEXT, sizeof(BENCH_TEXT) - 1);
+        if (m && appendMessage(board, m)) walAppend(board, m);
+    }
+}
+
+static void flatPoster() {
+    char rec[RECORD_LEN] = {0};
+    DWORD dw;
+    for (DWORD i = 0; i < per_poster; i++) {
+        EnterCriticalSection(&cs_flat);
+        WriteFile(flat_file, rec, sizeof(rec), &dw, NULL);
+        FlushFileBuffers(flat_file);
+        LeaveCriticalSection(&cs_flat);
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "wal_bench.log";
+    char flat_path[MAX_PATH];
+    char* args[] = {argv[0], "--wal", (char*) path, NULL};
+    DWORD posters[] = {1, 10, 100};
+    double t_wal, t_flat;
+    WalStats ws;
+
+    snprintf(flat_path, sizeof(flat_path), "%s.flat", path);
+    DeleteFileA(path);
+    if (!parseServerArgs(3, args)) return 2;
+    initBlobStore();
+    initBoards();
+    board = getBoard(DEFAULT_BOARD, FALSE);
+    InitializeCriticalSection(&cs_flat);
+    if (!board) return 2;
+
+    printf("posters   group commit                  flush per message\r\n");
+    for (DWORD i = 0; i < sizeof(posters) / sizeof(DWORD); i++) {
+        per_poster = MESSAGES / posters[i] < MIN_PER_POSTER ? MIN_PER_POSTER : MESSAGES / posters[i];
+
+        // Fresh log for each round, so messages per flush are of this round only
+        if (!openWal()) return 2;
+        t_wal = runPosters(posters[i], walPoster);
+        getWalStats(&ws);
+        closeWal();
+        DeleteFileA(path);
+
+        flat_file = CreateFileA(flat_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (flat_file == INVALID_HANDLE_VALUE) return 2;
+        t_flat = runPosters(posters[i], flatPoster);
+        CloseHandle(flat_file);
+        DeleteFileA(flat_path);
+        if (t_wal <= 0 || t_flat <= 0) return 2;
+
+        printf("%7lu   %8.0f msg/s (%5.1f per flush)   %8.0f msg/s\r\n", posters[i],
+               (double) ws.records / t_wal, ws.batches ? (double) ws.records / (double) ws.batches : 0.0,
+               (double) posters[i] * per_poster / t_flat);
+    }
+    DeleteCriticalSection(&cs_flat);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef LAB6_CACHE_H
+#define LAB6_CACHE_H
+
+#include <windows.h>
+
+/*
+ *      History cache of client (one file per server, mapped in memory)
+ *
+ *      file "6chan-<host>_<port>.cache":  <CacheHeader, one page> <records: CACHE_DATA_LEN bytes>
+ *      record:                             <CacheRecord> <text as printed>, padded to CACHE_ALIGN
+ *
+ *      Messages of the joined board are kept as the server delivers them, in #id order. On start
+ *      the last CACHE_SHOW of them are printed before connecting, and /resume tells the server
+ *      which ones the client has, so it sends only newer ones. #ids are only valid for the run
+ *      of server that gave them: server sends its history serial, a cache of another one is dropped.
+ *      Only the receiving thread changes the cache (after start), no lock.
+ */
+
+#define CACHE_MAGIC "6CHCACH1"
+#define CACHE_PREFIX "6chan-"
+#define CACHE_SUFFIX ".cache"
+#define CACHE_HEADER_LEN 4096
+#define CACHE_DATA_LEN 4194304          // Oldest half is dropped when full
+#define CACHE_ALIGN 8
+#define CACHE_KEY_LEN 300               // Same as SESSION_KEY_LEN of client
+#define CACHE_BOARD_LEN 32              // Same as BOARD_NAME_LEN of server
+#define CACHE_SHOW 100                  // Cached messages printed on start
+#define CACHE_ARGS_LEN (CACHE_BOARD_LEN + 64)
+#define CACHE_STALE_NOTE "-- Server was restarted, messages above may be gone --"
+
+
+typedef struct CacheHeader {
+    char magic[8];
+    char key[CACHE_KEY_LEN];            // <host>:<port> of server
+    ULONGLONG serial;                   // History serial of server run the messages came from (0 = none)
+    char board[CACHE_BOARD_LEN];        // Board of messages
+    ULONGLONG first_id;                 // #ids of the first and the last cached message (0 = empty)
+    ULONGLONG last_id;
+    ULONGLONG used;                     // Bytes of records
+    ULONGLONG count;                    // Records
+} CacheHeader;
+
+typedef struct CacheRecord {
+    ULONGLONG msg_id;
+    DWORD len;                          // Text length (without padding)
+    DWORD reserved;
+} CacheRecord;
+
+
+bool cacheOpen(const char* key);
+void cacheRender();
+bool cacheResumeArgs(char* args);
+void cacheServer(ULONGLONG serial);
+void cacheBoard(const char* board);
+void cacheAdd(const char* text, ULONGLONG len);
+void cacheClose();
+
+#endif //LAB6_CACHE_H
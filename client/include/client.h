@@ -5,12 +5,17 @@
 #include <ws2tcpip.h>
 
 WINBOOL runClient(const char *ip, const char *port);
+WINBOOL runRingClient(const char *name);
 void closeClient(ADDRINFOA *fullcli, SOCKET sock);
+void loadSession(const char *ip, const char *port);
+void saveSession(const char *token);
 
 void startAllServices(ADDRINFOA *fullcli, SOCKET sock);
 
 void syncService(SOCKET sock);
 void sendService(SOCKET sock);
-void recvMessages(SOCKET sock);
+void recvService(SOCKET sock);
+void recvMessages(const char* buf, LONGLONG len, bool deliver);
+void printRecord(const char* buf, LONGLONG len);
 
 #endif //LAB6_CLIENT_H
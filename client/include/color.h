@@ -12,15 +12,11 @@
     FOREGROUND_RED | FOREGROUND_GREEN, \
     FOREGROUND_BLUE
 
-#define NUM_COLORS 6
-
-#define DEFAULT_COLOR 0
+// Same colors as SGR codes (green, cyan, magenta, red, yellow, blue)
+#define ANSI_COLORS_ARRAY 32, 36, 35, 31, 33, 34
+#define ANSI_RESET "\x1b[0m"
 
-HANDLE hConsole;
-CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
-WORD saved_attr;
-
-void setColor(int seed);
+#define NUM_COLORS 6
 
 #endif //USE_COLOR
 #endif //LAB6_COLOR_H
@@ -2,9 +2,39 @@
 #define LAB6_FILESHARE_H
 
 #include <winsock2.h>
+#include "../../utils/include/mux.h"
 
-void clientDownloadFile(SOCKET sock, DWORD file_id, CRITICAL_SECTION *cs_send, CRITICAL_SECTION *cs_recv);
-void clientUploadFile(SOCKET sock, CRITICAL_SECTION *cs_send);
+
+#define DL_HEADER_LEN (4 * sizeof(ULONGLONG))
+#define INVALID_SIZE ((ULONGLONG) -1)
+#define PART_SUFFIX ".part"
+#define HASH_SUFFIX ".part.hash"
+
+
+typedef struct Download {
+    DWORD stream_id;                    // Stream of /dl request
+    ULONGLONG file_id;                  // File #id
+    HANDLE hf;                          // Partial file, renamed to `path` once complete
+    char path[MAX_PATH];                // Output file path
+    char part_path[MAX_PATH + sizeof(PART_SUFFIX)];
+    char hash_path[MAX_PATH + sizeof(HASH_SUFFIX)];  // Content hash of file the partial file is of
+    char header[DL_HEADER_LEN];         // <size> <offset> <length> <hash>, may come split
+    DWORD header_got;                   // Bytes of header received
+    ULONGLONG size;                     // Full file length
+    ULONGLONG offset;                   // Bytes already in partial file (requested offset)
+    ULONGLONG len;                      // Length of range sent by server
+    ULONGLONG got;                      // Bytes of range received
+    ULONGLONG hash;                     // Content hash: of partial file when requested, then of file on server
+    bool failed;                        // Partial file could not be written, rest of stream is dropped
+} Download;
+
+
+void clientInitDownloads();
+void clientCloseDownloads();
+
+void clientDownloadFile(Mux* mux, ULONGLONG file_id);
+bool clientDownloadChunk(MuxFrame* f);
+void clientUploadFile(Mux* mux);
 
 WINBOOL clientSelectOpenPath(char* path_buf);
 WINBOOL clientSelectSavePath(char* path_buf);
@@ -0,0 +1,27 @@
+#ifndef LAB6_RENDER_H
+#define LAB6_RENDER_H
+
+#include <windows.h>
+
+/*
+ *      Terminal output of client
+ *
+ *      Lines are queued in one buffer and written with one call per batch: at the end of a server
+ *      response, when the buffer is full, or RENDER_FLUSH_MS after the oldest queued line (a long
+ *      catch-up is redrawn that often at most). Colors by sender #id (USE_COLOR):
+ *          - console with virtual terminal sequences (Windows 10+): ANSI codes inside the buffer
+ *          - older console: SetConsoleTextAttribute() between writes, only where color changes
+ *          - output redirected to file or pipe: no colors
+ */
+
+#define RENDER_BUF_LEN 65536
+#define RENDER_FLUSH_MS 50
+#define DEFAULT_COLOR 0
+
+
+void renderInit();
+void renderLine(int color, const char* text, ULONGLONG len);
+void renderFlush();
+void setColor(int seed);
+
+#endif //LAB6_RENDER_H
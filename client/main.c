@@ -1,3 +1,4 @@
+#include <string.h>
 #include "include/client.h"
 
 #define DEFAULT_HOST "127.0.0.1"
@@ -6,14 +7,24 @@
 int main(int argc, char** argv) {
     /**
      * @usage
-     *      server.exe
-     *      server.exe [port]
-     *      server.exe [host] [port]
+     *      client.exe
+     *      client.exe [port]
+     *      client.exe [host] [port]
+     *      client.exe --unix <path>
+     *      client.exe --ring <name>
      *
      *  default is 127.0.0.1:5000
      */
     char *host, *port;
-    if (argc < 2) {
+    if (argc == 3 && !strcmp(argv[1], "--ring"))
+        // Server on the same host: read its shared-memory ring of messages
+        return runRingClient(argv[2]);
+    if (argc == 3 && !strcmp(argv[1], "--unix")) {
+        // Server on the same host: AF_UNIX socket, no port
+        host = argv[2];
+        port = NULL;
+    }
+    else if (argc < 2) {
         host = DEFAULT_HOST;
         port = DEFAULT_PORT;
     }
@@ -0,0 +1,205 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/cache.h"
+#include "../include/client.h"
+#include "../include/render.h"
+
+#define CACHE_PATH_LEN (sizeof(CACHE_PREFIX) + CACHE_KEY_LEN + sizeof(CACHE_SUFFIX))
+
+#define recordLen(len) ((sizeof(CacheRecord) + (len) + CACHE_ALIGN - 1) & ~(ULONGLONG) (CACHE_ALIGN - 1))
+
+static HANDLE cache_file = INVALID_HANDLE_VALUE, cache_map;
+static CacheHeader* hdr;                // NULL = no cache (file is used by another client, disk error)
+static char* data;
+static ULONGLONG shown_id;              // First cached #id printed on start (server pages /older from it)
+
+
+static void cacheDrop() {
+    /**
+     * @brief Forget cached messages, keep server and board
+     */
+    hdr->first_id = hdr->last_id = 0;
+    hdr->used = hdr->count = 0;
+    shown_id = 0;
+}
+
+static CacheRecord* recordAt(ULONGLONG off) {
+    /**
+     * @brief Record at `off` in data, NULL if it does not fit in used bytes
+     */
+    CacheRecord* rec;
+    if (off > hdr->used || hdr->used - off < sizeof(CacheRecord)) return NULL;
+    rec = (CacheRecord*) (data + off);
+    if (recordLen(rec->len) > hdr->used - off) return NULL;
+    return rec;
+}
+
+static bool cacheValid() {
+    /**
+     * @brief Check records of a cache file read from disk before anything is printed from it
+     * @details Each record fits in used bytes, #ids grow from first_id to last_id and there are `count` of them.
+     *  A damaged file (or one cut short by a crash) must not make the client read past the mapping.
+     */
+    ULONGLONG off, n = 0, prev = 0;
+    CacheRecord* rec;
+
+    for (off = 0; off < hdr->used; off += recordLen(rec->len), n++) {
+        rec = recordAt(off);
+        if (!rec || rec->msg_id <= prev || (!n && rec->msg_id != hdr->first_id)) return FALSE;
+        prev = rec->msg_id;
+    }
+    return n == hdr->count && prev == hdr->last_id;
+}
+
+static void cacheDropOldest() {
+    /**
+     * @brief Cache is full: drop the oldest half of records
+     */
+    ULONGLONG off = 0, n = 0;
+    CacheRecord* rec;
+
+    while (off < hdr->used / 2) {
+        rec = (CacheRecord*) (data + off);
+        off += recordLen(rec->len);
+        n++;
+    }
+    memmove(data, data + off, hdr->used - off);
+    hdr->used -= off;
+    hdr->count -= n;
+    hdr->first_id = hdr->used ? ((CacheRecord*) data)->msg_id : 0;
+    if (shown_id < hdr->first_id) shown_id = hdr->first_id;
+}
+
+bool cacheOpen(const char* key) {
+    /**
+     * @brief Map cache file of server `key` (<host>:<port>), create it if missing
+     * @return FALSE if client runs without cache
+     */
+    char path[CACHE_PATH_LEN];
+    ULONGLONG total = CACHE_HEADER_LEN + CACHE_DATA_LEN;
+    DWORD len = sprintf(path, "%s", CACHE_PREFIX);
+
+    // Server key as file name: ':' and path separators become '_'
+    for (const char* p = key; *p && len < CACHE_PATH_LEN - sizeof(CACHE_SUFFIX); p++)
+        path[len++] = (char) (isalnum((unsigned char) *p) || *p == '.' || *p == '-' ? *p : '_');
+    strcpy(path + len, CACHE_SUFFIX);
+
+    // Not shared: second client of the same server in this directory runs without cache
+    cache_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (cache_file == INVALID_HANDLE_VALUE) return FALSE;
+    cache_map = CreateFileMappingA(cache_file, NULL, PAGE_READWRITE, (DWORD) (total >> 32), (DWORD) total, NULL);
+    hdr = cache_map ? MapViewOfFile(cache_map, FILE_MAP_WRITE, 0, 0, total) : NULL;
+    if (!hdr) {
+        cacheClose();
+        return FALSE;
+    }
+    data = (char*) hdr + CACHE_HEADER_LEN;
+
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) || strncmp(hdr->key, key, CACHE_KEY_LEN)
+            || hdr->used > CACHE_DATA_LEN || hdr->first_id > hdr->last_id) {
+        memset(hdr, 0, sizeof(CacheHeader));
+        memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+        strncpy(hdr->key, key, CACHE_KEY_LEN-1);
+    }
+    else if (!cacheValid()) {
+#ifdef DEBUG
+        fprintf(stderr, "[cache] Records of %s are damaged, dropped\n", path);
+#endif
+        cacheDrop();
+    }
+    return TRUE;
+}
+
+void cacheRender() {
+    /**
+     * @brief Print the last CACHE_SHOW cached messages (before the server answers)
+     * @details Records were checked by cacheOpen(), bounds are checked again anyway: a record that
+     *  does not fit in the mapping drops the cache.
+     */
+    ULONGLONG off = 0, skip;
+    CacheRecord* rec;
+
+    if (!hdr || !hdr->count) return;
+    skip = hdr->count > CACHE_SHOW ? hdr->count - CACHE_SHOW : 0;
+    for (; off < hdr->used; off += recordLen(rec->len)) {
+        rec = recordAt(off);
+        if (!rec) {
+            cacheDrop();
+            return;
+        }
+        if (skip) {
+            skip--;
+            continue;
+        }
+        if (!shown_id) shown_id = rec->msg_id;
+        printRecord((const char*) (rec + 1), rec->len);
+    }
+}
+
+bool cacheResumeArgs(char* args) {
+    /**
+     * @brief "<history serial> <board> <first #id shown> <last #id>" for /resume
+     * @return FALSE if there is nothing cached
+     */
+    if (!hdr || !hdr->serial || !hdr->last_id) return FALSE;
+    sprintf(args, "%016llx %s %llu %llu", hdr->serial, hdr->board, shown_id ? shown_id : hdr->first_id, hdr->last_id);
+    return TRUE;
+}
+
+void cacheServer(ULONGLONG serial) {
+    /**
+     * @brief History serial of server (reply to /resume): cache of another run of server is dropped
+     */
+    if (!hdr || hdr->serial == serial) return;
+    if (shown_id) renderLine(DEFAULT_COLOR, CACHE_STALE_NOTE, sizeof(CACHE_STALE_NOTE) - 1);
+    cacheDrop();
+    hdr->serial = serial;
+}
+
+void cacheBoard(const char* board) {
+    /**
+     * @brief Server delivers messages of `board` from now on (/resume, /join)
+     */
+    if (!hdr || !strncmp(hdr->board, board, CACHE_BOARD_LEN)) return;
+    cacheDrop();
+    strncpy(hdr->board, board, CACHE_BOARD_LEN-1);
+}
+
+void cacheAdd(const char* text, ULONGLONG len) {
+    /**
+     * @brief Keep delivered message "#<id> ..." if it is newer than cached ones
+     */
+    CacheRecord* rec;
+    ULONGLONG id, rec_len = recordLen(len);
+    char* end;
+
+    if (!hdr || !hdr->serial || !hdr->board[0] || text[0] != '#' || rec_len > CACHE_DATA_LEN / 2) return;
+    id = strtoull(text + 1, &end, 10);
+    if (end == text + 1 || *end != ' ' || id <= hdr->last_id) return;
+
+    if (hdr->used + rec_len > CACHE_DATA_LEN) cacheDropOldest();
+    rec = (CacheRecord*) (data + hdr->used);
+    rec->msg_id = id;
+    rec->len = (DWORD) len;
+    memcpy(rec + 1, text, len);
+
+    // Record is complete before header counts it
+    hdr->used += rec_len;
+    hdr->count++;
+    hdr->last_id = id;
+    if (!hdr->first_id) hdr->first_id = id;
+}
+
+void cacheClose() {
+    if (hdr) {
+        FlushViewOfFile(hdr, 0);
+        UnmapViewOfFile(hdr);
+    }
+    if (cache_map) CloseHandle(cache_map);
+    if (cache_file != INVALID_HANDLE_VALUE) CloseHandle(cache_file);
+    hdr = NULL;
+    cache_map = NULL;
+    cache_file = INVALID_HANDLE_VALUE;
+}
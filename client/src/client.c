@@ -2,17 +2,14 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include "../include/client.h"
 #include "../include/fileshare.h"
-#include "../include/color.h"
-#include "../../utils/include/recvbuf.h"
-
-bool cv_stop;
-HANDLE ev_stop_client;
-CRITICAL_SECTION cs_msg, cs_rcv;
-
-int last_msg_id;
-DWORD my_id = 0;
+#include "../include/render.h"
+#include "../include/cache.h"
+#include "../../utils/include/mux.h"
+#include "../../utils/include/scan.h"
+#include "../../utils/include/ring.h"
 
 #ifdef DEBUG
 #define POLL_INTERVAL_MS 5000
@@ -20,13 +17,47 @@ DWORD my_id = 0;
 #define POLL_INTERVAL_MS 300
 #endif
 
-#define SYNC_BUF_LEN 32
+#define SYNC_BUF_LEN 64
+#define BOARD_NAME_LEN 32
+#define TOKEN_LEN 17
+#define SESSION_FILE "6chan.session"    // Resume token of last session: <host>:<port> <token>
+#define SESSION_KEY_LEN 300
+#define SYNC_TIMEOUT_MS 10000
 #define INPUT_BUF_LEN 1024
+#define RECORDS_BATCH 64                // Record offsets found per pass of recvMessages()
+#define RING_WAIT_MS 1000               // Consumer rechecks ring that long after a missed wakeup
+#define RING_LINE_EXTRA 256             // Room for header of ring message line (board, #ids, time, size)
 
 #define STR_(x) #x
 #define STR(x) STR_(x)
 
-#define NO_MESSAGES (-1)
+#define CMD_QUIT "/q"
+#define CMD_DL "/dl"
+#define CMD_FILE "/file"
+#define CMD_SYNC "/sync"
+#define CMD_STATS "/stats"
+#define CMD_COMPRESS "/compress"
+#define CMD_JOIN "/join"
+#define CMD_BOARDS "/boards"
+#define CMD_RESUME "/resume"
+#define CMD_OLDER "/older"
+#define CMD_SEARCH "/search"
+#define CMD_WHO "/who"
+#define CMD_BOARD "/board"
+#define CMD_HANDOFF "/handoff"
+#define CMD_PARKED "/parked"
+#define CMD_RESUMED "/resumed"
+
+bool cv_stop;
+HANDLE ev_stop_client, ev_synced;
+bool sync_more;                         // Server capped last sync response, sync again without delay
+Mux* mux;
+DWORD compress_stream;
+
+DWORD my_id = 0;
+
+char session_key[SESSION_KEY_LEN];      // <host>:<port> of server
+char session_token[TOKEN_LEN];          // Resume token given by server (empty = new session)
 
 
 #define disconnectOnError() \
@@ -40,12 +71,16 @@ WINBOOL runClient(const char *ip, const char *port) {
     /**
      * @brief initialize client: wsaStartup(), getaddrinfo(), socket(), connect()
      * transfer control to startAllServices()
+     * @details Without `port`, `ip` is the path of server's AF_UNIX socket (server on the same host).
      */
     int err;
     WSADATA wsa = {0};
     SOCKET sock = INVALID_SOCKET;
     ADDRINFOA client = {0};
     ADDRINFOA *fullcli = NULL;
+    struct sockaddr_un local = {0};
+    struct sockaddr *addr;
+    int addr_len;
 
     err = WSAStartup(0x0202, &wsa);
 #ifdef DEBUG
@@ -53,38 +88,122 @@ WINBOOL runClient(const char *ip, const char *port) {
 #endif
     disconnectOnError();
 
-    client.ai_family = AF_INET;
-    client.ai_socktype = SOCK_STREAM;
-    client.ai_protocol = IPPROTO_TCP;
+    if (!port) {
+        if (strlen(ip) >= sizeof(local.sun_path)) err = SOCKET_ERROR;
+        disconnectOnError();
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, ip);
+        addr = (struct sockaddr *) &local;
+        addr_len = sizeof(local);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    else {
+        client.ai_family = AF_INET;
+        client.ai_socktype = SOCK_STREAM;
+        client.ai_protocol = IPPROTO_TCP;
 
-    err = getaddrinfo(ip, port, &client, &fullcli);
+        err = getaddrinfo(ip, port, &client, &fullcli);
 #ifdef DEBUG
-    fprintf(stderr, "[runCli] GetAddrInfo: code %d\n", err);
+        fprintf(stderr, "[runCli] GetAddrInfo: code %d\n", err);
 #endif
-    disconnectOnError();
+        disconnectOnError();
 
-    sock = socket(fullcli->ai_family, fullcli->ai_socktype, fullcli->ai_protocol);
+        addr = fullcli->ai_addr;
+        addr_len = (int) fullcli->ai_addrlen;
+        sock = socket(fullcli->ai_family, fullcli->ai_socktype, fullcli->ai_protocol);
+    }
     if (sock == INVALID_SOCKET) err = SOCKET_ERROR;
     disconnectOnError();
 #ifdef DEBUG
     fprintf(stderr, "[runCli] Socket created successfully\n");
 #endif
 
-    printf("Connecting to %s:%s...\r\n", ip, port);
-    err = connect(sock, fullcli->ai_addr, fullcli->ai_addrlen);
-    disconnectOnError();
+    loadSession(ip, port ? port : "unix");
 
-#ifdef USE_COLOR
-    hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-    saved_attr = consoleInfo.wAttributes;
-#endif
+    renderInit();
+
+    // Messages of the last run are shown at once, server sends only newer ones
+    if (cacheOpen(session_key)) cacheRender();
+    renderFlush();
+
+    if (port) printf("Connecting to %s:%s...\r\n", ip, port);
+    else printf("Connecting to %s...\r\n", ip);
+    err = connect(sock, addr, addr_len);
+    disconnectOnError();
 
     startAllServices(fullcli, sock);
+    renderFlush();
+    cacheClose();
 
     return 0;
 }
 
+WINBOOL runRingClient(const char *name) {
+    /**
+     * @brief Read-only consumer: print messages server publishes to shared-memory ring `name`
+     * @details Server runs on the same host with --ring. No connection: messages are read in place
+     *  from the mapping, the thread sleeps only when there are none. Files are announced, not
+     *  downloaded. Runs until it is killed (Ctrl+C).
+     */
+    Ring* r;
+    RingRecord hdr;
+    char *body, *line;
+    DWORD body_cap;
+    ULONGLONG lost = 0, len;
+
+    r = ring_open(name);
+    if (!r) {
+        fprintf(stderr, "[ringCli] Failed to open ring '%s': code %lu\r\n", name, GetLastError());
+        return EXIT_FAILURE;
+    }
+    printf("Reading messages of ring '%s' (%llu bytes)...\r\n", name, r->hdr->size);
+
+    // Line of output: body and header (board, #ids, time, size) shorter than RING_LINE_EXTRA
+    body_cap = (DWORD) RING_BODY_MAX(r->hdr->size);
+    body = malloc(body_cap);
+    line = malloc(body_cap + RING_LINE_EXTRA);
+    if (!body || !line) {
+        free(body);
+        free(line);
+        ring_close(r);
+        return EXIT_FAILURE;
+    }
+
+    renderInit();
+
+    while (!cv_stop) {
+        // Record is copied out: server may overwrite it once we are a lap behind
+        if (!ring_read(r, &hdr, body, body_cap)) {
+            renderFlush();
+            ring_wait(r, RING_WAIT_MS);
+            continue;
+        }
+
+        if (r->lost != lost) {
+            len = sprintf(line, "... %llu bytes of messages skipped", r->lost - lost);
+            renderLine(DEFAULT_COLOR, line, len);
+            lost = r->lost;
+        }
+
+        hdr.board[RING_BOARD_LEN - 1] = '\0';
+        len = sprintf(line, "%s #%llu [%02hu:%02hu]  ", hdr.board, hdr.msg_id, hdr.timestamp.wHour, hdr.timestamp.wMinute);
+        if (hdr.src_id) len += sprintf(line + len, "Anonim #%lu: ", hdr.src_id);
+        if (hdr.type == RING_TYPE_FILE)
+            len += sprintf(line + len, "File '%.*s' (%llu bytes)", (int) hdr.body_len, body, hdr.msg_len);
+        else if (hdr.body_len < hdr.msg_len)
+            len += sprintf(line + len, "%.*s... (%llu bytes)", (int) hdr.body_len, body, hdr.msg_len);
+        else
+            len += sprintf(line + len, "%.*s", (int) hdr.body_len, body);
+        renderLine((int) hdr.src_id, line, len);
+    }
+
+    renderFlush();
+    free(body);
+    free(line);
+    ring_close(r);
+    return 0;
+}
+
 void closeClient(ADDRINFOA *fullcli, SOCKET sock)  {
     /**
      * @brief Close socket and free address info
@@ -106,33 +225,47 @@ void startAllServices(ADDRINFOA *fullcli, SOCKET sock) {
      * @brief Launch threads for services: sendService(), syncService(), recvService()
      * @details
      *
-     *  Initialize critical sections:
-     *      - cs_msg   - lock for send()
-     *      - cs_rcv   - lock for recv()
+     *  Initialize stream multiplexer for socket. All sends are queued to it,
+     *  so file transfers and chat messages are interleaved by chunks.
      *
      *  Launch service threads:
-     *      - syncService():   sends /sync in background and receives messages until \0\0. uses cs_msg and cs_rcv locks
+     *      - syncService():   sends /sync in background, waits for recvService() to process response
      *      - sendService():   parses user input, sends messages to server
      *          * File download:
-     *              uses cs_msg and cs_rcv locks, calls clientDownloadFile()
+     *              calls clientDownloadFile(), opens new stream and returns
      *          * File upload:
-     *              uses cs_msg lock, calls clientUploadFile()
+     *              calls clientUploadFile(), queues file on new stream and returns
+     *      - recvService():   the only thread that calls recv(). Dispatches frames by stream:
+     *              sync responses, file chunks, server notes
      *
      *  Wait for event ev_stop_client (is set once connection is closed)
      */
-    DWORD dwt;
-    HANDLE controllers[2] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+    DWORD dwt, n = 0;
+    HANDLE controllers[3], started[3];
 
-    InitializeCriticalSection(&cs_msg);
-    InitializeCriticalSection(&cs_rcv);
     ev_stop_client = CreateEventA(0, 0, FALSE, NULL);
+    ev_synced = CreateEventA(0, 0, FALSE, NULL);
     cv_stop = FALSE;
 
+    mux = mux_init(sock);
+    if (!mux) {
+        closeClient(fullcli, sock);
+        return;
+    }
+    clientInitDownloads();
+
+    // Offer compression: server replies /compress on the same stream if it accepts
+    compress_stream = mux_openstream(mux);
+    mux_send(mux, compress_stream, CMD_COMPRESS, strlen(CMD_COMPRESS)+1, TRUE);
+
     controllers[0] = CreateThread(NULL, 0, (LPVOID) syncService, (LPVOID) sock, 0, &dwt);
     controllers[1] = CreateThread(NULL, 0, (LPVOID) sendService, (LPVOID) sock, 0, &dwt);
-    for (int i = 0; i < 2; i++)
-        if (controllers[i] == INVALID_HANDLE_VALUE)
-            SetEvent(ev_stop_client);
+    controllers[2] = CreateThread(NULL, 0, (LPVOID) recvService, (LPVOID) sock, 0, &dwt);
+    // CreateThread() returns NULL on failure: stop the others, wait only for threads that run
+    for (int i = 0; i < 3; i++) {
+        if (controllers[i] == NULL) SetEvent(ev_stop_client);
+        else started[n++] = controllers[i];
+    }
 
 #ifdef DEBUG
     fprintf(stderr, "[startAllSrv] Services launched!\n");
@@ -143,74 +276,108 @@ void startAllServices(ADDRINFOA *fullcli, SOCKET sock) {
     fprintf(stderr, "[startAllSrv] Stopping client...\n");
 #endif
     cv_stop = TRUE;
+    SetEvent(ev_synced);
     closeClient(fullcli, sock);
-    WaitForMultipleObjects(2, controllers, TRUE, INFINITE);
+    if (n) WaitForMultipleObjects(n, started, TRUE, INFINITE);
 
-    for (int i = 0; i < 2; i++)
-        if (controllers != INVALID_HANDLE_VALUE)
-            CloseHandle(controllers[i]);
+    for (DWORD i = 0; i < n; i++)
+        CloseHandle(started[i]);
 #ifdef DEBUG
     fprintf(stderr, "[startAllSrv] Service threads stopped\n");
 #endif
-    DeleteCriticalSection(&cs_msg);
-    DeleteCriticalSection(&cs_rcv);
+    mux_close(mux);
+    clientCloseDownloads();
+    CloseHandle(ev_synced);
+}
+
+void loadSession(const char *ip, const char *port) {
+    /**
+     * @brief Read resume token of last session with this server from SESSION_FILE (if any)
+     */
+    FILE* f;
+    char line[SESSION_KEY_LEN + TOKEN_LEN + 1] = {0};
+    size_t len;
+
+    snprintf(session_key, SESSION_KEY_LEN, "%s:%s", ip, port);
+    session_token[0] = '\0';
+
+    f = fopen(SESSION_FILE, "r");
+    if (!f) return;
+    if (fgets(line, sizeof(line), f)) {
+        len = strlen(session_key);
+        if (!strncmp(line, session_key, len) && line[len] == ' ')
+            sscanf(&line[len+1], "%16[0-9a-f]", session_token);
+    }
+    fclose(f);
+}
+
+void saveSession(const char *token) {
+    /**
+     * @brief Remember resume token given by server in SESSION_FILE, so next run continues the session
+     */
+    FILE* f;
+
+    if (!strcmp(token, session_token)) return;
+    strncpy(session_token, token, TOKEN_LEN-1);
+
+    f = fopen(SESSION_FILE, "w");
+    if (!f) return;
+    fprintf(f, "%s %s\n", session_key, session_token);
+    fclose(f);
 }
 
 void syncService(SOCKET sock) {
     /**
      * @brief Background service: Send /sync within a certain time interval
      * @details
-     *   Sends /sync command in a certain time interval. Uses cs_msg, i.e. lock for send()
+     *   Starts with /resume <token> (empty for new session): server restores board and delivery cursor
+     *   of that session, so only missed messages are sent. With `@<cache>` (see cacheResumeArgs()) server
+     *   sends only messages newer than cached ones, even if the session is gone. Then sends /sync command on control stream
+     *   in loop, waits until recvService() processes the response (or timeout), and sleeps for polling interval.
+     *   Server keeps the delivery cursor, so /sync carries no message id. Response of server is capped,
+     *   it ends with record "/sync" if more messages are pending: next /sync is sent right away.
      */
-    char buf[SYNC_BUF_LEN];
-    int res;
-    last_msg_id = NO_MESSAGES;
-
-    while (!cv_stop) {
-        memset(buf, 0, SYNC_BUF_LEN);
+    char buf[SYNC_BUF_LEN + CACHE_ARGS_LEN], cache[CACHE_ARGS_LEN];
 
-        EnterCriticalSection(&cs_msg);
-        sprintf(buf, "/sync %d", last_msg_id);
+    memset(buf, 0, sizeof(buf));
+    sprintf(buf, "%s %s", CMD_RESUME, session_token);
+    if (cacheResumeArgs(cache)) sprintf(buf + strlen(buf), " @%s", cache);
 
-        res = send(sock, buf, strlen(buf)+1, 0); // with trailing \0
-        if (res == SOCKET_ERROR) {
+    while (!cv_stop) {
+        if (!mux_send(mux, MUX_STREAM_CONTROL, buf, strlen(buf)+1, TRUE)) { // with trailing \0
             printf("Connection reset.\r\n");
             SetEvent(ev_stop_client);
             cv_stop = TRUE;
+            break;
         }
-        LeaveCriticalSection(&cs_msg);
 #ifdef DEBUG
-        fprintf(stderr, "[syncService] Sync request sent, last_msg_id=%d\r\n", last_msg_id);
+        fprintf(stderr, "[syncService] Request sent: %s\r\n", buf);
 #endif
-        recvMessages(sock);
+        WaitForSingleObject(ev_synced, SYNC_TIMEOUT_MS);
 #ifdef DEBUG
         fprintf(stderr, "[syncService] Messages received.\r\n");
 #endif
-        Sleep(POLL_INTERVAL_MS);
+        if (sync_more) sync_more = FALSE;
+        else Sleep(POLL_INTERVAL_MS);
+        strcpy(buf, CMD_SYNC);
     }
 }
 
-#define CMD_QUIT "/q"
-#define CMD_DL "/dl"
-#define CMD_FILE "/file"
-#define CMD_SYNC "/sync"
-
 void sendService(SOCKET sock) {
     /**
      * @brief Foreground activity: process user input and send messages to server
      * @details
      *  Parses user input, sends messages to server
      *      * File download:
-     *          uses cs_msg and cs_rcv locks, calls clientDownloadFile()
+     *          calls clientDownloadFile(), does not wait for download to complete
      *      * File upload:
-     *          uses cs_msg lock, calls clientUploadFile()
+     *          calls clientUploadFile(), does not wait for upload to complete
      */
-    char buf[INPUT_BUF_LEN] = {0};
-    int res;
-    DWORD file_id;
+    char buf[INPUT_BUF_LEN + 1] = {0};     // scanf() stores up to INPUT_BUF_LEN chars and \0
+    ULONGLONG file_id;
 
     while (!cv_stop) {
-        memset(buf, 0, INPUT_BUF_LEN);
+        memset(buf, 0, sizeof(buf));
 #ifdef USE_COLOR
         setColor(my_id);
 #endif
@@ -238,67 +405,80 @@ void sendService(SOCKET sock) {
 
         // Download file
         else if (!strncmp(CMD_DL, buf, 3)) {
-            if (strlen(buf) < 5 || !(file_id = atol(&buf[4]))) {
+            if (strlen(buf) < 5 || !(file_id = strtoull(&buf[4], NULL, 10))) {
                 printf("Specify file id to download.\r\n");
                 continue;
             }
-            clientDownloadFile(sock, file_id, &cs_msg, &cs_rcv);
+            clientDownloadFile(mux, file_id);
         }
 
         // Upload file
         else if (!strcmp(CMD_FILE, buf)) {
-            clientUploadFile(sock, &cs_msg);
+            clientUploadFile(mux);
+        }
+
+        // Server statistics, list of boards and clients online, response is printed by recvService()
+        else if (!strcmp(CMD_STATS, buf) || !strcmp(CMD_BOARDS, buf) || !strcmp(CMD_WHO, buf)) {
+            mux_send(mux, mux_openstream(mux), buf, strlen(buf)+1, TRUE);
+        }
+
+        // Join board (control stream), page older history or search (stream of their own, not cached),
+        // recvMessages() prints response
+        else if (!strncmp(CMD_JOIN, buf, 5) || !strcmp(CMD_OLDER, buf) || !strncmp(CMD_SEARCH, buf, 7)) {
+            if (!strncmp(CMD_JOIN, buf, 5) && (buf[5] != ' ' || strlen(buf) < 7 || strlen(buf) - 6 >= BOARD_NAME_LEN)) {
+                printf("Specify board name to join.\r\n");
+                continue;
+            }
+            if (!strncmp(CMD_SEARCH, buf, 7) && (buf[7] != ' ' || strlen(buf) < 9)) {
+                printf("Specify words to search.\r\n");
+                continue;
+            }
+            if (!mux_send(mux, buf[1] == 'j' ? MUX_STREAM_CONTROL : mux_openstream(mux), buf, strlen(buf)+1, TRUE)) {
+                printf("Send connection reset.\r\n");
+                SetEvent(ev_stop_client);
+                cv_stop = TRUE;
+            }
         }
 
         // Some other command (now manual /sync is disabled)
         else if (buf[0] == '/' != 0)
-            printf("Available commands:\r\n/file - upload file\r\n/dl <id> - download file or message by #id\r\n/q - quit");
+            printf("Available commands:\r\n/file - upload file\r\n/dl <id> - download file or message by #id\r\n"
+                   "/older - show older messages\r\n/search <words> - find messages with all words\r\n/join <board> - switch to board\r\n/boards - list boards\r\n/who - clients online\r\n/stats - server statistics\r\n/q - quit");
 
         // Not a command, send message
         else {
-            EnterCriticalSection(&cs_msg);
-            res = send(sock, buf, strlen(buf)+1, 0);
-            if (res == SOCKET_ERROR) {
+            if (!mux_send(mux, MUX_STREAM_CONTROL, buf, strlen(buf)+1, TRUE)) {
                 printf("Send connection reset.\r\n");
                 SetEvent(ev_stop_client);
                 cv_stop = TRUE;
             }
-            LeaveCriticalSection(&cs_msg);
         }
     }
 }
 
-void recvMessages(SOCKET sock) {
+void recvService(SOCKET sock) {
     /**
-     * @brief syncService's subroutine: receive /sync response from server
+     * @brief Background service: receive frames from server and dispatch them by stream
      * @details
-     *  Uses cs_rcv lock, receives messages from server and prints in terminal.
+     *  - download streams:  chunks are written to file as they arrive, see clientDownloadChunk()
+     *  - control stream:    /sync response, passed to recvMessages() (messages are cached)
+     *  - compression reply: enables compression of outgoing frames
+     *  - notice stream:     /handoff pauses sending until /resumed (server restarts without disconnect)
+     *  - other streams:     responses to /older, /search, /stats, server notes (e.g. rejected upload), printed
      */
+    LONGLONG res;
+    char *buf;
+    MuxFrame frame;
 
-    int res;
-    int msg_id, user_id;
-    char *buf = NULL, *tmp;
-
-    // Monitor server's responses and print them, stop on \0\0, i.e. empty message
     while (!cv_stop) {
-        EnterCriticalSection(&cs_rcv);
-        res = recvuntil('\0', &buf, sock);
-        LeaveCriticalSection(&cs_rcv);
-
-        // Received only \0 (which means \0 twice in a row)
-        if (res == 1 && !buf[0]) { if (buf) free(buf); return; }
-
-#ifdef USE_COLOR
-        setColor(DEFAULT_COLOR);
-#endif
+        res = mux_recvframe(mux, &frame);
 
-        if (cv_stop) return;
+        if (cv_stop) { if (res > 0) free(frame.buf); return; }
 
         if (res == SOCKET_ERROR) {
             printf("Connection reset.\r\n");
             SetEvent(ev_stop_client);
             cv_stop = TRUE;
-            if (buf) free(buf);
             return;
         }
         if (res == 0) {
@@ -307,49 +487,107 @@ void recvMessages(SOCKET sock) {
             cv_stop = TRUE;
             return;
         }
-        if (buf[0] == '#') {
-            // Matches message form, update last message id
-            msg_id = atoi(&buf[1]);
-#ifdef DEBUG
-            fprintf(stderr, "[recvMessages] Got msg_id=%d, last_msg_id=%d\r\n", msg_id, last_msg_id);
-#endif
-            if (msg_id > last_msg_id) last_msg_id = msg_id;
 
-#ifdef USE_COLOR
-            // search for sender id:  #3 [hh:mm] Anonim #id: ...
-            tmp = strchr(&buf[1], '#');
-            if (tmp != NULL) {
-                user_id = atoi(tmp+1);
-
-                // Get my id from welcome message
-                if (msg_id == 0) {
-                    my_id = user_id;
-                    setColor(DEFAULT_COLOR);
-                }
-
-                // set message's sender #id as seed
-                else setColor(user_id);
-            }
-            else setColor(DEFAULT_COLOR);
-#endif
+        if (clientDownloadChunk(&frame)) continue;
+
+        res = mux_collect(mux, &frame, &buf);
+        if (res <= 0) continue;
 
+        if (frame.stream_id == MUX_STREAM_CONTROL) {
+            recvMessages(buf, res, TRUE);
+            SetEvent(ev_synced);
         }
-        printf("%s\r\n", buf);
+        else if (frame.stream_id == compress_stream && !strncmp(buf, CMD_COMPRESS, res)) {
+            // Server accepted compression, compress what we send too
+            mux->compress = TRUE;
+        }
+        else if (frame.stream_id == MUX_STREAM_NOTICE) {
+            // Server hands our connection over to its new process: /parked is the last thing it
+            // reads from us, the rest is held until the new one says /resumed
+            if (!strncmp(buf, CMD_HANDOFF, res)) mux_pause(mux, MUX_STREAM_NOTICE, CMD_PARKED, strlen(CMD_PARKED)+1);
+            else if (!strncmp(buf, CMD_RESUMED, res)) mux_resume(mux);
+        }
+        else recvMessages(buf, res, FALSE);
         free(buf);
-        buf = NULL;
+    }
+}
 
-#ifdef USE_COLOR
-        setColor(my_id);
-#endif
+void recvMessages(const char* buf, LONGLONG len, bool deliver) {
+    /**
+     * @brief recvService's subroutine: print /sync response from server
+     * @details
+     *  Response is a sequence of \0-terminated messages, ends with \0\0 (empty message).
+     *  Prints them in terminal. Record "/resume <token> <history serial>" (reply to /resume) is saved,
+     *  not printed, as is "/board <name>" (board delivered from now on). Record "/sync" means more
+     *  messages are pending. Messages of delivery (`deliver`, not /older or /search) are cached.
+     *  Records are split in one pass over the response, RECORDS_BATCH offsets at a time.
+     *  Lines are rendered in batches: output is written at the end of response (see render.h).
+     */
+
+    const char *end, *base = buf, *stop = buf + len;
+    char token[TOKEN_LEN];
+    ULONGLONG offs[RECORDS_BATCH], n = 0, k = 0, serial;
+
+    for (; buf < stop && !cv_stop; buf = end + 1) {
+        if (k == n) {
+            base = buf;
+            n = scan_split(base, stop - base, "", 1, offs, RECORDS_BATCH);
+            k = 0;
+        }
+        end = k < n ? base + offs[k++] : stop;
+        if (end == buf) {
+            renderFlush();
+            return;
+        }
+
+        if (!strncmp(buf, CMD_RESUME " ", 8)) {
+            if (end < stop && sscanf(&buf[8], "%16[0-9a-f] %llx", token, &serial) == 2) {
+                saveSession(token);
+                cacheServer(serial);
+            }
+            continue;
+        }
+        if (!strncmp(buf, CMD_BOARD " ", 7)) {
+            if (end < stop && end - buf - 7 < CACHE_BOARD_LEN) cacheBoard(&buf[7]);
+            continue;
+        }
+        if (end - buf == strlen(CMD_SYNC) && !strncmp(buf, CMD_SYNC, end - buf)) {
+            sync_more = TRUE;
+            continue;
+        }
+
+        if (deliver) cacheAdd(buf, end - buf);
+        printRecord(buf, end - buf);
     }
+
+    // Single notes on other streams (/stats, ...) have no end of response
+    if (!deliver) renderFlush();
 }
 
-#ifdef USE_COLOR
-void setColor(int seed) {
-    WORD colors[NUM_COLORS] = { COLORS_ARRAY };
-    if (seed == DEFAULT_COLOR)
-        SetConsoleTextAttribute(hConsole, saved_attr);
-    else
-        SetConsoleTextAttribute(hConsole, colors[seed % NUM_COLORS]);
+void printRecord(const char* buf, LONGLONG len) {
+    /**
+     * @brief Queue message or note of server for output, colored by sender #id
+     */
+    int color = DEFAULT_COLOR, user_id;
+    const char* tmp;
+
+    if (buf[0] == '#') {
+        // search for sender id:  #3 [hh:mm] Anonim #id: ...
+        tmp = memchr(&buf[1], '#', len - 1);
+        if (tmp != NULL) {
+            user_id = (int) strtoul(tmp+1, NULL, 10);
+
+            // Get my id from welcome message (#0), what user types is in this color
+            if (!strncmp(buf, "#0 ", 3)) {
+                my_id = user_id;
+                renderLine(DEFAULT_COLOR, buf, len);
+                setColor(my_id);
+                return;
+            }
+
+            // set message's sender #id as seed
+            color = user_id;
+        }
+    }
+    renderLine(color, buf, len);
 }
-#endif
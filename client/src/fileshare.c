@@ -4,8 +4,10 @@
 #include "../include/fileshare.h"
 #include "../../utils/include/recvbuf.h"
 
-#define CMD_BUF_LEN 32
-#define FILE_HEADER '\xff'
+#define CMD_BUF_LEN 80
+
+static List* downloads;             // Active Download's
+static CRITICAL_SECTION cs_dl;      // Lock for `downloads`
 
 
 WINBOOL clientSelectSavePath(char* buf) {
@@ -45,110 +47,237 @@ WINBOOL clientSelectOpenPath(char* buf) {
 }
 
 
-#define abortDlOnError() \
-    if (res <= 0) { \
-        printf("File #%lu not found.\r\n", file_id); \
-        LeaveCriticalSection(cs_recv); \
-        LeaveCriticalSection(cs_send); \
-        return; \
-    }
+void clientInitDownloads() {
+    downloads = list();
+    InitializeCriticalSection(&cs_dl);
+}
 
-void clientDownloadFile(SOCKET sock, DWORD file_id, CRITICAL_SECTION *cs_send, CRITICAL_SECTION *cs_recv) {
+void clientCloseDownloads() {
     /**
-     * @brief Download file by ID and write it on disk
-     * @details
-     *  Uses critical sections cs_msg and cs_rcv, i.e. locks both send() and recv() while downloading.
-     *
-     *  Request format:   /dl <id>
-     *  Response format:  FILE_HEADER <size> <content>
-     *
-     *  Once downloaded to buffer, releases sections and asks user 'Save as...'.
+     * @brief Abort all active downloads (on disconnect). Partial files are kept for resume
      */
-    char *tmp = NULL, cmd_buf[CMD_BUF_LEN] = {0};
-    int res, size;
-
-    sprintf(cmd_buf, "/dl %lu", file_id);
-
-    EnterCriticalSection(cs_send);
-    res = send(sock, cmd_buf, strlen(cmd_buf)+1, 0);
+    Download* d;
+    EnterCriticalSection(&cs_dl);
+    while ((d = list_pop(downloads, 0)) != NULL) {
+        printf("Download of file #%llu interrupted. Download it to the same path again to resume.\r\n", d->file_id);
+        CloseHandle(d->hf);
+        free(d);
+    }
+    LeaveCriticalSection(&cs_dl);
+    free(downloads);
+    DeleteCriticalSection(&cs_dl);
+}
 
-    EnterCriticalSection(cs_recv);
+static bool readPartHash(Download* d) {
+    /**
+     * @brief Load content hash of file that `<path>.part` belongs to into d->hash
+     */
+    HANDLE hf = CreateFileA(d->hash_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD br = 0;
+    if (hf == INVALID_HANDLE_VALUE) return FALSE;
+    if (!ReadFile(hf, &d->hash, sizeof(d->hash), &br, NULL)) br = 0;
+    CloseHandle(hf);
+    return br == sizeof(d->hash) && d->hash != 0;
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "[downloadFile] Waiting for header...\r\n");
-#endif
-    res = recvuntil(FILE_HEADER, &tmp, sock);
-    abortDlOnError();
-    free(tmp);
+static bool writePartHash(Download* d) {
+    /**
+     * @brief Store d->hash next to `<path>.part`, so a resumed download can tell it is the same file
+     */
+    HANDLE hf = CreateFileA(d->hash_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD bw = 0;
+    if (hf == INVALID_HANDLE_VALUE) return FALSE;
+    if (!WriteFile(hf, &d->hash, sizeof(d->hash), &bw, NULL)) bw = 0;
+    CloseHandle(hf);
+    return bw == sizeof(d->hash);
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "[downloadFile] Header loaded\r\n");
-#endif
+static bool truncatePart(Download* d) {
+    /**
+     * @brief Drop content of `<path>.part`, download starts from 0
+     */
+    LARGE_INTEGER zero = {0};
+    d->offset = 0;
+    return SetFilePointerEx(d->hf, zero, NULL, FILE_BEGIN) && SetEndOfFile(d->hf);
+}
 
-    res = recvlen(sizeof(int), (LPVOID) &tmp, sock);
-    abortDlOnError();
+void clientDownloadFile(Mux* mux, ULONGLONG file_id) {
+    /**
+     * @brief Ask user 'Save as...', then request file by ID on a new stream
+     * @details
+     *  Does not wait for download. Content is written to `<path>.part` by clientDownloadChunk()
+     *  in receiving thread as it arrives, interleaved with chat and other transfers.
+     *  Once complete, partial file is renamed to `<path>`.
+     *
+     *  If `<path>.part` already exists (interrupted download), only the rest of file is requested,
+     *  together with content hash of the file it is of (`<path>.part.hash`). If server has other
+     *  content under this #id, it sends the whole file and partial file is started over.
+     *
+     *  Request format:   /dl <id> <offset> [0 <hash>]
+     *  Response format:  <size> <offset> <length> <hash> <content>
+     */
+    char cmd_buf[CMD_BUF_LEN] = {0};
+    LARGE_INTEGER zero = {0}, part_size;
 
-#ifdef DEBUG
-    fprintf(stderr, "[downloadFile] Size received\r\n");
-#endif
+    Download* d = calloc(1, sizeof(Download));
+    if (!d) return;
+    d->file_id = file_id;
 
-    size = *((int*) tmp);
-    free(tmp);
-    if (size == INVALID_FILE_SIZE) res = 0;
-    abortDlOnError();
+    if (!clientSelectSavePath(d->path)) {
+        free(d);
+        return;
+    }
+    sprintf(d->part_path, "%s%s", d->path, PART_SUFFIX);
+    sprintf(d->hash_path, "%s%s", d->path, HASH_SUFFIX);
+
+    d->hf = CreateFileA(d->part_path,
+                        GENERIC_WRITE,
+                        FILE_SHARE_READ,
+                        NULL,
+                        OPEN_ALWAYS,
+                        FILE_ATTRIBUTE_NORMAL,
+                        NULL);
+    if (d->hf == INVALID_HANDLE_VALUE) {
+        printf("Could not save to %s\r\n", d->part_path);
+        printLastError();
+        free(d);
+        return;
+    }
 
-    printf("Downloading file #%lu (%d bytes)...\r\n", file_id, size);
-    res = recvlen(size, &tmp, sock);
-    abortDlOnError();
+    // Resume after data we already have, if we know which file it is of
+    if (GetFileSizeEx(d->hf, &part_size)) d->offset = part_size.QuadPart;
+    if (d->offset && !readPartHash(d)) {
+        printf("File #%llu: %s is not of a known file, downloading from start.\r\n", file_id, d->part_path);
+        if (!truncatePart(d)) {
+            printLastError();
+            CloseHandle(d->hf);
+            free(d);
+            return;
+        }
+    }
+    SetFilePointerEx(d->hf, zero, NULL, FILE_END);
+    if (d->offset)
+        printf("Resuming file #%llu from %llu bytes...\r\n", file_id, d->offset);
+
+    d->stream_id = mux_openstream(mux);
+    EnterCriticalSection(&cs_dl);
+    list_append(downloads, d);
+    LeaveCriticalSection(&cs_dl);
+
+    if (d->offset) sprintf(cmd_buf, "/dl %llu %llu 0 %llx", file_id, d->offset, d->hash);
+    else sprintf(cmd_buf, "/dl %llu 0", file_id);
+    mux_send(mux, d->stream_id, cmd_buf, strlen(cmd_buf)+1, TRUE);
+}
 
-    LeaveCriticalSection(cs_recv);
+static void clientFinishDownload(Download* d) {
+    /**
+     * @brief Close partial file and rename it, or keep it for resume
+     */
+    CloseHandle(d->hf);
 
-#ifdef DEBUG
-    fprintf(stderr, "[downloadFile] File downloaded, saving...\r\n");
-#endif
+    if (d->header_got < DL_HEADER_LEN || d->size == INVALID_SIZE) {
+        printf("File #%llu not found.\r\n", d->file_id);
+        DeleteFileA(d->part_path);
+        DeleteFileA(d->hash_path);
+    }
+    else if (d->offset > d->size) {
+        // Partial file is larger than file on server: it belongs to some other file
+        printf("File #%llu: %s does not match this file, removed. Try again.\r\n", d->file_id, d->part_path);
+        DeleteFileA(d->part_path);
+        DeleteFileA(d->hash_path);
+    }
+    else if (d->failed)
+        printf("File #%llu: could not write %s, download stopped at %llu of %llu bytes. Free some space and download it again to resume.\r\n",
+               d->file_id, d->part_path, d->offset + d->got, d->size);
+    else if (d->got < d->len)
+        printf("File #%llu: download incomplete (%llu of %llu bytes). Download it to the same path again to resume.\r\n",
+               d->file_id, d->offset + d->got, d->size);
+    else if (!MoveFileExA(d->part_path, d->path, MOVEFILE_REPLACE_EXISTING)) {
+        printf("Could not save to %s\r\n", d->path);
+        printLastError();
+    }
+    else {
+        DeleteFileA(d->hash_path);
+        printf("File #%llu saved as %s\r\n", d->file_id, d->path);
+    }
+}
 
-    // now `tmp` contains `size`-bytes file content
-    DWORD bw;
-    char file_path[MAX_PATH] = {0};
-    if (!clientSelectSavePath(file_path)) {
-        free(tmp);
-        LeaveCriticalSection(cs_send);
-        return;
+bool clientDownloadChunk(MuxFrame* f) {
+    /**
+     * @brief Write frame to file, if it belongs to a download stream
+     * @return TRUE if frame was consumed (f->buf is freed), FALSE if it is not a download
+     */
+    Download* d = NULL;
+    Item *i, *prev = NULL;
+    DWORD pos = 0, n, bw;
+    ULONGLONG offset;
+    WINBOOL written;
+
+    EnterCriticalSection(&cs_dl);
+    for (i = downloads->head; i != NULL; prev = i, i = i->next)
+        if (((Download*) i->data)->stream_id == f->stream_id) {
+            d = i->data;
+            break;
+        }
+    if (!d) {
+        LeaveCriticalSection(&cs_dl);
+        return FALSE;
     }
 
-    LeaveCriticalSection(cs_send);
+    // First bytes of stream are file length, offset and length of range, content hash
+    while (d->header_got < DL_HEADER_LEN && pos < f->len)
+        d->header[d->header_got++] = f->buf[pos++];
+    if (d->header_got == DL_HEADER_LEN && pos) {
+        memcpy(&d->size, d->header, sizeof(ULONGLONG));
+        memcpy(&offset, d->header + sizeof(ULONGLONG), sizeof(ULONGLONG));
+        memcpy(&d->len, d->header + 2 * sizeof(ULONGLONG), sizeof(ULONGLONG));
+        memcpy(&d->hash, d->header + 3 * sizeof(ULONGLONG), sizeof(ULONGLONG));
+        if (d->size != INVALID_SIZE && offset != d->offset) {
+            // Partial file is of other content: server sends the file from start
+            printf("File #%llu: %s is of another file, downloading from start.\r\n", d->file_id, d->part_path);
+            if (offset != 0 || !truncatePart(d)) d->failed = TRUE;
+        }
+        if (d->size != INVALID_SIZE && !writePartHash(d)) d->failed = TRUE;
+        if (d->size != INVALID_SIZE && d->len && !d->failed)
+            printf("Downloading file #%llu (%llu bytes from %llu of %llu)...\r\n", d->file_id, d->len, d->offset, d->size);
+    }
 
-    // now we have file path to save to
-    HANDLE hf = CreateFileA(file_path,
-                            GENERIC_WRITE,
-                            FILE_SHARE_READ,
-                            NULL,
-                            CREATE_ALWAYS,
-                            FILE_ATTRIBUTE_NORMAL,
-                            NULL);
-    if (hf == INVALID_HANDLE_VALUE) {
-        printf("Could not save to %s\r\n", file_path);
-        printLastError();
-        free(tmp);
-        return;
+    // Range is written as it arrives. After a write error the rest of stream is dropped
+    if (pos < f->len && d->size != INVALID_SIZE && !d->failed) {
+        n = f->len - pos;
+        if (n > d->len - d->got) n = (DWORD) (d->len - d->got);
+        bw = 0;
+        written = WriteFile(d->hf, f->buf + pos, n, &bw, NULL);
+        d->got += bw;
+        if (!written || bw != n) {
+            printLastError();
+            d->failed = TRUE;
+        }
     }
+    free(f->buf);
+    f->buf = NULL;
 
-    WriteFile(hf, tmp, size, &bw, NULL);
-    free(tmp);
-    CloseHandle(hf);
-    printf("File #%lu saved as %s\r\n", file_id, file_path);
+    if (f->flags & FRAME_FIN) {
+        list_popnext(downloads, prev);
+        clientFinishDownload(d);
+        free(d);
+    }
+    LeaveCriticalSection(&cs_dl);
+    return TRUE;
 }
 
-void clientUploadFile(SOCKET sock, CRITICAL_SECTION *cs_send) {
+void clientUploadFile(Mux* mux) {
     /**
      * @brief Routine to pick a file from disk and send it to server
      * @details
-     *  Uses cs_msg lock, i.e. locks send() while uploading
+     *  Queues file on a new stream and returns, file is sent in chunks by multiplexer
      *
-     *  request format:  /file <name> \0 <size> <content>
-     *  response format:  None (does not wait for response)
+     *  request format:  /file <name> \0 <size:8> <content>
+     *  response format:  None (server replies on the same stream only if file is rejected)
      */
-    DWORD dw, size, total_size, pos;
+    DWORD dw, n;
+    ULONGLONG size, total_size, pos;
+    LARGE_INTEGER file_size;
     char* tmp;
     char file_path[MAX_PATH] = {0}, file_name[MAX_PATH] = {0}, *buf = NULL;
     if (!clientSelectOpenPath(file_path)) return;
@@ -171,31 +300,42 @@ void clientUploadFile(SOCKET sock, CRITICAL_SECTION *cs_send) {
     if (tmp) strncpy(file_name, tmp+1, tmp-file_path+MAX_PATH-1);
     else strncpy(file_name, file_path, MAX_PATH);
 
-    size = GetFileSize(hf, NULL);
-    total_size = 6 + strlen(file_name) + 1 + sizeof(DWORD) + size;
+    if (!GetFileSizeEx(hf, &file_size) || (ULONGLONG) file_size.QuadPart > MAX_BUF_LEN) {
+        printf("File is too large.\r\n");
+        CloseHandle(hf);
+        return;
+    }
+    size = file_size.QuadPart;
+    total_size = 6 + strlen(file_name) + 1 + sizeof(ULONGLONG) + size;
 
     // buf will look like:    /file <file_name>\0<file_size><content>
     buf = malloc(total_size);
-    if (!buf) return;
+    if (!buf) { CloseHandle(hf); return; }
 
     sprintf(buf, "/file %s", file_name); //  /file <name>\0
     pos = 6 + strlen(file_name) + 1;
-    memcpy(buf+pos, &size, sizeof(DWORD)); //  <size>
-    pos += sizeof(DWORD);
-    ReadFile(hf, buf+pos, size, &dw, NULL);
+    memcpy(buf+pos, &size, sizeof(ULONGLONG)); //  <size>
+    pos += sizeof(ULONGLONG);
 
-    CloseHandle(hf);
+    // ReadFile() takes 32-bit length, read large files in parts
+    for (; pos < total_size; pos += dw) {
+        n = total_size - pos < 0x40000000 ? (DWORD) (total_size - pos) : 0x40000000;
+        if (!ReadFile(hf, buf+pos, n, &dw, NULL) || dw == 0) break;
+    }
 
-    // Now file has been read, sending
-    EnterCriticalSection(cs_send);
-    int res = send(sock, buf, total_size, 0);
-    LeaveCriticalSection(cs_send);
+    CloseHandle(hf);
+    if (pos < total_size) {
+        printf("Could not read file %s\r\n", file_path);
+        printLastError();
+        free(buf);
+        return;
+    }
 
-    if (res == SOCKET_ERROR) {
+    // Now file has been read, queue it. Multiplexer frees buf once sent
+    if (!mux_sendref(mux, mux_openstream(mux), buf, total_size, TRUE, free, buf)) {
         printf("Could not send this file. Network error.\r\n");
         printLastWSAError();
     }
-    free(buf);
 }
 
 void printLastError() {
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/render.h"
+#include "../include/color.h"
+
+#define ANSI_LEN 8
+
+static CRITICAL_SECTION cs_render;      // Lock for buffer (receiving and input threads)
+static char out[RENDER_BUF_LEN];
+static DWORD out_len;
+static ULONGLONG queued_tick;           // When the oldest queued line was queued
+static HANDLE h_out;
+static bool console;                    // Output is a console: lines are colored
+static bool ansi;                       //   and it takes ANSI sequences
+static WORD saved_attr;                 // Attributes of console before client
+static int cur_color = DEFAULT_COLOR;   // Color at the end of queued output
+static int input_color = DEFAULT_COLOR; // Color of user input (setColor())
+
+
+void renderInit() {
+    /**
+     * @brief Find out what output is: console with or without virtual terminal sequences, file or pipe
+     */
+    DWORD mode;
+    CONSOLE_SCREEN_BUFFER_INFO info;
+
+    InitializeCriticalSection(&cs_render);
+    h_out = GetStdHandle(STD_OUTPUT_HANDLE);
+#ifdef USE_COLOR
+    console = GetConsoleMode(h_out, &mode) != 0;
+    if (console) {
+        if (GetConsoleScreenBufferInfo(h_out, &info)) saved_attr = info.wAttributes;
+        ansi = SetConsoleMode(h_out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+    }
+#endif
+}
+
+static void writeOut() {
+    /**
+     * @brief Write queued output at once. Caller holds cs_render
+     */
+    if (!out_len) return;
+    fwrite(out, 1, out_len, stdout);
+    fflush(stdout);
+    out_len = 0;
+}
+
+static void switchColor(int color) {
+    /**
+     * @brief Following output is in `color`. Caller holds cs_render
+     */
+#ifdef USE_COLOR
+    WORD colors[NUM_COLORS] = { COLORS_ARRAY };
+    int codes[NUM_COLORS] = { ANSI_COLORS_ARRAY };
+
+    if (!console || color == cur_color) return;
+    if (ansi) {
+        if (out_len + ANSI_LEN > RENDER_BUF_LEN) writeOut();
+        if (color == DEFAULT_COLOR) out_len += sprintf(out + out_len, "%s", ANSI_RESET);
+        else out_len += sprintf(out + out_len, "\x1b[%dm", codes[color % NUM_COLORS]);
+    }
+    else {
+        writeOut();
+        SetConsoleTextAttribute(h_out, color == DEFAULT_COLOR ? saved_attr : colors[color % NUM_COLORS]);
+    }
+    cur_color = color;
+#endif
+}
+
+static void flushOut() {
+    /**
+     * @brief Write queued lines, leave console in color of user input. Caller holds cs_render
+     */
+    if (ansi) switchColor(input_color);
+    writeOut();
+    switchColor(input_color);
+}
+
+void renderLine(int color, const char* text, ULONGLONG len) {
+    /**
+     * @brief Queue line of text in `color`, write queued output if it is full or RENDER_FLUSH_MS old
+     */
+    EnterCriticalSection(&cs_render);
+    if (!out_len) queued_tick = GetTickCount64();
+    switchColor(color);
+
+    if (out_len + len + 2 > RENDER_BUF_LEN) writeOut();
+    if (len + 2 > RENDER_BUF_LEN) {
+        // Longer than buffer: as it is
+        fwrite(text, 1, len, stdout);
+        fwrite("\r\n", 1, 2, stdout);
+        fflush(stdout);
+    }
+    else {
+        memcpy(out + out_len, text, len);
+        out[out_len + len] = '\r';
+        out[out_len + len + 1] = '\n';
+        out_len += (DWORD) len + 2;
+    }
+
+    if (GetTickCount64() - queued_tick >= RENDER_FLUSH_MS) flushOut();
+    LeaveCriticalSection(&cs_render);
+}
+
+void renderFlush() {
+    EnterCriticalSection(&cs_render);
+    flushOut();
+    LeaveCriticalSection(&cs_render);
+}
+
+void setColor(int seed) {
+    /**
+     * @brief Color of what user types (and of plain printf() output) from now on
+     */
+    EnterCriticalSection(&cs_render);
+    input_color = seed;
+    flushOut();
+    LeaveCriticalSection(&cs_render);
+}
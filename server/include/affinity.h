@@ -0,0 +1,25 @@
+#ifndef LAB6_AFFINITY_H
+#define LAB6_AFFINITY_H
+
+#include <windows.h>
+#include "config.h"
+
+/*
+ *      CPU affinity and NUMA placement of server threads (--affinity, --numa)
+ *
+ *      Listener and timer threads run on CPUs of their role. Client threads run on worker CPUs or,
+ *      with --numa, each on one NUMA node, nodes taken in turn; the mux sender of a client follows
+ *      its thread. A client thread is placed before it allocates anything, so its recv buffer,
+ *      decompressed segment and mux are faulted in on its own node (first touch).
+ *      Message History is shared by all clients and is not placed: see README, CPU affinity.
+ */
+
+#define AFFINITY_NODES_MAX 64
+
+
+bool initAffinity();
+void pinThread(HANDLE thread, DWORD role);
+void placeWorker();
+void pinAlongside(HANDLE thread);
+
+#endif //LAB6_AFFINITY_H
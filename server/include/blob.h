@@ -0,0 +1,52 @@
+#ifndef LAB6_BLOB_H
+#define LAB6_BLOB_H
+
+#include <windows.h>
+
+/*
+ *      Content-addressed store for uploaded files
+ *
+ *      Identical uploads are stored once. Each Blob is reference-counted:
+ *      one reference per Message (refBlob / unrefBlob), and one hold per download,
+ *      log write or replica send in progress (holdBlob / releaseBlob). Blob is freed
+ *      when it has neither.
+ */
+
+#define BLOB_BUCKETS_INIT 1024
+
+
+typedef struct Blob {
+    ULONGLONG hash;                     // Content hash (blobHash)
+    ULONGLONG len;                      // Length of content
+    LONG refs;                          // References of messages
+    LONG holds;                         // Transfers in progress that read content
+    char *buf;                          // Content
+    struct Blob *next;                  // Next blob in hash bucket
+} Blob;
+
+typedef struct BlobStats {
+    DWORD blobs;                        // Unique blobs stored
+    DWORD refs;                         // References to blobs (files in history)
+    DWORD holds;                        // Holds of transfers in progress (downloads, log, replicas)
+    DWORD uploads;                      // Total uploads put into store
+    DWORD dedup_hits;                   // Uploads that matched an existing blob
+    ULONGLONG stored_bytes;             // Bytes actually held in RAM
+    ULONGLONG logical_bytes;            // Bytes all uploads would take without deduplication
+} BlobStats;
+
+
+void initBlobStore();
+void destroyBlobStore();
+
+ULONGLONG blobHash(const char* buf, ULONGLONG len);
+
+Blob* putBlob(const char* buf, ULONGLONG len);
+Blob* adoptBlob(char* buf, ULONGLONG len, ULONGLONG hash);
+void refBlob(Blob* b);
+void unrefBlob(Blob* b);
+void holdBlob(Blob* b);
+void releaseBlob(Blob* b);
+
+void getBlobStats(BlobStats* st);
+
+#endif //LAB6_BLOB_H
@@ -0,0 +1,63 @@
+#ifndef LAB6_CONFIG_H
+#define LAB6_CONFIG_H
+
+#include <windows.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "5000"
+
+#define DEFAULT_HOT_MESSAGES 1024
+#define DEFAULT_CATCHUP 100
+#define DEFAULT_SYNC_MAX 1000
+#define DEFAULT_IDLE_TIMEOUT 120       // Seconds (clients poll every few seconds)
+#define DEFAULT_HEARTBEAT 30
+#define DEFAULT_STALL_TIMEOUT 60
+#define DEFAULT_RING_SIZE 16           // MB
+#define DEFAULT_RELAY_HISTORY 1000     // Messages per board kept by relay without --retention
+#define CONFIG_BOARDS_MAX 64
+
+#define CPUS_ACCEPT 0                  // Roles of --affinity: listener threads
+#define CPUS_WORKER 1                  //   client threads and their mux senders
+#define CPUS_TIMER 2                   //   timer wheel thread
+#define CPUS_ROLES 3
+
+
+typedef struct ServerConfig {
+    const char *host;                   // Host to listen at
+    const char *port;                   // Port to listen at
+    const char *unix_path;              // AF_UNIX socket to listen at as well, for local clients (NULL = TCP only)
+    const char *replica_of;             // Primary "<host>:<port>" this server replicates (NULL = primary)
+    bool relay;                         //   only recent history of it (fan-out node, --relay)
+    const char *repl_key;               // Key file replicas prove they have (NULL = replication refused)
+    bool compress_history;              // Compress cold segments of Message History
+    DWORD hot_messages;                 // Recent messages always kept uncompressed
+    bool wire_compress;                 // Allow clients to negotiate compressed frames
+    ULONGLONG retention;                // Messages kept per board by default (0 = all)
+    ULONGLONG catchup;                  // Last messages sent to new client or on /join, page of /older (0 = all)
+    DWORD sync_max;                     // Messages per sync response at most (0 = no limit)
+    const char *snapshot;               // Snapshot file, restored on start and saved on shutdown (NULL = RAM only)
+    const char *snapshot_key;           // Key file of snapshot and log (created if missing)
+    const char *wal;                    // Write-ahead log of posts, replayed on start (NULL = off)
+    bool handoff;                       // Take over from a running server on same port, hand over to the next one
+    const char *ring;                   // Shared-memory ring posts are published to (NULL = off)
+    DWORD ring_size;                    //   MB of ring data
+    double rate_msgs;                   // Posts per second per client (0 = no limit)
+    double rate_msgs_burst;             //   burst (0 = one second of rate)
+    double rate_bytes;                  // Received bytes per second per client (0 = no limit)
+    double rate_bytes_burst;
+    DWORD max_transfers;                // File downloads in flight per client (0 = no limit)
+    DWORD idle_timeout;                 // Seconds without frames from client before it is disconnected (0 = never)
+    DWORD heartbeat;                    // Seconds without frames to client before an empty frame is sent (0 = never)
+    DWORD stall_timeout;                // Seconds a transfer may make no progress (0 = no limit)
+    ULONGLONG cpus[CPUS_ROLES];         // CPUs of processor group 0 for threads of role (0 = any, --affinity)
+    bool numa;                          // Place each client's threads on one NUMA node, nodes in turn
+    const char *boards[CONFIG_BOARDS_MAX];  // Boards created on start, "<name>[:<retention>]"
+    DWORD n_boards;
+} ServerConfig;
+
+
+ServerConfig* getConfig();
+bool parseServerArgs(int argc, char** argv);
+void printUsage();
+
+#endif //LAB6_CONFIG_H
@@ -0,0 +1,87 @@
+#ifndef LAB6_HANDOFF_H
+#define LAB6_HANDOFF_H
+
+#include <winsock2.h>
+#include <windows.h>
+#include "model.h"
+
+/*
+ *      Handoff of a running server to a new process of it (--handoff, upgrade without disconnects)
+ *
+ *      Server started with --handoff first looks for a predecessor on pipe HANDOFF_PIPE<port>. If there
+ *      is none, it starts as usual and waits on that pipe for a successor itself. When one connects:
+ *          1. listening sockets are duplicated for successor (WSADuplicateSocket), ours are closed:
+ *             new connections wait in the backlog meanwhile
+ *          2. each client gets /handoff on MUX_STREAM_NOTICE. It answers /parked as its last frame
+ *             and holds the rest, so nothing of it is left unread in the socket
+ *          3. client's thread waits until responses queued for it are sent, duplicates its socket
+ *             for successor with board, cursors, token and half-received uploads, and leaves
+ *             without shutdown(): the connection stays open
+ *          4. snapshot is saved (history, files, sessions), log and ring are closed, then
+ *             everything goes over the pipe; successor acknowledges once it owns the sockets
+ *      Successor maps the snapshot, adopts sockets and clients with the same history serial and
+ *      #ids, and sends /resumed to each client: it sends what it held. Nobody reconnects or syncs again.
+ *      Replicas, and clients that do not park within HANDOFF_WAIT_MS (e.g. a long download is
+ *      still being sent), are disconnected as on shutdown: they reconnect and resume.
+ *
+ *      pipe, predecessor -> successor:   <HandoffHeader> { <HandoffClient> { <HandoffPartial> <bytes> } }
+ *      pipe, successor -> predecessor:   <1 byte> (sockets are adopted)
+ */
+
+#define HANDOFF_MAGIC "6CHHAND1"
+#define HANDOFF_PIPE "\\\\.\\pipe\\6chan-handoff-"    // + port
+#define HANDOFF_PIPE_SDDL "D:P(A;;GA;;;OW)"         // Only owner of server process may take it over
+#define HANDOFF_PIPE_BUF 65536
+#define HANDOFF_WAIT_MS 5000            // Clients have that long to park, queued responses to be sent
+#define HANDOFF_STEP_MS 10
+
+
+typedef struct HandoffHeader {
+    char magic[8];                      // HANDOFF_MAGIC
+    ULONGLONG history_serial;           // Run of server continues: caches of clients stay valid
+    LONG clients_counter;               // Last client #id given
+    DWORD clients;                      // HandoffClient records that follow
+    bool has_local;                     // AF_UNIX listener is handed over too (--unix)
+    WSAPROTOCOL_INFOA listener;         // Listening sockets, duplicated for successor
+    WSAPROTOCOL_INFOA local;
+} HandoffHeader;
+
+typedef struct HandoffClient {
+    WSAPROTOCOL_INFOA sock;             // Connection, duplicated for successor
+    DWORD id;
+    char ip[16];
+    WORD port;
+    char token[TOKEN_LEN];
+    char board[BOARD_NAME_LEN];
+    ULONGLONG cursor;
+    ULONGLONG oldest;
+    bool announced;
+    bool compress;                      // Compressed frames were negotiated
+    DWORD partials;                     // Half-received messages that follow
+} HandoffClient;
+
+typedef struct HandoffPartial {
+    DWORD stream_id;
+    bool dropped;                       // Too large, rest of it is discarded
+    ULONGLONG len;                      // Bytes received so far, follow the record
+} HandoffPartial;
+
+
+// Successor
+bool findPredecessor();
+bool takeListeners(SOCKET* listener, SOCKET* local);
+List* takeClients(LONG* clients_counter);
+void resumeConnection(Client* c);
+
+// Predecessor
+bool waitSuccessor(HANDLE ev_stop);
+bool successorWaiting();
+bool handOverListeners(SOCKET listener, SOCKET local);
+void parkClients();
+bool parkClient(Client* c);
+void clientLeft(Client* c);
+bool handOver(bool saved, LONG clients_counter);
+
+void closeHandoff();
+
+#endif //LAB6_HANDOFF_H
@@ -3,6 +3,10 @@
 
 #include <Winsock2.h>
 #include "../../utils/include/list.h"
+#include "../../utils/include/mux.h"
+#include "blob.h"
+#include "ratelimit.h"
+#include "timer.h"
 
 #define FILE_NAME_LEN 32
 
@@ -10,6 +14,122 @@
 #define MSG_TYPE_MSG 1
 #define MSG_TYPE_FILE 2
 #define MSG_TYPE_LOADFILE 3
+#define MSG_TYPE_STATS 4
+#define MSG_TYPE_COMPRESS 5
+#define MSG_TYPE_JOIN 6
+#define MSG_TYPE_BOARDS 7
+#define MSG_TYPE_RESUME 8
+#define MSG_TYPE_OLDER 9
+#define MSG_TYPE_SEARCH 10
+#define MSG_TYPE_WHO 11
+#define MSG_TYPE_REPLICATE 12
+#define MSG_TYPE_REPLACK 13
+#define MSG_TYPE_FORWARD 14
+#define MSG_TYPE_PARKED 15
+#define MSG_TYPE_REPLAUTH 16
+
+#define USER_ID_SYSTEM 0                // Sender of system messages
+#define MSG_JOIN_TEXT "New anon joined. Welcome, Anonim #%lu"
+
+#define MSG_TEXT_MAX 0x7FFFFFFF        // Longest text body (Message.msg_len is 32-bit, files are not limited by it)
+#define MSG_INLINE_MAX 80               // Longer text bodies get an allocation of their own (header and body fit 128 bytes)
+#define MSG_BODY_INLINE 0               // Body follows header (Message.text)
+#define MSG_BODY_HEAP 1                 // Body in its own allocation (Message.buf), may be compacted
+#define MSG_BODY_SEGMENT 2              // Body in compressed segment (Message.seg, seg_off)
+#define MSG_BODY_FILE 3                 // File: name and content in side record (Message.file)
+#define MSG_LOG_DURABLE 0               // In log or snapshot (or no --wal)
+#define MSG_LOG_PENDING 1               // Being logged
+#define MSG_LOG_FAILED 2                // Could not be logged, replay gives #id a placeholder once a later one is logged
+
+#define STAMP_MINUTE 600000000ULL       // Time stamps are local FILETIME: 100 ns units since 1601
+
+#define SEGMENT_MSGS 64                 // Messages per compressed segment of Message History
+#define SEGMENT_BODY_MAX 1048576        // Longer text bodies stay raw (segment offsets are 32-bit)
+
+#define HISTORY_BLOCK_MSGS 65536        // Message slots per block of Message History
+#define HISTORY_CHUNK_BLOCKS 4096       // Block pointers per chunk
+#define HISTORY_RING_CHUNKS 4096        // Ring of chunks: up to 2^40 messages kept per board, #ids wrap around it
+#define HISTORY_RETRY_MS 1000           // Longest wait between attempts to allocate slot of a reserved #id
+
+#define BOARD_NAME_LEN 32
+#define BOARDS_MAX 256
+#define DEFAULT_BOARD "main"
+
+#define TOKEN_LEN 17                    // Resume token: 16 hex digits and \0
+#define SESSIONS_MAX 4096               // Sessions of disconnected clients kept for resume
+
+#define REGISTRY_STRIPES 16             // Locks of client registry, client #id picks one
+#define REGISTRY_BUCKETS_INIT 64        // Buckets per stripe, doubled when chains get long
+
+
+typedef struct Segment {
+    ULONGLONG serial;                   // Unique #id of segment (for body cache)
+    DWORD msgs;                         // Number of messages in segment
+    DWORD raw_len;                      // Length of all bodies, uncompressed
+    DWORD len;                          // Compressed length
+    char *buf;                          // Compressed bodies (lz)
+} Segment;
+
+typedef struct HistoryStats {
+    ULONGLONG first_id;                 // Oldest message kept
+    ULONGLONG last_id;                  // Last committed message
+    DWORD subscribers;                  // Clients in board
+    DWORD segments;                     // Compressed segments
+    DWORD cold_msgs;                    // Messages in compressed segments
+    ULONGLONG raw_bytes;                // Bodies of cold messages, uncompressed
+    ULONGLONG stored_bytes;             // Bodies of cold messages, compressed
+} HistoryStats;
+
+typedef struct ClientStats {
+    DWORD online;                       // Connected clients
+    DWORD peak;                         //   most at once
+    DWORD total;                        // Clients connected since start
+} ClientStats;
+
+
+typedef struct MessageFile {
+    Blob *blob;                         // Shared file content
+    char name[FILE_NAME_LEN];           // File name
+} MessageFile;
+
+typedef struct Message {
+    ULONGLONG msg_id;                   // Message #id
+    ULONGLONG timestamp;                // Time stamp of message (local time, STAMP_MINUTE)
+    DWORD src_id;                       // Sender #id
+    DWORD msg_len;                      // Length of text body (files: messageLen(), content may exceed 4 GB)
+    BYTE msg_type;                      // Type of message (in #define)
+    BYTE body_at;                       // Where body is (MSG_BODY_*)
+    BYTE log_state;                     // --wal: MSG_LOG_* (under cs_mh of board)
+    BYTE reserved;
+    DWORD seg_off;                      // Offset of body in uncompressed segment
+    union {
+        char *buf;                      // MSG_BODY_HEAP: body (may be owned by snapshot)
+        Segment *seg;                   // MSG_BODY_SEGMENT: compressed segment holding body
+        MessageFile *file;              // MSG_BODY_FILE: cold side record
+    };
+    char text[];                        // MSG_BODY_INLINE: body and \0
+} Message;
+
+#define messageBlob(m) ((m)->body_at == MSG_BODY_FILE ? (m)->file->blob : NULL)
+#define messageFileName(m) ((m)->body_at == MSG_BODY_FILE ? (m)->file->name : "")
+#define messageLen(m) ((m)->body_at != MSG_BODY_FILE ? (ULONGLONG) (m)->msg_len : (m)->file->blob ? (m)->file->blob->len : 0)
+
+
+typedef struct Board {
+    char name[BOARD_NAME_LEN];          // Board name (/join <name>)
+    ULONGLONG retention;                // Keep only that many last messages (0 = keep all)
+    Message* volatile* volatile* volatile* history;    // Message History: ring of chunks of blocks of message slots
+    volatile LONGLONG reserved_ids;     // Last #id handed out to a writer
+    volatile LONGLONG committed_ids;    // Messages #1..committed_ids are all published
+    volatile LONGLONG durable_ids;      // --wal: messages #1..durable_ids keep their #ids after a crash
+    volatile ULONGLONG first_id;        // Oldest message kept (older ones dropped by retention)
+    CRITICAL_SECTION cs_mh;             // Lock for message bodies: readers vs compaction and retention
+    CRITICAL_SECTION cs_compact;        // Only one thread compacts at a time
+    List *segments;                     // Compressed segments
+    ULONGLONG cold_count;               // Messages #1..cold_count checked by compactMessageHistory()
+    List *subscribers;                  // Clients in board (under cs_boards)
+    struct SearchIndex *index;          // Full-text index of board (search.c)
+} Board;
 
 
 typedef struct Client {
@@ -17,27 +137,89 @@ typedef struct Client {
     DWORD id;                           // Client #id
     char ip[16];                        // IP in decimal notation
     WORD port;                          // Port number
+    Mux *mux;                           // Stream multiplexer for socket
+    Board *board;                       // Joined board (changed by client's own thread only)
+    ULONGLONG cursor;                   // Next #id of board to deliver on /sync
+    ULONGLONG oldest;                   // Oldest #id of board delivered (/older pages back from it)
+    char token[TOKEN_LEN];              // Resume token of session (empty until /resume)
+    TokenBucket rl_msgs;                // Posts per second (--rate-msgs)
+    TokenBucket rl_bytes;               // Received bytes per second (--rate-bytes)
+    volatile LONG transfers;            // File downloads in flight (--max-transfers)
+    struct Transfer *waiting;           // Downloads waiting for a slot, under lock of `mux` (service.c)
+    DWORD waiting_count;                //   how many
+    ULONGLONG throttled;                // Times client waited because of its limits
+    volatile LONGLONG throttled_ms;     //   and how long (also added by sender thread of `mux`)
+    struct Client *reg_next;            // Next client in bucket of registry
+    Timer t_idle;                       // Idle timeout (--idle-timeout)
+    Timer t_beat;                       // Heartbeat (--heartbeat)
+    Timer t_stall;                      // Progress check of transfers (--stall-timeout)
+    volatile ULONGLONG rx_tick;         // Timer tick of last frame from client
+    volatile ULONGLONG rx_bytes;        // Bytes of frames from client
+    ULONGLONG beat_sent;                // Bytes sent at last heartbeat check
+    ULONGLONG stall_sent, stall_rx;     // Bytes sent and received at last stall check
+    bool announced;                     // Join announcement posted (on first request)
+    struct ReplicaLink *repl;           // Connection is a replica fed by this server (NULL = client)
+    ULONGLONG repl_nonce;               // Challenge of /replicate, answered by /replauth (0 = none)
+    bool parking;                       // Asked to park for successor process (handoff.h)
+    struct HandoffState *handoff;       // Taken over from previous process: state applied on start
 } Client;
 
+typedef struct Session {
+    char token[TOKEN_LEN];              // Resume token
+    Board *board;                       // Board and delivery cursors of disconnected client
+    ULONGLONG cursor;
+    ULONGLONG oldest;
+} Session;
 
-typedef struct Message {
-    DWORD msg_id;                       // Message #id
-    DWORD src_id;                       // Sender #id
-    DWORD msg_len;                      // Length of buffer
-    BYTE msg_type;                      // Type of message (in #define)
-    char file_name[FILE_NAME_LEN];      // File name (if message is a file)
-    char *buf;                          // Message buffer
-    SYSTEMTIME timestamp;               // Time stamp of message
-} Message;
 
+extern CRITICAL_SECTION cs_boards;      // Lock for board list and subscribers
+
+
+void initBoards();
+ULONGLONG getHistorySerial();
+void setHistorySerial(ULONGLONG serial);
+void destroyBoards();
+List* getBoardList();
+Board* getBoard(const char* name, bool create);
+void joinBoard(Client* c, Board* b);
+
+void startBoardAt(Board* b, ULONGLONG first_id, ULONGLONG cold_count);
+Segment* adoptSegment(Board* b, char* buf, DWORD len, DWORD raw_len);
+Message* newMessage(DWORD src_id, const char* body, DWORD len);
+Message* newFileMessage(DWORD src_id, const char* name, Blob* blob);
+Message* newJoinMessage(DWORD client_id);
+void freeMessage(Message* m);
+ULONGLONG nowStamp();
+ULONGLONG toStamp(const SYSTEMTIME* t);
+void fromStamp(ULONGLONG stamp, SYSTEMTIME* t);
+ULONGLONG appendMessage(Board* b, Message* m);
+ULONGLONG getLastMessageId(Board* b);
+ULONGLONG getDurableMessageId(Board* b);
+Message* getMessage(Board* b, ULONGLONG id);
+
+void compactMessageHistory(Board* b);
+const char* getMessageBody(Message* m);
+void releaseBodyCache();
+void getHistoryStats(Board* b, HistoryStats* st);
 
-List* getMessageHistory();
-List* initMessageHistory();
-void destroyMessageHistory();
+void initClientRegistry();
+void destroyClientRegistry();
+bool registerClient(Client* c);
+void unregisterClient(Client* c);
+void closeClientSocket(Client* c);
+SOCKET takeClientSocket(Client* c);
+void disconnectAllClients();
+DWORD parkAllClients(const char* notice);
+void waitClientsLeft();
+void getClientStats(ClientStats* st);
 
-List* getClientList();
-List* initClientList();
-void destroyClientList();
+void initSessions();
+void destroySessions();
+void newSessionToken(char* token);
+void saveSession(Client* c);
+void addSession(const char* token, Board* b, ULONGLONG cursor, ULONGLONG oldest);
+List* getSessionList();
+bool restoreSession(Client* c, const char* token);
 
 void printLastError();
 void printLastWSAError();
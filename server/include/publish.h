@@ -0,0 +1,30 @@
+#ifndef LAB6_PUBLISH_H
+#define LAB6_PUBLISH_H
+
+#include <windows.h>
+#include "model.h"
+#include "../../utils/include/ring.h"
+
+/*
+ *      Shared-memory feed of posted messages for local consumers (--ring <name>, opt-in)
+ *
+ *      Every message added to a board is copied into a ring (utils/ring.h) that consumers on the
+ *      same machine map and read in place: no socket, no syscall per message, they sleep on a
+ *      semaphore only when the ring is empty. Text messages carry their body, files carry
+ *      their name (full size in msg_len): contents are downloaded over the socket as usual.
+ */
+
+typedef struct RingStats {
+    ULONGLONG records;                  // Messages published since start
+    ULONGLONG bytes;                    // Bytes written to ring (records, bodies and padding)
+    ULONGLONG cut;                      // Bodies longer than a quarter of ring, published cut
+    ULONGLONG size;                     // Bytes of ring data
+} RingStats;
+
+
+bool openRing();
+void publishMessage(Board* b, Message* m);
+void closeRing();
+bool getRingStats(RingStats* st);
+
+#endif //LAB6_PUBLISH_H
@@ -0,0 +1,36 @@
+#ifndef LAB6_RATELIMIT_H
+#define LAB6_RATELIMIT_H
+
+#include <windows.h>
+
+/*
+ *      Token buckets for per-client limits (--rate-msgs, --rate-bytes)
+ *
+ *      Bucket refills at `rate` tokens per second up to `burst`. Taking more tokens than there
+ *      are puts it in debt, and the caller waits until the debt is repaid. So a large frame or
+ *      upload is accepted, but the next ones of that client wait. Each client has its own thread:
+ *      only the client over its limit sleeps, and it stops reading its socket meanwhile.
+ */
+
+#define RATE_WAIT_STEP_MS 100           // Waits are cut in steps to notice server stop
+
+
+typedef struct TokenBucket {
+    double rate;                        // Tokens per second (0 = no limit)
+    double burst;                       // Capacity
+    double tokens;                      // Available now (negative = debt)
+    ULONGLONG last_ms;                  // Time of last refill (GetTickCount64)
+} TokenBucket;
+
+typedef struct RateStats {
+    ULONGLONG throttled;                // Times clients had to wait
+    ULONGLONG waited_ms;                // Total time they waited
+} RateStats;
+
+
+void initBucket(TokenBucket* tb, double rate, double burst);
+DWORD takeTokens(TokenBucket* tb, double n);
+void countThrottle(DWORD ms);
+void getRateStats(RateStats* st);
+
+#endif //LAB6_RATELIMIT_H
@@ -0,0 +1,91 @@
+#ifndef LAB6_REPLICA_H
+#define LAB6_REPLICA_H
+
+#include <windows.h>
+#include "model.h"
+#include "wal.h"
+
+/*
+ *      Primary/replica replication (--replica-of <host>:<port>)
+ *
+ *      Replica connects to primary like a client and sends /replicate on a new stream. Primary answers
+ *      there with REPL_CHALLENGE (random nonce), replica proves it has the key of --repl-key:
+ *          /replauth <proof> <board> <last #id> <board> <last #id> ...
+ *      where proof is the key stream of nonce (ChaCha20). Primary answers REPL_HELLO (or REPL_DENIED),
+ *      then pushes every committed message of every board in #id order, from the replica's positions on:
+ *          <ReplFrame> <WalRecord> <body>
+ *      Replica appends them as they are, so #ids match, and serves /sync, /dl, /search, ... locally.
+ *      Posts of its clients go to primary:   /fwd\0 <WalRecord> <body>
+ *      and joins as records of MSG_TYPE_JOIN, primary posts the announcement itself. Sender of a
+ *      forwarded record must be a client #id of the replica's block.
+ *      Replica acknowledges what it applied with /replack <applied> <lag ms> on the control stream,
+ *      which also keeps the connection alive. It answers frames of primary only, so an idle primary
+ *      sends REPL_BEAT every REPL_WAIT_MS: lag of replicas falls to 0 once they catch up.
+ *      Client #ids of replica come from a block primary reserves for it, so they never clash.
+ *
+ *      A replica with retention (relay, --relay) asks only for the messages it keeps:
+ *          /replauth <proof> ~<n> <board> <last #id> ...
+ *      and replicas may connect to it in turn, so servers form a fan-out tree. A replica passes
+ *      forwarded posts up and hands its own replicas blocks cut out of its block of #ids.
+ */
+
+#define REPL_HELLO 1                    // ReplFrame only: id_base of replica's clients
+#define REPL_RECORD 2                   // ReplFrame, WalRecord, body
+#define REPL_CHALLENGE 3                // ReplFrame only: nonce in head_id
+#define REPL_DENIED 4                   // ReplFrame only: key or #ids missing, replica is not fed
+#define REPL_BEAT 5                     // ReplFrame only: nothing new for REPL_WAIT_MS, replica may acknowledge
+
+#define REPLICA_ID_BLOCK 1048576        // Client #ids reserved per replica connection of primary
+#define REPL_FANOUT 64                  // Replica reserves 1/REPL_FANOUT of its block per replica of its own
+#define REPL_WINDOW 4194304             // Bytes queued to a replica before pusher waits for socket
+#define REPL_WAIT_MS 1000               // Pusher rechecks boards that often without new posts
+#define REPL_DRAIN_MS 10                // Pusher waits that long for socket while window is full
+#define REPL_ACK_MS 500                 // Replica acknowledges at most that often
+#define REPL_RETRY_MS 1000              // Replica reconnects to primary after that pause
+#define REPL_START_MS 10000             // Replica waits that long for primary on start
+#define REPL_PROOF_LEN 16               // Bytes of key stream replica answers challenge with
+#define REPL_REQUEST_LEN (BOARDS_MAX * (BOARD_NAME_LEN + 24) + 2 * REPL_PROOF_LEN + 32)
+#define REPL_UNREACHABLE "Primary server is unreachable, post was not sent"
+
+
+typedef struct ReplFrame {
+    DWORD kind;                         // REPL_*
+    DWORD id_base;                      // HELLO: client #ids of replica are id_base + 1 ...
+    DWORD id_count;                     //   ... id_base + id_count
+    DWORD reserved;
+    ULONGLONG head_id;                  // RECORD: last committed #id of board when it was sent, CHALLENGE: nonce
+} ReplFrame;
+
+typedef struct ReplStats {
+    bool primary;                       // Replicas are connected to this server
+    DWORD replicas;                     //   how many
+    ULONGLONG lag;                      //   messages the slowest one has not applied yet
+    ULONGLONG lag_ms;                   //   its delay of the last message applied
+    bool replica;                       // This server is a replica (--replica-of)
+    bool connected;                     //   connected to primary now
+    ULONGLONG applied;                  //   messages applied since start
+    ULONGLONG behind;                   //   messages of board that primary had past the last applied one
+    ULONGLONG delay_ms;                 //   age of the last message applied, when it was applied
+    ULONGLONG forwarded;                //   posts sent to primary
+} ReplStats;
+
+
+void initReplication();
+void destroyReplication();
+bool challengeReplica(Client* c, DWORD stream_id);
+bool acceptReplica(Client* c, DWORD stream_id, const char* auth, volatile LONG* counter);
+void stopReplication(Client* c);
+void ackReplication(Client* c, const char* ack);
+void notifyReplicas();
+Message* acceptForward(Client* c, char* buf, ULONGLONG len, Board** board);
+
+bool isReplica();
+bool startReplica();
+void stopReplica();
+DWORD getClientIdBase();
+bool forwardPost(Board* b, Message* m);
+bool forwardJoin(Board* b, DWORD client_id);
+
+void getReplStats(ReplStats* st);
+
+#endif //LAB6_REPLICA_H
@@ -0,0 +1,68 @@
+#ifndef LAB6_SEARCH_H
+#define LAB6_SEARCH_H
+
+#include <windows.h>
+#include "model.h"
+
+/*
+ *      Full-text index of a board (/search <words>)
+ *
+ *      Words of text messages and of file names, lowercased (ASCII), map to posting lists
+ *      of #ids. A posting list is a sequence of blocks of SEARCH_BLOCK_IDS ascending #ids:
+ *      first #id of a block is in the skip table, the others are varint deltas.
+ *      Queries intersect lists block by block, newest blocks first, skipping blocks
+ *      that cannot match. Messages are indexed in #id order right after they are posted.
+ */
+
+#define SEARCH_BLOCK_IDS 128            // #ids per block of posting list (unit of skip and decode)
+#define SEARCH_WORD_LEN 32              // Longer words are cut (both in index and in query)
+#define SEARCH_QUERY_WORDS 8            // Words of query used at most
+#define SEARCH_RESULTS_MAX 20           // Newest matches shown
+#define SEARCH_PRUNE_EVERY 4096         // Prune postings after that many messages are dropped by retention
+#define SEARCH_BUCKETS_INIT 1024
+
+
+typedef struct PostingSkip {
+    DWORD first_id;                     // First #id of block
+    DWORD off;                          // Block in `data` (deltas of the other #ids)
+} PostingSkip;
+
+typedef struct SearchTerm {
+    ULONGLONG hash;                     // Hash of word
+    char word[SEARCH_WORD_LEN];
+    DWORD count;                        // #ids in posting list
+    DWORD last_id;                      // Last #id added
+    BYTE *data;                         // Varint deltas of all blocks
+    DWORD len, cap;
+    PostingSkip *skips;                 // One per block
+    DWORD n_skips, cap_skips;
+    struct SearchTerm *next;            // Next term in hash bucket
+} SearchTerm;
+
+typedef struct SearchIndex {
+    CRITICAL_SECTION cs;                // Lock for everything below
+    SearchTerm **buckets;
+    DWORD n_buckets;
+    DWORD n_terms;
+    ULONGLONG indexed_id;               // Messages up to this #id are indexed
+    ULONGLONG pruned_id;                // First #id of board at the last prune
+    ULONGLONG postings;                 // #ids in all posting lists
+    ULONGLONG bytes;                    // Memory of posting lists
+} SearchIndex;
+
+typedef struct SearchStats {
+    DWORD terms;                        // Distinct words
+    ULONGLONG indexed_id;
+    ULONGLONG postings;
+    ULONGLONG bytes;
+} SearchStats;
+
+
+SearchIndex* newSearchIndex();
+void destroySearchIndex(SearchIndex* idx);
+
+void indexMessageHistory(Board* b);
+DWORD searchBoard(Board* b, const char* query, ULONGLONG* ids, DWORD max);
+void getSearchStats(Board* b, SearchStats* st);
+
+#endif //LAB6_SEARCH_H
@@ -4,13 +4,59 @@
 #include <winsock2.h>
 #include "model.h"
 
+#define CMD_QUIT "/q"
+#define CMD_DL "/dl"
+#define CMD_FILE "/file"
+#define CMD_SYNC "/sync"
+#define CMD_STATS "/stats"
+#define CMD_COMPRESS "/compress"
+#define CMD_JOIN "/join"
+#define CMD_BOARDS "/boards"
+#define CMD_RESUME "/resume"
+#define CMD_OLDER "/older"
+#define CMD_SEARCH "/search"
+#define CMD_WHO "/who"
+#define CMD_REPLICATE "/replicate"
+#define CMD_REPLACK "/replack"
+#define CMD_REPLAUTH "/replauth"
+#define CMD_FWD "/fwd"
+#define CMD_BOARD "/board"
+#define CMD_HANDOFF "/handoff"
+#define CMD_PARKED "/parked"
+#define CMD_RESUMED "/resumed"
+
+
+typedef struct Request {
+    BYTE type;                          // Type of request (MSG_TYPE_* in model.h)
+    ULONGLONG msg_id;                   // /dl: #id of file or message
+    ULONGLONG range_off;                // /dl: requested range
+    ULONGLONG range_len;                //   0 = up to end of file
+    ULONGLONG range_hash;               //   content hash of what client has (0 = none), mismatch sends from 0
+    char name[BOARD_NAME_LEN];          // /join: board name, /resume: token
+    char *args;                         // Arguments kept as text (/search, /resume, ...), /fwd: record
+    ULONGLONG args_len;                 //   length of /fwd record
+    Message *post;                      // Message or file to post (owned by request until it is posted)
+} Request;
+
 
 void getIpPort(SOCKET sock, char *ip, WORD *port);
 
-WINBOOL sendMessageToClient(Client* c, Message* msg);
-WINBOOL sendFileToClient(Client* c, Message* msg);
+WINBOOL sendMessageToClient(Client* c, DWORD stream_id, Message* msg);
+WINBOOL sendHistoryToClient(Client* c, DWORD stream_id);
+WINBOOL sendOlderToClient(Client* c, DWORD stream_id);
+WINBOOL sendSearchToClient(Client* c, DWORD stream_id, const char* query);
+void sendCatchupNote(Client* c, DWORD stream_id);
+void sendBoardName(Client* c, DWORD stream_id);
+bool resumeFromCache(Client* c, const char* cache, bool restored);
+WINBOOL sendFileToClient(Client* c, DWORD stream_id, Message* msg, ULONGLONG offset, ULONGLONG len, ULONGLONG hash);
+WINBOOL sendStatsToClient(Client* c, DWORD stream_id);
+WINBOOL sendBoardsToClient(Client* c, DWORD stream_id);
+WINBOOL sendWhoToClient(Client* c, DWORD stream_id);
+
+WINBOOL postMessage(Board* board, Message* msg, bool* durable);
 
-Message* parseMsgFromClient(const char* buf, int len, SOCKET sock);
-int acceptFileFromClient(Message* msg, SOCKET sock);
+Request* parseMsgFromClient(const char* buf, ULONGLONG len);
+void freeRequest(Request* req);
+Message* acceptFileFromClient(const char* name, const char* buf, ULONGLONG len);
 
 #endif //LAB6_SERVICE_H
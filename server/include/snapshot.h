@@ -0,0 +1,85 @@
+#ifndef LAB6_SNAPSHOT_H
+#define LAB6_SNAPSHOT_H
+
+#include <windows.h>
+#include "model.h"
+
+/*
+ *      Encrypted snapshot of boards, blobs and sessions (--snapshot <path>, opt-in)
+ *
+ *      file:       <header> | encrypted: <info> <boards> <segments> <blobs> <messages> <sessions> <data>
+ *
+ *      Records are fixed-size, bodies and file contents live in data area and are
+ *      referenced by offset. On start the file is mapped copy-on-write, decrypted in place
+ *      and messages, segments and blobs point right into the view: nothing is parsed or copied.
+ *      Messages of a board follow each other with consecutive #ids from `first_id`.
+ */
+
+#define SNAPSHOT_MAGIC "6CHSNAP2"
+#define SNAPSHOT_ALIGN 8
+
+
+typedef struct SnapshotHeader {
+    char magic[8];                      // SNAPSHOT_MAGIC
+    ULONGLONG nonce;                    // Cipher nonce, new for each snapshot
+    ULONGLONG size;                     // Size of file
+    ULONGLONG check;                    // blobHash() of everything after header, before encryption
+} SnapshotHeader;
+
+typedef struct SnapshotInfo {
+    ULONGLONG messages;                 // Number of records of each kind
+    ULONGLONG segments;
+    ULONGLONG blobs;
+    DWORD boards;
+    DWORD sessions;
+} SnapshotInfo;
+
+typedef struct SnapshotBoard {
+    char name[BOARD_NAME_LEN];
+    ULONGLONG retention;
+    ULONGLONG first_id;                 // #id of first message of board
+    ULONGLONG cold_count;               // Board.cold_count
+    ULONGLONG messages;                 // Number of messages of board
+} SnapshotBoard;
+
+typedef struct SnapshotSegment {
+    ULONGLONG off;                      // Compressed bodies in data area
+    DWORD len;
+    DWORD raw_len;
+} SnapshotSegment;
+
+typedef struct SnapshotBlob {
+    ULONGLONG off;                      // Content in data area
+    ULONGLONG len;
+    ULONGLONG hash;                     // Blob.hash, content is not hashed again on load
+} SnapshotBlob;
+
+typedef struct SnapshotMessage {
+    ULONGLONG msg_len;                  // Length of body / file
+    ULONGLONG off;                      // Body in data area (text messages, \0-terminated)
+    ULONGLONG blob;                     // Index of blob + 1 (files), 0 for text messages
+    ULONGLONG seg;                      // Index of segment + 1 (cold messages), 0 for raw ones
+    DWORD seg_off;                      // Offset of body in uncompressed segment
+    DWORD src_id;
+    BYTE msg_type;
+    char file_name[FILE_NAME_LEN];
+    SYSTEMTIME timestamp;
+} SnapshotMessage;
+
+typedef struct SnapshotSession {
+    char token[TOKEN_LEN];
+    DWORD board;                        // Index of board
+    ULONGLONG cursor;
+    ULONGLONG oldest;
+} SnapshotSession;
+
+
+bool loadSnapshot();
+bool saveSnapshot();
+bool replaceSnapshot();
+void closeSnapshot();
+bool snapshotOwns(const void* p);
+bool loadKeyFile(const char* path, BYTE* key, bool create);
+bool loadSnapshotKey(BYTE* key);
+
+#endif //LAB6_SNAPSHOT_H
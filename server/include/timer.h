@@ -0,0 +1,50 @@
+#ifndef LAB6_TIMER_H
+#define LAB6_TIMER_H
+
+#include <windows.h>
+
+/*
+ *      Hierarchical timing wheel (idle, stall and heartbeat timers of connections)
+ *
+ *      TIMER_LEVELS wheels of TIMER_SLOTS slots: a slot of level 0 is one tick, a slot of level k
+ *      is TIMER_SLOTS^k ticks. A timer goes to the lowest level that reaches its expiry. When level 0
+ *      wraps around, the next slot of level 1 is spread over level 0 (cascade), and so on up.
+ *      Arm and cancel are O(1), a tick fires one slot and cascades one slot of a level above
+ *      every TIMER_SLOTS ticks, however many connections there are.
+ *      Callbacks run on the wheel thread with the wheel locked: they must be short and never wait.
+ */
+
+#define TIMER_TICK_MS 100
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)      // Slots per level
+#define TIMER_LEVELS 3                          // Up to 2^24 ticks ahead (19 days), longer ones cascade again
+
+
+typedef struct Timer {
+    struct Timer *next;                 // Next timer in slot
+    struct Timer **pprev;               // Link to this timer in slot (NULL = not armed)
+    ULONGLONG expires;                  // Tick to fire at
+    void (*fire)(struct Timer*);        // Called on wheel thread when timer expires
+    void *ctx;                          // Owner of timer
+} Timer;
+
+typedef struct TimerStats {
+    DWORD pending;                      // Armed timers
+    ULONGLONG fired;                    // Timers expired since start
+    ULONGLONG reaped_idle;              // Connections closed as idle
+    ULONGLONG reaped_stalled;           // Connections closed for a stalled transfer
+} TimerStats;
+
+
+bool startTimers();
+void stopTimers();
+
+void initTimer(Timer* t, void (*fire)(Timer*), void* ctx);
+void armTimer(Timer* t, DWORD ms);
+void cancelTimer(Timer* t);
+ULONGLONG getTimerTick();
+
+void countReap(bool stalled);
+void getTimerStats(TimerStats* st);
+
+#endif //LAB6_TIMER_H
@@ -0,0 +1,67 @@
+#ifndef LAB6_WAL_H
+#define LAB6_WAL_H
+
+#include <windows.h>
+#include "model.h"
+
+/*
+ *      Write-ahead log of posted messages (--wal <path>, opt-in)
+ *
+ *      file:       <header> <record> <record> ...
+ *      record:     <len:8> <check:8> <nonce:8> <payload:len> [padding up to 8 bytes]
+ *      payload:    WalRecord, then body (text or file content)
+ *
+ *      Payload is encrypted if --snapshot-key is set. `check` is blobHash() of plain payload:
+ *      replay stops at the first torn or damaged record, the tail is cut off.
+ *      Records are in order of logging, not of #id: replay sorts them per board.
+ *      A batch that fails to be written is cut off again, the log goes on after the last good record.
+ */
+
+#define WAL_MAGIC "6CHWAL01"
+#define WAL_ALIGN 8
+#define WAL_FLAG_ENCRYPTED 1
+#define WAL_BATCH_KEEP 16777216         // Batch buffers larger than that are freed after write
+#define WAL_INLINE_MAX 65536            // Larger records are written from their own buffer, not copied to batch
+#define WAL_LOST_MSG "Message was lost in server crash"
+#define WAL_NOT_DURABLE "Server cannot write its log, your post may be lost if it crashes"
+
+
+typedef struct WalHeader {
+    char magic[8];                      // WAL_MAGIC
+    ULONGLONG flags;                    // WAL_FLAG_*
+} WalHeader;
+
+typedef struct WalFrame {
+    ULONGLONG len;                      // Length of payload
+    ULONGLONG check;                    // blobHash() of plain payload
+    ULONGLONG nonce;                    // Cipher nonce of payload (unique per record)
+} WalFrame;
+
+typedef struct WalRecord {
+    char board[BOARD_NAME_LEN];
+    ULONGLONG msg_id;
+    ULONGLONG msg_len;                  // Length of body following the record
+    DWORD src_id;
+    BYTE msg_type;
+    char file_name[FILE_NAME_LEN];
+    SYSTEMTIME timestamp;
+} WalRecord;
+
+typedef struct WalStats {
+    ULONGLONG records;                  // Records logged since start
+    ULONGLONG batches;                  // Group commits (one FlushFileBuffers() each)
+    ULONGLONG bytes;                    // Bytes written
+    ULONGLONG failed;                   // Records not written (disk error), posters were told
+    bool broken;                        // Log could not be rewound after an error, off until next snapshot
+} WalStats;
+
+
+bool openWal();
+Message* newReplayedMessage(const WalRecord* rec);
+Message* newLostMessage();
+bool walAppend(Board* b, Message* m);
+void resetWal();
+void closeWal();
+bool getWalStats(WalStats* st);
+
+#endif //LAB6_WAL_H
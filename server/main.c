@@ -1,7 +1,5 @@
 #include "include/controller.h"
-
-#define DEFAULT_HOST "127.0.0.1"
-#define DEFAULT_PORT "5000"
+#include "include/config.h"
 
 int main(int argc, char** argv) {
     /**
@@ -9,21 +7,14 @@ int main(int argc, char** argv) {
      *      ./lab6
      *      ./lab6 [port]
      *      ./lab6 [host] [port]
+     *      ./lab6 [host] [port] [options]
      *
-     *  default is 127.0.0.1:5000
+     *  default is 127.0.0.1:5000, see printUsage() for options
      */
-    char *host, *port;
-    if (argc < 2) {
-        host = DEFAULT_HOST;
-        port = DEFAULT_PORT;
-    }
-    else if (argc == 2) {
-        host = DEFAULT_HOST;
-        port = argv[1];
-    }
-    else {
-        host = argv[1];
-        port = argv[2];
+    if (!parseServerArgs(argc, argv)) {
+        printUsage();
+        return EXIT_FAILURE;
     }
-    return startServer(host, port);
+    ServerConfig* config = getConfig();
+    return startServer(config->host, config->port);
 }
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include "../include/affinity.h"
+
+static GROUP_AFFINITY nodes[AFFINITY_NODES_MAX];        // Processors of NUMA nodes clients are placed on
+static DWORD n_nodes;                                   // (0 = no placement)
+static volatile LONG next_node;                         // Node of next client
+
+
+bool initAffinity() {
+    /**
+     * @brief Find NUMA nodes for clients (--numa)
+     * @details Nodes are cut down to worker CPUs of --affinity, those left without CPUs are skipped.
+     * @return FALSE if no node has worker CPUs
+     */
+    ServerConfig* config = getConfig();
+    KAFFINITY workers = (KAFFINITY) config->cpus[CPUS_WORKER];
+    GROUP_AFFINITY ga;
+    ULONG highest;
+
+    n_nodes = 0;
+    next_node = -1;
+    if (!config->numa) return TRUE;
+
+    if (!GetNumaHighestNodeNumber(&highest)) {
+        fprintf(stderr, "[affinity] Cannot get NUMA nodes: code %lu\r\n", GetLastError());
+        return FALSE;
+    }
+    for (ULONG node = 0; node <= highest && n_nodes < AFFINITY_NODES_MAX; node++) {
+        if (!GetNumaNodeProcessorMaskEx((USHORT) node, &ga) || !ga.Mask) continue;
+        // --affinity lists CPUs of processor group 0
+        if (workers && (ga.Group != 0 || !(ga.Mask &= workers))) continue;
+        nodes[n_nodes++] = ga;
+        fprintf(stderr, "[affinity] Clients placed on node %lu: group %u, CPUs 0x%llx\r\n",
+                node, ga.Group, (ULONGLONG) ga.Mask);
+    }
+    if (!n_nodes) {
+        fprintf(stderr, "[affinity] No NUMA node has worker CPUs\r\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void pinThread(HANDLE thread, DWORD role) {
+    /**
+     * @brief Run `thread` on CPUs of `role` (CPUS_*), if --affinity gives them
+     */
+    ULONGLONG mask = getConfig()->cpus[role];
+
+    if (mask && !SetThreadAffinityMask(thread, (DWORD_PTR) mask))
+        fprintf(stderr, "[affinity] Cannot pin thread to CPUs 0x%llx: code %lu\r\n", mask, GetLastError());
+}
+
+void placeWorker() {
+    /**
+     * @brief Pin calling client thread to next NUMA node (--numa) or to worker CPUs
+     * @details Called before the thread allocates its buffers: their pages come from its node.
+     */
+    GROUP_AFFINITY ga;
+
+    if (!n_nodes) {
+        pinThread(GetCurrentThread(), CPUS_WORKER);
+        return;
+    }
+    ga = nodes[(DWORD) InterlockedIncrement(&next_node) % n_nodes];
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &ga, NULL))
+        fprintf(stderr, "[affinity] Cannot place thread on node: code %lu\r\n", GetLastError());
+}
+
+void pinAlongside(HANDLE thread) {
+    /**
+     * @brief Run `thread` on the CPUs of calling thread (mux sender of client thread)
+     */
+    GROUP_AFFINITY ga;
+
+    if (!n_nodes && !getConfig()->cpus[CPUS_WORKER]) return;
+    if (!GetThreadGroupAffinity(GetCurrentThread(), &ga) || !SetThreadGroupAffinity(thread, &ga, NULL))
+        fprintf(stderr, "[affinity] Cannot pin thread: code %lu\r\n", GetLastError());
+}
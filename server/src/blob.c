@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include "../include/blob.h"
+#include "../include/snapshot.h"
+
+static Blob** buckets;
+static DWORD n_buckets;
+static DWORD n_blobs;
+static DWORD n_uploads;
+static DWORD n_dedup_hits;
+static CRITICAL_SECTION cs_blobs;
+
+
+void initBlobStore() {
+    n_buckets = BLOB_BUCKETS_INIT;
+    buckets = calloc(n_buckets, sizeof(Blob*));
+    n_blobs = n_uploads = n_dedup_hits = 0;
+    InitializeCriticalSection(&cs_blobs);
+}
+
+void destroyBlobStore() {
+    Blob *b, *next;
+    for (DWORD i = 0; i < n_buckets; i++)
+        for (b = buckets[i]; b != NULL; b = next) {
+            next = b->next;
+            if (!snapshotOwns(b->buf)) free(b->buf);
+            free(b);
+        }
+    free(buckets);
+    buckets = NULL;
+    DeleteCriticalSection(&cs_blobs);
+}
+
+#define HASH_M 0x9E3779B97F4A7C15ULL
+#define HASH_R(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+ULONGLONG blobHash(const char* buf, ULONGLONG len) {
+    /**
+     * @brief Fast non-cryptographic 64-bit hash, 8 bytes per step
+     * @details Equal hashes are always confirmed with memcmp() before sharing a blob.
+     */
+    ULONGLONG h = len * HASH_M, k, i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&k, buf + i, 8);
+        k *= 0x87C37B91114253D5ULL;
+        k = HASH_R(k, 31);
+        h ^= k * 0x4CF5AD432745937FULL;
+        h = HASH_R(h, 27) * 5 + 0x52DCE729;
+    }
+    for (k = 0; i < len; i++)
+        k = (k << 8) | (BYTE) buf[i];
+    h ^= k * HASH_M;
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void growBlobStore() {
+    /**
+     * @brief Double number of buckets and rehash. Caller holds cs_blobs
+     */
+    DWORD new_n = n_buckets * 2;
+    Blob **new_buckets = calloc(new_n, sizeof(Blob*)), *b, *next;
+    if (!new_buckets) return;
+
+    for (DWORD i = 0; i < n_buckets; i++)
+        for (b = buckets[i]; b != NULL; b = next) {
+            next = b->next;
+            b->next = new_buckets[b->hash % new_n];
+            new_buckets[b->hash % new_n] = b;
+        }
+    free(buckets);
+    buckets = new_buckets;
+    n_buckets = new_n;
+}
+
+static Blob* candidateBlob(ULONGLONG h, ULONGLONG len) {
+    /**
+     * @brief First blob of the same hash and length, or NULL. Caller holds cs_blobs
+     */
+    Blob* b;
+    for (b = buckets[h % n_buckets]; b != NULL; b = b->next)
+        if (b->hash == h && b->len == len) return b;
+    return NULL;
+}
+
+static Blob* findBlob(ULONGLONG h, const char* buf, ULONGLONG len, Blob** seen) {
+    /**
+     * @brief Find blob by hash, confirm content match. Adds reference if found
+     * @details Content (up to the largest upload) is compared outside of cs_blobs: the candidate
+     *  is held meanwhile, so it cannot be freed. `seen` is the candidate compared, even if it differs.
+     */
+    Blob* b;
+
+    EnterCriticalSection(&cs_blobs);
+    b = candidateBlob(h, len);
+    if (b) b->holds++;
+    LeaveCriticalSection(&cs_blobs);
+    *seen = b;
+    if (!b) return NULL;
+
+    if (memcmp(b->buf, buf, len) != 0) {
+        // Hash collision: not shared
+        releaseBlob(b);
+        return NULL;
+    }
+
+    // Hold becomes reference of the new message
+    EnterCriticalSection(&cs_blobs);
+    b->holds--;
+    b->refs++;
+    n_uploads++;
+    n_dedup_hits++;
+    LeaveCriticalSection(&cs_blobs);
+    fprintf(stderr, "[putBlob] Duplicate of blob %016llx (%llu bytes), %ld refs\r\n", h, len, b->refs);
+    return b;
+}
+
+Blob* putBlob(const char* buf, ULONGLONG len) {
+    /**
+     * @brief Find blob with the same content, or store a copy of `buf` as a new blob
+     * @details
+     *  Returns blob with one new reference for the caller.
+     *  A duplicate upload costs only hashing and comparison, content is not copied.
+     */
+    ULONGLONG h = blobHash(buf, len);
+    Blob *b, *found, *seen;
+
+    found = findBlob(h, buf, len, &seen);
+    if (found) return found;
+
+    // New content. Copy outside of lock
+    b = calloc(1, sizeof(Blob));
+    if (!b) return NULL;
+    b->buf = malloc(len ? len : 1);
+    if (!b->buf) { free(b); return NULL; }
+    memcpy(b->buf, buf, len);
+    b->hash = h;
+    b->len = len;
+    b->refs = 1;
+
+    // Same content may have been stored by another thread meanwhile: compare with it first
+    EnterCriticalSection(&cs_blobs);
+    while (candidateBlob(h, len) != seen) {
+        LeaveCriticalSection(&cs_blobs);
+        found = findBlob(h, buf, len, &seen);
+        if (found) {
+            free(b->buf);
+            free(b);
+            return found;
+        }
+        EnterCriticalSection(&cs_blobs);
+    }
+    n_uploads++;
+    b->next = buckets[h % n_buckets];
+    buckets[h % n_buckets] = b;
+    if (++n_blobs > n_buckets * 2) growBlobStore();
+    LeaveCriticalSection(&cs_blobs);
+
+    return b;
+}
+
+Blob* adoptBlob(char* buf, ULONGLONG len, ULONGLONG hash) {
+    /**
+     * @brief Store `buf` as a new blob without copying or hashing (content restored from snapshot)
+     * @details Content is known to be unique, `hash` is its blobHash() saved with it.
+     *  Blob has no references yet, see refBlob()
+     */
+    Blob* b = calloc(1, sizeof(Blob));
+    if (!b) return NULL;
+    b->buf = buf;
+    b->len = len;
+    b->hash = hash;
+
+    EnterCriticalSection(&cs_blobs);
+    n_uploads++;
+    b->next = buckets[b->hash % n_buckets];
+    buckets[b->hash % n_buckets] = b;
+    if (++n_blobs > n_buckets * 2) growBlobStore();
+    LeaveCriticalSection(&cs_blobs);
+    return b;
+}
+
+void refBlob(Blob* b) {
+    /**
+     * @brief Add reference of a message (restored from snapshot)
+     */
+    EnterCriticalSection(&cs_blobs);
+    b->refs++;
+    LeaveCriticalSection(&cs_blobs);
+}
+
+void holdBlob(Blob* b) {
+    /**
+     * @brief Keep content while a transfer reads it (download, log write, replica send)
+     */
+    EnterCriticalSection(&cs_blobs);
+    b->holds++;
+    LeaveCriticalSection(&cs_blobs);
+}
+
+static void dropBlob(Blob* b, bool ref) {
+    /**
+     * @brief Drop one reference or hold, free blob once nobody uses it
+     */
+    Blob** p;
+    if (!b) return;
+
+    EnterCriticalSection(&cs_blobs);
+    if (ref) b->refs--;
+    else b->holds--;
+    if (b->refs > 0 || b->holds > 0) {
+        LeaveCriticalSection(&cs_blobs);
+        return;
+    }
+    for (p = &buckets[b->hash % n_buckets]; *p != NULL; p = &(*p)->next)
+        if (*p == b) {
+            *p = b->next;
+            break;
+        }
+    n_blobs--;
+    LeaveCriticalSection(&cs_blobs);
+
+    if (!snapshotOwns(b->buf)) free(b->buf);
+    free(b);
+}
+
+void unrefBlob(Blob* b) {
+    /**
+     * @brief Drop reference of a message
+     */
+    dropBlob(b, TRUE);
+}
+
+void releaseBlob(Blob* b) {
+    /**
+     * @brief End of transfer started with holdBlob()
+     */
+    dropBlob(b, FALSE);
+}
+
+void getBlobStats(BlobStats* st) {
+    Blob* b;
+    memset(st, 0, sizeof(BlobStats));
+
+    EnterCriticalSection(&cs_blobs);
+    for (DWORD i = 0; i < n_buckets; i++)
+        for (b = buckets[i]; b != NULL; b = b->next) {
+            st->blobs++;
+            st->refs += b->refs;
+            st->holds += b->holds;
+            st->stored_bytes += b->len;
+            st->logical_bytes += b->len * b->refs;
+        }
+    st->uploads = n_uploads;
+    st->dedup_hits = n_dedup_hits;
+    LeaveCriticalSection(&cs_blobs);
+}
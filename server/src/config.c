@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/config.h"
+
+static ServerConfig config = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .compress_history = FALSE,
+    .hot_messages = DEFAULT_HOT_MESSAGES,
+    .wire_compress = TRUE,
+    .retention = 0,
+    .catchup = DEFAULT_CATCHUP,
+    .sync_max = DEFAULT_SYNC_MAX,
+    .idle_timeout = DEFAULT_IDLE_TIMEOUT,
+    .heartbeat = DEFAULT_HEARTBEAT,
+    .stall_timeout = DEFAULT_STALL_TIMEOUT,
+    .ring_size = DEFAULT_RING_SIZE,
+    .n_boards = 0,
+};
+
+ServerConfig* getConfig() {
+    return &config;
+}
+
+void printUsage() {
+    printf("Usage: server.exe [host] [port] [options]\r\n"
+           "Options:\r\n"
+           "  --unix <path>          listen on AF_UNIX socket at path too (local clients, bots)\r\n"
+           "  --replica-of <h>:<p>   replicate server at host:port, serve reads locally, forward posts to it\r\n"
+           "  --relay <h>:<p>        replicate only recent history (--retention, default %d) for fan-out\r\n"
+           "  --repl-key <path>      key file shared by primary and replicas, required for replication\r\n"
+           "  --compress-history     compress cold Message History in RAM\r\n"
+           "  --hot <n>              recent messages kept uncompressed (default %d)\r\n"
+           "  --no-wire-compress     decline compressed frames for all clients\r\n"
+           "  --retention <n>        keep only last n messages per board (default 0 = all)\r\n"
+           "  --board <name>[:<n>]   create board on start, optionally with its own retention\r\n"
+           "  --catchup <n>          last messages shown to new client, page of /older (default %d, 0 = all)\r\n"
+           "  --sync-max <n>         messages per sync response at most (default %d, 0 = no limit)\r\n"
+           "  --snapshot <path>      restore state from encrypted snapshot on start, save it on shutdown\r\n"
+           "  --snapshot-key <path>  key file of snapshot and log (random key is created if missing)\r\n"
+           "  --wal <path>           log posts durably (group commit), replay them on start\r\n"
+           "  --handoff              take over clients of a running server on this port, or wait for a successor\r\n"
+           "  --ring <name>          publish posts to shared-memory ring for local consumers\r\n"
+           "  --ring-size <MB>       size of ring (default %d)\r\n"
+           "  --rate-msgs <n>[:<b>]  posts per second per client, burst b (default 0 = no limit)\r\n"
+           "  --rate-bytes <n>[:<b>] received bytes per second per client, burst b (default 0 = no limit)\r\n"
+           "  --max-transfers <n>    file downloads in flight per client, others are queued (default 0 = no limit)\r\n"
+           "  --idle-timeout <s>     disconnect client silent for s seconds (default %d, 0 = never)\r\n"
+           "  --heartbeat <s>        send empty frame to client after s seconds of silence (default %d, 0 = never)\r\n"
+           "  --stall-timeout <s>    disconnect client whose transfer makes no progress (default %d, 0 = never)\r\n"
+           "  --affinity <r>:<cpus>  run threads of role r (accept, worker, timer) on cpus, e.g. 0-7,16-23\r\n"
+           "  --numa                 place each client's threads on one NUMA node, nodes in turn\r\n",
+           DEFAULT_RELAY_HISTORY, DEFAULT_HOT_MESSAGES, DEFAULT_CATCHUP, DEFAULT_SYNC_MAX, DEFAULT_RING_SIZE,
+           DEFAULT_IDLE_TIMEOUT, DEFAULT_HEARTBEAT, DEFAULT_STALL_TIMEOUT);
+}
+
+static void parseRate(const char* arg, double* rate, double* burst) {
+    /**
+     * @brief "<rate>[:<burst>]"
+     */
+    char* sep;
+    *rate = strtod(arg, &sep);
+    *burst = *sep == ':' ? strtod(sep+1, NULL) : 0;
+}
+
+static bool parseAffinity(const char* arg) {
+    /**
+     * @brief "<role>:<cpus>", cpus is a list of CPU numbers and ranges ("0-7,16-23"), below 64
+     */
+    static const char* roles[CPUS_ROLES] = {"accept", "worker", "timer"};
+    const char* p = strchr(arg, ':');
+    char* end;
+    ULONGLONG mask = 0, lo, hi;
+    DWORD r;
+
+    if (!p) return FALSE;
+    for (r = 0; r < CPUS_ROLES; r++)
+        if (strlen(roles[r]) == (size_t) (p - arg) && !strncmp(arg, roles[r], p - arg)) break;
+    if (r == CPUS_ROLES) return FALSE;
+
+    do {
+        p++;
+        lo = hi = strtoull(p, &end, 10);
+        if (end == p) return FALSE;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtoull(p, &end, 10);
+            if (end == p) return FALSE;
+        }
+        if (lo > hi || hi >= 64) return FALSE;
+        for (; lo <= hi; lo++) mask |= 1ULL << lo;
+        p = end;
+    } while (*p == ',');
+    if (*p) return FALSE;
+
+    config.cpus[r] = mask;
+    return TRUE;
+}
+
+bool parseServerArgs(int argc, char** argv) {
+    /**
+     * @brief Parse command line: positional [host] [port], then --options
+     */
+    const char* positional[2];
+    int n_positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            if (n_positional == 2) return FALSE;
+            positional[n_positional++] = argv[i];
+        }
+        else if (!strcmp(argv[i], "--unix") && i+1 < argc)
+            config.unix_path = argv[++i];
+        else if (!strcmp(argv[i], "--replica-of") && i+1 < argc)
+            config.replica_of = argv[++i];
+        else if (!strcmp(argv[i], "--relay") && i+1 < argc) {
+            config.replica_of = argv[++i];
+            config.relay = TRUE;
+        }
+        else if (!strcmp(argv[i], "--repl-key") && i+1 < argc)
+            config.repl_key = argv[++i];
+        else if (!strcmp(argv[i], "--compress-history"))
+            config.compress_history = TRUE;
+        else if (!strcmp(argv[i], "--hot") && i+1 < argc)
+            config.hot_messages = atol(argv[++i]);
+        else if (!strcmp(argv[i], "--no-wire-compress"))
+            config.wire_compress = FALSE;
+        else if (!strcmp(argv[i], "--retention") && i+1 < argc)
+            config.retention = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--catchup") && i+1 < argc)
+            config.catchup = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--sync-max") && i+1 < argc)
+            config.sync_max = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--snapshot") && i+1 < argc)
+            config.snapshot = argv[++i];
+        else if (!strcmp(argv[i], "--snapshot-key") && i+1 < argc)
+            config.snapshot_key = argv[++i];
+        else if (!strcmp(argv[i], "--wal") && i+1 < argc)
+            config.wal = argv[++i];
+        else if (!strcmp(argv[i], "--handoff"))
+            config.handoff = TRUE;
+        else if (!strcmp(argv[i], "--ring") && i+1 < argc)
+            config.ring = argv[++i];
+        else if (!strcmp(argv[i], "--ring-size") && i+1 < argc)
+            config.ring_size = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--rate-msgs") && i+1 < argc)
+            parseRate(argv[++i], &config.rate_msgs, &config.rate_msgs_burst);
+        else if (!strcmp(argv[i], "--rate-bytes") && i+1 < argc)
+            parseRate(argv[++i], &config.rate_bytes, &config.rate_bytes_burst);
+        else if (!strcmp(argv[i], "--max-transfers") && i+1 < argc)
+            config.max_transfers = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--idle-timeout") && i+1 < argc)
+            config.idle_timeout = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--heartbeat") && i+1 < argc)
+            config.heartbeat = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--stall-timeout") && i+1 < argc)
+            config.stall_timeout = strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(argv[i], "--affinity") && i+1 < argc) {
+            if (!parseAffinity(argv[++i])) return FALSE;
+        }
+        else if (!strcmp(argv[i], "--numa"))
+            config.numa = TRUE;
+        else if (!strcmp(argv[i], "--board") && i+1 < argc && config.n_boards < CONFIG_BOARDS_MAX)
+            config.boards[config.n_boards++] = argv[++i];
+        else
+            return FALSE;
+    }
+
+    // Snapshot is always encrypted
+    if (config.snapshot && !config.snapshot_key) return FALSE;
+
+    // History is handed over through the snapshot
+    if (config.handoff && !config.snapshot) return FALSE;
+
+    // Primary refuses replicas without the key
+    if (config.replica_of && !config.repl_key) return FALSE;
+
+    // Relay keeps bounded history
+    if (config.relay && !config.retention) config.retention = DEFAULT_RELAY_HISTORY;
+
+    if (n_positional == 1)
+        config.port = positional[0];
+    else if (n_positional == 2) {
+        config.host = positional[0];
+        config.port = positional[1];
+    }
+    return TRUE;
+}
@@ -1,21 +1,29 @@
 #include <stdio.h>
 #include <windows.h>
 #include <winsock2.h>
+#include <afunix.h>
 #include "../include/controller.h"
 #include "../include/service.h"
+#include "../include/config.h"
+#include "../include/snapshot.h"
+#include "../include/wal.h"
+#include "../include/publish.h"
+#include "../include/replica.h"
+#include "../include/search.h"
+#include "../include/timer.h"
+#include "../include/handoff.h"
+#include "../include/affinity.h"
 #include "../../utils/include/recvbuf.h"
 
 
-#define ANNOUNCE_LEN 32
-#define USER_ID_SYSTEM 0
-#define NO_MESSAGES (-1)
+#define ANNOUNCE_LEN 64
 
-#define MAX_USERS 65536
-
-CRITICAL_SECTION cs_mh;
-DWORD msg_id_counter;
 bool cv_stop;
 
+static SOCKET unix_sock = INVALID_SOCKET;       // Listener for local clients (--unix)
+static volatile LONG clients_counter;           // Last client #id given, shared by both listeners
+static volatile bool handing_off;               // Listeners are handed over to successor (handoff.h)
+
 #define terminate() \
     do { \
         printLastWSAError(); \
@@ -23,105 +31,247 @@ bool cv_stop;
         return EXIT_FAILURE; \
     } while(0)
 
-WINBOOL startServer(const char* ip, const char* port) {
+static SOCKET listenUnix(const char* path) {
     /**
-     * @brief Run TCP server: socket() bind() listen(), transfer control to startAllControllers()
+     * @brief socket(AF_UNIX) bind() listen() at `path`
+     * @details Socket file of a previous run is removed first. Local clients skip the TCP stack.
+     */
+    struct sockaddr_un addr = {0};
+    SOCKET s;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "[startServ] Socket path is too long: %s\r\n", path);
+        return INVALID_SOCKET;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    DeleteFileA(path);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) == SOCKET_ERROR || listen(s, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+static bool startClient(Client* c) {
+    /**
+     * @brief Register client and create messageController() thread for it
+     * @details Thread is not joined: shutdown waits until registry is empty.
+     * @return FALSE if registry is full
      */
+    HANDLE thread;
+    DWORD dwt;
 
+    if (!registerClient(c)) return FALSE;
+    // Accepted right before shutdown: disconnectAllClients() may have missed it
+    if (cv_stop) shutdown(c->sock, SD_BOTH);
+    thread = CreateThread(NULL, 0, (LPVOID) messageController, (LPVOID) c, 0, &dwt);
+    if (!thread) {
+        fprintf(stderr, "[clMgmtCtrl] Failed to create thread for client #%lu! Closing connection.\r\n", c->id);
+        closeClientSocket(c);
+        joinBoard(c, NULL);
+        clientLeft(c);
+        unregisterClient(c);
+        free(c);
+        return TRUE;
+    }
+    CloseHandle(thread);
+    return TRUE;
+}
+
+static WINBOOL startListening(const char* ip, const char* port, ADDRINFOA** fullserv, SOCKET* sock) {
+    /**
+     * @brief socket() bind() listen() at `ip`:`port` and, with --unix, at socket path
+     * @details On failure caller closes what was opened (closeServer()).
+     */
     int err;
-    WSADATA wsa = {0};
-    SOCKET sock = INVALID_SOCKET;
     ADDRINFOA server = {0};
-    ADDRINFOA *fullserv = NULL;
-
-    err = WSAStartup(0x0202, &wsa);
-    fprintf(stderr, "[startServ] WSAStartup: code %d\r\n", err);
-    if (err != ERROR_SUCCESS) terminate();
 
     server.ai_family = AF_INET;
     server.ai_socktype = SOCK_STREAM;
     server.ai_protocol = IPPROTO_TCP;
 
-    err = getaddrinfo(ip, port, &server, &fullserv);
+    err = getaddrinfo(ip, port, &server, fullserv);
     fprintf(stderr, "[startServ] GetAddrInfo: code %d\r\n", err);
-    if (err != ERROR_SUCCESS) terminate();
+    if (err != ERROR_SUCCESS) return FALSE;
 
-    sock = socket(fullserv->ai_family, fullserv->ai_socktype, fullserv->ai_protocol);
-    if (sock == INVALID_SOCKET) terminate();
+    *sock = socket((*fullserv)->ai_family, (*fullserv)->ai_socktype, (*fullserv)->ai_protocol);
+    if (*sock == INVALID_SOCKET) return FALSE;
     fprintf(stderr, "[startServ] Socket created successfully\r\n");
 
-    err = bind(sock, fullserv->ai_addr, fullserv->ai_addrlen);
-    if (err == SOCKET_ERROR) terminate();
+    err = bind(*sock, (*fullserv)->ai_addr, (*fullserv)->ai_addrlen);
+    if (err == SOCKET_ERROR) return FALSE;
 
-    err = listen(sock, SOMAXCONN);
-    if (err == SOCKET_ERROR) terminate();
+    err = listen(*sock, SOMAXCONN);
+    if (err == SOCKET_ERROR) return FALSE;
 
     fprintf(stderr, "[startServ] Server is listening at %s:%s\r\n", ip, port);
     printf("Server is listening at %s:%s\r\n", ip, port);
 
-    initMessageHistory();
-    initClientList();
+    if (getConfig()->unix_path) {
+        unix_sock = listenUnix(getConfig()->unix_path);
+        if (unix_sock == INVALID_SOCKET) return FALSE;
+        fprintf(stderr, "[startServ] Server is listening at %s (AF_UNIX)\r\n", getConfig()->unix_path);
+        printf("Local clients connect to %s\r\n", getConfig()->unix_path);
+    }
+    return TRUE;
+}
+
+WINBOOL startServer(const char* ip, const char* port) {
+    /**
+     * @brief Run TCP server: socket() bind() listen(), transfer control to startAllControllers()
+     */
+
+    int err;
+    WSADATA wsa = {0};
+    SOCKET sock = INVALID_SOCKET;
+    ADDRINFOA *fullserv = NULL;
+    BlobStats bs;
+    ServerConfig* config = getConfig();
+    List* taken;
+    Client* c;
+    bool saved;
+
+    err = WSAStartup(0x0202, &wsa);
+    fprintf(stderr, "[startServ] WSAStartup: code %d\r\n", err);
+    if (err != ERROR_SUCCESS) terminate();
+
+    // Take over listening sockets and clients of a running server instead of binding
+    if (config->handoff && findPredecessor()) {
+        if (!takeListeners(&sock, &unix_sock)) terminate();
+        fprintf(stderr, "[startServ] Server is listening at %s:%s (taken over)\r\n", ip, port);
+        printf("Server is listening at %s:%s (taken over)\r\n", ip, port);
+    }
+    else if (!startListening(ip, port, &fullserv, &sock)) terminate();
+
+    initBlobStore();
+    initBoards();
+    initClientRegistry();
+    initSessions();
+    initReplication();
+    if (!loadSnapshot() || !openWal() || !openRing() || !initAffinity() || !startTimers() || !startReplica()) {
+        closeServer(fullserv, sock);
+        return EXIT_FAILURE;
+    }
+
+    // History is loaded: clients taken over continue where they were
+    if (config->handoff && (taken = takeClients((LONG*) &clients_counter)) != NULL) {
+        while ((c = list_pop(taken, 0)) != NULL) {
+            fprintf(stderr, "[startServ] User #%lu (%s:%d) taken over in board '%s'\r\n", c->id, c->ip, c->port, c->board->name);
+            if (startClient(c)) continue;
+            closeClientSocket(c);
+            joinBoard(c, NULL);
+            clientLeft(c);
+            free(c);
+        }
+        list_delete(taken);
+    }
 
     startAllControllers(fullserv, sock);
+    stopReplica();
+    stopTimers();
 
     fprintf(stderr, "[startServ] Shutting down server...\r\n");
-    destroyMessageHistory();
-    destroyClientList();
+    getBlobStats(&bs);
+    fprintf(stderr, "[startServ] Blob store: %lu uploads, %lu unique, %llu of %llu bytes stored\r\n",
+            bs.uploads, bs.blobs, bs.stored_bytes, bs.logical_bytes);
+    // New snapshot replaces the old one once nothing points into the old one's view
+    saved = config->snapshot && saveSnapshot();
+    closeRing();
+    destroySessions();
+    destroyReplication();
+    destroyBoards();
+    destroyClientRegistry();
+    destroyBlobStore();
+    closeSnapshot();
+    saved = saved && replaceSnapshot();
+    // Log is not needed once its messages are in snapshot
+    if (saved) resetWal();
+    closeWal();
+
+    // Last: successor maps the snapshot and opens the log as soon as it owns the sockets
+    if (successorWaiting()) handOver(saved, clients_counter);
+    closeHandoff();
 
     return 0;
 }
 
+static void waitEnter(HANDLE ev_enter) {
+    scanf("%*c");
+    SetEvent(ev_enter);
+}
+
 void startAllControllers(ADDRINFOA *fullserv, SOCKET sock) {
     /**
      * @brief Launch threads for all controllers
-     * (though only one main controller at the moment, but used to be more)
+     * (clientMgmtController() for TCP and, with --unix, another one for local clients)
+     * @details Server stops on Enter or, with --handoff, when a successor takes it over.
      */
-    DWORD dwt;
-    HANDLE controllers[1] = {INVALID_HANDLE_VALUE};
+    DWORD dwt, n = 0;
+    HANDLE controllers[2] = {INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE};
+    HANDLE stop[2] = {NULL, NULL};      // Enter pressed, successor connected
 
-    InitializeCriticalSection(&cs_mh);
     cv_stop = FALSE;
 
-    controllers[0] = CreateThread(NULL, 0, (LPVOID ) clientMgmtController, (LPVOID) sock, 0, &dwt);
-    if (controllers[0] == INVALID_HANDLE_VALUE) {
+    controllers[n] = CreateThread(NULL, 0, (LPVOID ) clientMgmtController, (LPVOID) sock, 0, &dwt);
+    if (!controllers[n]) {
         closeServer(fullserv, sock);
-        DeleteCriticalSection(&cs_mh);
         return;
     }
+    pinThread(controllers[n++], CPUS_ACCEPT);
+    if (unix_sock != INVALID_SOCKET) {
+        controllers[n] = CreateThread(NULL, 0, (LPVOID ) clientMgmtController, (LPVOID) unix_sock, 0, &dwt);
+        if (controllers[n]) pinThread(controllers[n++], CPUS_ACCEPT);
+    }
+
+    stop[0] = CreateEventA(NULL, FALSE, FALSE, NULL);
+    stop[1] = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (getConfig()->handoff && !waitSuccessor(stop[1]))
+        fprintf(stderr, "[startCtrls] Cannot wait for successor: code %lu\r\n", GetLastError());
+    CloseHandle(CreateThread(NULL, 0, (LPVOID) waitEnter, (LPVOID) stop[0], 0, &dwt));
 
     fprintf(stderr, "[startCtrls] Server is online!\r\n");
     printf("Server is online! Press Enter to stop.\r\n");
 
-    scanf("%*c");
+    // Successor whose handover fails is turned away, server keeps running
+    while (WaitForMultipleObjects(2, stop, FALSE, INFINITE) == WAIT_OBJECT_0 + 1
+            && !handOverListeners(sock, unix_sock));
 
-    printf("Stopping server...\r\n");
+    if (successorWaiting()) {
+        printf("Handing over to successor...\r\n");
+        // accept() fails once listeners are closed, new connections wait in backlog for successor
+        handing_off = TRUE;
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+        if (unix_sock != INVALID_SOCKET) {
+            closesocket(unix_sock);
+            unix_sock = INVALID_SOCKET;
+        }
+        parkClients();
+    }
+    else printf("Stopping server...\r\n");
 
     cv_stop = TRUE;
 
     closeServer(fullserv, sock);
-    WaitForMultipleObjects(1, controllers, TRUE, INFINITE);
-    CloseHandle(controllers[0]);
+    WaitForMultipleObjects(n, controllers, TRUE, INFINITE);
+    for (DWORD i = 0; i < n; i++)
+        CloseHandle(controllers[i]);
+    // stop[0] stays open: waitEnter() may still be waiting for Enter after a handover
+    CloseHandle(stop[1]);
 
     fprintf(stderr, "[startCtrls] Threads stopped.\r\n");
-    DeleteCriticalSection(&cs_mh);
 }
 
 void closeServer(ADDRINFOA *fullserv, SOCKET sock) {
     /**
-     * @brief Disconnect all clients, close socket and free address info
+     * @brief Disconnect all clients, close sockets and free address info
      */
-    Client *c;
-
     fprintf(stderr, "[closeServer] Disconnecting clients...\r\n");
-    List* cl = getClientList();
-    for (Item* i = cl->head; i != NULL; i = i->next) {
-        c = (Client*) i->data;
-        if (c->sock != INVALID_SOCKET) {
-            shutdown(c->sock, SD_BOTH);
-            closesocket(c->sock);
-            fprintf(stderr, "[closeServer] Disconnected client #%lu\r\n", c->id);
-        }
-    }
+    disconnectAllClients();
 
     fprintf(stderr, "[closeServer] Closing server socket...\r\n");
 
@@ -130,6 +280,12 @@ void closeServer(ADDRINFOA *fullserv, SOCKET sock) {
 
     if (sock != INVALID_SOCKET)
         closesocket(sock);
+
+    if (unix_sock != INVALID_SOCKET) {
+        closesocket(unix_sock);
+        unix_sock = INVALID_SOCKET;
+        DeleteFileA(getConfig()->unix_path);
+    }
 }
 
 void clientMgmtController(SOCKET sock) {
@@ -137,28 +293,17 @@ void clientMgmtController(SOCKET sock) {
      * @brief Controller for clients management
      */
 
-    List* cl = getClientList();
-    List* mh = getMessageHistory();
-
     Client *c = NULL;
-    Message* announce = NULL;
     SOCKET c_sock = INVALID_SOCKET;
-    HANDLE* tmp;
-
-    int msg_threads_size = MAX_USERS;
-    HANDLE *msgThreads = calloc(MAX_USERS, sizeof(HANDLE));
-    if (!msgThreads) return;
-
-    int clients_counter = 1;
-    msg_id_counter = 1;
-    DWORD dwt;
 
     fprintf(stderr, "[clMgmtCtrl] Controller launched\r\n");
 
     // Accept connections in loop
-    while (!cv_stop) {
+    while (!cv_stop && !handing_off) {
         c_sock = accept(sock, NULL, NULL);
         if (c_sock == INVALID_SOCKET) {
+            // Listener was closed: it is handed over to successor
+            if (handing_off) break;
             fprintf(stderr, "[clMgmtCtrl] Failed to accept new client: code %d\r\n", WSAGetLastError());
             continue;
         }
@@ -167,103 +312,214 @@ void clientMgmtController(SOCKET sock) {
         c = calloc(1, sizeof(Client));
         if (!c) break;
         c->sock = c_sock;
-        c->id = clients_counter;
+        // Replica numbers its clients in the block primary reserved for it
+        c->id = getClientIdBase() + InterlockedIncrement(&clients_counter);
         getIpPort(c_sock, c->ip, &c->port);
 
-        list_append(cl, c);
-
-        // Publish system message about new client
-        announce = calloc(1, sizeof(Message));
-        if (!announce) break;
-        announce->msg_type = MSG_TYPE_MSG;
-        announce->src_id = USER_ID_SYSTEM;
-        announce->buf = calloc(1, ANNOUNCE_LEN);
-        if (!announce->buf) { free(announce); break; }
-        sprintf(announce->buf, "New anon joined. Welcome, Anonim #%lu", c->id);
-        announce->msg_len = strlen(announce->buf);
-        GetLocalTime(&announce->timestamp);
-
-        EnterCriticalSection(&cs_mh);
-        announce->msg_id = msg_id_counter++;
-        list_append(mh, announce);
-        LeaveCriticalSection(&cs_mh);
-
-        fprintf(stderr, "[clMgmtCtrl] New user #%d (%s:%d) joined\r\n", clients_counter, c->ip, c->port);
-        printf("New user #%d (%s:%d) joined!\r\n", clients_counter, c->ip, c->port);
-
-        // Create messageController() thread for client
-        msgThreads[clients_counter] = CreateThread(NULL, 0, (LPVOID) messageController, (LPVOID) c, 0, &dwt);
-        if (msgThreads[clients_counter] == INVALID_HANDLE_VALUE) {
-            fprintf(stderr, "[clMgmtCtrl] Failed to create thread for client #%lu! Closing connection.\r\n", c->id);
-            send(c->sock, "Sorry, something went wrong.\r\n\0", 32, 0);
-            shutdown(c->sock, SD_BOTH);
-            closesocket(c->sock);
-            c->sock = INVALID_SOCKET;
-            break;
-        }
+        // New client starts in default board, it is announced there on its first request
+        joinBoard(c, getBoard(DEFAULT_BOARD, FALSE));
 
-        // Extend msgThreads buffer if needed
-        clients_counter++;
-        if (clients_counter == msg_threads_size) {
-            fprintf(stderr, "[clMgmtCtrl] Max users count reached (%d). Reallocating.\r\n", msg_threads_size);
-            tmp = realloc(msgThreads, msg_threads_size + MAX_USERS);
-            if (!tmp) break;
-            msgThreads = tmp;
-            msg_threads_size += MAX_USERS;
-        }
-    }
-    fprintf(stderr, "[clMgmtCtrl] Registration loop stopped, waiting for threads...\r\n");
+        fprintf(stderr, "[clMgmtCtrl] New user #%lu (%s:%d) joined\r\n", c->id, c->ip, c->port);
+        printf("New user #%lu (%s:%d) joined!\r\n", c->id, c->ip, c->port);
 
-    WaitForMultipleObjects(clients_counter, msgThreads, TRUE, INFINITE);
-    for (int j = 0; j < clients_counter; j++)
-        if (msgThreads[j] != INVALID_HANDLE_VALUE)
-            CloseHandle(msgThreads[j]);
+        if (!startClient(c)) break;
+    }
+    fprintf(stderr, "[clMgmtCtrl] Registration loop stopped, waiting for clients to leave...\r\n");
 
-    free(msgThreads);
-    fprintf(stderr, "[clMgmtCtrl] Stopped all threads, quitting...\r\n");
+    waitClientsLeft();
+    fprintf(stderr, "[clMgmtCtrl] All clients left, quitting...\r\n");
 }
 
 
 #define disconnectClient()              \
 do {                                    \
-    if (c->sock != INVALID_SOCKET) {    \
-        shutdown(c->sock, SD_BOTH);     \
-        closesocket(c->sock);           \
-        c->sock = INVALID_SOCKET;       \
-    }                                   \
+    cancelTimer(&c->t_idle);            \
+    cancelTimer(&c->t_beat);            \
+    cancelTimer(&c->t_stall);           \
+    stopReplication(c);                 \
+    parked = parked && parkClient(c);   \
+    closeClientSocket(c);               \
+    mux_close(c->mux);                  \
+    c->mux = NULL;                      \
+    if (!parked) saveSession(c);        \
+    joinBoard(c, NULL);                 \
+    releaseBodyCache();                 \
+    recvrelease();                      \
+    clientLeft(c);                      \
+    unregisterClient(c);                \
+    free(c);                            \
     return;                             \
 } while(0)
 
 
+static void announceClient(Client* c, bool post) {
+    /**
+     * @brief Post system message about new client in its board (once, on its first request)
+     * @details Replicas (first request /replicate) are not announced. A replica tells primary
+     *  its client joined, primary posts the announcement.
+     */
+    Message* announce;
+
+    c->announced = TRUE;
+    if (!post) return;
+    if (isReplica()) {
+        forwardJoin(c->board, c->id);
+        return;
+    }
+    announce = newJoinMessage(c->id);
+    if (announce && !postMessage(c->board, announce, NULL)) freeMessage(announce);
+}
+
+static void throttleClient(Client* c, DWORD ms) {
+    /**
+     * @brief Client is over its rate limit: sleep in its own thread, do not read its socket meanwhile
+     */
+    DWORD waited = 0, step;
+
+    fprintf(stderr, "[msgCtrl | Thread %lu] Client #%lu is over its limit, waits %lu ms\r\n", GetCurrentThreadId(), c->id, ms);
+    for (; waited < ms && !cv_stop; waited += step) {
+        step = ms - waited < RATE_WAIT_STEP_MS ? ms - waited : RATE_WAIT_STEP_MS;
+        Sleep(step);
+    }
+    c->throttled++;
+    InterlockedExchangeAdd64(&c->throttled_ms, waited);
+    countThrottle(waited);
+}
+
+static void onIdleTimer(Timer* t) {
+    /**
+     * @brief Disconnect client that sent no frames for `idle_timeout` (half-open connection, gone client)
+     * @details Frames only update rx_tick, the timer is moved forward here, so receiving takes no lock.
+     *  Shutdown wakes the client's thread from recv(), it then frees the connection as usual.
+     */
+    Client* c = t->ctx;
+    DWORD timeout = getConfig()->idle_timeout;
+    ULONGLONG limit = timeout * 1000ULL / TIMER_TICK_MS, idle = getTimerTick() - c->rx_tick;
+
+    if (idle < limit) {
+        armTimer(t, (DWORD) ((limit - idle) * TIMER_TICK_MS));
+        return;
+    }
+    fprintf(stderr, "[timers] Client #%lu sent nothing for %lu s, disconnecting\r\n", c->id, timeout);
+    countReap(FALSE);
+    shutdown(c->sock, SD_BOTH);
+}
+
+static void onBeatTimer(Timer* t) {
+    /**
+     * @brief Send empty frame if nothing was sent to client since last beat (keeps NAT and proxies open,
+     *  and a dead peer is noticed by the sender)
+     */
+    Client* c = t->ctx;
+
+    if (c->mux->bytes_sent == c->beat_sent)
+        mux_sendref(c->mux, MUX_STREAM_HEARTBEAT, NULL, 0, TRUE, NULL, NULL);
+    c->beat_sent = c->mux->bytes_sent;
+    armTimer(t, getConfig()->heartbeat * 1000);
+}
+
+static void onStallTimer(Timer* t) {
+    /**
+     * @brief Disconnect client whose download or upload made no progress since last check
+     * @details A download stalls when client stops reading: the sender thread blocks in send().
+     *  An upload stalls when a message is half received and no more frames come.
+     */
+    Client* c = t->ctx;
+    Mux* m = c->mux;
+    bool sending, receiving, stalled;
+    DWORD timeout = getConfig()->stall_timeout;
+
+    EnterCriticalSection(&m->cs);
+    sending = m->streams->length > 0;
+    LeaveCriticalSection(&m->cs);
+    // Partial messages belong to the client's thread, their count is only a hint here
+    receiving = m->partial->length > 0;
+
+    stalled = (sending && m->bytes_sent == c->stall_sent) || (receiving && c->rx_bytes == c->stall_rx);
+    c->stall_sent = m->bytes_sent;
+    c->stall_rx = c->rx_bytes;
+    if (!stalled) {
+        armTimer(t, timeout * 1000);
+        return;
+    }
+    fprintf(stderr, "[timers] Transfer of client #%lu made no progress for %lu s, disconnecting\r\n", c->id, timeout);
+    countReap(TRUE);
+    shutdown(c->sock, SD_BOTH);
+}
+
+
 void messageController(Client *c) {
     /**
      * @brief Threaded controller for communicating with client
+     * @details
+     *  Requests arrive as messages on multiplexed streams, response goes to the stream of request.
+     *  Responses are queued to client's multiplexer, so this thread never blocks on a large send().
      */
 
-    int res;
-    char *buf, welcome_msg[ANNOUNCE_LEN];
+    LONGLONG res;
+    char *buf, welcome_msg[ANNOUNCE_LEN + BOARD_NAME_LEN], buf_token[sizeof(CMD_RESUME) + TOKEN_LEN + 17];
 
-    List* msgs = getMessageHistory();
     SOCKET c_sock = c->sock;
 
-    Message *msg = NULL, *orig_msg = NULL, msgbuf = {0};
-    Item* i;
+    Request *req = NULL;
+    Message *orig_msg = NULL;
+    MuxFrame frame;
+    Board* board;
+    ServerConfig* config = getConfig();
+    DWORD wait_ms;
+    bool durable;
+    bool restored, parked = FALSE;
 
     fprintf(stderr, "[msgCtrl | Thread %lu] Controller launched\r\n", GetCurrentThreadId());
 
+    // Before anything is allocated: buffers of this thread come from its NUMA node
+    placeWorker();
+
+    initBucket(&c->rl_msgs, config->rate_msgs, config->rate_msgs_burst);
+    initBucket(&c->rl_bytes, config->rate_bytes, config->rate_bytes_burst);
+
+    c->mux = mux_init(c_sock);
+    if (!c->mux) disconnectClient();
+    pinAlongside(c->mux->sender);
+    if (c->handoff) resumeConnection(c);
+
+    // Timeouts of connection run on timer wheel (timer.c)
+    c->rx_tick = getTimerTick();
+    initTimer(&c->t_idle, onIdleTimer, c);
+    initTimer(&c->t_beat, onBeatTimer, c);
+    initTimer(&c->t_stall, onStallTimer, c);
+    if (config->idle_timeout) armTimer(&c->t_idle, config->idle_timeout * 1000);
+    if (config->heartbeat) armTimer(&c->t_beat, config->heartbeat * 1000);
+    if (config->stall_timeout) armTimer(&c->t_stall, config->stall_timeout * 1000);
+
     // Process client's requests in loop
     while (!cv_stop) {
-        res = recvuntil('\0', &buf, c_sock);
+        res = mux_recvframe(c->mux, &frame);
 
         if (res > 0) {
-            fprintf(stderr, "[msgCtrl | Thread %lu] Received data from client #%lu\r\n", GetCurrentThreadId(), c->id);
+            c->rx_tick = getTimerTick();
+            c->rx_bytes += res;
 
-            // Construct Message from raw buffer
-            msg = parseMsgFromClient(buf, res, c_sock);
+            // Over byte rate: next frames of this client wait (its uploads slow down). Replicas are
+            // not limited: they carry posts of many clients, each limited by the replica
+            if (!c->repl && (wait_ms = takeTokens(&c->rl_bytes, (double) res)) != 0) throttleClient(c, wait_ms);
+
+            res = mux_collect(c->mux, &frame, &buf);
+            if (res == 0) continue;
+            if (res == SOCKET_ERROR) {
+                mux_send(c->mux, frame.stream_id, "Wow, it's so big!", 18, TRUE);
+                continue;
+            }
+
+            fprintf(stderr, "[msgCtrl | Thread %lu] Received data from client #%lu, stream %lu\r\n", GetCurrentThreadId(), c->id, frame.stream_id);
+
+            // Construct Request from raw buffer
+            req = parseMsgFromClient(buf, res);
             free(buf);
-            if (!msg) disconnectClient();
+            if (!req) disconnectClient();
 
-            msg->src_id = c->id;
+            if (req->post) req->post->src_id = c->id;
+            if (!c->announced) announceClient(c, req->type != MSG_TYPE_REPLICATE && req->type != MSG_TYPE_REPLAUTH);
         }
         else {
             // Connection closed, closing socket
@@ -271,97 +527,171 @@ void messageController(Client *c) {
             disconnectClient();
         }
 
-        // Process message
-        switch (msg->msg_type) {
+        // Process request
+        switch (req->type) {
 
-            // Sync: send new messages (if any) to client, end with \0\0
-            // msg_id = ID of client's last stored message
+            // Sync: send new messages (if any) to client, separated by \0, end with \0\0
+            // Server keeps delivery cursor, so sync just resumes from it
             case MSG_TYPE_SYNC:
-                fprintf(stderr, "[msgCtrl | Thread %lu] Sync request from #%lu, last msg %d\r\n", GetCurrentThreadId(), msg->src_id, (int) msg->msg_id);
+                fprintf(stderr, "[msgCtrl | Thread %lu] Sync request from #%lu, cursor %llu\r\n", GetCurrentThreadId(), c->id, c->cursor);
+                sendHistoryToClient(c, frame.stream_id);
+                break;
+
+            // Resume: first request of connection. With a known token client gets its board
+            // and cursor back (only messages it missed), otherwise a new session starts
+            // with the last `catchup` messages of board. Client that has messages of this run
+            // of server cached gets only newer ones in either case.
+            // Response: /resume <token> <history serial>, /board <name>, welcome message,
+            // messages, then \0 as for sync
+            case MSG_TYPE_RESUME:
+                restored = req->name[0] && restoreSession(c, req->name);
+                if (!restored) newSessionToken(c->token);
+                if (resumeFromCache(c, req->args, restored) || restored)
+                    sprintf(welcome_msg, "#0  Welcome back, Anonim #%lu. Resumed in board '%s'", c->id, c->board->name);
+                else
+                    sprintf(welcome_msg, "#0  Welcome back, Anonim #%lu", c->id);
+                fprintf(stderr, "[msgCtrl | Thread %lu] Session of #%lu: board '%s', cursor %llu\r\n", GetCurrentThreadId(), c->id, c->board->name, c->cursor);
+
+                sprintf(buf_token, "%s %s %016llx", CMD_RESUME, c->token, getHistorySerial());
+                mux_send(c->mux, frame.stream_id, buf_token, strlen(buf_token)+1, FALSE);
+                sendBoardName(c, frame.stream_id);
+                mux_send(c->mux, frame.stream_id, welcome_msg, strlen(welcome_msg)+1, FALSE);
+                if (c->oldest == c->cursor) sendCatchupNote(c, frame.stream_id);
+                sendHistoryToClient(c, frame.stream_id);
+                break;
+
+            // Older messages: page of history before the oldest one client has (control stream)
+            case MSG_TYPE_OLDER:
+                sendOlderToClient(c, frame.stream_id);
+                break;
+
+            // Search: newest messages of client's board with all words of query (control stream)
+            case MSG_TYPE_SEARCH:
+                sendSearchToClient(c, frame.stream_id, req->args);
+                break;
 
-                if ((int) msg->msg_id == NO_MESSAGES) {
-                    // New client, send welcome message and skip message search
-                    sprintf(welcome_msg, "#0  Welcome back, Anonim #%lu", msg->src_id);
-                    send(c->sock, welcome_msg, strlen(welcome_msg)+1, 0);
-                    i = msgs->head;
+            // Join board: like sync from the last `catchup` messages of new board
+            case MSG_TYPE_JOIN:
+                board = req->name[0] ? getBoard(req->name, TRUE) : NULL;
+                if (!board) {
+                    if (req->name[0]) sprintf(welcome_msg, "Cannot join board '%s'", req->name);
+                    else strcpy(welcome_msg, "Invalid board name");
+                    mux_send(c->mux, frame.stream_id, welcome_msg, strlen(welcome_msg)+1, FALSE);
+                    mux_send(c->mux, frame.stream_id, "", 1, TRUE);
+                    break;
                 }
-                else {
-                    // Iterate over Message History until msg_id
-                    EnterCriticalSection(&cs_mh);
-                    for (i = msgs->head; i != NULL; i = i->next)
-                        if (((Message*) i->data)->msg_id == msg->msg_id) {
-                            i = i->next;
-                            break;
-                        }
-                    LeaveCriticalSection(&cs_mh);
+                joinBoard(c, board);
+                fprintf(stderr, "[msgCtrl | Thread %lu] Client #%lu joined board '%s'\r\n", GetCurrentThreadId(), c->id, board->name);
+
+                sendBoardName(c, frame.stream_id);
+                sprintf(welcome_msg, "#0  Joined board '%s'", board->name);
+                mux_send(c->mux, frame.stream_id, welcome_msg, strlen(welcome_msg)+1, FALSE);
+                sendCatchupNote(c, frame.stream_id);
+                sendHistoryToClient(c, frame.stream_id);
+                break;
+
+            // Messages and Files: simply add to Message History of client's board
+            // No lock: writers reserve #id and store message in its own slot
+            // Replica sends them to primary, they come back with their #id through replication
+            case MSG_TYPE_MSG:
+            case MSG_TYPE_FILE:
+                board = c->board;
+                if ((wait_ms = takeTokens(&c->rl_msgs, 1)) != 0) throttleClient(c, wait_ms);
+                if (isReplica()) {
+                    if (!forwardPost(board, req->post)) {
+                        mux_send(c->mux, frame.stream_id, REPL_UNREACHABLE, strlen(REPL_UNREACHABLE)+1, FALSE);
+                        mux_send(c->mux, frame.stream_id, "", 1, TRUE);
+                    }
+                    break;
+                }
+                if (postMessage(board, req->post, &durable)) {
+                    req->post = NULL;
+                    if (!durable) {
+                        mux_send(c->mux, frame.stream_id, WAL_NOT_DURABLE, strlen(WAL_NOT_DURABLE)+1, FALSE);
+                        mux_send(c->mux, frame.stream_id, "", 1, TRUE);
+                    }
                 }
+                break;
 
-                // Starting from next message, send all messages to client
-                for (; i != NULL; i = i->next) {
-                    EnterCriticalSection(&cs_mh);
-                    orig_msg = (Message*) i->data;
-                    // Copy message contents to buffer, or else all Message History will be locked while sending
-                    msgbuf.msg_id = orig_msg->msg_id;
-                    msgbuf.src_id = orig_msg->src_id;
-                    msgbuf.msg_type = orig_msg->msg_type;
-                    msgbuf.msg_len = orig_msg->msg_len;
-                    msgbuf.timestamp = orig_msg->timestamp;
-                    memcpy(msgbuf.file_name, orig_msg->file_name, FILE_NAME_LEN);
-                    msgbuf.buf = calloc(msgbuf.msg_len+1, sizeof(char));
-                    if (msgbuf.buf != NULL) {
-                        memcpy(msgbuf.buf, orig_msg->buf, msgbuf.msg_len);
-                        // Leave CS before sending
-                        LeaveCriticalSection(&cs_mh);
-
-                        // Send message contents to client
-                        sendMessageToClient(c, &msgbuf);
-
-                        free(msgbuf.buf);
-                    } else LeaveCriticalSection(&cs_mh);
+            // Replica subscribes: it has to prove it has --repl-key first (replica.h)
+            case MSG_TYPE_REPLICATE:
+                challengeReplica(c, frame.stream_id);
+                break;
+
+            // Proof of replica: committed messages are pushed on this stream from now on. It numbers
+            // its clients in a block of #ids taken from our counter
+            case MSG_TYPE_REPLAUTH:
+                if (!acceptReplica(c, frame.stream_id, req->args, &clients_counter))
+                    fprintf(stderr, "[msgCtrl | Thread %lu] Cannot replicate to client #%lu\r\n", GetCurrentThreadId(), c->id);
+                break;
+
+            // Replica reports its progress (shown in /stats)
+            case MSG_TYPE_REPLACK:
+                ackReplication(c, req->args);
+                break;
+
+            // Post of a replica's client: as if it was posted here (or passed on, if we replicate too)
+            case MSG_TYPE_FORWARD:
+                orig_msg = acceptForward(c, req->args, req->args_len, &board);
+                if (!orig_msg) break;
+                if (isReplica()) {
+                    forwardPost(board, orig_msg);
+                    freeMessage(orig_msg);
                 }
-                send(c->sock, "\0", 1, 0);
+                else if (!postMessage(board, orig_msg, NULL)) freeMessage(orig_msg);
+                break;
 
-                free(msg);
+            // Client can decode compressed frames, compress what we send (if allowed)
+            case MSG_TYPE_COMPRESS:
+                if (getConfig()->wire_compress) {
+                    c->mux->compress = TRUE;
+                    mux_send(c->mux, frame.stream_id, CMD_COMPRESS, strlen(CMD_COMPRESS)+1, TRUE);
+                    fprintf(stderr, "[msgCtrl | Thread %lu] Compression enabled for client #%lu\r\n", GetCurrentThreadId(), c->id);
+                }
                 break;
 
-            // Messages and Files: simply add to Message History
-            case MSG_TYPE_MSG:
-                // Display messages on server, do not display files
-                printf("#%lu | Anonim #%lu : %s\r\n", msg_id_counter, msg->src_id, msg->buf);
-            case MSG_TYPE_FILE:
-                EnterCriticalSection(&cs_mh);
+            // Client answered /handoff: nothing more of it is in the socket, connection goes to successor
+            case MSG_TYPE_PARKED:
+                freeRequest(req);
+                parked = TRUE;
+                disconnectClient();
+
+            // Server statistics
+            case MSG_TYPE_STATS:
+                sendStatsToClient(c, frame.stream_id);
+                break;
 
-                // Add to Message History
-                msg->msg_id = msg_id_counter++;
-                fprintf(stderr, "[msgCtrl | Thread %lu] msg_id = %d  msg_len = %lu\r\n", GetCurrentThreadId(), (int) msg->msg_id, msg->msg_len);
-                list_append(msgs, msg);
+            // List of boards
+            case MSG_TYPE_BOARDS:
+                sendBoardsToClient(c, frame.stream_id);
+                break;
 
-                LeaveCriticalSection(&cs_mh);
+            // Clients online
+            case MSG_TYPE_WHO:
+                sendWhoToClient(c, frame.stream_id);
                 break;
 
             // Download File or Message
             // msg_id = id of requested file / message
             case MSG_TYPE_LOADFILE:
-                // Iterate over Message History to find file / message by id
-                EnterCriticalSection(&cs_mh);
-
-                orig_msg = NULL;
-                for (i = msgs->head; i != NULL; i = i->next)
-                    if (((Message*) i->data)->msg_id == msg->msg_id) {
-                        orig_msg = i->data;
-                        break;
-                    }
-                if (!orig_msg)
-                    fprintf(stderr, "[msgCtrl | Thread %lu] User #%lu requested unknown file id=%lu\r\n", GetCurrentThreadId(), c->id, msg->msg_id);
+                // At most `max_transfers` files in flight, the rest wait in client's queue, not in this thread
 
-                LeaveCriticalSection(&cs_mh);
+                // Find file / message by id in client's board
+                board = c->board;
+                EnterCriticalSection(&board->cs_mh);
+
+                orig_msg = getMessage(board, req->msg_id);
+                if (!orig_msg)
+                    fprintf(stderr, "[msgCtrl | Thread %lu] User #%lu requested unknown file id=%llu\r\n", GetCurrentThreadId(), c->id, req->msg_id);
 
-                // Initiate file download
-                sendFileToClient(c, orig_msg);
+                // Initiate file download. Content is sent in background, interleaved with other streams
+                sendFileToClient(c, frame.stream_id, orig_msg, req->range_off, req->range_len, req->range_hash);
 
-                free(msg);
+                LeaveCriticalSection(&board->cs_mh);
                 break;
 
         }
+        freeRequest(req);
     }
+    disconnectClient();
 }
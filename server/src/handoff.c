@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <string.h>
+#include <sddl.h>
+#include "../include/handoff.h"
+#include "../include/config.h"
+#include "../include/service.h"
+#include "../../utils/include/recvbuf.h"
+
+#define PIPE_NAME_LEN 64
+
+
+typedef struct HandoffState {
+    char board[BOARD_NAME_LEN];         // Joined once history is loaded
+    bool compress;
+    List *partial;                      // MuxIn's of half-received messages
+} HandoffState;
+
+typedef struct Parked {
+    HandoffClient rec;
+    List *partial;                      // MuxIn's taken from multiplexer of client
+} Parked;
+
+// Handoff pipe: server end in predecessor, client end in successor
+static HANDLE h_pipe = INVALID_HANDLE_VALUE;
+static HANDLE waiter;                   // Thread waiting for successor on pipe
+static HANDLE ev_successor;             // Set when successor connects (stops controllers)
+static volatile DWORD successor_pid;    // 0 = no successor
+static HandoffHeader hdr;
+static List* parked;                    // Predecessor: Parked's to send, successor: Client's taken over
+static CRITICAL_SECTION cs_parked;
+static volatile LONG parking;           // Clients asked to park that have not left yet
+static HANDLE ev_parked;                //   set when the last of them leaves
+static ULONGLONG park_deadline;         // Tick count parking ends at
+
+
+static void pipeName(char* name) {
+    snprintf(name, PIPE_NAME_LEN, "%s%s", HANDOFF_PIPE, getConfig()->port);
+}
+
+static bool readPipe(void* buf, ULONGLONG len) {
+    /**
+     * @brief Read exactly `len` bytes from pipe
+     */
+    DWORD n, part;
+
+    for (ULONGLONG got = 0; got < len; got += n) {
+        part = len - got < HANDOFF_PIPE_BUF ? (DWORD) (len - got) : HANDOFF_PIPE_BUF;
+        if (!ReadFile(h_pipe, (char*) buf + got, part, &n, NULL) || n == 0) return FALSE;
+    }
+    return TRUE;
+}
+
+static bool writePipe(const void* buf, ULONGLONG len) {
+    DWORD n, part;
+
+    for (ULONGLONG put = 0; put < len; put += n) {
+        part = len - put < HANDOFF_PIPE_BUF ? (DWORD) (len - put) : HANDOFF_PIPE_BUF;
+        if (!WriteFile(h_pipe, (const char*) buf + put, part, &n, NULL) || n == 0) return FALSE;
+    }
+    return TRUE;
+}
+
+static void freePartial(List* partial) {
+    MuxIn* in;
+
+    if (!partial) return;
+    while ((in = list_pop(partial, 0)) != NULL) {
+        free(in->buf);
+        free(in);
+    }
+    free(partial);
+}
+
+
+bool findPredecessor() {
+    /**
+     * @brief Connect to handoff pipe of a server running on our port
+     * @return FALSE if there is none: server starts on its own
+     */
+    char name[PIPE_NAME_LEN];
+
+    pipeName(name);
+    h_pipe = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (h_pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeA(name, HANDOFF_WAIT_MS))
+        h_pipe = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (h_pipe == INVALID_HANDLE_VALUE) return FALSE;
+
+    fprintf(stderr, "[handoff] Server is running at port %s, taking it over...\r\n", getConfig()->port);
+    return TRUE;
+}
+
+static SOCKET adoptSocket(WSAPROTOCOL_INFOA* info) {
+    return WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, info, 0, WSA_FLAG_OVERLAPPED);
+}
+
+static Client* takeClient() {
+    /**
+     * @brief Receive one connection of predecessor with its state and half-received messages
+     */
+    HandoffClient rec;
+    HandoffPartial part;
+    HandoffState* st;
+    MuxIn* in;
+    Client* c;
+
+    if (!readPipe(&rec, sizeof(rec))) return NULL;
+    c = calloc(1, sizeof(Client));
+    st = calloc(1, sizeof(HandoffState));
+    if (!c || !st || !(st->partial = list())) {
+        free(c);
+        free(st);
+        return NULL;
+    }
+    c->handoff = st;
+    c->sock = adoptSocket(&rec.sock);
+    c->id = rec.id;
+    memcpy(c->ip, rec.ip, sizeof(c->ip) - 1);
+    c->port = rec.port;
+    memcpy(c->token, rec.token, TOKEN_LEN - 1);
+    c->cursor = rec.cursor;
+    c->oldest = rec.oldest;
+    c->announced = rec.announced;
+    memcpy(st->board, rec.board, BOARD_NAME_LEN - 1);
+    st->compress = rec.compress;
+
+    for (DWORD i = 0; i < rec.partials; i++) {
+        in = calloc(1, sizeof(MuxIn));
+        if (!in || !readPipe(&part, sizeof(part)) || part.len > MAX_BUF_LEN
+                || (part.len && !(in->buf = malloc(part.len))) || !readPipe(in->buf, part.len)) {
+            if (in) free(in->buf);
+            free(in);
+            clientLeft(c);
+            free(c);
+            return NULL;
+        }
+        in->stream_id = part.stream_id;
+        in->dropped = part.dropped;
+        in->len = in->size = part.len;
+        list_append(st->partial, in);
+    }
+    return c;
+}
+
+bool takeListeners(SOCKET* listener, SOCKET* local) {
+    /**
+     * @brief Receive listening sockets and connections of predecessor, acknowledge once they are ours
+     * @details Blocks until predecessor has parked its clients and saved the snapshot.
+     *  Clients wait for history to be loaded (takeClients()).
+     */
+    Client* c;
+    char ack = 1;
+
+    parked = list();
+    if (!readPipe(&hdr, sizeof(hdr)) || memcmp(hdr.magic, HANDOFF_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "[handoff] Running server did not hand over\r\n");
+        return FALSE;
+    }
+
+    *listener = adoptSocket(&hdr.listener);
+    *local = hdr.has_local ? adoptSocket(&hdr.local) : INVALID_SOCKET;
+    if (*listener == INVALID_SOCKET || (hdr.has_local && *local == INVALID_SOCKET)) {
+        fprintf(stderr, "[handoff] Cannot adopt listening sockets: code %d\r\n", WSAGetLastError());
+        return FALSE;
+    }
+
+    for (DWORD i = 0; i < hdr.clients; i++) {
+        c = takeClient();
+        if (!c) {
+            fprintf(stderr, "[handoff] Handoff of clients broke off after %lu of %lu\r\n", i, hdr.clients);
+            return FALSE;
+        }
+        if (c->sock == INVALID_SOCKET) {
+            fprintf(stderr, "[handoff] Cannot adopt connection of client #%lu: code %d\r\n", c->id, WSAGetLastError());
+            clientLeft(c);
+            free(c);
+            continue;
+        }
+        list_append(parked, c);
+    }
+
+    writePipe(&ack, 1);
+    CloseHandle(h_pipe);
+    h_pipe = INVALID_HANDLE_VALUE;
+    fprintf(stderr, "[handoff] Took over listening sockets and %llu clients\r\n", (ULONGLONG) parked->length);
+    return TRUE;
+}
+
+List* takeClients(LONG* clients_counter) {
+    /**
+     * @brief Clients taken over, moved to their boards (history is loaded by now). Caller starts them
+     * @return NULL if server did not take over from a predecessor
+     */
+    List* taken = parked;
+    ULONGLONG cursor, oldest;
+    Client* c;
+    Board* b;
+
+    if (!taken) return NULL;
+    parked = NULL;
+    setHistorySerial(hdr.history_serial);
+    *clients_counter = hdr.clients_counter;
+    for (Item* i = taken->head; i != NULL; i = i->next) {
+        c = i->data;
+        cursor = c->cursor;
+        oldest = c->oldest;
+        b = getBoard(c->handoff->board, TRUE);
+        joinBoard(c, b ? b : getBoard(DEFAULT_BOARD, FALSE));
+        // joinBoard() starts from catchup, client has everything before its cursor
+        if (b) {
+            c->cursor = cursor;
+            c->oldest = oldest;
+        }
+    }
+    return taken;
+}
+
+void resumeConnection(Client* c) {
+    /**
+     * @brief First thing on a connection taken over: restore its multiplexer, let client send again
+     */
+    HandoffState* st = c->handoff;
+    MuxIn* in;
+
+    c->mux->compress = st->compress;
+    while ((in = list_pop(st->partial, 0)) != NULL)
+        list_append(c->mux->partial, in);
+    freePartial(st->partial);
+    free(st);
+    c->handoff = NULL;
+
+    mux_send(c->mux, MUX_STREAM_NOTICE, CMD_RESUMED, strlen(CMD_RESUMED)+1, TRUE);
+}
+
+
+static void waitForSuccessor() {
+    /**
+     * @brief Wait until a successor connects to pipe, then stop controllers
+     * @details closeHandoff() wakes it by connecting from this process.
+     */
+    ULONG pid = 0;
+
+    if (!ConnectNamedPipe(h_pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) return;
+    if (!GetNamedPipeClientProcessId(h_pipe, &pid) || pid == GetCurrentProcessId()) return;
+
+    fprintf(stderr, "[handoff] Successor (process %lu) connected\r\n", pid);
+    successor_pid = pid;
+    SetEvent(ev_successor);
+}
+
+bool waitSuccessor(HANDLE ev_stop) {
+    /**
+     * @brief Open handoff pipe, wait for a successor in background (sets `ev_stop` when it connects)
+     */
+    char name[PIPE_NAME_LEN];
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+    DWORD dwt;
+
+    pipeName(name);
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(HANDOFF_PIPE_SDDL, SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+        return FALSE;
+    h_pipe = CreateNamedPipeA(name, PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                            PIPE_UNLIMITED_INSTANCES, HANDOFF_PIPE_BUF, HANDOFF_PIPE_BUF, 0, &sa);
+    LocalFree(sa.lpSecurityDescriptor);
+    if (h_pipe == INVALID_HANDLE_VALUE) return FALSE;
+
+    if (!parked) parked = list();
+    InitializeCriticalSection(&cs_parked);
+    ev_parked = CreateEventA(NULL, FALSE, FALSE, NULL);
+    ev_successor = ev_stop;
+    waiter = CreateThread(NULL, 0, (LPVOID) waitForSuccessor, NULL, 0, &dwt);
+    if (!waiter) return FALSE;
+
+    fprintf(stderr, "[handoff] Successor may take over at %s\r\n", name);
+    return TRUE;
+}
+
+bool successorWaiting() {
+    return successor_pid != 0;
+}
+
+bool handOverListeners(SOCKET listener, SOCKET local) {
+    /**
+     * @brief Duplicate listening sockets for successor. Caller closes its own ones: accept() stops,
+     *  connections wait in backlog for successor
+     * @return FALSE if they cannot be shared: successor is turned away, server keeps running
+     */
+    DWORD dwt;
+
+    hdr.has_local = local != INVALID_SOCKET;
+    if (WSADuplicateSocketA(listener, successor_pid, &hdr.listener) != SOCKET_ERROR
+            && (!hdr.has_local || WSADuplicateSocketA(local, successor_pid, &hdr.local) != SOCKET_ERROR))
+        return TRUE;
+
+    fprintf(stderr, "[handoff] Cannot share listening sockets: code %d, server keeps running\r\n", WSAGetLastError());
+    DisconnectNamedPipe(h_pipe);
+    WaitForSingleObject(waiter, INFINITE);
+    CloseHandle(waiter);
+    successor_pid = 0;
+    waiter = CreateThread(NULL, 0, (LPVOID) waitForSuccessor, NULL, 0, &dwt);
+    return FALSE;
+}
+
+void parkClients() {
+    /**
+     * @brief Ask clients to park, wait until they all left (parked or gone) or HANDOFF_WAIT_MS passed
+     */
+    LONG n;
+
+    park_deadline = GetTickCount64() + HANDOFF_WAIT_MS;
+    n = (LONG) parkAllClients(CMD_HANDOFF);
+    fprintf(stderr, "[handoff] Asked %ld clients to park\r\n", n);
+
+    // Some may have left already
+    if (InterlockedExchangeAdd(&parking, n) + n > 0 && WaitForSingleObject(ev_parked, HANDOFF_WAIT_MS) == WAIT_TIMEOUT)
+        fprintf(stderr, "[handoff] %ld clients did not park in time, disconnecting them\r\n", parking);
+}
+
+static bool muxPending(Mux* m) {
+    bool pending;
+
+    EnterCriticalSection(&m->cs);
+    pending = m->streams->length > 0;
+    LeaveCriticalSection(&m->cs);
+    return pending;
+}
+
+bool parkClient(Client* c) {
+    /**
+     * @brief Client answered /handoff with /parked: hand its connection over to successor
+     * @details Responses queued for client are sent to the end first, half-received messages
+     *  (uploads) go along. Socket is closed without shutdown(): successor's duplicate keeps the connection.
+     * @return FALSE if client cannot be handed over, it is disconnected
+     */
+    Parked* p;
+    SOCKET sock;
+
+    if (!c->parking || !successor_pid || !c->mux || !c->board) return FALSE;
+    while (muxPending(c->mux) && !c->mux->dead) {
+        if (GetTickCount64() >= park_deadline) return FALSE;
+        Sleep(HANDOFF_STEP_MS);
+    }
+    if (c->mux->dead) return FALSE;
+
+    p = calloc(1, sizeof(Parked));
+    if (!p || !(p->partial = list())) {
+        free(p);
+        return FALSE;
+    }
+    p->rec.id = c->id;
+    strcpy(p->rec.ip, c->ip);
+    p->rec.port = c->port;
+    strcpy(p->rec.token, c->token);
+    strcpy(p->rec.board, c->board->name);
+    p->rec.cursor = c->cursor;
+    p->rec.oldest = c->oldest;
+    p->rec.announced = c->announced;
+    p->rec.compress = c->mux->compress;
+
+    // Sender thread finishes the frame it sends, nothing is written to the socket after that
+    while (c->mux->partial->length)
+        list_append(p->partial, list_pop(c->mux->partial, 0));
+    p->rec.partials = (DWORD) p->partial->length;
+    mux_close(c->mux);
+    c->mux = NULL;
+
+    sock = takeClientSocket(c);
+    if (sock == INVALID_SOCKET || WSADuplicateSocketA(sock, successor_pid, &p->rec.sock) == SOCKET_ERROR) {
+        fprintf(stderr, "[handoff] Cannot hand over client #%lu: code %d\r\n", c->id, WSAGetLastError());
+        if (sock != INVALID_SOCKET) {
+            shutdown(sock, SD_BOTH);
+            closesocket(sock);
+        }
+        freePartial(p->partial);
+        free(p);
+        return FALSE;
+    }
+    closesocket(sock);
+
+    EnterCriticalSection(&cs_parked);
+    list_append(parked, p);
+    LeaveCriticalSection(&cs_parked);
+    fprintf(stderr, "[handoff] Client #%lu parked (%lu partial messages)\r\n", c->id, p->rec.partials);
+    return TRUE;
+}
+
+void clientLeft(Client* c) {
+    /**
+     * @brief Thread of client ends: count it off if it was asked to park, drop state taken over if unused
+     */
+    if (c->parking && InterlockedDecrement(&parking) == 0) SetEvent(ev_parked);
+    if (c->handoff) {
+        freePartial(c->handoff->partial);
+        free(c->handoff);
+        c->handoff = NULL;
+    }
+}
+
+bool handOver(bool saved, LONG clients_counter) {
+    /**
+     * @brief Send listening sockets and parked clients to successor, wait until it owns them
+     * @details Called last: snapshot is saved, log and ring are closed. If snapshot was not saved
+     *  nothing is sent, successor gives up (it would lose history) and clients reconnect.
+     */
+    HandoffPartial part;
+    Parked* p;
+    MuxIn* in;
+    char ack = 0;
+    bool ok = saved;
+
+    memcpy(hdr.magic, HANDOFF_MAGIC, sizeof(hdr.magic));
+    hdr.history_serial = getHistorySerial();
+    hdr.clients_counter = clients_counter;
+    hdr.clients = (DWORD) parked->length;
+    ok = ok && writePipe(&hdr, sizeof(hdr));
+
+    while ((p = list_pop(parked, 0)) != NULL) {
+        ok = ok && writePipe(&p->rec, sizeof(p->rec));
+        while ((in = list_pop(p->partial, 0)) != NULL) {
+            part.stream_id = in->stream_id;
+            part.dropped = in->dropped;
+            part.len = in->len;
+            ok = ok && writePipe(&part, sizeof(part)) && writePipe(in->buf, in->len);
+            free(in->buf);
+            free(in);
+        }
+        freePartial(p->partial);
+        free(p);
+    }
+    ok = ok && readPipe(&ack, 1) && ack;
+
+    if (ok) fprintf(stderr, "[handoff] Successor took over %lu clients\r\n", hdr.clients);
+    else fprintf(stderr, "[handoff] Handoff failed, clients will reconnect\r\n");
+    return ok;
+}
+
+void closeHandoff() {
+    /**
+     * @brief Close pipe, stop waiting for successor
+     */
+    char name[PIPE_NAME_LEN];
+    HANDLE self = INVALID_HANDLE_VALUE;
+
+    if (waiter) {
+        // Waiting thread is woken by a connection from this process
+        if (!successor_pid) {
+            pipeName(name);
+            self = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        }
+        WaitForSingleObject(waiter, INFINITE);
+        CloseHandle(waiter);
+        waiter = NULL;
+        if (self != INVALID_HANDLE_VALUE) CloseHandle(self);
+    }
+    if (h_pipe != INVALID_HANDLE_VALUE) CloseHandle(h_pipe);
+    h_pipe = INVALID_HANDLE_VALUE;
+    if (ev_parked) {
+        CloseHandle(ev_parked);
+        ev_parked = NULL;
+        DeleteCriticalSection(&cs_parked);
+    }
+    if (parked) list_delete(parked);
+    parked = NULL;
+}
@@ -1,36 +1,883 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <stdio.h>
 #include "../include/model.h"
+#include "../include/config.h"
+#include "../include/snapshot.h"
+#include "../include/search.h"
+#include "../../utils/include/lz.h"
 
-static List* client_list;
-static List* message_history;
+CRITICAL_SECTION cs_boards;
 
-List* getMessageHistory() {
-    return message_history;
+typedef struct RegistryStripe {
+    CRITICAL_SECTION cs;                // Lock for buckets of stripe and `sock` of its clients
+    Client **buckets;                   // Chains of clients by #id
+    DWORD n_buckets;                    // Power of 2
+    DWORD count;
+} RegistryStripe;
+
+static RegistryStripe registry[REGISTRY_STRIPES];      // Connected clients, stripe = #id % REGISTRY_STRIPES
+static HANDLE ev_left;                  // Set when the last connected client leaves
+static volatile LONG online;            // Connected clients
+static volatile LONG peak_online;
+static volatile LONG total_clients;     // Clients connected since start
+static List* boards;
+static List* sessions;                  // Saved Session's, oldest first
+static CRITICAL_SECTION cs_sessions;
+
+static volatile LONGLONG segment_serial;                // Last Segment.serial handed out
+static ULONGLONG history_serial;                        // Random, new on every start (caches of clients are dropped)
+
+static thread_local ULONGLONG cached_serial = 0;        // Last segment decompressed by this thread
+static thread_local char* cached_raw = NULL;
+
+#define isCompactable(m) ((m)->body_at == MSG_BODY_HEAP && (m)->msg_len <= SEGMENT_BODY_MAX)
+
+
+static Board* createBoard(const char* name, ULONGLONG retention) {
+    /**
+     * @brief Create empty board. Caller holds cs_boards
+     */
+    Board* b = calloc(1, sizeof(Board));
+    if (!b) return NULL;
+    b->history = calloc(HISTORY_RING_CHUNKS, sizeof(Message***));
+    b->index = newSearchIndex();
+    if (!b->history || !b->index) {
+        free((void*) b->history);
+        destroySearchIndex(b->index);
+        free(b);
+        return NULL;
+    }
+
+    strncpy(b->name, name, BOARD_NAME_LEN-1);
+    b->retention = retention;
+    b->first_id = 1;
+    b->segments = list();
+    b->subscribers = list();
+    InitializeCriticalSection(&b->cs_mh);
+    InitializeCriticalSection(&b->cs_compact);
+    list_append(boards, b);
+
+    fprintf(stderr, "[board] Created board '%s', retention %llu\r\n", b->name, retention);
+    return b;
+}
+
+static void removeSegment(Board* b, Segment* seg) {
+    /**
+     * @brief Free segment once all its messages are dropped. Caller holds b->cs_mh
+     */
+    Item *i, *prev = NULL;
+    for (i = b->segments->head; i != NULL; prev = i, i = i->next)
+        if (i->data == seg) {
+            list_popnext(b->segments, prev);
+            break;
+        }
+    if (!snapshotOwns(seg->buf)) free(seg->buf);
+    free(seg);
+}
+
+static void dropMessage(Board* b, Message* m) {
+    /**
+     * @brief Free message of board with its body. Caller holds b->cs_mh
+     */
+    if (m->body_at == MSG_BODY_SEGMENT) {
+        if (m->seg && --m->seg->msgs == 0) removeSegment(b, m->seg);
+        free(m);
+    }
+    else freeMessage(m);
+}
+
+static void destroyBoard(Board* b) {
+    Message* m;
+    for (ULONGLONG id = b->first_id; id <= (ULONGLONG) b->committed_ids; id++) {
+        m = getMessage(b, id);
+        if (m) dropMessage(b, m);
+    }
+    for (DWORD i = 0; i < HISTORY_RING_CHUNKS; i++) {
+        if (!b->history[i]) continue;
+        for (DWORD k = 0; k < HISTORY_CHUNK_BLOCKS; k++)
+            free((void*) b->history[i][k]);
+        free((void*) b->history[i]);
+    }
+    free((void*) b->history);
+
+    list_delete(b->segments);
+    destroySearchIndex(b->index);
+    while (b->subscribers->length) list_pop(b->subscribers, 0);
+    free(b->subscribers);
+    DeleteCriticalSection(&b->cs_mh);
+    DeleteCriticalSection(&b->cs_compact);
+    free(b);
+}
+
+void initBoards() {
+    /**
+     * @brief Create default board and boards from config (--board <name>[:<retention>])
+     */
+    ServerConfig* config = getConfig();
+    char name[BOARD_NAME_LEN];
+    const char* sep;
+    DWORD len;
+
+    unsigned int hi = 0, lo = 0;
+
+    InitializeCriticalSection(&cs_boards);
+    boards = list();
+    segment_serial = 0;
+    rand_s(&hi);
+    rand_s(&lo);
+    history_serial = (ULONGLONG) hi << 32 | lo;
+
+    EnterCriticalSection(&cs_boards);
+    createBoard(DEFAULT_BOARD, config->retention);
+    for (DWORD i = 0; i < config->n_boards; i++) {
+        sep = strchr(config->boards[i], ':');
+        len = sep ? (DWORD) (sep - config->boards[i]) : (DWORD) strlen(config->boards[i]);
+        if (len == 0 || len >= BOARD_NAME_LEN) continue;
+        memcpy(name, config->boards[i], len);
+        name[len] = '\0';
+        if (getBoard(name, FALSE)) continue;
+        createBoard(name, sep ? strtoull(sep+1, NULL, 10) : config->retention);
+    }
+    LeaveCriticalSection(&cs_boards);
+}
+
+ULONGLONG getHistorySerial() {
+    /**
+     * @brief Identifies this run of server: #ids client cached from another run may mean other messages
+     */
+    return history_serial;
+}
+
+void setHistorySerial(ULONGLONG serial) {
+    /**
+     * @brief Continue run of previous process (handoff): same history, caches of clients stay valid
+     */
+    history_serial = serial;
+}
+
+void destroyBoards() {
+    Board* b;
+    while ((b = list_pop(boards, 0)) != NULL)
+        destroyBoard(b);
+    free(boards);
+    releaseBodyCache();
+    DeleteCriticalSection(&cs_boards);
+}
+
+List* getBoardList() {
+    /**
+     * @brief All boards. Caller holds cs_boards
+     */
+    return boards;
+}
+
+Board* getBoard(const char* name, bool create) {
+    /**
+     * @brief Find board by name, or create it with default retention (up to BOARDS_MAX)
+     * @details Boards are never removed while server runs, so returned pointer stays valid.
+     */
+    Board* b = NULL;
+
+    EnterCriticalSection(&cs_boards);
+    for (Item* i = boards->head; i != NULL; i = i->next)
+        if (!strcmp(((Board*) i->data)->name, name)) {
+            b = i->data;
+            break;
+        }
+    if (!b && create && boards->length < BOARDS_MAX)
+        b = createBoard(name, getConfig()->retention);
+    LeaveCriticalSection(&cs_boards);
+    return b;
+}
+
+void joinBoard(Client* c, Board* b) {
+    /**
+     * @brief Move client from its board to board `b` (NULL = just leave)
+     * @details Delivery of `b` starts with its last `catchup` messages, older ones are paged with /older
+     */
+    Item *i, *prev = NULL;
+    ULONGLONG last, catchup = getConfig()->catchup;
+
+    EnterCriticalSection(&cs_boards);
+    if (c->board) {
+        for (i = c->board->subscribers->head; i != NULL; prev = i, i = i->next)
+            if (i->data == c) {
+                list_popnext(c->board->subscribers, prev);
+                break;
+            }
+    }
+    c->board = b;
+    c->cursor = 1;
+    if (b) {
+        last = getLastMessageId(b);
+        if (catchup && last > catchup) c->cursor = last - catchup + 1;
+        list_append(b->subscribers, c);
+    }
+    c->oldest = c->cursor;
+    LeaveCriticalSection(&cs_boards);
+}
+
+Message* newMessage(DWORD src_id, const char* body, DWORD len) {
+    /**
+     * @brief Text message stamped now, body is copied
+     * @details Body up to MSG_INLINE_MAX is stored right after header: one allocation, and sync
+     *  reads header and body from the same cache lines. Longer body gets its own allocation,
+     *  it may be compressed into a segment later (see compactMessageHistory()).
+     */
+    Message* m = malloc(sizeof(Message) + (len <= MSG_INLINE_MAX ? len + 1 : 0));
+    char* dst;
+
+    if (!m) return NULL;
+    memset(m, 0, sizeof(Message));
+    m->src_id = src_id;
+    m->msg_len = len;
+    m->msg_type = MSG_TYPE_MSG;
+    m->timestamp = nowStamp();
+    if (len <= MSG_INLINE_MAX) {
+        m->body_at = MSG_BODY_INLINE;
+        dst = m->text;
+    }
+    else {
+        m->body_at = MSG_BODY_HEAP;
+        dst = m->buf = malloc(len + 1);
+        if (!dst) { free(m); return NULL; }
+    }
+    memcpy(dst, body, len);
+    dst[len] = '\0';
+    return m;
+}
+
+Message* newFileMessage(DWORD src_id, const char* name, Blob* blob) {
+    /**
+     * @brief File message stamped now, takes over reference to `blob` (released if it fails)
+     * @details Name and content are in a side record: history scans touch only the header.
+     */
+    Message* m = calloc(1, sizeof(Message));
+    MessageFile* f = calloc(1, sizeof(MessageFile));
+
+    if (!m || !f) {
+        free(m);
+        free(f);
+        if (blob) unrefBlob(blob);
+        return NULL;
+    }
+    strncpy(f->name, name, FILE_NAME_LEN-1);
+    f->blob = blob;
+    m->src_id = src_id;
+    m->msg_type = MSG_TYPE_FILE;
+    m->body_at = MSG_BODY_FILE;
+    m->timestamp = nowStamp();
+    m->file = f;
+    return m;
+}
+
+Message* newJoinMessage(DWORD client_id) {
+    /**
+     * @brief System message announcing new client in its board
+     */
+    char text[sizeof(MSG_JOIN_TEXT) + 10];
+    sprintf(text, MSG_JOIN_TEXT, client_id);
+    return newMessage(USER_ID_SYSTEM, text, (DWORD) strlen(text));
+}
+
+void freeMessage(Message* m) {
+    /**
+     * @brief Free message that is not in a board (or dropped from it), with its body
+     */
+    if (!m) return;
+    if (m->body_at == MSG_BODY_HEAP && !snapshotOwns(m->buf)) free(m->buf);
+    else if (m->body_at == MSG_BODY_FILE) {
+        if (m->file->blob) unrefBlob(m->file->blob);
+        free(m->file);
+    }
+    free(m);
+}
+
+ULONGLONG nowStamp() {
+    /**
+     * @brief Local time as time stamp (without splitting it to SYSTEMTIME and back)
+     */
+    FILETIME utc, local;
+    GetSystemTimeAsFileTime(&utc);
+    if (!FileTimeToLocalFileTime(&utc, &local)) local = utc;
+    return (ULONGLONG) local.dwHighDateTime << 32 | local.dwLowDateTime;
+}
+
+ULONGLONG toStamp(const SYSTEMTIME* t) {
+    /**
+     * @brief Time stamp of local time `t` (records of log, snapshot and replication keep SYSTEMTIME)
+     */
+    FILETIME ft;
+    if (!SystemTimeToFileTime(t, &ft)) return 0;
+    return (ULONGLONG) ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+}
+
+void fromStamp(ULONGLONG stamp, SYSTEMTIME* t) {
+    FILETIME ft;
+    ft.dwLowDateTime = (DWORD) stamp;
+    ft.dwHighDateTime = (DWORD) (stamp >> 32);
+    if (!FileTimeToSystemTime(&ft, t)) memset(t, 0, sizeof(SYSTEMTIME));
+}
+
+static PVOID installBlock(PVOID volatile* entry, SIZE_T size) {
+    /**
+     * @brief Allocate zeroed block of `size` bytes into empty `entry`, unless another writer was first
+     */
+    PVOID block = calloc(1, size), prev;
+    if (!block) return NULL;
+    prev = InterlockedCompareExchangePointer(entry, block, NULL);
+    if (prev == NULL) return block;
+    free(block);
+    return prev;
+}
+
+static Message* volatile* getSlot(Board* b, ULONGLONG id, bool alloc) {
+    /**
+     * @brief Find slot of message #id, allocate its chunk and block if needed
+     * @details
+     *  #id picks chunk of ring, block of chunk and slot of block. Retention frees chunks
+     *  behind `first_id`, so #ids wrap around the ring for as long as the server runs.
+     *  Only a board keeping 2^40 messages at once runs out of slots.
+     */
+    ULONGLONG n = id - 1, k = n / HISTORY_BLOCK_MSGS, j = k / HISTORY_CHUNK_BLOCKS;
+    Message* volatile* volatile* volatile* entry;
+    Message* volatile* volatile* chunk;
+    Message* volatile* block;
+
+    // Entry of chunk is reused once the chunk a whole ring before is dropped
+    if (id == 0 || j >= (b->first_id - 1) / HISTORY_BLOCK_MSGS / HISTORY_CHUNK_BLOCKS + HISTORY_RING_CHUNKS) return NULL;
+    entry = &b->history[j % HISTORY_RING_CHUNKS];
+    chunk = *entry;
+    if (!chunk) {
+        if (!alloc) return NULL;
+        chunk = installBlock((PVOID volatile*) entry, HISTORY_CHUNK_BLOCKS * sizeof(Message**));
+        if (!chunk) return NULL;
+    }
+    block = chunk[k % HISTORY_CHUNK_BLOCKS];
+    if (!block) {
+        if (!alloc) return NULL;
+        block = installBlock((PVOID volatile*) &chunk[k % HISTORY_CHUNK_BLOCKS], HISTORY_BLOCK_MSGS * sizeof(Message*));
+        if (!block) return NULL;
+    }
+    return &block[n % HISTORY_BLOCK_MSGS];
+}
+
+void startBoardAt(Board* b, ULONGLONG first_id, ULONGLONG cold_count) {
+    /**
+     * @brief Make next appended message get #first_id (board restored from snapshot). Board must be empty
+     */
+    b->first_id = first_id;
+    b->cold_count = cold_count;
+    b->reserved_ids = b->committed_ids = b->durable_ids = (LONGLONG) first_id - 1;
+}
+
+Segment* adoptSegment(Board* b, char* buf, DWORD len, DWORD raw_len) {
+    /**
+     * @brief Add compressed segment restored from snapshot (not copied). Messages add themselves to `msgs`
+     */
+    Segment* seg = calloc(1, sizeof(Segment));
+    if (!seg) return NULL;
+    seg->serial = InterlockedIncrement64(&segment_serial);
+    seg->buf = buf;
+    seg->len = len;
+    seg->raw_len = raw_len;
+
+    EnterCriticalSection(&b->cs_mh);
+    list_append(b->segments, seg);
+    LeaveCriticalSection(&b->cs_mh);
+    return seg;
+}
+
+ULONGLONG appendMessage(Board* b, Message* m) {
+    /**
+     * @brief Add message to Message History of board and assign its #id
+     * @details
+     *  Lock-free for parallel writers: #id is reserved with one atomic increment and message
+     *  is stored in its own slot. Then committed prefix is moved over all filled slots,
+     *  so readers never see a gap. Whoever fills a slot last moves prefix over it.
+     *  Message must not be changed by caller after this (except body, by compaction).
+     *  Once #id is reserved, prefix cannot move past it until its slot is filled: if its block
+     *  cannot be allocated, writer waits until it can rather than leave a gap for good.
+     *
+     * @return #id of message (always added)
+     */
+    ULONGLONG id = InterlockedIncrement64(&b->reserved_ids);
+    Message* volatile* slot;
+    DWORD wait = 1;
+    LONGLONG c;
+
+    while ((slot = getSlot(b, id, TRUE)) == NULL) {
+        if (wait == 1)
+            fprintf(stderr, "[appendMessage] No memory for slot of message #%llu in board '%s', retrying\r\n", id, b->name);
+        Sleep(wait);
+        if (wait < HISTORY_RETRY_MS) wait *= 2;
+    }
+    m->msg_id = id;
+    InterlockedExchangePointer((PVOID volatile*) slot, (PVOID) m);
+
+    while (TRUE) {
+        c = InterlockedCompareExchange64(&b->committed_ids, 0, 0);
+        slot = getSlot(b, c + 1, FALSE);
+        if (!slot || !*slot) break;
+        InterlockedCompareExchange64(&b->committed_ids, c + 1, c);
+    }
+    return id;
+}
+
+ULONGLONG getLastMessageId(Board* b) {
+    /**
+     * @brief #id of the last message of committed prefix (0 if history is empty)
+     */
+    return (ULONGLONG) InterlockedCompareExchange64(&b->committed_ids, 0, 0);
+}
+
+ULONGLONG getDurableMessageId(Board* b) {
+    /**
+     * @brief #id of the last message a crash of server cannot renumber: end of logged prefix with --wal
+     */
+    if (!getConfig()->wal) return getLastMessageId(b);
+    return (ULONGLONG) InterlockedCompareExchange64(&b->durable_ids, 0, 0);
+}
+
+Message* getMessage(Board* b, ULONGLONG id) {
+    /**
+     * @brief Find message by #id in O(1). NULL if there is no such message (yet, or anymore)
+     * @details Caller holds b->cs_mh: old messages may be dropped by retention.
+     */
+    if (id < b->first_id || id > getLastMessageId(b)) return NULL;
+    return *getSlot(b, id, FALSE);
+}
+
+static void trimMessageHistory(Board* b) {
+    /**
+     * @brief Drop oldest messages beyond retention of board. Caller holds b->cs_compact
+     */
+    Message* volatile* slot;
+    Message* volatile* volatile* chunk;
+    ULONGLONG k;
+
+    if (!b->retention) return;
+
+    EnterCriticalSection(&b->cs_mh);
+    while (getLastMessageId(b) - b->first_id + 1 > b->retention) {
+        slot = getSlot(b, b->first_id, FALSE);
+        dropMessage(b, *slot);
+        *slot = NULL;
+
+        // Last slot of block: block is not needed anymore, nor is chunk after its last block.
+        // Freed before `first_id` moves on: writers reuse the entry once they see it move
+        if (b->first_id % HISTORY_BLOCK_MSGS == 0) {
+            k = (b->first_id - 1) / HISTORY_BLOCK_MSGS;
+            chunk = b->history[k / HISTORY_CHUNK_BLOCKS % HISTORY_RING_CHUNKS];
+            free((void*) chunk[k % HISTORY_CHUNK_BLOCKS]);
+            chunk[k % HISTORY_CHUNK_BLOCKS] = NULL;
+            if ((k + 1) % HISTORY_CHUNK_BLOCKS == 0) {
+                b->history[k / HISTORY_CHUNK_BLOCKS % HISTORY_RING_CHUNKS] = NULL;
+                free((void*) chunk);
+            }
+        }
+        MemoryBarrier();
+        b->first_id++;
+    }
+    LeaveCriticalSection(&b->cs_mh);
+}
+
+void compactMessageHistory(Board* b) {
+    /**
+     * @brief Apply retention, then compress text bodies of cold messages in segments of SEGMENT_MSGS
+     * @details
+     *  Called after append. The last `hot_messages` messages always stay raw, as do short
+     *  bodies stored inside their Message (nothing to free).
+     *  Bodies of a segment are concatenated and compressed together (small chats compress
+     *  poorly one by one), then raw bodies are freed. Files are not touched, see blob store.
+     *  Compression itself runs outside of cs_mh; bodies change only here, and only under cs_mh.
+     */
+    ServerConfig* config = getConfig();
+    ULONGLONG first, id;
+    Message* m;
+    Segment* seg;
+    DWORD raw_len, off, len;
+    char *raw, *lz;
+
+    if (!b->retention && !config->compress_history) return;
+    if (!TryEnterCriticalSection(&b->cs_compact)) return;
+
+    trimMessageHistory(b);
+    if (b->cold_count < b->first_id - 1) b->cold_count = b->first_id - 1;
+
+    while (config->compress_history && getLastMessageId(b) >= b->cold_count + config->hot_messages + SEGMENT_MSGS) {
+        // Collect next segment of cold messages
+        first = b->cold_count + 1;
+        raw_len = 0;
+        for (id = first; id < first + SEGMENT_MSGS; id++) {
+            m = getMessage(b, id);
+            if (isCompactable(m)) raw_len += (DWORD) m->msg_len;
+        }
+
+        raw = malloc(raw_len ? raw_len : 1);
+        lz = malloc(raw_len ? raw_len : 1);
+        seg = calloc(1, sizeof(Segment));
+        if (!raw || !lz || !seg) { free(raw); free(lz); free(seg); break; }
+
+        for (id = first, off = 0; id < first + SEGMENT_MSGS; id++) {
+            m = getMessage(b, id);
+            if (isCompactable(m)) {
+                memcpy(raw + off, m->buf, m->msg_len);
+                off += (DWORD) m->msg_len;
+            }
+        }
+        len = lz_compress(raw, raw_len, lz, raw_len - raw_len / 8);
+        free(raw);
+
+        EnterCriticalSection(&b->cs_mh);
+        if (len) {
+            // Worth it: switch messages to segment and free raw bodies
+            seg->serial = InterlockedIncrement64(&segment_serial);
+            seg->raw_len = raw_len;
+            seg->len = len;
+            seg->buf = realloc(lz, len);
+            if (!seg->buf) seg->buf = lz;
+            for (id = first, off = 0; id < first + SEGMENT_MSGS; id++) {
+                m = getMessage(b, id);
+                if (isCompactable(m)) {
+                    if (!snapshotOwns(m->buf)) free(m->buf);
+                    m->body_at = MSG_BODY_SEGMENT;
+                    m->seg = seg;
+                    m->seg_off = off;
+                    off += (DWORD) m->msg_len;
+                    seg->msgs++;
+                }
+            }
+            list_append(b->segments, seg);
+        }
+        else {
+            free(lz);
+            free(seg);
+        }
+        b->cold_count += SEGMENT_MSGS;
+        LeaveCriticalSection(&b->cs_mh);
+
+        fprintf(stderr, "[compactHistory] Board '%s', segment of %d messages: %lu -> %lu bytes\r\n", b->name, SEGMENT_MSGS, raw_len, len ? len : raw_len);
+    }
+
+    LeaveCriticalSection(&b->cs_compact);
+}
+
+const char* getMessageBody(Message* m) {
+    /**
+     * @brief Get message body, decompressing its segment if message is cold
+     * @details
+     *  Cold body stays valid until next call in the same thread.
+     *  Last segment is cached per thread, so a sync decompresses each segment once.
+     *  Caller holds cs_mh of message's board.
+     */
+    char* tmp;
+
+    switch (m->body_at) {
+        case MSG_BODY_INLINE: return m->text;
+        case MSG_BODY_HEAP: return m->buf;
+        case MSG_BODY_FILE: return m->file->blob ? m->file->blob->buf : NULL;
+    }
+    if (!m->seg) return NULL;
+
+    if (cached_serial != m->seg->serial) {
+        tmp = realloc(cached_raw, m->seg->raw_len);
+        if (!tmp) return NULL;
+        cached_raw = tmp;
+        if (lz_decompress(m->seg->buf, m->seg->len, cached_raw, m->seg->raw_len) != (int) m->seg->raw_len) {
+            cached_serial = 0;
+            return NULL;
+        }
+        cached_serial = m->seg->serial;
+    }
+    return cached_raw + m->seg_off;
+}
+
+void releaseBodyCache() {
+    free(cached_raw);
+    cached_raw = NULL;
+    cached_serial = 0;
+}
+
+void getHistoryStats(Board* b, HistoryStats* st) {
+    Segment* seg;
+    memset(st, 0, sizeof(HistoryStats));
+
+    EnterCriticalSection(&b->cs_mh);
+    st->first_id = b->first_id;
+    st->last_id = getLastMessageId(b);
+    for (Item* i = b->segments->head; i != NULL; i = i->next) {
+        seg = i->data;
+        st->segments++;
+        st->cold_msgs += seg->msgs;
+        st->raw_bytes += seg->raw_len;
+        st->stored_bytes += seg->len;
+    }
+    LeaveCriticalSection(&b->cs_mh);
+
+    EnterCriticalSection(&cs_boards);
+    st->subscribers = b->subscribers->length;
+    LeaveCriticalSection(&cs_boards);
+}
+
+#define stripeOf(c) (&registry[(c)->id % REGISTRY_STRIPES])
+#define bucketOf(st, c) (&(st)->buckets[((c)->id / REGISTRY_STRIPES) & ((st)->n_buckets - 1)])
+
+void initClientRegistry() {
+    for (DWORD i = 0; i < REGISTRY_STRIPES; i++) {
+        InitializeCriticalSection(&registry[i].cs);
+        registry[i].buckets = calloc(REGISTRY_BUCKETS_INIT, sizeof(Client*));
+        registry[i].n_buckets = registry[i].buckets ? REGISTRY_BUCKETS_INIT : 0;
+        registry[i].count = 0;
+    }
+    online = peak_online = total_clients = 0;
+    ev_left = CreateEventA(NULL, FALSE, FALSE, NULL);
+}
+
+void destroyClientRegistry() {
+    if (!ev_left) return;
+    for (DWORD i = 0; i < REGISTRY_STRIPES; i++) {
+        free(registry[i].buckets);
+        registry[i].buckets = NULL;
+        DeleteCriticalSection(&registry[i].cs);
+    }
+    CloseHandle(ev_left);
+    ev_left = NULL;
+}
+
+static void growStripe(RegistryStripe* st) {
+    /**
+     * @brief Double buckets of stripe, rehash its clients. Caller holds st->cs
+     */
+    Client **old = st->buckets, *c, *next, **bucket;
+    DWORD n_old = st->n_buckets;
+
+    st->buckets = calloc(n_old * 2, sizeof(Client*));
+    if (!st->buckets) {
+        // Keep longer chains rather than fail
+        st->buckets = old;
+        return;
+    }
+    st->n_buckets = n_old * 2;
+    for (DWORD i = 0; i < n_old; i++)
+        for (c = old[i]; c != NULL; c = next) {
+            next = c->reg_next;
+            bucket = bucketOf(st, c);
+            c->reg_next = *bucket;
+            *bucket = c;
+        }
+    free(old);
+}
+
+bool registerClient(Client* c) {
+    /**
+     * @brief Add connected client to registry
+     * @details Each stripe has its own lock, so clients connecting and leaving rarely wait for each other.
+     */
+    RegistryStripe* st = stripeOf(c);
+    Client** bucket;
+    LONG n, peak;
+
+    EnterCriticalSection(&st->cs);
+    if (!st->buckets) {
+        LeaveCriticalSection(&st->cs);
+        return FALSE;
+    }
+    if (st->count >= st->n_buckets * 2) growStripe(st);
+    bucket = bucketOf(st, c);
+    c->reg_next = *bucket;
+    *bucket = c;
+    st->count++;
+    LeaveCriticalSection(&st->cs);
+
+    InterlockedIncrement(&total_clients);
+    n = InterlockedIncrement(&online);
+    while ((peak = peak_online) < n && InterlockedCompareExchange(&peak_online, n, peak) != peak);
+    return TRUE;
+}
+
+void unregisterClient(Client* c) {
+    /**
+     * @brief Remove client from registry. After that shutdown no longer touches it and it can be freed
+     */
+    RegistryStripe* st = stripeOf(c);
+    Client** p;
+
+    EnterCriticalSection(&st->cs);
+    for (p = bucketOf(st, c); *p != NULL; p = &(*p)->reg_next)
+        if (*p == c) {
+            *p = c->reg_next;
+            st->count--;
+            break;
+        }
+    LeaveCriticalSection(&st->cs);
+
+    if (InterlockedDecrement(&online) == 0) SetEvent(ev_left);
+}
+
+void closeClientSocket(Client* c) {
+    /**
+     * @brief Close socket of client
+     */
+    SOCKET sock = takeClientSocket(c);
+
+    if (sock != INVALID_SOCKET) {
+        shutdown(sock, SD_BOTH);
+        closesocket(sock);
+    }
+}
+
+SOCKET takeClientSocket(Client* c) {
+    /**
+     * @brief Take socket away from client (INVALID_SOCKET if it is closed already)
+     * @details Socket is taken under lock of stripe, so disconnectAllClients() never shuts down a closed
+     *  handle, and parkAllClients() never notices a client whose multiplexer is being closed.
+     */
+    RegistryStripe* st = stripeOf(c);
+    SOCKET sock;
+
+    EnterCriticalSection(&st->cs);
+    sock = c->sock;
+    c->sock = INVALID_SOCKET;
+    LeaveCriticalSection(&st->cs);
+    return sock;
 }
 
-List* initMessageHistory() {
-    message_history = list();
-    return message_history;
+void disconnectAllClients() {
+    /**
+     * @brief Shut down sockets of connected clients, their threads then close them and leave
+     * @details Walks only clients that are still connected.
+     */
+    Client* c;
+
+    if (!ev_left) return;
+    for (DWORD i = 0; i < REGISTRY_STRIPES; i++) {
+        EnterCriticalSection(&registry[i].cs);
+        for (DWORD j = 0; j < registry[i].n_buckets; j++)
+            for (c = registry[i].buckets[j]; c != NULL; c = c->reg_next)
+                if (c->sock != INVALID_SOCKET) {
+                    shutdown(c->sock, SD_BOTH);
+                    fprintf(stderr, "[closeServer] Disconnected client #%lu\r\n", c->id);
+                }
+        LeaveCriticalSection(&registry[i].cs);
+    }
 }
 
-void destroyMessageHistory() {
-    for (Item* i = message_history->head; i != NULL; i = i->next) {
-        Message* m = (Message*) i->data;
-        if (m->buf) free(m->buf);
+DWORD parkAllClients(const char* notice) {
+    /**
+     * @brief Send `notice` to connected clients (not replicas) on MUX_STREAM_NOTICE, mark them `parking`
+     * @return Number of clients noticed
+     */
+    Client* c;
+    DWORD n = 0;
+
+    if (!ev_left) return 0;
+    for (DWORD i = 0; i < REGISTRY_STRIPES; i++) {
+        EnterCriticalSection(&registry[i].cs);
+        for (DWORD j = 0; j < registry[i].n_buckets; j++)
+            for (c = registry[i].buckets[j]; c != NULL; c = c->reg_next)
+                if (c->sock != INVALID_SOCKET && c->mux && !c->repl) {
+                    // Marked first: the answer may arrive before mux_send() returns
+                    c->parking = TRUE;
+                    if (mux_send(c->mux, MUX_STREAM_NOTICE, notice, strlen(notice)+1, TRUE)) n++;
+                    else c->parking = FALSE;
+                }
+        LeaveCriticalSection(&registry[i].cs);
     }
-    list_delete(message_history);
+    return n;
+}
+
+void waitClientsLeft() {
+    /**
+     * @brief Wait until every registered client has left
+     */
+    while (online > 0)
+        WaitForSingleObject(ev_left, INFINITE);
+}
+
+void getClientStats(ClientStats* st) {
+    st->online = online;
+    st->peak = peak_online;
+    st->total = total_clients;
+}
+
+void initSessions() {
+    sessions = list();
+    InitializeCriticalSection(&cs_sessions);
+}
+
+void destroySessions() {
+    list_delete(sessions);
+    DeleteCriticalSection(&cs_sessions);
+}
+
+void newSessionToken(char* token) {
+    /**
+     * @brief Generate random resume token (16 hex digits)
+     */
+    unsigned int hi = 0, lo = 0;
+    rand_s(&hi);
+    rand_s(&lo);
+    sprintf(token, "%08x%08x", hi, lo);
 }
 
-List* getClientList() {
-    return client_list;
+void saveSession(Client* c) {
+    /**
+     * @brief Keep board and delivery cursor of disconnecting client, so it can resume with its token
+     */
+    if (!c->token[0] || !c->board) return;
+    addSession(c->token, c->board, c->cursor, c->oldest);
 }
 
-List* initClientList() {
-    client_list = list();
-    return client_list;
+void addSession(const char* token, Board* b, ULONGLONG cursor, ULONGLONG oldest) {
+    /**
+     * @brief Add resumable session (disconnected client, or restored from snapshot)
+     * @details Only SESSIONS_MAX last sessions are kept, oldest ones are forgotten.
+     */
+    Session* s = calloc(1, sizeof(Session));
+    if (!s) return;
+    strncpy(s->token, token, TOKEN_LEN-1);
+    s->board = b;
+    s->cursor = cursor;
+    s->oldest = oldest;
+
+    EnterCriticalSection(&cs_sessions);
+    list_append(sessions, s);
+    if (sessions->length > SESSIONS_MAX)
+        free(list_pop(sessions, 0));
+    LeaveCriticalSection(&cs_sessions);
+}
+
+List* getSessionList() {
+    /**
+     * @brief Saved sessions, oldest first. Only for snapshot, when no client is connected
+     */
+    return sessions;
 }
 
-void destroyClientList() {
-    list_delete(client_list);
+bool restoreSession(Client* c, const char* token) {
+    /**
+     * @brief Find saved session by token, move client to its board and cursor. Session is used up
+     */
+    Session* s = NULL;
+    Item *i, *prev = NULL;
+
+    EnterCriticalSection(&cs_sessions);
+    for (i = sessions->head; i != NULL; prev = i, i = i->next)
+        if (!strcmp(((Session*) i->data)->token, token)) {
+            s = list_popnext(sessions, prev);
+            break;
+        }
+    LeaveCriticalSection(&cs_sessions);
+    if (!s) return FALSE;
+
+    joinBoard(c, s->board);
+    c->cursor = s->cursor;
+    c->oldest = s->oldest;
+    strcpy(c->token, s->token);
+    free(s);
+    return TRUE;
 }
 
 void printLastError() {
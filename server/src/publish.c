@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/publish.h"
+#include "../include/config.h"
+
+static Ring* ring;
+static CRITICAL_SECTION cs_ring;        // One writer at a time
+static RingStats ring_stats;
+
+
+bool openRing() {
+    /**
+     * @brief Create the ring of --ring
+     * @return FALSE if it cannot be created: consumers expect it, server should not start without it
+     */
+    ServerConfig* config = getConfig();
+
+    if (!config->ring) return TRUE;
+
+    ring = ring_create(config->ring, (ULONGLONG) config->ring_size << 20);
+    if (!ring) {
+        fprintf(stderr, "[ring] Failed to create ring '%s': code %lu\r\n", config->ring, GetLastError());
+        return FALSE;
+    }
+    InitializeCriticalSection(&cs_ring);
+    memset(&ring_stats, 0, sizeof(RingStats));
+    ring_stats.size = ring->hdr->size;
+    fprintf(stderr, "[ring] Publishing messages to '%s' (%llu bytes)\r\n", config->ring, ring_stats.size);
+    return TRUE;
+}
+
+void publishMessage(Board* b, Message* m) {
+    /**
+     * @brief Copy message just added to board into the ring, wake consumers
+     * @details Body is copied straight from Message History: it may be compacted or dropped
+     *  by retention meanwhile, so board lock is held (ring lock nests inside it).
+     */
+    RingRecord rec = {0};
+    const char* body;
+    ULONGLONG head;
+
+    if (!ring) return;
+
+    rec.type = m->msg_type;
+    rec.msg_id = m->msg_id;
+    rec.msg_len = messageLen(m);
+    rec.src_id = m->src_id;
+    fromStamp(m->timestamp, &rec.timestamp);
+    strcpy(rec.board, b->name);
+
+    EnterCriticalSection(&b->cs_mh);
+    if (m->msg_id < b->first_id) {
+        LeaveCriticalSection(&b->cs_mh);
+        return;
+    }
+    if (m->msg_type == MSG_TYPE_FILE) {
+        body = m->file->name;
+        rec.body_len = strlen(m->file->name);
+    }
+    else {
+        body = getMessageBody(m);
+        rec.body_len = m->msg_len;
+    }
+
+    EnterCriticalSection(&cs_ring);
+    head = ring->hdr->head;
+    ring_write(ring, &rec, body);
+    ring_stats.records++;
+    ring_stats.bytes += ring->hdr->head - head;
+    if (m->msg_type != MSG_TYPE_FILE && rec.body_len < m->msg_len) ring_stats.cut++;
+    LeaveCriticalSection(&cs_ring);
+    LeaveCriticalSection(&b->cs_mh);
+}
+
+void closeRing() {
+    /**
+     * @brief Unmap the ring. Consumers keep their mapping: ring lives until the last one closes it
+     */
+    if (!ring) return;
+    ring_close(ring);
+    ring = NULL;
+    DeleteCriticalSection(&cs_ring);
+}
+
+bool getRingStats(RingStats* st) {
+    /**
+     * @brief Counters of ring since start. FALSE if ring is disabled
+     */
+    if (!ring) return FALSE;
+    EnterCriticalSection(&cs_ring);
+    *st = ring_stats;
+    LeaveCriticalSection(&cs_ring);
+    return TRUE;
+}
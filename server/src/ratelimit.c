@@ -0,0 +1,45 @@
+#include <math.h>
+#include "../include/ratelimit.h"
+
+static volatile LONGLONG total_throttled;
+static volatile LONGLONG total_waited_ms;
+
+
+void initBucket(TokenBucket* tb, double rate, double burst) {
+    /**
+     * @brief Full bucket. Burst defaults to one second of rate
+     */
+    tb->rate = rate > 0 ? rate : 0;
+    tb->burst = burst > 0 ? burst : tb->rate;
+    tb->tokens = tb->burst;
+    tb->last_ms = GetTickCount64();
+}
+
+DWORD takeTokens(TokenBucket* tb, double n) {
+    /**
+     * @brief Take `n` tokens (bucket may go into debt)
+     * @return milliseconds to wait until debt is repaid, 0 if there was enough
+     */
+    ULONGLONG now;
+
+    if (tb->rate == 0) return 0;
+
+    now = GetTickCount64();
+    tb->tokens += (double) (now - tb->last_ms) * tb->rate / 1000.0;
+    if (tb->tokens > tb->burst) tb->tokens = tb->burst;
+    tb->last_ms = now;
+
+    tb->tokens -= n;
+    if (tb->tokens >= 0) return 0;
+    return (DWORD) ceil(-tb->tokens * 1000.0 / tb->rate);
+}
+
+void countThrottle(DWORD ms) {
+    InterlockedIncrement64(&total_throttled);
+    InterlockedAdd64(&total_waited_ms, ms);
+}
+
+void getRateStats(RateStats* st) {
+    st->throttled = (ULONGLONG) InterlockedCompareExchange64(&total_throttled, 0, 0);
+    st->waited_ms = (ULONGLONG) InterlockedCompareExchange64(&total_waited_ms, 0, 0);
+}
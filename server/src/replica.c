@@ -0,0 +1,805 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ws2tcpip.h>
+#include "../include/replica.h"
+#include "../include/config.h"
+#include "../include/service.h"
+#include "../include/snapshot.h"
+#include "../../utils/include/recvbuf.h"
+#include "../../utils/include/chacha.h"
+
+#define REPL_HOST_LEN 256
+
+typedef struct ReplCursor {
+    Board *b;
+    ULONGLONG next;                     // Next #id to push
+} ReplCursor;
+
+typedef struct ReplicaLink {
+    Client *c;                          // Connection of replica
+    DWORD stream_id;                    // Stream of /replicate, records go there
+    HANDLE pusher;                      // pusherThread()
+    volatile bool stop;
+    char names[BOARDS_MAX][BOARD_NAME_LEN];     // Positions replica asked for
+    ULONGLONG last[BOARDS_MAX];
+    DWORD n_positions;
+    ULONGLONG tail;                     // Messages per board replica keeps (0 = all)
+    DWORD id_base, id_count;            // Client #ids of replica, senders of its /fwd records
+    ReplCursor cursors[BOARDS_MAX];
+    DWORD n_cursors;
+    ULONGLONG queued;                   // Bytes queued to mux
+    ULONGLONG raw_base;                 // mux->bytes_raw when replication started
+    volatile ULONGLONG sent;            // Records queued
+    volatile ULONGLONG acked;           // Records replica processed (/replack)
+    volatile ULONGLONG lag_ms;          // Delay of the last one, as replica reported
+    volatile ULONGLONG pending;         // Committed messages not queued yet, after the last pass
+} ReplicaLink;
+
+// Primary: connected replicas
+static CRITICAL_SECTION cs_repl;        // Lock for `links` and `repl_seq`
+static CONDITION_VARIABLE cv_repl;      // Signaled when a message is committed
+static List* links;
+static volatile LONG n_links;
+static ULONGLONG repl_seq;              // Commits so far (pushers sleep until it changes)
+static BYTE repl_key[CHACHA_KEY_LEN];   // --repl-key, proved by replicas (and by us, to our primary)
+
+// Replica: connection to primary
+static char up_host[REPL_HOST_LEN];
+static const char* up_port;
+static CRITICAL_SECTION cs_up;          // Lock for `up_mux` and `up_sock`
+static Mux* up_mux;                     // NULL while disconnected
+static SOCKET up_sock = INVALID_SOCKET;
+static HANDLE up_thread;                // upstreamThread()
+static HANDLE ev_hello;                 // Set when primary first accepted replica
+static volatile bool up_stop;
+static volatile LONG id_base;
+static volatile LONG id_count;          // Client #ids of this replica are id_base + 1 ... id_base + id_count
+static ReplStats up_stats;
+
+
+static void parsePositions(ReplicaLink* l, const char* positions) {
+    /**
+     * @brief "[~<kept>] <board> <last #id> ..." of /replauth
+     */
+    const char* p = positions;
+    char* end;
+    int n;
+
+    while (*p == ' ') p++;
+    if (*p == '~') {
+        l->tail = strtoull(p + 1, &end, 10);
+        p = end;
+    }
+
+    while (l->n_positions < BOARDS_MAX) {
+        while (*p == ' ') p++;
+        n = (int) strcspn(p, " ");
+        if (!n || n >= BOARD_NAME_LEN) break;
+        memcpy(l->names[l->n_positions], p, n);
+        l->names[l->n_positions][n] = '\0';
+        p += n;
+        l->last[l->n_positions] = strtoull(p, &end, 10);
+        if (end == p) break;
+        p = end;
+        l->n_positions++;
+    }
+}
+
+static ReplCursor* findCursor(ReplicaLink* l, Board* b) {
+    /**
+     * @brief Push position of board. A board seen first starts after what replica has of it
+     */
+    ReplCursor* cur;
+    ULONGLONG last;
+
+    for (DWORD i = 0; i < l->n_cursors; i++)
+        if (l->cursors[i].b == b) return &l->cursors[i];
+    if (l->n_cursors == BOARDS_MAX) return NULL;
+
+    cur = &l->cursors[l->n_cursors++];
+    cur->b = b;
+    cur->next = 1;
+    last = getLastMessageId(b);
+    for (DWORD i = 0; i < l->n_positions; i++)
+        if (!strcmp(l->names[i], b->name)) {
+            cur->next = l->last[i] + 1;
+            if (l->last[i] > last)
+                fprintf(stderr, "[repl] Replica of client #%lu is ahead of primary in board '%s' (#%llu)\r\n", l->c->id, b->name, l->last[i]);
+            break;
+        }
+
+    // Relay would drop older ones by retention at once
+    if (l->tail && last >= l->tail && cur->next + l->tail <= last) cur->next = last - l->tail + 1;
+    return cur;
+}
+
+static void pushRecord(ReplicaLink* l, Board* b, ULONGLONG id, ULONGLONG head_id) {
+    /**
+     * @brief Queue message #id of board to replica. File content is queued by reference
+     */
+    Mux* mux = l->c->mux;
+    Message* m;
+    ReplFrame* f;
+    WalRecord* rec;
+    Blob* blob = NULL;
+    const char* body;
+    ULONGLONG body_len, len;
+    char* buf;
+
+    EnterCriticalSection(&b->cs_mh);
+    m = getMessage(b, id);
+    if (!m) {
+        // Dropped by retention meanwhile
+        LeaveCriticalSection(&b->cs_mh);
+        return;
+    }
+    blob = messageBlob(m);
+    body = blob ? NULL : getMessageBody(m);
+    body_len = blob || body ? messageLen(m) : 0;
+    len = sizeof(ReplFrame) + sizeof(WalRecord) + (blob ? 0 : body_len);
+    buf = calloc(1, len);
+    if (!buf) {
+        LeaveCriticalSection(&b->cs_mh);
+        return;
+    }
+    f = (ReplFrame*) buf;
+    f->kind = REPL_RECORD;
+    f->head_id = head_id;
+    rec = (WalRecord*) (f + 1);
+    strcpy(rec->board, b->name);
+    rec->msg_id = id;
+    rec->msg_len = body_len;
+    rec->src_id = m->src_id;
+    rec->msg_type = m->msg_type;
+    strcpy(rec->file_name, messageFileName(m));
+    fromStamp(m->timestamp, &rec->timestamp);
+    if (blob) holdBlob(blob);
+    else if (body_len) memcpy(rec + 1, body, body_len);
+    LeaveCriticalSection(&b->cs_mh);
+
+    mux_sendref(mux, l->stream_id, buf, len, blob == NULL, free, buf);
+    if (blob) mux_sendref(mux, l->stream_id, blob->buf, body_len, TRUE, (void (*)(void*)) releaseBlob, blob);
+    l->queued += len + (blob ? body_len : 0);
+    l->sent++;
+}
+
+static bool windowFull(ReplicaLink* l) {
+    /**
+     * @brief REPL_WINDOW bytes are queued and not sent yet
+     */
+    ULONGLONG sent = l->c->mux->bytes_raw - l->raw_base;
+    return l->queued > sent && l->queued - sent >= REPL_WINDOW;
+}
+
+static bool pushBoards(ReplicaLink* l) {
+    /**
+     * @brief Queue committed messages of all boards that replica does not have yet (with --wal, logged ones)
+     * @return TRUE if window filled up before everything was queued
+     */
+    Board* boards[BOARDS_MAX];
+    ReplCursor* cur;
+    DWORD n = 0;
+    ULONGLONG last, pending = 0;
+    bool full = FALSE;
+
+    EnterCriticalSection(&cs_boards);
+    for (Item* i = getBoardList()->head; i != NULL && n < BOARDS_MAX; i = i->next)
+        boards[n++] = i->data;
+    LeaveCriticalSection(&cs_boards);
+
+    for (DWORD i = 0; i < n; i++) {
+        cur = findCursor(l, boards[i]);
+        if (!cur) continue;
+        last = getDurableMessageId(boards[i]);
+        if (cur->next < boards[i]->first_id) cur->next = boards[i]->first_id;
+        for (; cur->next <= last && !full && !l->stop; cur->next++) {
+            if (windowFull(l)) {
+                full = TRUE;
+                break;
+            }
+            pushRecord(l, boards[i], cur->next, last);
+        }
+        if (cur->next <= last) pending += last + 1 - cur->next;
+    }
+    l->pending = pending;
+    return full;
+}
+
+static void pusherThread(ReplicaLink* l) {
+    /**
+     * @brief Push new messages to replica as they are committed
+     * @details Sleeps until a commit (notifyReplicas()) or REPL_WAIT_MS. Queues up to REPL_WINDOW bytes
+     *  ahead of the socket, so a slow replica holds that much memory of primary at most.
+     *  Woken by nothing: sends REPL_BEAT, which replica answers with /replack.
+     */
+    ReplFrame beat = {.kind = REPL_BEAT};
+    ULONGLONG seq;
+    bool idle;
+
+    while (!l->stop && !l->c->mux->dead) {
+        EnterCriticalSection(&cs_repl);
+        seq = repl_seq;
+        LeaveCriticalSection(&cs_repl);
+
+        if (pushBoards(l)) {
+            Sleep(REPL_DRAIN_MS);
+            continue;
+        }
+
+        EnterCriticalSection(&cs_repl);
+        idle = !l->stop && seq == repl_seq && !SleepConditionVariableCS(&cv_repl, &cs_repl, REPL_WAIT_MS) && seq == repl_seq;
+        LeaveCriticalSection(&cs_repl);
+
+        if (idle && mux_send(l->c->mux, l->stream_id, (const char*) &beat, sizeof(beat), TRUE))
+            l->queued += sizeof(beat);
+    }
+}
+
+void initReplication() {
+    InitializeCriticalSection(&cs_repl);
+    InitializeConditionVariable(&cv_repl);
+    links = list();
+    n_links = 0;
+    repl_seq = 0;
+}
+
+void destroyReplication() {
+    free(links);
+    links = NULL;
+    DeleteCriticalSection(&cs_repl);
+}
+
+static void makeProof(ULONGLONG nonce, char* hex) {
+    /**
+     * @brief Answer to challenge: REPL_PROOF_LEN bytes of key stream of --repl-key for `nonce`, in hex
+     */
+    char stream[REPL_PROOF_LEN] = {0};
+
+    chacha_xor(repl_key, nonce, stream, REPL_PROOF_LEN);
+    for (DWORD i = 0; i < REPL_PROOF_LEN; i++)
+        sprintf(hex + 2*i, "%02x", (BYTE) stream[i]);
+}
+
+static bool reserveReplicaIds(volatile LONG* counter, DWORD* base, DWORD* count) {
+    /**
+     * @brief Block of client #ids for a new replica, taken from `counter` of #ids this server gives
+     * @details Primary gives REPLICA_ID_BLOCK, a replica (relay in a tree) 1/REPL_FANOUT of its own block.
+     *  #ids are never reused, so a block that would run past the last #id is refused and nothing is taken.
+     * @return FALSE if there are no #ids to spare
+     */
+    ULONGLONG limit = isReplica() ? (DWORD) id_count : MAXLONG;
+    LONG first;
+
+    *count = isReplica() ? (DWORD) id_count / REPL_FANOUT : REPLICA_ID_BLOCK;
+    if (!*count) return FALSE;
+    do {
+        first = *counter;
+        if ((ULONGLONG) first + *count > limit) return FALSE;
+    } while (InterlockedCompareExchange(counter, first + (LONG) *count, first) != first);
+    *base = (DWORD) id_base + (DWORD) first;
+    return TRUE;
+}
+
+static void denyReplica(Client* c, DWORD stream_id, const char* reason) {
+    ReplFrame f = {0};
+
+    f.kind = REPL_DENIED;
+    mux_send(c->mux, stream_id, (const char*) &f, sizeof(f), TRUE);
+    fprintf(stderr, "[repl] Client #%lu is not a replica: %s\r\n", c->id, reason);
+}
+
+bool challengeReplica(Client* c, DWORD stream_id) {
+    /**
+     * @brief Primary: /replicate. Send random nonce, replica proves --repl-key with /replauth
+     * @return FALSE if replication is refused (no --repl-key here)
+     */
+    ReplFrame f = {0};
+    unsigned int hi = 0, lo = 0;
+
+    if (c->repl || !getConfig()->repl_key || rand_s(&hi) || rand_s(&lo)) {
+        denyReplica(c, stream_id, c->repl ? "replicates already" : "replication is off (--repl-key)");
+        return FALSE;
+    }
+    c->repl_nonce = ((ULONGLONG) hi << 32 | lo) | 1;
+    f.kind = REPL_CHALLENGE;
+    f.head_id = c->repl_nonce;
+    mux_send(c->mux, stream_id, (const char*) &f, sizeof(f), TRUE);
+    return TRUE;
+}
+
+static bool startReplication(Client* c, DWORD stream_id, const char* positions, DWORD base, DWORD count) {
+    /**
+     * @brief Primary: client is a replica, push committed messages to it from its positions on
+     */
+    ReplicaLink* l;
+    ReplFrame hello = {0};
+    DWORD dwt;
+
+    if (c->repl) return FALSE;
+    l = calloc(1, sizeof(ReplicaLink));
+    if (!l) return FALSE;
+    l->c = c;
+    l->stream_id = stream_id;
+    l->id_base = base;
+    l->id_count = count;
+    l->raw_base = c->mux->bytes_raw;
+    parsePositions(l, positions ? positions : "");
+
+    hello.kind = REPL_HELLO;
+    hello.id_base = base;
+    hello.id_count = count;
+    mux_send(c->mux, stream_id, (const char*) &hello, sizeof(hello), TRUE);
+    l->queued = sizeof(hello);
+
+    EnterCriticalSection(&cs_repl);
+    list_append(links, l);
+    n_links++;
+    LeaveCriticalSection(&cs_repl);
+    c->repl = l;
+
+    l->pusher = CreateThread(NULL, 0, (LPVOID) pusherThread, (LPVOID) l, 0, &dwt);
+    if (!l->pusher) {
+        stopReplication(c);
+        return FALSE;
+    }
+    fprintf(stderr, "[repl] Client #%lu is a replica (%lu boards known, keeps %llu messages, client #ids %lu..%lu)\r\n",
+            c->id, l->n_positions, l->tail, base + 1, base + count);
+    return TRUE;
+}
+
+bool acceptReplica(Client* c, DWORD stream_id, const char* auth, volatile LONG* counter) {
+    /**
+     * @brief Primary: /replauth <proof> <positions>. Check proof of the challenge sent, then feed replica
+     * @details #ids are reserved only for a replica that proved the key. Challenge is good for one answer.
+     * @return FALSE if replica is refused
+     */
+    char proof[2 * REPL_PROOF_LEN + 1];
+    DWORD base, count, diff = 0;
+    ULONGLONG nonce = c->repl_nonce;
+
+    c->repl_nonce = 0;
+    if (!nonce || !auth || strlen(auth) < 2 * REPL_PROOF_LEN) {
+        denyReplica(c, stream_id, "no challenge answered");
+        return FALSE;
+    }
+    makeProof(nonce, proof);
+    for (DWORD i = 0; i < 2 * REPL_PROOF_LEN; i++)
+        diff |= proof[i] ^ auth[i];
+    if (diff) {
+        denyReplica(c, stream_id, "wrong key");
+        return FALSE;
+    }
+    if (!reserveReplicaIds(counter, &base, &count)) {
+        denyReplica(c, stream_id, "no client #ids left");
+        return FALSE;
+    }
+    return startReplication(c, stream_id, auth + 2 * REPL_PROOF_LEN, base, count);
+}
+
+void stopReplication(Client* c) {
+    /**
+     * @brief Primary: replica disconnects. Stops its pusher before the mux goes away
+     */
+    ReplicaLink* l = c->repl;
+    Item *i, *prev = NULL;
+
+    if (!l) return;
+    EnterCriticalSection(&cs_repl);
+    l->stop = TRUE;
+    for (i = links->head; i != NULL; prev = i, i = i->next)
+        if (i->data == l) {
+            list_popnext(links, prev);
+            n_links--;
+            break;
+        }
+    WakeAllConditionVariable(&cv_repl);
+    LeaveCriticalSection(&cs_repl);
+
+    if (l->pusher) {
+        WaitForSingleObject(l->pusher, INFINITE);
+        CloseHandle(l->pusher);
+    }
+    fprintf(stderr, "[repl] Replica of client #%lu left: %llu records sent, %llu applied\r\n", c->id, l->sent, l->acked);
+    free(l);
+    c->repl = NULL;
+}
+
+void ackReplication(Client* c, const char* ack) {
+    /**
+     * @brief Primary: "<records processed on this connection> <delay of the last one, ms>" of /replack
+     */
+    char* end;
+    if (!c->repl || !ack) return;
+    c->repl->acked = strtoull(ack, &end, 10);
+    c->repl->lag_ms = strtoull(end, NULL, 10);
+}
+
+void notifyReplicas() {
+    /**
+     * @brief A message was committed: wake pushers
+     */
+    if (!n_links) return;
+    EnterCriticalSection(&cs_repl);
+    repl_seq++;
+    WakeAllConditionVariable(&cv_repl);
+    LeaveCriticalSection(&cs_repl);
+}
+
+Message* acceptForward(Client* c, char* buf, ULONGLONG len, Board** board) {
+    /**
+     * @brief Post relayed by a replica (/fwd <record>): make the message it carries, find its board
+     * @details Join of a replica's client becomes the announcement, made here (or passed on).
+     * @return NULL if sender is not a replica, record is damaged or not of its clients, or it was passed on
+     */
+    WalRecord* rec = (WalRecord*) buf;
+    ReplicaLink* l = c->repl;
+
+    if (!l || !rec || len < sizeof(WalRecord) || rec->msg_len != len - sizeof(WalRecord))
+        return NULL;
+    if (rec->msg_type != MSG_TYPE_MSG && rec->msg_type != MSG_TYPE_FILE && rec->msg_type != MSG_TYPE_JOIN)
+        return NULL;
+    if (rec->src_id <= l->id_base || rec->src_id > l->id_base + l->id_count) {
+        fprintf(stderr, "[repl] Replica of client #%lu forwarded post of #%lu, not one of its clients\r\n", c->id, rec->src_id);
+        return NULL;
+    }
+    rec->board[BOARD_NAME_LEN-1] = '\0';
+    *board = getBoard(rec->board, TRUE);
+    if (!*board) return NULL;
+
+    if (rec->msg_type == MSG_TYPE_JOIN) {
+        if (!isReplica()) return newJoinMessage(rec->src_id);
+        forwardJoin(*board, rec->src_id);
+        return NULL;
+    }
+    return newReplayedMessage(rec);
+}
+
+
+bool isReplica() {
+    return getConfig()->replica_of != NULL;
+}
+
+DWORD getClientIdBase() {
+    return (DWORD) id_base;
+}
+
+static ULONGLONG ageMs(const SYSTEMTIME* t) {
+    /**
+     * @brief Milliseconds since local time `t`
+     */
+    SYSTEMTIME now;
+    FILETIME ft_then, ft_now;
+    ULONGLONG then, cur;
+
+    GetLocalTime(&now);
+    SystemTimeToFileTime(t, &ft_then);
+    SystemTimeToFileTime(&now, &ft_now);
+    then = (ULONGLONG) ft_then.dwHighDateTime << 32 | ft_then.dwLowDateTime;
+    cur = (ULONGLONG) ft_now.dwHighDateTime << 32 | ft_now.dwLowDateTime;
+    return cur > then ? (cur - then) / 10000 : 0;
+}
+
+static SOCKET connectPrimary() {
+    /**
+     * @brief socket() connect() to primary
+     */
+    ADDRINFOA hints = {0}, *addr = NULL;
+    SOCKET sock;
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(up_host, up_port, &hints, &addr) != 0) return INVALID_SOCKET;
+
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock != INVALID_SOCKET && connect(sock, addr->ai_addr, (int) addr->ai_addrlen) == SOCKET_ERROR) {
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(addr);
+    return sock;
+}
+
+static void buildRequest(char* req, ULONGLONG nonce) {
+    /**
+     * @brief "/replauth <proof> [~<kept>] <board> <last #id> ..." for all boards replica has
+     */
+    DWORD len = sprintf(req, "%s ", CMD_REPLAUTH);
+    Board* b;
+
+    makeProof(nonce, req + len);
+    len += 2 * REPL_PROOF_LEN;
+
+    if (getConfig()->retention) len += sprintf(req + len, " ~%llu", getConfig()->retention);
+
+    EnterCriticalSection(&cs_boards);
+    for (Item* i = getBoardList()->head; i != NULL; i = i->next) {
+        b = i->data;
+        len += sprintf(req + len, " %s %llu", b->name, getLastMessageId(b));
+    }
+    LeaveCriticalSection(&cs_boards);
+}
+
+static void applyRecord(const ReplFrame* f, WalRecord* rec) {
+    /**
+     * @brief Replica: append message pushed by primary under the same #id
+     * @details A board seen first starts at #id of its first record (older ones were dropped by
+     *  retention of primary). #ids skipped later get a placeholder, as in log replay.
+     */
+    Board* b;
+    Message* m;
+    ULONGLONG last;
+
+    rec->board[BOARD_NAME_LEN-1] = '\0';
+    b = getBoard(rec->board, TRUE);
+    if (!b) return;
+
+    last = getLastMessageId(b);
+    if (rec->msg_id <= last) return;
+    if (!last && b->first_id == 1 && rec->msg_id > 1)
+        startBoardAt(b, rec->msg_id, rec->msg_id - 1);
+    else
+        for (; last + 1 < rec->msg_id; last++)
+            if (!(m = newLostMessage()) || !appendMessage(b, m)) break;
+
+    m = newReplayedMessage(rec);
+    if (!m) return;
+    if (!postMessage(b, m, NULL)) {
+        freeMessage(m);
+        return;
+    }
+    if (m->msg_id != rec->msg_id)
+        fprintf(stderr, "[replica] Board '%s' diverged from primary: #%llu stored as #%llu\r\n", b->name, rec->msg_id, m->msg_id);
+
+    up_stats.applied++;
+    up_stats.behind = f->head_id > rec->msg_id ? f->head_id - rec->msg_id : 0;
+    up_stats.delay_ms = ageMs(&rec->timestamp);
+}
+
+static void receiveRecords(Mux* mux, DWORD stream_id, char* req) {
+    /**
+     * @brief Replica: answer challenge, apply what primary pushes until connection breaks, acknowledge progress
+     */
+    MuxFrame frame;
+    ReplFrame* f;
+    char *buf, ack[64];
+    LONGLONG res;
+    ULONGLONG done = 0, done_acked = 0, now, last_ack = 0;
+
+    while (!up_stop) {
+        res = mux_recvframe(mux, &frame);
+        if (res <= 0) return;
+        res = mux_collect(mux, &frame, &buf);
+
+        if (res > 0 && frame.stream_id == stream_id && res >= (LONGLONG) sizeof(ReplFrame)) {
+            f = (ReplFrame*) buf;
+            if (f->kind == REPL_CHALLENGE) {
+                buildRequest(req, f->head_id);
+                mux_send(mux, stream_id, req, strlen(req)+1, TRUE);
+            }
+            else if (f->kind == REPL_DENIED) {
+                fprintf(stderr, "[replica] Primary %s:%s refused replication (same --repl-key on both?)\r\n", up_host, up_port);
+                free(buf);
+                return;
+            }
+            else if (f->kind == REPL_HELLO) {
+                id_base = (LONG) f->id_base;
+                id_count = (LONG) f->id_count;
+                up_stats.connected = TRUE;
+                fprintf(stderr, "[replica] Replicating %s:%s, client #ids from %lu\r\n", up_host, up_port, f->id_base + 1);
+                SetEvent(ev_hello);
+            }
+            else if (f->kind == REPL_RECORD && res >= (LONGLONG) (sizeof(ReplFrame) + sizeof(WalRecord))
+                     && ((WalRecord*) (f + 1))->msg_len == res - sizeof(ReplFrame) - sizeof(WalRecord)) {
+                applyRecord(f, (WalRecord*) (f + 1));
+                done++;
+            }
+        }
+        if (res > 0) free(buf);
+
+        // Any frame of primary (heartbeats too) is a chance to acknowledge
+        now = GetTickCount64();
+        if (now - last_ack >= REPL_ACK_MS && (done != done_acked || now - last_ack >= REPL_WAIT_MS)) {
+            sprintf(ack, "%s %llu %llu", CMD_REPLACK, done, up_stats.delay_ms);
+            mux_send(mux, MUX_STREAM_CONTROL, ack, strlen(ack)+1, TRUE);
+            done_acked = done;
+            last_ack = now;
+        }
+    }
+}
+
+static void upstreamThread() {
+    /**
+     * @brief Replica: stay connected to primary, reconnect after REPL_RETRY_MS when connection breaks
+     */
+    char* req;
+    SOCKET sock;
+    Mux* mux;
+    DWORD stream_id;
+
+    req = malloc(REPL_REQUEST_LEN);
+    if (!req) return;
+
+    while (!up_stop) {
+        sock = connectPrimary();
+        mux = sock != INVALID_SOCKET ? mux_init(sock) : NULL;
+        if (mux) {
+            stream_id = mux_openstream(mux);
+            mux_send(mux, stream_id, CMD_REPLICATE, sizeof(CMD_REPLICATE), TRUE);
+
+            EnterCriticalSection(&cs_up);
+            up_sock = sock;
+            up_mux = mux;
+            LeaveCriticalSection(&cs_up);
+
+            receiveRecords(mux, stream_id, req);
+
+            EnterCriticalSection(&cs_up);
+            up_mux = NULL;
+            up_sock = INVALID_SOCKET;
+            up_stats.connected = FALSE;
+            LeaveCriticalSection(&cs_up);
+            mux_close(mux);
+            recvrelease();
+            if (!up_stop) fprintf(stderr, "[replica] Lost connection to primary %s:%s\r\n", up_host, up_port);
+        }
+        if (sock != INVALID_SOCKET) closesocket(sock);
+
+        for (DWORD waited = 0; waited < REPL_RETRY_MS && !up_stop; waited += REPL_DRAIN_MS * 10)
+            Sleep(REPL_DRAIN_MS * 10);
+    }
+    free(req);
+}
+
+bool startReplica() {
+    /**
+     * @brief Replica: connect to primary of --replica-of and wait until it accepts (REPL_START_MS)
+     * @return FALSE if primary does not answer: replica would have no #ids for its clients
+     */
+    const char* spec = getConfig()->replica_of;
+    const char* sep;
+    DWORD dwt;
+
+    // Primary creates the key, replicas must have a copy of it
+    if (getConfig()->repl_key && !loadKeyFile(getConfig()->repl_key, repl_key, spec == NULL)) return FALSE;
+    if (!spec) return TRUE;
+
+    sep = strrchr(spec, ':');
+    if (!sep || sep == spec || sep - spec >= REPL_HOST_LEN || !sep[1]) {
+        fprintf(stderr, "[replica] Expected --replica-of <host>:<port>, got '%s'\r\n", spec);
+        return FALSE;
+    }
+    memcpy(up_host, spec, sep - spec);
+    up_host[sep - spec] = '\0';
+    up_port = sep + 1;
+
+    InitializeCriticalSection(&cs_up);
+    memset(&up_stats, 0, sizeof(ReplStats));
+    ev_hello = CreateEventA(NULL, TRUE, FALSE, NULL);
+    up_stop = FALSE;
+    up_thread = CreateThread(NULL, 0, (LPVOID) upstreamThread, NULL, 0, &dwt);
+    if (!up_thread) {
+        fprintf(stderr, "[replica] Failed to create replication thread\r\n");
+        return FALSE;
+    }
+    if (WaitForSingleObject(ev_hello, REPL_START_MS) != WAIT_OBJECT_0) {
+        fprintf(stderr, "[replica] Primary %s:%s does not answer\r\n", up_host, up_port);
+        stopReplica();
+        return FALSE;
+    }
+    printf("Replicating %s:%s\r\n", up_host, up_port);
+    return TRUE;
+}
+
+void stopReplica() {
+    /**
+     * @brief Replica: disconnect from primary, stop applying
+     */
+    if (!up_thread) return;
+    up_stop = TRUE;
+    EnterCriticalSection(&cs_up);
+    if (up_sock != INVALID_SOCKET) shutdown(up_sock, SD_BOTH);
+    LeaveCriticalSection(&cs_up);
+
+    WaitForSingleObject(up_thread, INFINITE);
+    CloseHandle(up_thread);
+    CloseHandle(ev_hello);
+    up_thread = NULL;
+    DeleteCriticalSection(&cs_up);
+}
+
+static bool forwardRecord(WalRecord* rec, const char* body, Blob* blob) {
+    /**
+     * @brief Replica: /fwd `rec` to primary, followed by text `body` (rec->msg_len bytes) or content of `blob`
+     * @return FALSE if primary is unreachable now
+     */
+    ULONGLONG body_len = blob ? 0 : rec->msg_len, len = sizeof(CMD_FWD) + sizeof(WalRecord) + body_len;
+    char* buf;
+    DWORD stream_id;
+    bool ok;
+
+    buf = malloc(len);
+    if (!buf) return FALSE;
+    memcpy(buf, CMD_FWD, sizeof(CMD_FWD));
+    memcpy(buf + sizeof(CMD_FWD), rec, sizeof(WalRecord));
+    if (body_len) memcpy(buf + sizeof(CMD_FWD) + sizeof(WalRecord), body, body_len);
+
+    // Stream of its own: content of a file follows its header
+    EnterCriticalSection(&cs_up);
+    if (!up_mux) {
+        LeaveCriticalSection(&cs_up);
+        free(buf);
+        return FALSE;
+    }
+    stream_id = mux_openstream(up_mux);
+    ok = mux_sendref(up_mux, stream_id, buf, len, blob == NULL, free, buf);
+    if (ok && blob) {
+        holdBlob(blob);
+        ok = mux_sendref(up_mux, stream_id, blob->buf, blob->len, TRUE, (void (*)(void*)) releaseBlob, blob);
+    }
+    if (ok) up_stats.forwarded++;
+    LeaveCriticalSection(&cs_up);
+    return ok;
+}
+
+bool forwardPost(Board* b, Message* m) {
+    /**
+     * @brief Replica: send post of a client to primary. It comes back with its #id through replication
+     * @return FALSE if primary is unreachable now
+     */
+    WalRecord rec = {0};
+    Blob* blob = messageBlob(m);
+
+    strcpy(rec.board, b->name);
+    rec.msg_len = messageLen(m);
+    rec.src_id = m->src_id;
+    rec.msg_type = m->msg_type;
+    strcpy(rec.file_name, messageFileName(m));
+    fromStamp(m->timestamp, &rec.timestamp);
+    return forwardRecord(&rec, blob ? NULL : getMessageBody(m), blob);
+}
+
+bool forwardJoin(Board* b, DWORD client_id) {
+    /**
+     * @brief Replica: tell primary client joined `b`, primary posts the announcement
+     * @return FALSE if primary is unreachable now
+     */
+    WalRecord rec = {0};
+
+    strcpy(rec.board, b->name);
+    rec.src_id = client_id;
+    rec.msg_type = MSG_TYPE_JOIN;
+    fromStamp(nowStamp(), &rec.timestamp);
+    return forwardRecord(&rec, NULL, NULL);
+}
+
+void getReplStats(ReplStats* st) {
+    /**
+     * @brief Primary: lag of the slowest replica. Replica: progress of applying
+     */
+    ReplicaLink* l;
+    ULONGLONG lag;
+
+    memset(st, 0, sizeof(ReplStats));
+    if (isReplica()) {
+        EnterCriticalSection(&cs_up);
+        *st = up_stats;
+        LeaveCriticalSection(&cs_up);
+        st->replica = TRUE;
+    }
+
+    EnterCriticalSection(&cs_repl);
+    st->primary = links->length > 0;
+    st->replicas = links->length;
+    for (Item* i = links->head; i != NULL; i = i->next) {
+        l = i->data;
+        lag = l->pending + (l->sent > l->acked ? l->sent - l->acked : 0);
+        if (lag >= st->lag) {
+            st->lag = lag;
+            st->lag_ms = l->lag_ms;
+        }
+    }
+    LeaveCriticalSection(&cs_repl);
+}
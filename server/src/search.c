@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include "../include/search.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SEARCH_SSE2
+#endif
+
+#define isWordChar(ch) (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || ((ch) >= '0' && (ch) <= '9') || (BYTE) (ch) >= 0x80)
+
+
+SearchIndex* newSearchIndex() {
+    SearchIndex* idx = calloc(1, sizeof(SearchIndex));
+    if (!idx) return NULL;
+    idx->n_buckets = SEARCH_BUCKETS_INIT;
+    idx->buckets = calloc(idx->n_buckets, sizeof(SearchTerm*));
+    if (!idx->buckets) { free(idx); return NULL; }
+    idx->bytes = idx->n_buckets * sizeof(SearchTerm*);
+    InitializeCriticalSection(&idx->cs);
+    return idx;
+}
+
+static void freeTerm(SearchTerm* t) {
+    free(t->data);
+    free(t->skips);
+    free(t);
+}
+
+void destroySearchIndex(SearchIndex* idx) {
+    SearchTerm *t, *next;
+    if (!idx) return;
+    for (DWORD i = 0; i < idx->n_buckets; i++)
+        for (t = idx->buckets[i]; t != NULL; t = next) {
+            next = t->next;
+            freeTerm(t);
+        }
+    free(idx->buckets);
+    DeleteCriticalSection(&idx->cs);
+    free(idx);
+}
+
+static DWORD nextWord(const char** p, const char* end, char* word) {
+    /**
+     * @brief Take next word from text: letters and digits, lowercased, cut to SEARCH_WORD_LEN-1
+     * @details Bytes above 127 are letters too, so words in other alphabets are indexed as they are.
+     * @return length of word, 0 if there are no more words
+     */
+    const char* s = *p;
+    DWORD len = 0;
+
+    while (s < end && !isWordChar(*s)) s++;
+    for (; s < end && isWordChar(*s); s++)
+        if (len < SEARCH_WORD_LEN - 1)
+            word[len++] = (*s >= 'A' && *s <= 'Z') ? (char) (*s - 'A' + 'a') : *s;
+    word[len] = '\0';
+    *p = s;
+    return len;
+}
+
+static ULONGLONG hashWord(const char* word) {
+    /**
+     * @brief FNV-1a
+     */
+    ULONGLONG h = 0xCBF29CE484222325ULL;
+    for (; *word; word++)
+        h = (h ^ (BYTE) *word) * 0x100000001B3ULL;
+    return h;
+}
+
+static void growSearchIndex(SearchIndex* idx) {
+    /**
+     * @brief Double number of buckets and rehash. Caller holds idx->cs
+     */
+    DWORD new_n = idx->n_buckets * 2;
+    SearchTerm **new_buckets = calloc(new_n, sizeof(SearchTerm*)), *t, *next;
+    if (!new_buckets) return;
+
+    for (DWORD i = 0; i < idx->n_buckets; i++)
+        for (t = idx->buckets[i]; t != NULL; t = next) {
+            next = t->next;
+            t->next = new_buckets[t->hash % new_n];
+            new_buckets[t->hash % new_n] = t;
+        }
+    free(idx->buckets);
+    idx->buckets = new_buckets;
+    idx->bytes += (new_n - idx->n_buckets) * sizeof(SearchTerm*);
+    idx->n_buckets = new_n;
+}
+
+static SearchTerm* findTerm(SearchIndex* idx, const char* word, bool create) {
+    /**
+     * @brief Find posting list of word, or add an empty one. Caller holds idx->cs
+     */
+    ULONGLONG h = hashWord(word);
+    SearchTerm* t;
+
+    for (t = idx->buckets[h % idx->n_buckets]; t != NULL; t = t->next)
+        if (t->hash == h && !strcmp(t->word, word)) return t;
+    if (!create) return NULL;
+
+    if (idx->n_terms >= idx->n_buckets) growSearchIndex(idx);
+    t = calloc(1, sizeof(SearchTerm));
+    if (!t) return NULL;
+    t->hash = h;
+    strcpy(t->word, word);
+    t->next = idx->buckets[h % idx->n_buckets];
+    idx->buckets[h % idx->n_buckets] = t;
+    idx->n_terms++;
+    idx->bytes += sizeof(SearchTerm);
+    return t;
+}
+
+static void addPosting(SearchIndex* idx, SearchTerm* t, DWORD id) {
+    /**
+     * @brief Append #id to posting list (#ids come in ascending order). Caller holds idx->cs
+     * @details Every SEARCH_BLOCK_IDS #ids a block starts: its first #id goes to skip table, not to data.
+     */
+    BYTE varint[5];
+    DWORD n = 0, delta, cap;
+    void* tmp;
+
+    // Word repeats in the same message
+    if (t->count && id <= t->last_id) return;
+
+    if (t->count % SEARCH_BLOCK_IDS == 0) {
+        if (t->n_skips == t->cap_skips) {
+            cap = t->cap_skips ? t->cap_skips * 2 : 1;
+            tmp = realloc(t->skips, cap * sizeof(PostingSkip));
+            if (!tmp) return;
+            t->skips = tmp;
+            idx->bytes += (cap - t->cap_skips) * sizeof(PostingSkip);
+            t->cap_skips = cap;
+        }
+        t->skips[t->n_skips].first_id = id;
+        t->skips[t->n_skips].off = t->len;
+        t->n_skips++;
+    }
+    else {
+        delta = id - t->last_id;
+        do {
+            varint[n++] = (BYTE) ((delta & 0x7F) | (delta > 0x7F ? 0x80 : 0));
+            delta >>= 7;
+        } while (delta);
+
+        if (t->len + n > t->cap) {
+            cap = t->cap ? t->cap * 2 : 16;
+            tmp = realloc(t->data, cap);
+            if (!tmp) return;
+            t->data = tmp;
+            idx->bytes += cap - t->cap;
+            t->cap = cap;
+        }
+        memcpy(t->data + t->len, varint, n);
+        t->len += n;
+    }
+    t->count++;
+    t->last_id = id;
+    idx->postings++;
+}
+
+static void indexWords(SearchIndex* idx, const char* text, ULONGLONG len, DWORD id) {
+    const char *p = text, *end = text + len;
+    char word[SEARCH_WORD_LEN];
+    SearchTerm* t;
+
+    while (nextWord(&p, end, word))
+        if ((t = findTerm(idx, word, TRUE)) != NULL)
+            addPosting(idx, t, id);
+}
+
+static void pruneIndex(SearchIndex* idx, ULONGLONG first_id) {
+    /**
+     * @brief Remove postings of messages dropped by retention. Caller holds idx->cs
+     * @details
+     *  Whole blocks before `first_id` are cut off, words with no messages left are removed.
+     *  A block that is only partly dropped stays, queries skip its old #ids.
+     */
+    SearchTerm **pt, *t;
+    DWORD k, off;
+
+    for (DWORD i = 0; i < idx->n_buckets; i++)
+        for (pt = &idx->buckets[i]; (t = *pt) != NULL; ) {
+            if (t->last_id < first_id) {
+                *pt = t->next;
+                idx->postings -= t->count;
+                idx->bytes -= sizeof(SearchTerm) + t->cap + t->cap_skips * sizeof(PostingSkip);
+                idx->n_terms--;
+                freeTerm(t);
+                continue;
+            }
+
+            for (k = 0; k + 1 < t->n_skips && t->skips[k+1].first_id <= first_id; k++);
+            if (k) {
+                off = t->skips[k].off;
+                memmove(t->data, t->data + off, t->len - off);
+                t->len -= off;
+                memmove(t->skips, t->skips + k, (t->n_skips - k) * sizeof(PostingSkip));
+                t->n_skips -= k;
+                for (DWORD j = 0; j < t->n_skips; j++)
+                    t->skips[j].off -= off;
+                t->count -= k * SEARCH_BLOCK_IDS;
+                idx->postings -= k * SEARCH_BLOCK_IDS;
+            }
+            pt = &t->next;
+        }
+}
+
+static void indexNew(Board* b) {
+    /**
+     * @brief Index messages of board posted since the last call, in #id order. Caller holds idx->cs
+     * @details Body is read under cs_mh (it may be compacted or dropped meanwhile), one message at a time.
+     */
+    SearchIndex* idx = b->index;
+    ULONGLONG id, last = getLastMessageId(b), first_id;
+    Message* m;
+    const char* body;
+
+    EnterCriticalSection(&b->cs_mh);
+    first_id = b->first_id;
+    LeaveCriticalSection(&b->cs_mh);
+
+    // Posting lists hold 32-bit #ids: messages past #4294967295 are not indexed
+    if (last > MAXDWORD) last = MAXDWORD;
+
+    for (id = idx->indexed_id < first_id ? first_id : idx->indexed_id + 1; id <= last; id++) {
+        EnterCriticalSection(&b->cs_mh);
+        m = getMessage(b, id);
+        if (m && m->msg_type == MSG_TYPE_MSG && (body = getMessageBody(m)) != NULL)
+            indexWords(idx, body, m->msg_len, (DWORD) id);
+        else if (m && m->msg_type == MSG_TYPE_FILE)
+            indexWords(idx, m->file->name, strnlen(m->file->name, FILE_NAME_LEN), (DWORD) id);
+        LeaveCriticalSection(&b->cs_mh);
+    }
+    if (last > idx->indexed_id) idx->indexed_id = last;
+
+    if (first_id - idx->pruned_id >= SEARCH_PRUNE_EVERY) {
+        pruneIndex(idx, first_id);
+        idx->pruned_id = first_id;
+    }
+}
+
+void indexMessageHistory(Board* b) {
+    /**
+     * @brief Index new messages of board. Called after append
+     * @details If another thread is indexing, it picks up new messages itself (or the next search does).
+     */
+    if (!b->index || !TryEnterCriticalSection(&b->index->cs)) return;
+    indexNew(b);
+    LeaveCriticalSection(&b->index->cs);
+}
+
+static DWORD decodeBlock(const SearchTerm* t, DWORD blk, DWORD* ids) {
+    /**
+     * @brief Unpack block of posting list into up to SEARCH_BLOCK_IDS ascending #ids
+     */
+    const BYTE *p = t->data + t->skips[blk].off;
+    const BYTE *end = t->data + (blk + 1 < t->n_skips ? t->skips[blk+1].off : t->len);
+    DWORD n = 0, id = t->skips[blk].first_id, delta, shift;
+
+    ids[n++] = id;
+    while (p < end) {
+        for (delta = 0, shift = 0; p < end; shift += 7) {
+            delta |= (DWORD) (*p & 0x7F) << shift;
+            if (!(*p++ & 0x80)) break;
+        }
+        id += delta;
+        ids[n++] = id;
+    }
+    return n;
+}
+
+static DWORD findBlock(const SearchTerm* t, DWORD id) {
+    /**
+     * @brief Last block that starts at or before `id` (binary search in skip table), 0 if none
+     */
+    DWORD lo = 0, hi = t->n_skips, mid;
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (t->skips[mid].first_id <= id) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static DWORD intersectIds(const DWORD* a, DWORD na, const DWORD* b, DWORD nb, DWORD* out) {
+    /**
+     * @brief Common #ids of two ascending lists
+     * @details
+     *  With SSE2, 4 #ids of `a` are compared with 4 of `b` at once (all 16 pairs, by rotating `b`),
+     *  then the block with the smaller maximum is advanced. The rest is merged one by one.
+     */
+    DWORD i = 0, j = 0, n = 0;
+
+#ifdef SEARCH_SSE2
+    __m128i va, vb, eq;
+    DWORD a_max, b_max;
+    int mask;
+
+    while (i + 4 <= na && j + 4 <= nb) {
+        va = _mm_loadu_si128((const __m128i*) (a + i));
+        vb = _mm_loadu_si128((const __m128i*) (b + j));
+        eq = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                             _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+                _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                             _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        for (int k = 0; k < 4; k++)
+            if (mask & (1 << k)) out[n++] = a[i+k];
+
+        a_max = a[i+3];
+        b_max = b[j+3];
+        if (a_max <= b_max) i += 4;
+        if (b_max <= a_max) j += 4;
+    }
+#endif
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) i++;
+        else if (a[i] > b[j]) j++;
+        else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+static DWORD intersectTerm(const SearchTerm* t, DWORD* cand, DWORD n_cand) {
+    /**
+     * @brief Keep candidates that are in posting list of `t`. Only blocks covering candidates are decoded
+     */
+    DWORD block[SEARCH_BLOCK_IDS], out[SEARCH_BLOCK_IDS], n, n_out = 0;
+
+    for (DWORD blk = findBlock(t, cand[0]); blk < t->n_skips && t->skips[blk].first_id <= cand[n_cand-1]; blk++) {
+        n = decodeBlock(t, blk, block);
+        if (block[n-1] < cand[0]) continue;
+        n_out += intersectIds(cand, n_cand, block, n, out + n_out);
+    }
+    memcpy(cand, out, n_out * sizeof(DWORD));
+    return n_out;
+}
+
+DWORD searchBoard(Board* b, const char* query, ULONGLONG* ids, DWORD max) {
+    /**
+     * @brief Find messages of board containing all words of query
+     * @details
+     *  Blocks of the rarest word are taken newest first, each is intersected with the other words.
+     *  Search stops as soon as `max` matches are found, so the cost depends on the rarest word
+     *  and on how far back matches are, not on size of history.
+     * @return number of #ids written to `ids`, newest first
+     */
+    SearchIndex* idx = b->index;
+    char words[SEARCH_QUERY_WORDS][SEARCH_WORD_LEN];
+    SearchTerm *terms[SEARCH_QUERY_WORDS], *t;
+    DWORD cand[SEARCH_BLOCK_IDS], n_words = 0, n_cand, found = 0, blk, i, k;
+    const char *p = query, *end = query + strlen(query);
+    ULONGLONG first_id;
+
+    if (!idx) return 0;
+    while (n_words < SEARCH_QUERY_WORDS && nextWord(&p, end, words[n_words])) {
+        for (k = 0; k < n_words && strcmp(words[k], words[n_words]) != 0; k++);
+        if (k == n_words) n_words++;
+    }
+    if (!n_words) return 0;
+
+    EnterCriticalSection(&idx->cs);
+    indexNew(b);
+    EnterCriticalSection(&b->cs_mh);
+    first_id = b->first_id;
+    LeaveCriticalSection(&b->cs_mh);
+
+    for (k = 0; k < n_words; k++)
+        if (!(terms[k] = findTerm(idx, words[k], FALSE))) {
+            LeaveCriticalSection(&idx->cs);
+            return 0;
+        }
+
+    // Rarest word first: fewer candidates to check against the others
+    for (k = 1; k < n_words; k++)
+        for (i = k; i > 0 && terms[i]->count < terms[i-1]->count; i--) {
+            t = terms[i];
+            terms[i] = terms[i-1];
+            terms[i-1] = t;
+        }
+
+    t = terms[0];
+    for (blk = t->n_skips; blk-- > 0 && found < max; ) {
+        n_cand = decodeBlock(t, blk, cand);
+        for (k = 1; k < n_words && n_cand; k++)
+            n_cand = intersectTerm(terms[k], cand, n_cand);
+
+        for (i = n_cand; i-- > 0 && found < max && cand[i] >= first_id; )
+            ids[found++] = cand[i];
+        if (t->skips[blk].first_id < first_id) break;
+    }
+    LeaveCriticalSection(&idx->cs);
+    return found;
+}
+
+void getSearchStats(Board* b, SearchStats* st) {
+    SearchIndex* idx = b->index;
+    memset(st, 0, sizeof(SearchStats));
+    if (!idx) return;
+
+    EnterCriticalSection(&idx->cs);
+    st->terms = idx->n_terms;
+    st->indexed_id = idx->indexed_id;
+    st->postings = idx->postings;
+    st->bytes = idx->bytes;
+    LeaveCriticalSection(&idx->cs);
+}
@@ -1,23 +1,34 @@
 #include <ws2tcpip.h>
 #include "../include/service.h"
+#include "../include/config.h"
+#include "../include/wal.h"
+#include "../include/publish.h"
+#include "../include/replica.h"
+#include "../include/search.h"
 #include "../../utils/include/recvbuf.h"
 
 #define MSG_HEADER_LEN 128
+#define STATS_LEN 2048
+#define BOARD_INFO_LEN 128
+#define NOTE_LEN 128
+#define BOARD_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_"
 #define INPUT_BUF_LEN 1024
 
-#define FILE_HEADER "\0\0\0\xff"
-#define FILE_HEADER_LEN 4
-
 #define FILE_SIZE_MAX MAX_BUF_LEN
+#define INVALID_SIZE ((ULONGLONG) -1)
 
 
 void getIpPort(SOCKET sock, char *ip, WORD *port) {
     /**
-     * @brief Get IP and port by socket
+     * @brief Get IP and port by socket ("local" and 0 for AF_UNIX peers)
      */
-    struct sockaddr addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len = sizeof(addr);
-    getpeername(sock, &addr, &addr_len);
+    if (getpeername(sock, (struct sockaddr *) &addr, &addr_len) == SOCKET_ERROR || addr.ss_family != AF_INET) {
+        strcpy(ip, "local");
+        *port = 0;
+        return;
+    }
     struct sockaddr_in *addr_inet = (struct sockaddr_in *) &addr;
     strncpy(ip, inet_ntoa(addr_inet->sin_addr), 16);
     *port = ntohs(addr_inet->sin_port);
@@ -31,55 +42,272 @@ void getIpPort(SOCKET sock, char *ip, WORD *port) {
     }
 
 
-WINBOOL sendMessageToClient(Client* c, Message* msg) {
+WINBOOL sendMessageToClient(Client* c, DWORD stream_id, Message* msg) {
     /**
-     * @brief Send message in human-readable format to client, ending with \0
+     * @brief Queue message in human-readable format for client, ending with \0
+     * @details
+     *  Message is formatted into a new buffer, so caller may hold history lock while calling this.
+     *  Caller must hold cs_mh of board: body of a cold message is read from its compressed segment.
      */
     int res;
-    if (!c || !msg || !msg->buf) return FALSE;
+    if (!c || !msg) return FALSE;
 
-    fprintf(stderr, "[sendMsgToClient] Service invoked for msg id=%lu\r\n", msg->msg_id);
+    fprintf(stderr, "[sendMsgToClient] Service invoked for msg id=%llu\r\n", msg->msg_id);
 
-    WORD hh = msg->timestamp.wHour;
-    WORD mm = msg->timestamp.wMinute;
+    // Minute of day straight from stamp: FILETIME epoch starts at midnight
+    WORD hh = (WORD) (msg->timestamp / STAMP_MINUTE % 1440 / 60);
+    WORD mm = (WORD) (msg->timestamp / STAMP_MINUTE % 60);
 
-    char msg_header[MSG_HEADER_LEN];
+    char msg_header[MSG_HEADER_LEN], file_info[MSG_HEADER_LEN];
     if (msg->src_id != 0)
-        sprintf(msg_header, "#%lu [%02hu:%02hu]  Anonim #%lu: ", msg->msg_id, hh, mm, msg->src_id);
+        sprintf(msg_header, "#%llu [%02hu:%02hu]  Anonim #%lu: ", msg->msg_id, hh, mm, msg->src_id);
     else
-        sprintf(msg_header, "#%lu [%02hu:%02hu]  ", msg->msg_id, hh, mm);
+        sprintf(msg_header, "#%llu [%02hu:%02hu]  ", msg->msg_id, hh, mm);
 
-    // Send message meta info: '#id [hh:mm]  Anonim #id : '
-    res = send(c->sock, msg_header, strlen(msg_header), 0); // no trailing \0 yet
-    returnOnError();
+    ULONGLONG header_len = strlen(msg_header), body_len;
+    const char* body;
 
     if (msg->msg_type == MSG_TYPE_MSG) {
-        // Send actual message with \0
-        res = send(c->sock, msg->buf, msg->msg_len+1, 0); // with trailing \0
-        returnOnError();
+        // Actual message
+        body = getMessageBody(msg);
+        body_len = msg->msg_len;
+        if (!body) return FALSE;
     }
     else if (msg->msg_type == MSG_TYPE_FILE) {
-        // Send file details (see sprintf below)
-        sprintf(msg_header, "File '%s' (%lu bytes). Type '/dl %lu' to download", msg->file_name, msg->msg_len, msg->msg_id);
-        res = send(c->sock, msg_header, strlen(msg_header)+1, 0);
-        returnOnError();
+        // File details (see sprintf below)
+        sprintf(file_info, "File '%s' (%llu bytes). Type '/dl %llu' to download", msg->file->name, messageLen(msg), msg->msg_id);
+        body = file_info;
+        body_len = strlen(file_info);
     }
     else return FALSE;
 
+    // Meta info '#id [hh:mm]  Anonim #id : ', then body with trailing \0
+    char* record = malloc(header_len + body_len + 1);
+    if (!record) return FALSE;
+    memcpy(record, msg_header, header_len);
+    memcpy(record + header_len, body, body_len);
+    record[header_len + body_len] = '\0';
+
+    res = mux_sendref(c->mux, stream_id, record, header_len + body_len + 1, FALSE, free, record);
+    returnOnError();
+
+    return TRUE;
+}
+
+
+WINBOOL sendHistoryToClient(Client* c, DWORD stream_id) {
+    /**
+     * @brief Queue messages of client's board from its cursor on, then end of response (empty message)
+     * @details
+     *  Cursor is moved past the last message sent, so next sync costs only new messages.
+     *  Messages committed meanwhile are sent too. Messages dropped by retention are skipped.
+     *  At most `sync_max` messages are sent, then record "/sync" asks client to sync again at once
+     *  (client far behind does not hold the thread and the send queue for the whole backlog).
+     *  sendMessageToClient() makes its own copy and does not block on network.
+     */
+    Board* b = c->board;
+    ULONGLONG id, sent = 0, sync_max = getConfig()->sync_max;
+
+    for (id = c->cursor; id <= getLastMessageId(b) && (!sync_max || sent < sync_max); id++, sent++) {
+        EnterCriticalSection(&b->cs_mh);
+        if (id < b->first_id) id = b->first_id;
+        sendMessageToClient(c, stream_id, getMessage(b, id));
+        LeaveCriticalSection(&b->cs_mh);
+    }
+    c->cursor = id;
+    if (id <= getLastMessageId(b))
+        mux_send(c->mux, stream_id, CMD_SYNC, sizeof(CMD_SYNC), FALSE);
+    return mux_send(c->mux, stream_id, "", 1, TRUE);
+}
+
+WINBOOL sendOlderToClient(Client* c, DWORD stream_id) {
+    /**
+     * @brief Queue page of messages just before the oldest one client has, then end of response
+     * @details
+     *  Page is `catchup` messages (capped by `sync_max`), begins with a note line.
+     *  Client's oldest #id moves back, so next /older continues from there.
+     */
+    Board* b = c->board;
+    ServerConfig* config = getConfig();
+    ULONGLONG id, from, page = config->catchup ? config->catchup : DEFAULT_CATCHUP;
+    char note[NOTE_LEN];
+
+    if (config->sync_max && page > config->sync_max) page = config->sync_max;
+
+    EnterCriticalSection(&b->cs_mh);
+    from = c->oldest > page ? c->oldest - page : 1;
+    if (from < b->first_id) from = b->first_id;
+    LeaveCriticalSection(&b->cs_mh);
+
+    if (from >= c->oldest) {
+        strcpy(note, "No older messages");
+        mux_send(c->mux, stream_id, note, strlen(note)+1, FALSE);
+        return mux_send(c->mux, stream_id, "", 1, TRUE);
+    }
+
+    sprintf(note, "-- Messages #%llu..#%llu of board '%s' --", from, c->oldest - 1, b->name);
+    mux_send(c->mux, stream_id, note, strlen(note)+1, FALSE);
+
+    for (id = from; id < c->oldest; id++) {
+        EnterCriticalSection(&b->cs_mh);
+        if (id < b->first_id) id = b->first_id;
+        if (id < c->oldest) sendMessageToClient(c, stream_id, getMessage(b, id));
+        LeaveCriticalSection(&b->cs_mh);
+    }
+    c->oldest = from;
+    return mux_send(c->mux, stream_id, "", 1, TRUE);
+}
+
+WINBOOL sendSearchToClient(Client* c, DWORD stream_id, const char* query) {
+    /**
+     * @brief Queue newest messages of client's board that contain all words of query, then end of response
+     * @details Up to SEARCH_RESULTS_MAX matches, oldest of them first, after a note line.
+     */
+    Board* b = c->board;
+    ULONGLONG ids[SEARCH_RESULTS_MAX];
+    char note[NOTE_LEN];
+    DWORD n = searchBoard(b, query ? query : "", ids, SEARCH_RESULTS_MAX);
+
+    if (!n) sprintf(note, "No messages found in board '%s'", b->name);
+    else if (n == SEARCH_RESULTS_MAX) sprintf(note, "-- Newest %lu matches in board '%s' --", n, b->name);
+    else sprintf(note, "-- Found %lu in board '%s' --", n, b->name);
+    mux_send(c->mux, stream_id, note, strlen(note)+1, FALSE);
+
+    while (n-- > 0) {
+        EnterCriticalSection(&b->cs_mh);
+        sendMessageToClient(c, stream_id, getMessage(b, ids[n]));
+        LeaveCriticalSection(&b->cs_mh);
+    }
+    return mux_send(c->mux, stream_id, "", 1, TRUE);
+}
+
+void sendBoardName(Client* c, DWORD stream_id) {
+    /**
+     * @brief Record "/board <name>": messages of this board are delivered from now on (client caches them)
+     */
+    char rec[sizeof(CMD_BOARD) + BOARD_NAME_LEN];
+    sprintf(rec, "%s %s", CMD_BOARD, c->board->name);
+    mux_send(c->mux, stream_id, rec, strlen(rec)+1, FALSE);
+}
+
+bool resumeFromCache(Client* c, const char* cache, bool restored) {
+    /**
+     * @brief Client has messages of a board cached: deliver only newer ones, page /older from them
+     * @details `cache` is "<history serial> <board> <first #id> <last #id>" of /resume. Cache of
+     *  another run of server, or of another board than the restored session, is ignored.
+     * @return TRUE if cache is used
+     */
+    char name[BOARD_NAME_LEN];
+    ULONGLONG serial, first, last;
+    Board* b;
+
+    if (!cache || sscanf(cache, "%llx %31s %llu %llu", &serial, name, &first, &last) != 4) return FALSE;
+    if (serial != getHistorySerial() || !first || first > last) return FALSE;
+    b = getBoard(name, FALSE);
+    if (!b || last > getLastMessageId(b) || (restored && b != c->board)) return FALSE;
+
+    if (!restored) joinBoard(c, b);
+    if (!restored || c->cursor > last + 1) c->cursor = last + 1;
+    c->oldest = first;
     return TRUE;
 }
 
+void sendCatchupNote(Client* c, DWORD stream_id) {
+    /**
+     * @brief Tell client how many messages of its board are older than the ones it gets (if any)
+     */
+    Board* b = c->board;
+    char note[NOTE_LEN];
+    ULONGLONG first_id;
+
+    EnterCriticalSection(&b->cs_mh);
+    first_id = b->first_id;
+    LeaveCriticalSection(&b->cs_mh);
+    if (c->oldest <= first_id) return;
+
+    sprintf(note, "-- %llu earlier messages, type %s to show them --", c->oldest - first_id, CMD_OLDER);
+    mux_send(c->mux, stream_id, note, strlen(note)+1, FALSE);
+}
+
+
+typedef struct Transfer {
+    Client *c;                          // Client downloading the file
+    Mux *mux;                           // Connection of client the transfer was requested on
+    Blob *blob;                         // Content, held until sent
+    DWORD stream_id;                    // Stream of /dl request
+    ULONGLONG offset;                   // Range of content to send
+    ULONGLONG len;
+    ULONGLONG queued;                   // GetTickCount64() when put in client's waiting queue
+    struct Transfer *next;              // Next transfer waiting for a slot
+} Transfer;
+
+static void endTransfer(void* ctx);
+
+static void startTransfer(Transfer* t) {
+    /**
+     * @brief Queue content in multiplexer by reference, that is a transfer in flight. Caller holds t->mux->cs
+     */
+    InterlockedIncrement(&t->c->transfers);
+    mux_sendref(t->mux, t->stream_id, t->blob->buf + t->offset, t->len, TRUE, endTransfer, t);
+}
+
+static void endTransfer(void* ctx) {
+    /**
+     * @brief File content is sent (or connection dropped): release blob, hand the slot to the next waiting transfer
+     * @details Runs on sender thread of the multiplexer, so a download waiting for its slot is started
+     *  without the client's thread. If the connection is gone, waiting transfers are dropped.
+     */
+    Transfer *t = ctx, *next;
+    Mux* m = t->mux;
+    Client* c = t->c;
+    DWORD waited;
+
+    releaseBlob(t->blob);
+    free(t);
+
+    EnterCriticalSection(&m->cs);
+    InterlockedDecrement(&c->transfers);
+    while ((next = c->waiting) != NULL) {
+        c->waiting = next->next;
+        c->waiting_count--;
+        if (!m->stop && !m->dead) {
+            waited = (DWORD) (GetTickCount64() - next->queued);
+            InterlockedExchangeAdd64(&c->throttled_ms, waited);
+            countThrottle(waited);
+            startTransfer(next);
+            break;
+        }
+        releaseBlob(next->blob);
+        free(next);
+    }
+    LeaveCriticalSection(&m->cs);
+}
 
-WINBOOL sendFileToClient(Client* c, Message* msg) {
+WINBOOL sendFileToClient(Client* c, DWORD stream_id, Message* msg, ULONGLONG offset, ULONGLONG len, ULONGLONG hash) {
     /**
      * @brief Routine to process file download request
      *
      * @details
-     *  request format:    /dl <id>
-     *  response format:   FILE_HEADER <size> <content>
+     *  request format:    /dl <id> [<offset> [<length> [<hash>]]]
+     *  response format:   <size> <offset> <length> <hash> <content>      (on the stream of request)
+     *
+     *  size, offset, length, hash are 64-bit. size = full file size, content = `length` bytes from `offset`,
+     *  hash = blobHash() of the whole file. Requested range is clamped to file, length 0 means up to end of file.
+     *  Client resumes an interrupted download by asking for the rest of it with the hash it got before (hex):
+     *  if content is not the same (#id of another board, restored history), range starts from 0 instead.
      *
-     *  Both files and messages can be downloaded
+     *  Both files and messages can be downloaded.
+     *  Content is sent in chunks, interleaved with other streams. File content is queued by reference.
+     *  With `max_transfers` files of client in flight, header is sent at once and content waits in
+     *  client's queue: endTransfer() starts it when a slot is free, client's thread goes on meanwhile.
+     *  Caller must hold cs_mh of board.
      */
+    ULONGLONG header[4], size = 0;
+    const char* body = NULL;
+    Blob* blob = NULL;
+    Transfer *t, **last;
+    DWORD max = getConfig()->max_transfers;
+    int res;
 
     if (!c) {
         return FALSE;
@@ -87,117 +315,435 @@ WINBOOL sendFileToClient(Client* c, Message* msg) {
 
     fprintf(stderr, "[sendFile] Starting file download, client #%lu...\r\n", c->id);
 
-    // send file header
-    int res = send(c->sock, FILE_HEADER, FILE_HEADER_LEN, 0);
-    returnOnError();
-
     // if file not found, send invalid len
-    res = INVALID_FILE_SIZE;
-    if (!msg || msg->msg_len < 1 || !msg->buf) {
-        send(c->sock, (LPVOID) &res, sizeof(DWORD), 0);
+    if (msg) {
+        blob = messageBlob(msg);
+        body = getMessageBody(msg);
+        size = messageLen(msg);
+    }
+    if (!msg || size < 1 || !body) {
+        header[0] = INVALID_SIZE;
+        header[1] = header[2] = header[3] = 0;
+        mux_send(c->mux, stream_id, (LPVOID) header, sizeof(header), TRUE);
         return TRUE;
     }
 
-    // send 4-byte file length
-    res = send(c->sock, (LPVOID) &msg->msg_len, sizeof(DWORD), 0);
-    returnOnError();
+    // client's partial file is of other content: send it all again
+    header[3] = blob ? blob->hash : blobHash(body, size);
+    if (hash && hash != header[3]) offset = len = 0;
 
-    fprintf(stderr, "[sendFile] Sent header and file size, sending content...\r\n");
+    // clamp range to file
+    if (offset > size) offset = size;
+    if (len == 0 || len > size - offset) len = size - offset;
 
-    // send actual file content
-    res = send(c->sock, msg->buf, msg->msg_len, 0);
+    // send size, offset, length of range and hash
+    header[0] = size;
+    header[1] = offset;
+    header[2] = len;
+    res = mux_send(c->mux, stream_id, (LPVOID) header, sizeof(header), len == 0);
     returnOnError();
+    if (len == 0) return TRUE;
 
-    fprintf(stderr, "[sendFile] Sent file #%lu (%lu bytes) to client #%lu\r\n", msg->msg_id, msg->msg_len, c->id);
+    // send message body as a copy
+    if (!blob) {
+        res = mux_send(c->mux, stream_id, body + offset, len, TRUE);
+        returnOnError();
+        fprintf(stderr, "[sendFile] Queued message #%llu (%llu of %llu bytes from %llu) for client #%lu\r\n", msg->msg_id, len, size, offset, c->id);
+        return TRUE;
+    }
+
+    // send actual file content without copy. Blob is held until it is sent
+    t = calloc(1, sizeof(Transfer));
+    if (!t) return FALSE;
+    t->c = c;
+    t->mux = c->mux;
+    t->blob = blob;
+    t->stream_id = stream_id;
+    t->offset = offset;
+    t->len = len;
+    holdBlob(blob);
+
+    // Slots are counted under lock of multiplexer: endTransfer() frees them on its sender thread
+    EnterCriticalSection(&c->mux->cs);
+    if (!max || c->transfers < (LONG) max) {
+        startTransfer(t);
+        LeaveCriticalSection(&c->mux->cs);
+        fprintf(stderr, "[sendFile] Queued file #%llu (%llu of %llu bytes from %llu) for client #%lu\r\n", msg->msg_id, len, size, offset, c->id);
+        return TRUE;
+    }
+    t->queued = GetTickCount64();
+    for (last = &c->waiting; *last != NULL; last = &(*last)->next);
+    *last = t;
+    c->waiting_count++;
+    c->throttled++;
+    LeaveCriticalSection(&c->mux->cs);
+    fprintf(stderr, "[sendFile] File #%llu for client #%lu waits for a transfer slot (%lu waiting)\r\n", msg->msg_id, c->id, c->waiting_count);
 
     return TRUE;
 }
 
-#define CMD_QUIT "/q"
-#define CMD_DL "/dl"
-#define CMD_FILE "/file"
-#define CMD_SYNC "/sync"
+static void publishDurable(Board* b, ULONGLONG id, bool logged) {
+    /**
+     * @brief --wal: record whether message #id reached the log, publish the prefix of board it completes
+     * @details Prefix moves over logged messages and over messages dropped by retention. A message that
+     *  could not be logged waits for a later logged one: replay then gives its #id a placeholder, so a
+     *  crash never hands its #id to another message. Board lock keeps ring records in #id order.
+     */
+    ULONGLONG last, next;
+    Message* m;
+
+    EnterCriticalSection(&b->cs_mh);
+    if ((m = getMessage(b, id)) != NULL) m->log_state = logged ? MSG_LOG_DURABLE : MSG_LOG_FAILED;
+    last = getLastMessageId(b);
+    for (id = (ULONGLONG) b->durable_ids + 1; id <= last; id++) {
+        m = getMessage(b, id);
+        if (m && m->log_state == MSG_LOG_PENDING) break;
+        if (m && m->log_state == MSG_LOG_FAILED) continue;
+        for (next = (ULONGLONG) b->durable_ids + 1; next <= id; next++)
+            if ((m = getMessage(b, next)) != NULL) publishMessage(b, m);
+        InterlockedExchange64(&b->durable_ids, (LONGLONG) id);
+    }
+    LeaveCriticalSection(&b->cs_mh);
+}
+
+WINBOOL postMessage(Board* board, Message* msg, bool* durable) {
+    /**
+     * @brief Add message to board and pass it on: log, shared-memory ring, replicas, search index
+     * @details Posts of clients, join announcements and messages a replica applies all go here.
+     *  FALSE if message was not added: caller still owns it.
+     *  `durable` (optional) is FALSE if message is added but the log could not be written.
+     */
+    bool logged, wal = getConfig()->wal != NULL;
+    ULONGLONG id;
+
+    msg->log_state = wal ? MSG_LOG_PENDING : MSG_LOG_DURABLE;
+    if (!(id = appendMessage(board, msg))) return FALSE;
+    fprintf(stderr, "[postMsg | Thread %lu] msg_id = %llu  msg_len = %llu\r\n", GetCurrentThreadId(), id, messageLen(msg));
+
+    // Durability mode: wait until message is in the log (shared fsync with other posters)
+    logged = walAppend(board, msg);
+    if (durable) *durable = logged;
+    // With --wal, local consumers and replicas get the board only up to its logged prefix
+    if (wal) publishDurable(board, id, logged);
+    else publishMessage(board, msg);
+    notifyReplicas();
+
+    // Display messages of clients on server, do not display files. Body may be compacted meanwhile
+    if (msg->msg_type == MSG_TYPE_MSG && msg->src_id) {
+        EnterCriticalSection(&board->cs_mh);
+        if (msg->msg_id >= board->first_id)
+            printf("%s #%llu | Anonim #%lu : %s\r\n", board->name, msg->msg_id, msg->src_id, getMessageBody(msg));
+        LeaveCriticalSection(&board->cs_mh);
+    }
+
+    // Index new words before retention may drop the message
+    indexMessageHistory(board);
+
+    // Drop messages beyond retention, compress cold part of history (if enabled)
+    compactMessageHistory(board);
+    return TRUE;
+}
+
+WINBOOL sendStatsToClient(Client* c, DWORD stream_id) {
+    /**
+     * @brief Send server statistics in human-readable format
+     */
+    char stats[STATS_LEN];
+    BlobStats bs;
+    HistoryStats hs;
+    WalStats ws;
+    RingStats gs;
+    ReplStats rp;
+    SearchStats ss;
+    RateStats rs;
+    TimerStats ts;
+    ServerConfig* config = getConfig();
+    DWORD len;
+
+    getBlobStats(&bs);
+    getHistoryStats(c->board, &hs);
+    getSearchStats(c->board, &ss);
+    getTimerStats(&ts);
+    len = sprintf(stats,
+            "Board '%s': messages #%llu..#%llu, %lu members\r\n"
+            "Files: %lu uploads, %lu unique (%lu duplicates)\r\n"
+            "Stored %llu bytes for %llu bytes of files, dedup ratio %.2f, held by %lu transfers\r\n"
+            "History: %lu cold messages in %lu segments, %llu bytes compressed to %llu\r\n"
+            "Search: %lu words, %llu postings in %llu bytes, indexed up to #%llu\r\n"
+            "Your connection: %llu bytes sent as %llu (compression %s)\r\n"
+            "Timers: %lu armed, %llu fired, closed %llu idle and %llu stalled connections",
+            c->board->name, hs.first_id, hs.last_id, hs.subscribers,
+            bs.uploads, bs.blobs, bs.dedup_hits,
+            bs.stored_bytes, bs.logical_bytes,
+            bs.stored_bytes ? (double) bs.logical_bytes / (double) bs.stored_bytes : 1.0, bs.holds,
+            hs.cold_msgs, hs.segments, hs.raw_bytes, hs.stored_bytes,
+            ss.terms, ss.postings, ss.bytes, ss.indexed_id,
+            c->mux->bytes_raw, c->mux->bytes_sent, c->mux->compress ? "on" : "off",
+            ts.pending, ts.fired, ts.reaped_idle, ts.reaped_stalled);
+    if (config->rate_msgs || config->rate_bytes || config->max_transfers) {
+        getRateStats(&rs);
+        len += sprintf(stats + len,
+                "\r\nLimits: %.0f posts/s, %.0f bytes/s, %lu transfers (0 = none), you have %ld in flight, %lu waiting\r\n"
+                "Throttled: you %llu times (%llu ms), all clients %llu times (%llu ms)",
+                config->rate_msgs, config->rate_bytes, config->max_transfers, c->transfers, c->waiting_count,
+                c->throttled, c->throttled_ms, rs.throttled, rs.waited_ms);
+    }
+    if (getWalStats(&ws))
+        len += sprintf(stats + len, "\r\nLog: %llu messages in %llu group commits (%.1f per flush), %llu bytes, %llu not written%s",
+                ws.records, ws.batches, ws.batches ? (double) ws.records / (double) ws.batches : 0.0, ws.bytes,
+                ws.failed, ws.broken ? " (log is off until next snapshot)" : "");
+    if (getRingStats(&gs))
+        len += sprintf(stats + len, "\r\nRing: %llu messages published, %llu bytes through %llu-byte ring (%llu cut)",
+                gs.records, gs.bytes, gs.size, gs.cut);
+    getReplStats(&rp);
+    if (rp.primary)
+        len += sprintf(stats + len, "\r\nReplication: %lu replicas, slowest is %llu messages behind (last applied %llu ms after post)",
+                rp.replicas, rp.lag, rp.lag_ms);
+    if (rp.replica)
+        sprintf(stats + len, "\r\n%s of %s: %s, %llu messages applied, %llu behind (last one %llu ms after post), %llu posts forwarded",
+                config->relay ? "Relay" : "Replica", config->replica_of, rp.connected ? "connected" : "disconnected", rp.applied, rp.behind, rp.delay_ms, rp.forwarded);
+
+    return mux_send(c->mux, stream_id, stats, strlen(stats)+1, TRUE);
+}
+
+WINBOOL sendBoardsToClient(Client* c, DWORD stream_id) {
+    /**
+     * @brief Send list of boards in human-readable format
+     */
+    List* boards;
+    Board* b;
+    char* info;
+    DWORD len = 0;
+
+    EnterCriticalSection(&cs_boards);
+    boards = getBoardList();
+    info = malloc(boards->length * BOARD_INFO_LEN + 1);
+    if (!info) {
+        LeaveCriticalSection(&cs_boards);
+        return FALSE;
+    }
+    for (Item* i = boards->head; i != NULL; i = i->next) {
+        b = i->data;
+        len += sprintf(info + len, "%s%s: %llu messages, %lu members\r\n",
+                       b == c->board ? "* " : "  ", b->name,
+                       getLastMessageId(b) - b->first_id + 1, (DWORD) b->subscribers->length);
+    }
+    LeaveCriticalSection(&cs_boards);
+
+    info[len] = '\0';
+    return mux_sendref(c->mux, stream_id, info, len + 1, TRUE, free, info);
+}
 
-Message* parseMsgFromClient(const char* buf, int len, SOCKET sock) {
+WINBOOL sendWhoToClient(Client* c, DWORD stream_id) {
     /**
-     * @brief parse raw message to process commands (if any) and form Message struct
+     * @brief Send number of clients online
+     */
+    ClientStats cs;
+    DWORD here;
+    char info[128];
+
+    getClientStats(&cs);
+    EnterCriticalSection(&cs_boards);
+    here = c->board ? (DWORD) c->board->subscribers->length : 0;
+    LeaveCriticalSection(&cs_boards);
+
+    sprintf(info, "Online: %lu anons, %lu in '%s' (peak %lu, %lu connected since start)\r\n",
+            cs.online, here, c->board ? c->board->name : "", cs.peak, cs.total);
+    return mux_send(c->mux, stream_id, info, strlen(info)+1, TRUE);
+}
+
+
+Request* parseMsgFromClient(const char* buf, ULONGLONG len) {
+    /**
+     * @brief parse raw message to process commands (if any) and form Request struct
+     * @details Message or file to post is made here (req->post), commands keep only their arguments.
      */
 
     if (!buf) return NULL;
 
-    Message* msg = calloc(1, sizeof(Message));
-    if (!msg) return NULL;
+    // Text part ends with \0, file content (if any) follows it
+    const char* text_end = memchr(buf, '\0', len);
+    if (!text_end) return NULL;
+    ULONGLONG text_len = (ULONGLONG) (text_end - buf) + 1;
+    char* args;
 
-    GetLocalTime(&msg->timestamp);
+    Request* req = calloc(1, sizeof(Request));
+    if (!req) return NULL;
 
-    if (len > 1) {
+    if (text_len > 1) {
 
         if (!strncmp(CMD_DL, buf, 3)) {
-            // dl format:     /dl <file_id>
-            msg->msg_type = MSG_TYPE_LOADFILE;
-            msg->msg_id = atol(&buf[4]);
-            return msg;
+            // dl format:     /dl <file_id> [<offset> [<length> [<hash>]]]
+            req->type = MSG_TYPE_LOADFILE;
+            req->msg_id = strtoull(&buf[3], &args, 10);
+            req->range_off = strtoull(args, &args, 10);
+            req->range_len = strtoull(args, &args, 10);
+            req->range_hash = strtoull(args, &args, 16);
+            return req;
         }
 
         if (!strncmp(CMD_FILE, buf, 5)) {
             // file format:   /file <name>%00<size><content>     (client "sends" /file, then chooses one in explorer)
-            msg->msg_type = MSG_TYPE_FILE;
-            strncpy(msg->file_name, &buf[6], FILE_NAME_LEN-1);
-            if (acceptFileFromClient(msg, sock) == SOCKET_ERROR) {
-                send(sock, "Wow, it's so big!", 18, 0);
+            req->type = MSG_TYPE_FILE;
+            req->post = acceptFileFromClient(&buf[6], buf + text_len, len - text_len);
+            if (!req->post) {
+                free(req);
                 return NULL;
             }
-            return msg;
+            return req;
+        }
+
+        if (!strcmp(CMD_COMPRESS, buf)) {
+            // compress format:   /compress      (client accepts compressed frames)
+            req->type = MSG_TYPE_COMPRESS;
+            return req;
         }
 
-        if (!strncmp(CMD_SYNC, buf, 5)) {
-            // sync format:    /sync <last_msg_id>
-            msg->msg_type = MSG_TYPE_SYNC;
-            msg->msg_id = atol(&buf[6]);
-            return msg;
+        if (!strncmp(CMD_JOIN, buf, 5)) {
+            // join format:    /join <board>       (board name: letters, digits, '-', '_')
+            req->type = MSG_TYPE_JOIN;
+            if (text_len > 7 && text_len - 7 < BOARD_NAME_LEN && buf[5] == ' '
+                    && strspn(&buf[6], BOARD_NAME_CHARS) == text_len - 7)
+                strcpy(req->name, &buf[6]);
+            return req;
+        }
+
+        if (!strcmp(CMD_BOARDS, buf)) {
+            // boards format:  /boards
+            req->type = MSG_TYPE_BOARDS;
+            return req;
+        }
+
+        if (!strcmp(CMD_WHO, buf)) {
+            // who format:     /who
+            req->type = MSG_TYPE_WHO;
+            return req;
+        }
+
+        if (!strcmp(CMD_STATS, buf)) {
+            // stats format:   /stats
+            req->type = MSG_TYPE_STATS;
+            return req;
+        }
+
+        if (!strcmp(CMD_OLDER, buf)) {
+            req->type = MSG_TYPE_OLDER;
+            return req;
+        }
+
+        if (!strncmp(CMD_SEARCH, buf, 7) && (buf[7] == ' ' || buf[7] == '\0')) {
+            // search format:  /search <words>       (query is kept in args)
+            req->type = MSG_TYPE_SEARCH;
+            req->args = calloc(text_len, sizeof(char));
+            if (!req->args) { free(req); return NULL; }
+            strcpy(req->args, &buf[7]);
+            return req;
+        }
+
+        if (!strcmp(CMD_SYNC, buf)) {
+            // sync format:    /sync          (server keeps delivery cursor of connection)
+            req->type = MSG_TYPE_SYNC;
+            return req;
+        }
+
+        if (!strcmp(CMD_FWD, buf)) {
+            // forward format:   /fwd%00<WalRecord><body>      (post relayed by replica, kept raw in args)
+            req->type = MSG_TYPE_FORWARD;
+            req->args_len = len - text_len;
+            req->args = malloc(req->args_len + 1);
+            if (!req->args) { free(req); return NULL; }
+            memcpy(req->args, buf + text_len, req->args_len);
+            return req;
+        }
+
+        if (!strcmp(CMD_REPLICATE, buf)) {
+            // replicate format:  /replicate          (replica asks for challenge, see replica.h)
+            req->type = MSG_TYPE_REPLICATE;
+            return req;
+        }
+
+        if (!strncmp(CMD_REPLAUTH, buf, 9) && buf[9] == ' ') {
+            // replauth format:   /replauth <proof> [~<kept>] [<board> <last #id> ...]     (replica subscribes, kept in args)
+            req->type = MSG_TYPE_REPLAUTH;
+            req->args = calloc(text_len, sizeof(char));
+            if (!req->args) { free(req); return NULL; }
+            strcpy(req->args, &buf[10]);
+            return req;
+        }
+
+        if (!strncmp(CMD_REPLACK, buf, 8) && buf[8] == ' ') {
+            // replack format:    /replack <processed> <lag ms>           (replica acknowledges)
+            req->type = MSG_TYPE_REPLACK;
+            req->args = calloc(text_len, sizeof(char));
+            if (!req->args) { free(req); return NULL; }
+            strcpy(req->args, &buf[9]);
+            return req;
+        }
+
+        if (!strcmp(CMD_PARKED, buf)) {
+            // parked format:  /parked        (reply to /handoff, client sends nothing more until /resumed)
+            req->type = MSG_TYPE_PARKED;
+            return req;
+        }
+
+        if (!strncmp(CMD_RESUME, buf, 7)) {
+            // resume format:  /resume [<token>] [@<serial> <board> <first #id> <last #id>]
+            //                 (first request of connection; after @ what client has cached, kept in args)
+            req->type = MSG_TYPE_RESUME;
+            if (buf[7] == ' ') sscanf(&buf[8], "%16[0-9a-f]", req->name);
+            if ((args = strchr(buf, '@')) != NULL) {
+                req->args = calloc(text_len, sizeof(char));
+                if (!req->args) { free(req); return NULL; }
+                strcpy(req->args, args + 1);
+            }
+            return req;
         }
     }
 
     // default: message
-    msg->msg_type = MSG_TYPE_MSG;
-    msg->buf = calloc(len, sizeof(char));
-    if (!msg->buf) { free(msg); return NULL; }
-    strncpy(msg->buf, buf, len-1);
-    msg->buf[len-1] = '\0';
-    msg->msg_len = len-1;
+    req->type = MSG_TYPE_MSG;
+    if (text_len-1 > MSG_TEXT_MAX) { free(req); return NULL; }
+    req->post = newMessage(0, buf, (DWORD) (text_len-1));
+    if (!req->post) { free(req); return NULL; }
+
+    return req;
+}
 
-    return msg;
+void freeRequest(Request* req) {
+    /**
+     * @brief Free request with its arguments and the post it still owns (not posted)
+     */
+    freeMessage(req->post);
+    free(req->args);
+    free(req);
 }
 
-int acceptFileFromClient(Message* msg, SOCKET sock) {
+Message* acceptFileFromClient(const char* name, const char* buf, ULONGLONG len) {
     /**
-     * @brief Use socket to accept file from client and write it as msg
+     * @brief Take file from reassembled upload buffer and make file message of it
+     * @details
+     *  buf format:  <size> <content>
+     *
+     *  Content goes to blob store, message references the blob.
      */
 
-    int res;
-    DWORD size;
-    char* tmp;
+    ULONGLONG size;
+    Blob* blob;
 
-    fprintf(stderr, "[acceptFile] Accepting file %s\r\n", msg->file_name);
+    fprintf(stderr, "[acceptFile] Accepting file %s\r\n", name);
 
     // get file size
-    res = recvlen(sizeof(DWORD), &tmp, sock);
-    if (res <= 0) return SOCKET_ERROR;
+    if (len < sizeof(ULONGLONG)) return NULL;
+    memcpy(&size, buf, sizeof(ULONGLONG));
+    if (size > FILE_SIZE_MAX || size != len - sizeof(ULONGLONG)) return NULL;
 
-    size = *((DWORD*) tmp);
-    free(tmp);
-    if (size > FILE_SIZE_MAX) return SOCKET_ERROR;
+    fprintf(stderr, "[acceptFile] File size = %llu\r\n", size);
 
-    fprintf(stderr, "[acceptFile] File size = %lu\r\n", size);
-
-    char *buf;
-    res = recvlen(size, (LPVOID) &buf, sock);
-    if (res == SOCKET_ERROR) return SOCKET_ERROR;
+    // Same content is stored only once
+    blob = putBlob(buf + sizeof(ULONGLONG), size);
+    if (!blob) return NULL;
 
     fprintf(stderr, "[acceptFile] File accepted!\r\n");
 
-    msg->msg_len = size;
-    msg->buf = buf;
-
-    return res;
+    return newFileMessage(0, name, blob);
 }
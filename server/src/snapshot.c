@@ -0,0 +1,486 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <stdio.h>
+#include "../include/snapshot.h"
+#include "../include/config.h"
+#include "../include/blob.h"
+#include "../../utils/include/chacha.h"
+
+#define SNAPSHOT_KEY_HEX (CHACHA_KEY_LEN * 2)
+#define alignUp(x) (((x) + SNAPSHOT_ALIGN - 1) & ~(ULONGLONG) (SNAPSHOT_ALIGN - 1))
+
+static HANDLE snap_file = INVALID_HANDLE_VALUE;     // Restored snapshot, mapped until closeSnapshot()
+static HANDLE snap_map = NULL;
+static char* snap_view = NULL;
+static ULONGLONG snap_size = 0;
+
+#define failSnapshot(text) \
+    do { \
+        fprintf(stderr, "[snapshot] %s: %s\r\n", text, config->snapshot); \
+        closeSnapshot(); \
+        return FALSE; \
+    } while(0)
+
+
+bool snapshotOwns(const void* p) {
+    /**
+     * @brief Whether `p` points into restored snapshot (such bodies and blobs are not freed one by one)
+     */
+    return snap_view && (const char*) p >= snap_view && (const char*) p < snap_view + snap_size;
+}
+
+bool loadKeyFile(const char* path, BYTE* key, bool create) {
+    /**
+     * @brief Read key file (64 hex digits), or create it with a random key if it does not exist and `create`
+     */
+    char hex[SNAPSHOT_KEY_HEX + 1] = {0}, pair[3] = {0};
+    unsigned int r;
+    FILE* f;
+
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%64[0-9a-fA-F]", hex) != 1) hex[0] = '\0';
+        fclose(f);
+        if (strlen(hex) != SNAPSHOT_KEY_HEX) {
+            fprintf(stderr, "[key] Key file %s must hold %d hex digits\r\n", path, SNAPSHOT_KEY_HEX);
+            return FALSE;
+        }
+        for (int i = 0; i < CHACHA_KEY_LEN; i++) {
+            memcpy(pair, &hex[2*i], 2);
+            key[i] = (BYTE) strtoul(pair, NULL, 16);
+        }
+        return TRUE;
+    }
+    if (!create) {
+        fprintf(stderr, "[key] Cannot read key file %s\r\n", path);
+        return FALSE;
+    }
+
+    for (int i = 0; i < CHACHA_KEY_LEN; i += sizeof(r)) {
+        if (rand_s(&r)) return FALSE;
+        memcpy(key + i, &r, sizeof(r));
+    }
+    f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "[key] Cannot write key file %s\r\n", path);
+        return FALSE;
+    }
+    for (int i = 0; i < CHACHA_KEY_LEN; i++)
+        fprintf(f, "%02x", key[i]);
+    fprintf(f, "\n");
+    fclose(f);
+    fprintf(stderr, "[key] New key written to %s\r\n", path);
+    return TRUE;
+}
+
+bool loadSnapshotKey(BYTE* key) {
+    /**
+     * @brief Key of snapshot and log (--snapshot-key), created if missing
+     */
+    return loadKeyFile(getConfig()->snapshot_key, key, TRUE);
+}
+
+bool loadSnapshot() {
+    /**
+     * @brief Restore boards, blobs and sessions from snapshot file (if it exists)
+     * @details
+     *  File is mapped copy-on-write and decrypted in place, the file itself is not changed.
+     *  Long message bodies, compressed segments and blob contents stay in the view until closeSnapshot(),
+     *  short bodies are copied into their Message (MSG_INLINE_MAX).
+     *  Board that exists already (from --board) keeps its retention from config.
+     *
+     * @return FALSE if file exists but cannot be restored: server should not start and overwrite it
+     */
+    ServerConfig* config = getConfig();
+    BYTE key[CHACHA_KEY_LEN];
+    LARGE_INTEGER size;
+    SnapshotHeader* hdr;
+    SnapshotInfo* info;
+    SnapshotBoard* sb;
+    SnapshotSegment* sseg;
+    SnapshotBlob* sblob;
+    SnapshotMessage* sm;
+    SnapshotSession* ss;
+    Board **boards, *b;
+    Segment** segs;
+    Blob **blobs, *blob;
+    Message* m;
+    ULONGLONG k, n, restored = 0;
+
+    if (!config->snapshot) return TRUE;
+    if (!loadSnapshotKey(key)) return FALSE;
+
+    snap_file = CreateFileA(config->snapshot,
+                            GENERIC_READ,
+                            FILE_SHARE_READ,
+                            NULL,
+                            OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL,
+                            NULL);
+    if (snap_file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[snapshot] No snapshot at %s, starting empty\r\n", config->snapshot);
+        return TRUE;
+    }
+    if (!GetFileSizeEx(snap_file, &size) || (ULONGLONG) size.QuadPart < sizeof(SnapshotHeader) + sizeof(SnapshotInfo))
+        failSnapshot("Snapshot is truncated");
+
+    snap_map = CreateFileMappingA(snap_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (!snap_map) failSnapshot("Cannot map snapshot");
+    snap_view = MapViewOfFile(snap_map, FILE_MAP_COPY, 0, 0, 0);
+    if (!snap_view) failSnapshot("Cannot map snapshot");
+    snap_size = size.QuadPart;
+
+    hdr = (SnapshotHeader*) snap_view;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 || hdr->size != snap_size)
+        failSnapshot("Not a snapshot file");
+
+    chacha_xor(key, hdr->nonce, snap_view + sizeof(SnapshotHeader), snap_size - sizeof(SnapshotHeader));
+    if (blobHash(snap_view + sizeof(SnapshotHeader), snap_size - sizeof(SnapshotHeader)) != hdr->check)
+        failSnapshot("Snapshot cannot be decrypted (wrong key?)");
+
+    info = (SnapshotInfo*) (snap_view + sizeof(SnapshotHeader));
+    sb = (SnapshotBoard*) (info + 1);
+    sseg = (SnapshotSegment*) (sb + info->boards);
+    sblob = (SnapshotBlob*) (sseg + info->segments);
+    sm = (SnapshotMessage*) (sblob + info->blobs);
+    ss = (SnapshotSession*) (sm + info->messages);
+    if ((char*) (ss + info->sessions) > snap_view + snap_size)
+        failSnapshot("Snapshot is truncated");
+
+    boards = calloc(info->boards + 1, sizeof(Board*));
+    segs = calloc(info->segments + 1, sizeof(Segment*));
+    blobs = calloc(info->blobs + 1, sizeof(Blob*));
+    if (!boards || !segs || !blobs) {
+        free(boards); free(segs); free(blobs);
+        failSnapshot("Not enough memory to restore snapshot");
+    }
+
+    for (k = 0; k < info->blobs; k++)
+        blobs[k] = adoptBlob(snap_view + sblob[k].off, sblob[k].len, sblob[k].hash);
+
+    for (k = 0; k < info->boards; k++, sm += n) {
+        n = sb[k].messages;
+        b = getBoard(sb[k].name, FALSE);
+        if (!b) {
+            b = getBoard(sb[k].name, TRUE);
+            if (!b) continue;
+            b->retention = sb[k].retention;
+        }
+        boards[k] = b;
+        startBoardAt(b, sb[k].first_id, sb[k].cold_count);
+
+        for (ULONGLONG i = 0; i < n; i++) {
+            if (sm[i].msg_type == MSG_TYPE_FILE) {
+                blob = sm[i].blob ? blobs[sm[i].blob - 1] : NULL;
+                if (blob) refBlob(blob);
+                m = newFileMessage(sm[i].src_id, sm[i].file_name, blob);
+            }
+            else if (!sm[i].seg && sm[i].msg_len <= MSG_INLINE_MAX)
+                m = newMessage(sm[i].src_id, snap_view + sm[i].off, (DWORD) sm[i].msg_len);
+            else if (sm[i].msg_len > MSG_TEXT_MAX) m = NULL;
+            else if ((m = calloc(1, sizeof(Message))) != NULL) {
+                m->src_id = sm[i].src_id;
+                m->msg_len = (DWORD) sm[i].msg_len;
+                m->msg_type = sm[i].msg_type;
+                if (sm[i].seg) {
+                    // Segment belongs to the board of its first message
+                    if (!segs[sm[i].seg - 1])
+                        segs[sm[i].seg - 1] = adoptSegment(b, snap_view + sseg[sm[i].seg - 1].off,
+                                                           sseg[sm[i].seg - 1].len, sseg[sm[i].seg - 1].raw_len);
+                    m->body_at = MSG_BODY_SEGMENT;
+                    m->seg = segs[sm[i].seg - 1];
+                    m->seg_off = sm[i].seg_off;
+                    if (m->seg) m->seg->msgs++;
+                }
+                else {
+                    m->body_at = MSG_BODY_HEAP;
+                    m->buf = snap_view + sm[i].off;
+                }
+            }
+            if (!m) break;
+            m->timestamp = toStamp(&sm[i].timestamp);
+
+            if (!appendMessage(b, m)) { freeMessage(m); break; }
+            restored++;
+        }
+        compactMessageHistory(b);
+    }
+
+    for (k = 0; k < info->sessions; k++)
+        if (ss[k].board < info->boards && boards[ss[k].board])
+            addSession(ss[k].token, boards[ss[k].board], ss[k].cursor, ss[k].oldest);
+
+    free(boards);
+    free(segs);
+    free(blobs);
+
+    fprintf(stderr, "[snapshot] Restored %lu boards, %llu messages, %llu blobs, %lu sessions from %s\r\n",
+            info->boards, restored, info->blobs, info->sessions, config->snapshot);
+    return TRUE;
+}
+
+static int comparePtr(const void* a, const void* b) {
+    return *(char* const*) a < *(char* const*) b ? -1 : *(char* const*) a > *(char* const*) b;
+}
+
+static ULONGLONG indexOfPtr(void** arr, ULONGLONG n, void* p) {
+    /**
+     * @brief Position of `p` in sorted array of pointers
+     */
+    void** found = bsearch(&p, arr, n, sizeof(void*), comparePtr);
+    return found ? (ULONGLONG) (found - arr) : 0;
+}
+
+static bool appendPtr(void*** arr, ULONGLONG* n, ULONGLONG* cap, void* p) {
+    void** tmp;
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        tmp = realloc(*arr, *cap * sizeof(void*));
+        if (!tmp) return FALSE;
+        *arr = tmp;
+    }
+    (*arr)[(*n)++] = p;
+    return TRUE;
+}
+
+static ULONGLONG uniquePtr(void** arr, ULONGLONG n) {
+    /**
+     * @brief Sort pointers, drop duplicates, return new count
+     */
+    ULONGLONG k = 0;
+    qsort(arr, n, sizeof(void*), comparePtr);
+    for (ULONGLONG i = 0; i < n; i++)
+        if (k == 0 || arr[k-1] != arr[i]) arr[k++] = arr[i];
+    return k;
+}
+
+bool saveSnapshot() {
+    /**
+     * @brief Write boards, blobs and sessions to snapshot file
+     * @details
+     *  Called on shutdown, when no client is connected. Cold messages are saved with their
+     *  compressed segments as is. File is written through a mapping to <path>.tmp,
+     *  encrypted in place and flushed. It replaces the old snapshot in replaceSnapshot(),
+     *  once that one is not mapped anymore: a crash in between keeps the previous one.
+     */
+    ServerConfig* config = getConfig();
+    BYTE key[CHACHA_KEY_LEN];
+    char tmp_path[MAX_PATH];
+    unsigned int r1 = 0, r2 = 0;
+    List *boards, *sessions;
+    Board* b;
+    Message* m;
+    Segment* seg;
+    Session* s;
+    void **segs = NULL, **blobs = NULL;
+    ULONGLONG n_segs = 0, cap_segs = 0, n_blobs = 0, cap_blobs = 0, n_msgs = 0;
+    ULONGLONG id, k, size, data, off;
+    DWORD n_boards, n_sessions, i;
+    HANDLE hf, hm;
+    char* view;
+    SnapshotHeader* hdr;
+    SnapshotInfo* info;
+    SnapshotBoard* sb;
+    SnapshotSegment* sseg;
+    SnapshotBlob* sblob;
+    SnapshotMessage* sm;
+    SnapshotSession* ss;
+    bool ok = TRUE;
+
+    if (!config->snapshot) return TRUE;
+    if (!loadSnapshotKey(key)) return FALSE;
+    if (strlen(config->snapshot) + 5 > MAX_PATH) return FALSE;
+    sprintf(tmp_path, "%s.tmp", config->snapshot);
+
+    EnterCriticalSection(&cs_boards);
+    boards = getBoardList();
+    sessions = getSessionList();
+    n_boards = boards->length;
+    n_sessions = sessions->length;
+
+    // Count records, collect segments and blobs (shared by messages)
+    data = 0;
+    for (Item* it = boards->head; it != NULL; it = it->next) {
+        b = it->data;
+        EnterCriticalSection(&b->cs_mh);
+        for (Item* j = b->segments->head; j != NULL; j = j->next) {
+            ok &= appendPtr(&segs, &n_segs, &cap_segs, j->data);
+            data += alignUp(((Segment*) j->data)->len);
+        }
+        for (id = b->first_id; id <= getLastMessageId(b); id++) {
+            m = getMessage(b, id);
+            n_msgs++;
+            if (m->body_at == MSG_BODY_FILE) {
+                if (m->file->blob) ok &= appendPtr(&blobs, &n_blobs, &cap_blobs, m->file->blob);
+            }
+            else if (m->body_at != MSG_BODY_SEGMENT) data += alignUp(m->msg_len + 1);
+        }
+        LeaveCriticalSection(&b->cs_mh);
+    }
+    n_segs = uniquePtr(segs, n_segs);
+    n_blobs = uniquePtr(blobs, n_blobs);
+    for (k = 0; k < n_blobs; k++)
+        data += alignUp(((Blob*) blobs[k])->len);
+
+    off = alignUp(sizeof(SnapshotHeader) + sizeof(SnapshotInfo) + n_boards * sizeof(SnapshotBoard)
+                  + n_segs * sizeof(SnapshotSegment) + n_blobs * sizeof(SnapshotBlob)
+                  + n_msgs * sizeof(SnapshotMessage) + n_sessions * sizeof(SnapshotSession));
+    size = off + data;
+
+    hf = CreateFileA(tmp_path,
+                     GENERIC_READ | GENERIC_WRITE,
+                     0,
+                     NULL,
+                     CREATE_ALWAYS,
+                     FILE_ATTRIBUTE_NORMAL,
+                     NULL);
+    hm = (ok && hf != INVALID_HANDLE_VALUE) ? CreateFileMappingA(hf, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL) : NULL;
+    view = hm ? MapViewOfFile(hm, FILE_MAP_WRITE, 0, 0, size) : NULL;
+    if (!view) {
+        LeaveCriticalSection(&cs_boards);
+        fprintf(stderr, "[snapshot] Cannot write %s\r\n", tmp_path);
+        printLastError();
+        if (hm) CloseHandle(hm);
+        if (hf != INVALID_HANDLE_VALUE) CloseHandle(hf);
+        free(segs);
+        free(blobs);
+        return FALSE;
+    }
+
+    hdr = (SnapshotHeader*) view;
+    info = (SnapshotInfo*) (hdr + 1);
+    sb = (SnapshotBoard*) (info + 1);
+    sseg = (SnapshotSegment*) (sb + n_boards);
+    sblob = (SnapshotBlob*) (sseg + n_segs);
+    sm = (SnapshotMessage*) (sblob + n_blobs);
+    ss = (SnapshotSession*) (sm + n_msgs);
+
+    info->boards = n_boards;
+    info->segments = n_segs;
+    info->blobs = n_blobs;
+    info->messages = n_msgs;
+    info->sessions = n_sessions;
+
+    for (k = 0; k < n_segs; k++) {
+        seg = segs[k];
+        sseg[k].off = off;
+        sseg[k].len = seg->len;
+        sseg[k].raw_len = seg->raw_len;
+        memcpy(view + off, seg->buf, seg->len);
+        off += alignUp(seg->len);
+    }
+    for (k = 0; k < n_blobs; k++) {
+        sblob[k].off = off;
+        sblob[k].len = ((Blob*) blobs[k])->len;
+        sblob[k].hash = ((Blob*) blobs[k])->hash;
+        memcpy(view + off, ((Blob*) blobs[k])->buf, sblob[k].len);
+        off += alignUp(sblob[k].len);
+    }
+
+    i = 0;
+    for (Item* it = boards->head; it != NULL; it = it->next, i++) {
+        b = it->data;
+        EnterCriticalSection(&b->cs_mh);
+        strcpy(sb[i].name, b->name);
+        sb[i].retention = b->retention;
+        sb[i].first_id = b->first_id;
+        sb[i].cold_count = b->cold_count;
+        sb[i].messages = getLastMessageId(b) - b->first_id + 1;
+
+        for (id = b->first_id; id <= getLastMessageId(b); id++, sm++) {
+            m = getMessage(b, id);
+            sm->msg_len = messageLen(m);
+            sm->src_id = m->src_id;
+            sm->msg_type = m->msg_type;
+            strcpy(sm->file_name, messageFileName(m));
+            fromStamp(m->timestamp, &sm->timestamp);
+
+            if (m->body_at == MSG_BODY_FILE) {
+                if (m->file->blob) sm->blob = indexOfPtr(blobs, n_blobs, m->file->blob) + 1;
+            }
+            else if (m->body_at == MSG_BODY_SEGMENT) {
+                sm->seg = indexOfPtr(segs, n_segs, m->seg) + 1;
+                sm->seg_off = m->seg_off;
+            }
+            else {
+                sm->off = off;
+                memcpy(view + off, getMessageBody(m), m->msg_len);
+                view[off + m->msg_len] = '\0';
+                off += alignUp(m->msg_len + 1);
+            }
+        }
+        LeaveCriticalSection(&b->cs_mh);
+    }
+
+    i = 0;
+    for (Item* it = sessions->head; it != NULL; it = it->next, i++) {
+        s = it->data;
+        strcpy(ss[i].token, s->token);
+        ss[i].cursor = s->cursor;
+        ss[i].oldest = s->oldest;
+        ss[i].board = 0;
+        k = 0;
+        for (Item* j = boards->head; j != NULL; j = j->next, k++)
+            if (j->data == s->board) ss[i].board = k;
+    }
+    LeaveCriticalSection(&cs_boards);
+
+    // Checksum of plain records, then encrypt everything after header with a fresh nonce
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    rand_s(&r1);
+    rand_s(&r2);
+    hdr->nonce = (ULONGLONG) r1 << 32 | r2;
+    hdr->size = size;
+    hdr->check = blobHash(view + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader));
+    chacha_xor(key, hdr->nonce, view + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader));
+
+    ok = FlushViewOfFile(view, 0);
+    UnmapViewOfFile(view);
+    CloseHandle(hm);
+    ok = ok && FlushFileBuffers(hf);
+    CloseHandle(hf);
+    free(segs);
+    free(blobs);
+
+    if (!ok) {
+        fprintf(stderr, "[snapshot] Cannot save snapshot to %s\r\n", tmp_path);
+        printLastError();
+        return FALSE;
+    }
+    fprintf(stderr, "[snapshot] Saved %lu boards, %llu messages, %llu blobs, %lu sessions (%llu bytes) to %s\r\n",
+            n_boards, n_msgs, n_blobs, n_sessions, size, tmp_path);
+    return TRUE;
+}
+
+bool replaceSnapshot() {
+    /**
+     * @brief Rename snapshot written by saveSnapshot() over the old one. Call after closeSnapshot()
+     * @details Windows does not replace a file that has a mapped view, and restored bodies and blobs
+     *  point into the view until boards and blob store are destroyed.
+     */
+    ServerConfig* config = getConfig();
+    char tmp_path[MAX_PATH];
+
+    if (!config->snapshot) return TRUE;
+    if (strlen(config->snapshot) + 5 > MAX_PATH) return FALSE;
+    sprintf(tmp_path, "%s.tmp", config->snapshot);
+    if (!MoveFileExA(tmp_path, config->snapshot, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        fprintf(stderr, "[snapshot] Cannot replace %s with %s\r\n", config->snapshot, tmp_path);
+        printLastError();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void closeSnapshot() {
+    /**
+     * @brief Unmap restored snapshot. Call after boards and blob store are destroyed
+     */
+    if (snap_view) UnmapViewOfFile(snap_view);
+    if (snap_map) CloseHandle(snap_map);
+    if (snap_file != INVALID_HANDLE_VALUE) CloseHandle(snap_file);
+    snap_view = NULL;
+    snap_map = NULL;
+    snap_file = INVALID_HANDLE_VALUE;
+    snap_size = 0;
+}
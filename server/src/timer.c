@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/timer.h"
+#include "../include/affinity.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+static CRITICAL_SECTION cs_timers;      // Lock for wheel, held while callbacks run
+static Timer* wheel[TIMER_LEVELS][TIMER_SLOTS];
+static volatile ULONGLONG now_tick;     // Next tick to process
+static ULONGLONG start_ms;              // GetTickCount64() of tick 0
+static HANDLE ticker;                   // timerThread()
+static volatile bool stop;
+
+static DWORD pending;
+static ULONGLONG fired;
+static volatile LONGLONG reaped_idle;
+static volatile LONGLONG reaped_stalled;
+
+
+static void linkTimer(Timer* t) {
+    /**
+     * @brief Put timer in slot of the lowest level that reaches its expiry. Caller holds cs_timers
+     * @details Expired timers go to the slot of the next tick.
+     */
+    LONGLONG delta = (LONGLONG) (t->expires - now_tick);
+    DWORD level = 0;
+    Timer** slot;
+
+    if (delta < 0)
+        slot = &wheel[0][now_tick & SLOT_MASK];
+    else {
+        while (level < TIMER_LEVELS - 1 && delta >= (1LL << (TIMER_SLOT_BITS * (level + 1)))) level++;
+        slot = &wheel[level][(t->expires >> (TIMER_SLOT_BITS * level)) & SLOT_MASK];
+    }
+
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void unlinkTimer(Timer* t) {
+    /**
+     * @brief Take timer out of its slot. Caller holds cs_timers
+     */
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static DWORD cascade(DWORD level, DWORD index) {
+    /**
+     * @brief Spread timers of a slot of `level` over lower levels
+     * @return index, so the caller cascades the level above when it is 0
+     */
+    Timer *t = wheel[level][index], *next;
+
+    wheel[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        linkTimer(t);
+    }
+    return index;
+}
+
+static void runTick() {
+    /**
+     * @brief Fire timers of the current tick. Caller holds cs_timers
+     */
+    DWORD index = now_tick & SLOT_MASK;
+    Timer* t;
+
+    if (!index && !cascade(1, (now_tick >> TIMER_SLOT_BITS) & SLOT_MASK))
+        cascade(2, (now_tick >> (2 * TIMER_SLOT_BITS)) & SLOT_MASK);
+    now_tick++;
+
+    // Callback may arm its timer again: it goes to a later slot, so the loop ends
+    while ((t = wheel[0][index]) != NULL) {
+        unlinkTimer(t);
+        pending--;
+        fired++;
+        t->fire(t);
+    }
+}
+
+static void timerThread() {
+    /**
+     * @brief Wheel thread: catch up with the clock every TIMER_TICK_MS
+     */
+    ULONGLONG target;
+
+    while (!stop) {
+        Sleep(TIMER_TICK_MS);
+        target = (GetTickCount64() - start_ms) / TIMER_TICK_MS;
+        EnterCriticalSection(&cs_timers);
+        while (now_tick < target) runTick();
+        LeaveCriticalSection(&cs_timers);
+    }
+}
+
+bool startTimers() {
+    /**
+     * @brief Start the wheel thread
+     */
+    DWORD dwt;
+
+    InitializeCriticalSection(&cs_timers);
+    memset(wheel, 0, sizeof(wheel));
+    now_tick = 0;
+    pending = 0;
+    start_ms = GetTickCount64();
+    stop = FALSE;
+
+    ticker = CreateThread(NULL, 0, (LPVOID) timerThread, NULL, 0, &dwt);
+    if (!ticker) {
+        fprintf(stderr, "[timers] Failed to create timer thread\r\n");
+        DeleteCriticalSection(&cs_timers);
+        return FALSE;
+    }
+    pinThread(ticker, CPUS_TIMER);
+    return TRUE;
+}
+
+void stopTimers() {
+    /**
+     * @brief Stop the wheel thread. Armed timers never fire after that
+     */
+    if (!ticker) return;
+    stop = TRUE;
+    WaitForSingleObject(ticker, INFINITE);
+    CloseHandle(ticker);
+    ticker = NULL;
+    DeleteCriticalSection(&cs_timers);
+}
+
+void initTimer(Timer* t, void (*fire)(Timer*), void* ctx) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->fire = fire;
+    t->ctx = ctx;
+}
+
+void armTimer(Timer* t, DWORD ms) {
+    /**
+     * @brief (Re)arm timer to fire in `ms` (rounded up to ticks, at least one tick)
+     */
+    ULONGLONG ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    EnterCriticalSection(&cs_timers);
+    if (t->pprev) unlinkTimer(t);
+    else pending++;
+    t->expires = now_tick + (ticks ? ticks : 1);
+    linkTimer(t);
+    LeaveCriticalSection(&cs_timers);
+}
+
+void cancelTimer(Timer* t) {
+    /**
+     * @brief Disarm timer
+     * @details Callbacks run under the same lock: once this returns, callback of `t` is not running
+     *  and will not run, so owner of timer can be freed.
+     */
+    EnterCriticalSection(&cs_timers);
+    if (t->pprev) {
+        unlinkTimer(t);
+        pending--;
+    }
+    LeaveCriticalSection(&cs_timers);
+}
+
+ULONGLONG getTimerTick() {
+    return now_tick;
+}
+
+void countReap(bool stalled) {
+    if (stalled) InterlockedIncrement64(&reaped_stalled);
+    else InterlockedIncrement64(&reaped_idle);
+}
+
+void getTimerStats(TimerStats* st) {
+    EnterCriticalSection(&cs_timers);
+    st->pending = pending;
+    st->fired = fired;
+    LeaveCriticalSection(&cs_timers);
+    st->reaped_idle = reaped_idle;
+    st->reaped_stalled = reaped_stalled;
+}
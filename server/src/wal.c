@@ -0,0 +1,448 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+#include <stdio.h>
+#include "../include/wal.h"
+#include "../include/config.h"
+#include "../include/blob.h"
+#include "../include/snapshot.h"
+#include "../../utils/include/chacha.h"
+
+#define alignWal(x) (((x) + WAL_ALIGN - 1) & ~(ULONGLONG) (WAL_ALIGN - 1))
+
+static HANDLE wal_file = INVALID_HANDLE_VALUE;
+static bool wal_encrypt;
+static BYTE wal_key[CHACHA_KEY_LEN];
+static volatile LONGLONG wal_nonce;     // Last nonce handed out (random start, then +1 per record)
+
+typedef struct WalWaiter {
+    struct WalWaiter* next;             // Other posters of the same batch
+    const char* buf;                    // Large record, written from poster's buffer (NULL = copied to batch)
+    ULONGLONG len;
+    bool done;                          // Batch was written, or failed
+    bool ok;                            // Record is on disk
+} WalWaiter;
+
+static CRITICAL_SECTION cs_wal;         // Lock for batch and counters below
+static CONDITION_VARIABLE cv_wal;       // Signaled after each group commit
+static char *wal_batch, *wal_spare;     // Batch being filled, buffer of batch being written
+static ULONGLONG wal_batch_len, wal_batch_cap, wal_spare_cap;
+static WalWaiter* wal_waiters;          // Posters of batch being filled (on their stacks)
+static ULONGLONG wal_end;               // End of the last good record in file (leader or reset only)
+static bool wal_flushing;               // A leader is writing a batch
+static WalStats wal_stats;
+
+
+static bool writeAll(HANDLE hf, const char* buf, ULONGLONG len) {
+    /**
+     * @brief WriteFile() takes 32-bit length, write large buffers in parts
+     */
+    DWORD dw, n;
+    for (ULONGLONG pos = 0; pos < len; pos += dw) {
+        n = len - pos < 0x40000000 ? (DWORD) (len - pos) : 0x40000000;
+        if (!WriteFile(hf, buf + pos, n, &dw, NULL) || dw == 0) return FALSE;
+    }
+    return TRUE;
+}
+
+static bool writeWalHeader() {
+    /**
+     * @brief Start empty log: cut file, write header
+     */
+    WalHeader hdr = {0};
+    LARGE_INTEGER zero = {0};
+
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.flags = wal_encrypt ? WAL_FLAG_ENCRYPTED : 0;
+    wal_end = sizeof(hdr);
+    return SetFilePointerEx(wal_file, zero, NULL, FILE_BEGIN) && SetEndOfFile(wal_file)
+           && writeAll(wal_file, (const char*) &hdr, sizeof(hdr)) && FlushFileBuffers(wal_file);
+}
+
+static bool writeBatch(const char* batch, ULONGLONG batch_len, WalWaiter* list, ULONGLONG* written, bool* broken) {
+    /**
+     * @brief Leader: write batch and large records of its posters, flush once
+     * @details On error the file is cut back to the last good record, so nothing torn stays
+     *  in the middle of the log. If even that fails, `broken` is set: log is off.
+     * @return FALSE if records of the batch are not durable
+     */
+    LARGE_INTEGER end;
+    bool ok = writeAll(wal_file, batch, batch_len);
+
+    *written = batch_len;
+    for (; ok && list; list = list->next) {
+        if (!list->buf) continue;
+        ok = writeAll(wal_file, list->buf, list->len);
+        *written += list->len;
+    }
+    if (ok && FlushFileBuffers(wal_file)) return TRUE;
+
+    fprintf(stderr, "[wal] Cannot write log, cutting it back to %llu bytes\r\n", wal_end);
+    printLastError();
+    *written = 0;
+    end.QuadPart = (LONGLONG) wal_end;
+    if (!SetFilePointerEx(wal_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(wal_file)) {
+        fprintf(stderr, "[wal] Cannot cut log, no posts are logged until next snapshot\r\n");
+        printLastError();
+        *broken = TRUE;
+    }
+    return FALSE;
+}
+
+static int compareRecords(const void* a, const void* b) {
+    /**
+     * @brief Order of replay: by board, then by #id
+     */
+    const WalRecord *x = *(WalRecord* const*) a, *y = *(WalRecord* const*) b;
+    int res = strcmp(x->board, y->board);
+    if (res) return res;
+    return x->msg_id < y->msg_id ? -1 : x->msg_id > y->msg_id;
+}
+
+Message* newLostMessage() {
+    /**
+     * @brief Placeholder for #id whose record did not reach the log (server crashed meanwhile)
+     */
+    return newMessage(0, WAL_LOST_MSG, sizeof(WAL_LOST_MSG) - 1);
+}
+
+Message* newReplayedMessage(const WalRecord* rec) {
+    /**
+     * @brief Make message from log record (body is copied: log is not kept mapped)
+     */
+    const char* body = (const char*) (rec + 1);
+    char name[FILE_NAME_LEN];
+    Blob* blob;
+    Message* m;
+
+    if (rec->msg_type == MSG_TYPE_FILE) {
+        blob = putBlob(body, rec->msg_len);
+        if (!blob) return NULL;
+        memcpy(name, rec->file_name, FILE_NAME_LEN);
+        name[FILE_NAME_LEN-1] = '\0';
+        m = newFileMessage(rec->src_id, name, blob);
+    }
+    else if (rec->msg_len <= MSG_TEXT_MAX) m = newMessage(rec->src_id, body, (DWORD) rec->msg_len);
+    else return NULL;
+    if (!m) return NULL;
+    m->timestamp = toStamp(&rec->timestamp);
+    return m;
+}
+
+static ULONGLONG replayWal(char* view, ULONGLONG size) {
+    /**
+     * @brief Decrypt and check records, add them to boards in #id order
+     * @details
+     *  Messages that are in boards already (restored from snapshot) are skipped.
+     *  #ids missing in the log get a placeholder, so #ids of the rest do not move.
+     * @return end of the last valid record
+     */
+    ULONGLONG off = sizeof(WalHeader), n = 0, cap = 0, replayed = 0, last;
+    WalFrame* f;
+    WalRecord **recs = NULL, **tmp, *rec;
+    Board* b = NULL;
+    Message* m;
+
+    // Collect valid records, stop at torn tail
+    while (off + sizeof(WalFrame) <= size) {
+        f = (WalFrame*) (view + off);
+        if (f->len < sizeof(WalRecord) || f->len > size - off - sizeof(WalFrame)) break;
+        if (wal_encrypt) chacha_xor(wal_key, f->nonce, (char*) (f + 1), f->len);
+        if (blobHash((const char*) (f + 1), f->len) != f->check) break;
+        rec = (WalRecord*) (f + 1);
+        if (rec->msg_len != f->len - sizeof(WalRecord)) break;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            tmp = realloc(recs, cap * sizeof(WalRecord*));
+            if (!tmp) break;
+            recs = tmp;
+        }
+        rec->board[BOARD_NAME_LEN-1] = '\0';
+        recs[n++] = rec;
+        off += alignWal(sizeof(WalFrame) + f->len);
+    }
+    if (off > size) off = size;
+
+    qsort(recs, n, sizeof(WalRecord*), compareRecords);
+    for (ULONGLONG i = 0; i < n; i++) {
+        if (!b || strcmp(b->name, recs[i]->board) != 0) {
+            if (b) compactMessageHistory(b);
+            b = getBoard(recs[i]->board, TRUE);
+        }
+        if (!b) continue;
+
+        last = getLastMessageId(b);
+        if (recs[i]->msg_id <= last) continue;
+        for (; last + 1 < recs[i]->msg_id; last++)
+            if (!(m = newLostMessage()) || !appendMessage(b, m)) break;
+
+        m = newReplayedMessage(recs[i]);
+        if (m && appendMessage(b, m)) replayed++;
+    }
+    if (b) compactMessageHistory(b);
+    free(recs);
+
+    fprintf(stderr, "[wal] Replayed %llu of %llu logged messages\r\n", replayed, n);
+    return off;
+}
+
+bool openWal() {
+    /**
+     * @brief Replay log into boards (after snapshot is restored), then open it for appending
+     * @return FALSE if log cannot be used: server should not start and lose it
+     */
+    ServerConfig* config = getConfig();
+    LARGE_INTEGER size, end;
+    WalHeader* hdr;
+    HANDLE hm;
+    char* view;
+    ULONGLONG valid = 0;
+    unsigned int r1 = 0, r2 = 0;
+
+    if (!config->wal) return TRUE;
+
+    wal_encrypt = config->snapshot_key != NULL;
+    if (wal_encrypt && !loadSnapshotKey(wal_key)) return FALSE;
+    rand_s(&r1);
+    rand_s(&r2);
+    wal_nonce = (LONGLONG) ((ULONGLONG) r1 << 32 | r2);
+
+    InitializeCriticalSection(&cs_wal);
+    InitializeConditionVariable(&cv_wal);
+    wal_batch = wal_spare = NULL;
+    wal_batch_len = wal_batch_cap = wal_spare_cap = 0;
+    wal_waiters = NULL;
+    wal_end = 0;
+    wal_flushing = FALSE;
+    memset(&wal_stats, 0, sizeof(WalStats));
+
+    wal_file = CreateFileA(config->wal,
+                           GENERIC_READ | GENERIC_WRITE,
+                           FILE_SHARE_READ,
+                           NULL,
+                           OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL,
+                           NULL);
+    if (wal_file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "[wal] Cannot open %s\r\n", config->wal);
+        printLastError();
+        return FALSE;
+    }
+
+    if (GetFileSizeEx(wal_file, &size) && size.QuadPart > 0) {
+        hm = CreateFileMappingA(wal_file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        view = hm ? MapViewOfFile(hm, FILE_MAP_COPY, 0, 0, 0) : NULL;
+        hdr = (WalHeader*) view;
+        if (!view || (ULONGLONG) size.QuadPart < sizeof(WalHeader) || memcmp(hdr->magic, WAL_MAGIC, sizeof(hdr->magic)) != 0)
+            fprintf(stderr, "[wal] %s is not a log\r\n", config->wal);
+        else if ((hdr->flags & WAL_FLAG_ENCRYPTED) && !wal_encrypt)
+            fprintf(stderr, "[wal] %s is encrypted, --snapshot-key is needed\r\n", config->wal);
+        else if (!(hdr->flags & WAL_FLAG_ENCRYPTED) && wal_encrypt)
+            fprintf(stderr, "[wal] %s is not encrypted, start without --snapshot-key to replay it\r\n", config->wal);
+        else
+            valid = replayWal(view, size.QuadPart);
+
+        if (view) UnmapViewOfFile(view);
+        if (hm) CloseHandle(hm);
+        if (!valid) { closeWal(); return FALSE; }
+
+        // Cut torn tail, append after the last valid record
+        wal_end = valid;
+        end.QuadPart = (LONGLONG) valid;
+        if (!SetFilePointerEx(wal_file, end, NULL, FILE_BEGIN) || !SetEndOfFile(wal_file)) {
+            closeWal();
+            return FALSE;
+        }
+    }
+    else if (!writeWalHeader()) {
+        closeWal();
+        return FALSE;
+    }
+
+    // Restored and replayed messages are durable already
+    EnterCriticalSection(&cs_boards);
+    for (Item* i = getBoardList()->head; i != NULL; i = i->next)
+        ((Board*) i->data)->durable_ids = ((Board*) i->data)->committed_ids;
+    LeaveCriticalSection(&cs_boards);
+
+    fprintf(stderr, "[wal] Logging posts to %s%s\r\n", config->wal, wal_encrypt ? " (encrypted)" : "");
+    return TRUE;
+}
+
+bool walAppend(Board* b, Message* m) {
+    /**
+     * @brief Log message just added to board and wait until it is on disk (group commit)
+     * @details
+     *  Records of all posting threads are gathered in one batch. A waiting thread becomes leader:
+     *  it writes the whole batch and calls FlushFileBuffers() once, outside of lock, while others
+     *  fill the next batch. Then every thread of that batch returns with the result of the write.
+     *  Record is built (and a file copied) outside of locks. Small ones are copied to the batch,
+     *  large ones are written by the leader from the poster's buffer.
+     *  Called after appendMessage(): clients of this server may see the post before it is durable,
+     *  ring and replicas do not (getDurableMessageId()).
+     * @return FALSE if log is enabled and message did not reach it
+     */
+    WalWaiter me = {0}, *list, *w;
+    WalFrame* f;
+    WalRecord* rec;
+    Blob* blob = NULL;
+    char *buf, *batch, *tmp;
+    ULONGLONG len, cap, batch_len, batch_cap, written = 0, records;
+    bool ok, broken;
+
+    if (wal_file == INVALID_HANDLE_VALUE) return TRUE;
+
+    // Copy message into record. It may be compacted or dropped by retention meanwhile
+    EnterCriticalSection(&b->cs_mh);
+    if (m->msg_id < b->first_id) {
+        LeaveCriticalSection(&b->cs_mh);
+        return TRUE;
+    }
+    len = alignWal(sizeof(WalFrame) + sizeof(WalRecord) + messageLen(m));
+    buf = calloc(1, len);
+    if (!buf) {
+        LeaveCriticalSection(&b->cs_mh);
+        fprintf(stderr, "[wal] No memory to log message #%llu\r\n", m->msg_id);
+        return FALSE;
+    }
+    f = (WalFrame*) buf;
+    rec = (WalRecord*) (f + 1);
+    strcpy(rec->board, b->name);
+    rec->msg_id = m->msg_id;
+    rec->msg_len = messageLen(m);
+    rec->src_id = m->src_id;
+    rec->msg_type = m->msg_type;
+    strcpy(rec->file_name, messageFileName(m));
+    fromStamp(m->timestamp, &rec->timestamp);
+    blob = messageBlob(m);
+    if (blob) holdBlob(blob);
+    else memcpy(rec + 1, getMessageBody(m), m->msg_len);
+    LeaveCriticalSection(&b->cs_mh);
+
+    if (blob) {
+        memcpy(rec + 1, blob->buf, blob->len);
+        releaseBlob(blob);
+    }
+
+    f->len = sizeof(WalRecord) + rec->msg_len;
+    f->check = blobHash((const char*) rec, f->len);
+    f->nonce = (ULONGLONG) InterlockedIncrement64(&wal_nonce);
+    if (wal_encrypt) chacha_xor(wal_key, f->nonce, (char*) rec, f->len);
+    if (len > WAL_INLINE_MAX) {
+        me.buf = buf;
+        me.len = len;
+    }
+
+    EnterCriticalSection(&cs_wal);
+    if (wal_stats.broken) {
+        wal_stats.failed++;
+        LeaveCriticalSection(&cs_wal);
+        free(buf);
+        return FALSE;
+    }
+    if (!me.buf && wal_batch_len + len > wal_batch_cap) {
+        cap = wal_batch_len + len > 2 * wal_batch_cap ? wal_batch_len + len : 2 * wal_batch_cap;
+        tmp = realloc(wal_batch, cap);
+        if (!tmp) {
+            LeaveCriticalSection(&cs_wal);
+            free(buf);
+            fprintf(stderr, "[wal] No memory to log message #%llu\r\n", m->msg_id);
+            return FALSE;
+        }
+        wal_batch = tmp;
+        wal_batch_cap = cap;
+    }
+    if (!me.buf) {
+        memcpy(wal_batch + wal_batch_len, buf, len);
+        wal_batch_len += len;
+    }
+    me.next = wal_waiters;
+    wal_waiters = &me;
+
+    while (!me.done) {
+        if (wal_flushing) {
+            SleepConditionVariableCS(&cv_wal, &cs_wal, INFINITE);
+            continue;
+        }
+
+        // Leader: take current batch and its posters, let others start the next one
+        wal_flushing = TRUE;
+        batch = wal_batch;
+        batch_len = wal_batch_len;
+        batch_cap = wal_batch_cap;
+        list = wal_waiters;
+        wal_batch = wal_spare;
+        wal_batch_cap = wal_spare_cap;
+        wal_batch_len = 0;
+        wal_waiters = NULL;
+        broken = wal_stats.broken;
+        LeaveCriticalSection(&cs_wal);
+
+        ok = !broken && writeBatch(batch, batch_len, list, &written, &broken);
+
+        EnterCriticalSection(&cs_wal);
+        if (batch_cap > WAL_BATCH_KEEP) {
+            free(batch);
+            batch = NULL;
+            batch_cap = 0;
+        }
+        wal_spare = batch;
+        wal_spare_cap = batch_cap;
+        wal_end += written;
+        wal_stats.broken = broken;
+        for (w = list, records = 0; w; w = w->next, records++) {
+            w->ok = ok;
+            w->done = TRUE;
+        }
+        if (ok) {
+            wal_stats.records += records;
+            wal_stats.batches++;
+            wal_stats.bytes += written;
+        }
+        else wal_stats.failed += records;
+        wal_flushing = FALSE;
+        WakeAllConditionVariable(&cv_wal);
+    }
+    LeaveCriticalSection(&cs_wal);
+    free(buf);
+
+    if (!me.ok)
+        fprintf(stderr, "[wal] Message #%llu of '%s' is not durable\r\n", m->msg_id, b->name);
+    return me.ok;
+}
+
+void resetWal() {
+    /**
+     * @brief Empty the log once its messages are in a saved snapshot
+     */
+    if (wal_file == INVALID_HANDLE_VALUE) return;
+    EnterCriticalSection(&cs_wal);
+    while (wal_flushing) SleepConditionVariableCS(&cv_wal, &cs_wal, INFINITE);
+    wal_stats.broken = !writeWalHeader();
+    if (wal_stats.broken) {
+        fprintf(stderr, "[wal] Cannot reset log, no posts are logged until next snapshot\r\n");
+        printLastError();
+    }
+    LeaveCriticalSection(&cs_wal);
+}
+
+void closeWal() {
+    if (wal_file == INVALID_HANDLE_VALUE) return;
+    CloseHandle(wal_file);
+    wal_file = INVALID_HANDLE_VALUE;
+    free(wal_batch);
+    free(wal_spare);
+    wal_batch = wal_spare = NULL;
+    DeleteCriticalSection(&cs_wal);
+}
+
+bool getWalStats(WalStats* st) {
+    /**
+     * @brief Counters of log since start. FALSE if log is disabled
+     */
+    if (wal_file == INVALID_HANDLE_VALUE) return FALSE;
+    EnterCriticalSection(&cs_wal);
+    *st = wal_stats;
+    LeaveCriticalSection(&cs_wal);
+    return TRUE;
+}
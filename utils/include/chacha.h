@@ -0,0 +1,21 @@
+#ifndef LAB6_CHACHA_H
+#define LAB6_CHACHA_H
+
+#include <windows.h>
+
+/*
+ *      ChaCha20 stream cipher (original variant: 64-bit nonce, 64-bit block counter)
+ *
+ *      state:      <constants:4> <key:8> <counter:2> <nonce:2>   (32-bit words)
+ *      block:      20 rounds over state, added to state, 64 bytes of keystream
+ *
+ *      Encryption and decryption are the same operation (XOR with keystream).
+ *      A (key, nonce) pair must never be used for two different buffers.
+ */
+
+#define CHACHA_KEY_LEN 32
+#define CHACHA_BLOCK_LEN 64
+
+void chacha_xor(const BYTE* key, ULONGLONG nonce, char* buf, ULONGLONG len);
+
+#endif //LAB6_CHACHA_H
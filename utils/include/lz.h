@@ -0,0 +1,25 @@
+#ifndef LAB6_LZ_H
+#define LAB6_LZ_H
+
+#include <windows.h>
+
+/*
+ *      Small LZ77 codec (LZ4-like block format)
+ *
+ *      sequence:   <token> [literal len+] <literals> <offset:2> [match len+]
+ *      token:      high 4 bits = literal length, low 4 bits = match length - 4
+ *                  (15 means length continues in following bytes, 255 = continue)
+ *
+ *      Last sequence has literals only. Offsets are up to 64 KB back.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+
+DWORD lz_compress(const char* src, DWORD len, char* dst, DWORD cap);
+int lz_decompress(const char* src, DWORD len, char* dst, DWORD cap);
+
+#endif //LAB6_LZ_H
@@ -0,0 +1,100 @@
+#ifndef LAB6_MUX_H
+#define LAB6_MUX_H
+
+#include <winsock2.h>
+#include <windows.h>
+#include "list.h"
+
+/*
+ *      Stream multiplexer: many logical streams over one socket
+ *
+ *      frame format:   <stream_id:4> <flags:1> <len:4> <payload:len>
+ *
+ *      Each logical message on a stream is split into frames of at most MUX_CHUNK_LEN bytes,
+ *      the last frame has FRAME_FIN flag. Sender thread takes one chunk from each pending
+ *      stream in turn (round-robin), so a short chat message never waits for a large file.
+ *
+ *      If compression is negotiated for connection, payload of a frame may be compressed
+ *      with lz_compress() (FRAME_LZ flag, len = compressed length). Receiver always accepts it.
+ */
+
+#ifdef DEBUG
+#define MUX_CHUNK_LEN 64
+#else
+#define MUX_CHUNK_LEN 16384     /*  16 KB */
+#endif
+
+#define FRAME_HEADER_LEN 9
+#define FRAME_FIN 0x01
+#define FRAME_LZ 0x02
+
+#define MUX_LZ_MIN_LEN 128      // Do not compress smaller chunks
+#define MUX_LZ_MAX_FAILS 4      // Stop compressing a stream after that many incompressible chunks
+
+#define MUX_STREAM_CONTROL 0    // chat, commands and /sync responses
+#define MUX_STREAM_HEARTBEAT 0xFFFFFFFF     // empty frames keeping idle connection alive, ignored by receiver
+#define MUX_STREAM_NOTICE 0xFFFFFFFE        // notices of server that answer no request (/handoff), and replies to them
+
+
+typedef struct MuxFrame {
+    DWORD stream_id;                    // Stream #id
+    BYTE flags;                         // FRAME_FIN, ...
+    DWORD len;                          // Payload length
+    char *buf;                          // Payload (NULL if empty)
+} MuxFrame;
+
+typedef struct MuxOut {
+    char *buf;                          // Data to send
+    ULONGLONG len;                      // Length of data
+    ULONGLONG pos;                      // Bytes already sent
+    bool fin;                           // Data ends a message
+    void (*release)(void*);             // Called on `ctx` once sent (if not NULL)
+    void *ctx;
+    bool pause;                         // Sender pauses once this is sent (mux_pause)
+} MuxOut;
+
+typedef struct MuxStream {
+    DWORD stream_id;
+    List *queue;                        // Pending MuxOut's, FIFO
+    DWORD lz_fails;                     // Chunks that did not compress
+} MuxStream;
+
+typedef struct MuxIn {
+    DWORD stream_id;
+    char *buf;                          // Reassembled payload
+    ULONGLONG len;
+    ULONGLONG size;
+    bool dropped;                       // Message too large, discard until FIN
+} MuxIn;
+
+typedef struct Mux {
+    SOCKET sock;
+    CRITICAL_SECTION cs;                // Lock for `streams`
+    HANDLE ev_ready;                    // Set when data is queued
+    HANDLE sender;                      // mux_senderThread()
+    List *streams;                      // Active outgoing MuxStream's, round-robin order
+    List *partial;                      // Incoming MuxIn's, not finished yet
+    DWORD next_stream;                  // Next free stream #id (for mux_openstream)
+    bool stop;
+    bool dead;                          // send() failed, drop everything
+    bool paused;                        // Sender sends nothing until mux_resume()
+    bool compress;                      // Compress outgoing frames (negotiated)
+    ULONGLONG bytes_raw;                // Payload bytes sent, before compression
+    ULONGLONG bytes_sent;               // Payload bytes sent, after compression
+} Mux;
+
+
+Mux* mux_init(SOCKET sock);
+void mux_close(Mux* m);
+
+DWORD mux_openstream(Mux* m);
+
+bool mux_send(Mux* m, DWORD stream_id, const char* buf, ULONGLONG len, bool fin);
+bool mux_sendref(Mux* m, DWORD stream_id, char* buf, ULONGLONG len, bool fin, void (*release)(void*), void* ctx);
+bool mux_pause(Mux* m, DWORD stream_id, const char* buf, ULONGLONG len);
+void mux_resume(Mux* m);
+
+int mux_recvframe(Mux* m, MuxFrame* f);
+LONGLONG mux_collect(Mux* m, MuxFrame* f, char** ptr);
+
+#endif //LAB6_MUX_H
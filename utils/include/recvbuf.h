@@ -3,15 +3,21 @@
 
 #include <winsock2.h>
 
+// Sizes are 64-bit, MAX_BUF_LEN may be raised with -DMAX_BUF_LEN=<bytes>
 #ifdef DEBUG
 #define BASE_BUF_LEN 32
-#define MAX_BUF_LEN 256
+#ifndef MAX_BUF_LEN
+#define MAX_BUF_LEN 256ULL
+#endif
 #else
 #define BASE_BUF_LEN 1048576   /*   1 MB */
-#define MAX_BUF_LEN 104857600  /* 100 MB */
+#ifndef MAX_BUF_LEN
+#define MAX_BUF_LEN 104857600ULL  /* 100 MB */
+#endif
 #endif
 
-int recvuntil(char delim, char **ptr, SOCKET sock);
-int recvlen(DWORD len, char **ptr, SOCKET sock);
+LONGLONG recvuntil(char delim, char **ptr, SOCKET sock);
+LONGLONG recvlen(ULONGLONG len, char **ptr, SOCKET sock);
+void recvrelease();
 
 #endif //LAB6_RECVBUF_H
@@ -0,0 +1,77 @@
+#ifndef LAB6_RING_H
+#define LAB6_RING_H
+
+#include <windows.h>
+
+/*
+ *      Shared-memory ring of published messages (server -> local consumers)
+ *
+ *      mapping "<name>":        <RingHeader, one page> <data: `size` bytes, power of 2>
+ *      mapping "<name>-ctl":    <RingCtl>  (written by consumers)
+ *      semaphore "<name>-wake": released once per waiting consumer after a record is published
+ *
+ *      One writer appends records at `head` (bytes written since start, never wraps), a record
+ *      that does not fit before the end of data is preceded by a RING_TYPE_PAD record.
+ *      Consumers map data read-only and keep their own position, so any number of them read
+ *      without locks and without syscalls while there is data. Writer never waits for them:
+ *      a consumer `size` bytes behind is lapped, it checks that after reading a record
+ *      (ring_next()) and skips to `head`. ring_read() does both and copies the record out.
+ */
+
+#define RING_MAGIC "6CHRING1"
+#define RING_HEADER_LEN 4096
+#define RING_ALIGN 8
+#define RING_BOARD_LEN 32               // Same as BOARD_NAME_LEN of server
+#define RING_TYPE_MSG 1                 // Same as MSG_TYPE_MSG of server
+#define RING_TYPE_FILE 2                // Same as MSG_TYPE_FILE of server, body is file name
+#define RING_TYPE_PAD 0xFF              // Skip to the beginning of data
+#define RING_BODY_MAX(size) ((size) / 4 - sizeof(RingRecord))   // Longer bodies are cut by writer
+
+
+typedef struct RingHeader {
+    char magic[8];
+    ULONGLONG size;                     // Bytes of data
+    ULONGLONG serial;                   // Changes when server restarts (consumers start over)
+    volatile ULONGLONG head;            // Bytes published since start, end of last complete record
+    volatile ULONGLONG records;         // Records published since start
+} RingHeader;
+
+typedef struct RingCtl {
+    volatile LONG waiters;              // Consumers about to sleep on the semaphore
+} RingCtl;
+
+typedef struct RingRecord {
+    DWORD len;                          // Whole record with body, multiple of RING_ALIGN
+    BYTE type;                          // Message type of server, RING_TYPE_PAD
+    BYTE reserved[3];
+    ULONGLONG msg_id;                   // #id in board
+    ULONGLONG msg_len;                  // Full length of message (body may be cut)
+    DWORD src_id;                       // Sender #id
+    DWORD body_len;                     // Bytes of body following record
+    SYSTEMTIME timestamp;
+    char board[RING_BOARD_LEN];
+} RingRecord;
+
+typedef struct Ring {
+    HANDLE map, ctl_map, wake;
+    RingHeader *hdr;
+    RingCtl *ctl;
+    char *data;
+    ULONGLONG pos;                      // Consumer: next record to read
+    ULONGLONG serial;                   // Consumer: serial of writer at `pos`
+    ULONGLONG lost;                     // Consumer: bytes skipped when lapped or after restart
+} Ring;
+
+
+Ring* ring_create(const char* name, ULONGLONG size);
+bool ring_write(Ring* r, RingRecord* rec, const char* body);
+
+Ring* ring_open(const char* name);
+const RingRecord* ring_peek(Ring* r);
+bool ring_next(Ring* r);
+bool ring_read(Ring* r, RingRecord* rec, char* body, DWORD cap);
+void ring_wait(Ring* r, DWORD ms);
+
+void ring_close(Ring* r);
+
+#endif //LAB6_RING_H
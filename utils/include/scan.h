@@ -0,0 +1,20 @@
+#ifndef LAB6_SCAN_H
+#define LAB6_SCAN_H
+
+#include <windows.h>
+
+/*
+ *      Delimiter scanner
+ *
+ *      Looks for any of up to SCAN_DELIMS_MAX delimiter bytes, 16 (SSE2) or 32 (AVX2)
+ *      bytes per step. AVX2 is used if CPU has it (checked once), bytes left over
+ *      at the end and CPUs without SSE2 take the scalar loop.
+ */
+
+#define SCAN_DELIMS_MAX 4
+
+
+ULONGLONG scan_find(const char* buf, ULONGLONG len, const char* delims, DWORD n_delims);
+ULONGLONG scan_split(const char* buf, ULONGLONG len, const char* delims, DWORD n_delims, ULONGLONG* offs, ULONGLONG max);
+
+#endif //LAB6_SCAN_H
@@ -0,0 +1,70 @@
+#include <string.h>
+#include "../include/chacha.h"
+
+#define CHACHA_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define CHACHA_QR(a, b, c, d)                       \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 16);         \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 12);         \
+    a += b; d ^= a; d = CHACHA_ROTL(d, 8);          \
+    c += d; b ^= c; b = CHACHA_ROTL(b, 7);
+
+static inline DWORD chacha_load32(const BYTE* p) {
+    return (DWORD) p[0] | (DWORD) p[1] << 8 | (DWORD) p[2] << 16 | (DWORD) p[3] << 24;
+}
+
+static void chacha_block(const DWORD* state, BYTE* out) {
+    /**
+     * @brief One block of keystream (20 rounds), little-endian
+     */
+    DWORD x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        // Column round
+        CHACHA_QR(x[0], x[4], x[8],  x[12])
+        CHACHA_QR(x[1], x[5], x[9],  x[13])
+        CHACHA_QR(x[2], x[6], x[10], x[14])
+        CHACHA_QR(x[3], x[7], x[11], x[15])
+        // Diagonal round
+        CHACHA_QR(x[0], x[5], x[10], x[15])
+        CHACHA_QR(x[1], x[6], x[11], x[12])
+        CHACHA_QR(x[2], x[7], x[8],  x[13])
+        CHACHA_QR(x[3], x[4], x[9],  x[14])
+    }
+    for (int i = 0; i < 16; i++) {
+        x[i] += state[i];
+        out[4*i]   = (BYTE) x[i];
+        out[4*i+1] = (BYTE) (x[i] >> 8);
+        out[4*i+2] = (BYTE) (x[i] >> 16);
+        out[4*i+3] = (BYTE) (x[i] >> 24);
+    }
+}
+
+void chacha_xor(const BYTE* key, ULONGLONG nonce, char* buf, ULONGLONG len) {
+    /**
+     * @brief Encrypt or decrypt `len` bytes of `buf` in place with 32-byte `key`
+     */
+    DWORD state[16];
+    BYTE ks[CHACHA_BLOCK_LEN];
+    ULONGLONG counter = 0, pos, n;
+
+    state[0] = 0x61707865;      // "expand 32-byte k"
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        state[4+i] = chacha_load32(key + 4*i);
+    state[14] = (DWORD) nonce;
+    state[15] = (DWORD) (nonce >> 32);
+
+    for (pos = 0; pos < len; pos += n, counter++) {
+        state[12] = (DWORD) counter;
+        state[13] = (DWORD) (counter >> 32);
+        chacha_block(state, ks);
+
+        n = len - pos < CHACHA_BLOCK_LEN ? len - pos : CHACHA_BLOCK_LEN;
+        for (ULONGLONG i = 0; i < n; i++)
+            buf[pos+i] ^= ks[i];
+    }
+}
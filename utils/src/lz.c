@@ -0,0 +1,127 @@
+#include <string.h>
+#include "../include/lz.h"
+
+static inline DWORD lz_read32(const BYTE* p) {
+    DWORD x;
+    memcpy(&x, p, sizeof(DWORD));
+    return x;
+}
+
+static inline DWORD lz_hash(DWORD seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static BYTE* lz_putlen(BYTE* op, DWORD len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (BYTE) len;
+    return op;
+}
+
+DWORD lz_compress(const char* src, DWORD len, char* dst, DWORD cap) {
+    /**
+     * @brief Compress `len` bytes of `src` into `dst`
+     * @return compressed length, or 0 if it does not fit into `cap` bytes (data is incompressible)
+     */
+    DWORD table[1 << LZ_HASH_BITS] = {0};
+    const BYTE *base = (const BYTE*) src, *ip = base, *anchor = base, *ref;
+    const BYTE *end = base + len, *mf_limit = end - LZ_MF_LIMIT, *match_limit = end - LZ_LAST_LITERALS;
+    BYTE *op = (BYTE*) dst, *oend = op + cap, *token;
+    DWORD seq, h, lit_len, match_len, step;
+
+    if (len >= LZ_MF_LIMIT) {
+        for (ip++; ip < mf_limit; ) {
+            seq = lz_read32(ip);
+            h = lz_hash(seq);
+            ref = base + table[h];
+            table[h] = ip - base;
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                // No match: skip faster through incompressible data
+                step = 1 + ((ip - anchor) >> 6);
+                ip += step;
+                continue;
+            }
+
+            match_len = LZ_MIN_MATCH;
+            while (ip + match_len < match_limit && ref[match_len] == ip[match_len]) match_len++;
+
+            lit_len = ip - anchor;
+            if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > oend) return 0;
+
+            token = op++;
+            *token = (BYTE) ((lit_len < 15 ? lit_len : 15) << 4);
+            if (lit_len >= 15) op = lz_putlen(op, lit_len - 15);
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            *op++ = (BYTE) (ip - ref);
+            *op++ = (BYTE) ((ip - ref) >> 8);
+
+            match_len -= LZ_MIN_MATCH;
+            *token |= (BYTE) (match_len < 15 ? match_len : 15);
+            if (match_len >= 15) op = lz_putlen(op, match_len - 15);
+
+            ip += match_len + LZ_MIN_MATCH;
+            anchor = ip;
+        }
+    }
+
+    // Last literals
+    lit_len = end - anchor;
+    if (op + 1 + lit_len / 255 + 1 + lit_len > oend) return 0;
+    token = op++;
+    *token = (BYTE) ((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15) op = lz_putlen(op, lit_len - 15);
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - (BYTE*) dst;
+}
+
+int lz_decompress(const char* src, DWORD len, char* dst, DWORD cap) {
+    /**
+     * @brief Decompress `len` bytes of `src` into `dst`
+     * @return decompressed length, or -1 if input is malformed or does not fit into `cap` bytes
+     */
+    const BYTE *ip = (const BYTE*) src, *iend = ip + len, *ref;
+    BYTE *op = (BYTE*) dst, *oend = op + cap, b;
+    DWORD token, lit_len, match_len, offset;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        lit_len = token >> 4;
+        if (lit_len == 15)
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        if (lit_len > (DWORD) (iend - ip) || lit_len > (DWORD) (oend - op)) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Last sequence has no match
+        if (ip >= iend) break;
+
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (DWORD) (op - (BYTE*) dst)) return -1;
+
+        match_len = token & 15;
+        if (match_len == 15)
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (DWORD) (oend - op)) return -1;
+
+        // Match may overlap output, copy byte by byte
+        for (ref = op - offset; match_len--; ) *op++ = *ref++;
+    }
+    return op - (BYTE*) dst;
+}
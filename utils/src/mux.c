@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include "../include/mux.h"
+#include "../include/recvbuf.h"
+#include "../include/lz.h"
+
+
+static void mux_senderThread(Mux* m);
+
+
+Mux* mux_init(SOCKET sock) {
+    /**
+     * @brief Create multiplexer for socket and launch its sender thread
+     */
+    DWORD dwt;
+    Mux* m = calloc(1, sizeof(Mux));
+    if (!m) return NULL;
+
+    m->sock = sock;
+    m->streams = list();
+    m->partial = list();
+    m->next_stream = MUX_STREAM_CONTROL + 1;
+    InitializeCriticalSection(&m->cs);
+    m->ev_ready = CreateEventA(NULL, FALSE, FALSE, NULL);
+
+    // CreateThread() and CreateEvent() return NULL on failure, not INVALID_HANDLE_VALUE
+    if (m->streams && m->partial && m->ev_ready)
+        m->sender = CreateThread(NULL, 0, (LPVOID) mux_senderThread, (LPVOID) m, 0, &dwt);
+    if (!m->sender) {
+        if (m->ev_ready) CloseHandle(m->ev_ready);
+        DeleteCriticalSection(&m->cs);
+        free(m->streams);
+        free(m->partial);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+static void mux_releaseOut(MuxOut* o) {
+    if (o->release) o->release(o->ctx);
+    free(o);
+}
+
+static void mux_dropAll(Mux* m) {
+    /**
+     * @brief Release all pending outgoing data. Caller holds m->cs
+     */
+    MuxStream* s;
+    while ((s = list_pop(m->streams, 0)) != NULL) {
+        while (s->queue->length)
+            mux_releaseOut(list_pop(s->queue, 0));
+        free(s->queue);
+        free(s);
+    }
+}
+
+void mux_close(Mux* m) {
+    /**
+     * @brief Stop sender thread, drop pending and partial data, free multiplexer
+     * @details Socket itself is not closed here, it belongs to caller.
+     */
+    MuxIn* in;
+    if (!m) return;
+
+    EnterCriticalSection(&m->cs);
+    m->stop = TRUE;
+    LeaveCriticalSection(&m->cs);
+    SetEvent(m->ev_ready);
+
+    WaitForSingleObject(m->sender, INFINITE);
+    CloseHandle(m->sender);
+    CloseHandle(m->ev_ready);
+
+    mux_dropAll(m);
+    free(m->streams);
+
+    while ((in = list_pop(m->partial, 0)) != NULL) {
+        free(in->buf);
+        free(in);
+    }
+    free(m->partial);
+
+    DeleteCriticalSection(&m->cs);
+    free(m);
+}
+
+DWORD mux_openstream(Mux* m) {
+    /**
+     * @brief Reserve new stream #id for a request (download, upload, ...)
+     */
+    DWORD id;
+    EnterCriticalSection(&m->cs);
+    id = m->next_stream++;
+    if (m->next_stream == MUX_STREAM_NOTICE) m->next_stream += 2;
+    if (m->next_stream == MUX_STREAM_CONTROL) m->next_stream++;
+    LeaveCriticalSection(&m->cs);
+    return id;
+}
+
+bool mux_sendref(Mux* m, DWORD stream_id, char* buf, ULONGLONG len, bool fin, void (*release)(void*), void* ctx) {
+    /**
+     * @brief Queue data for sending without copying it
+     * @details
+     *  `buf` must stay valid until release(ctx) is called by the sender thread.
+     *  Returns immediately. Data queued on the same stream is sent in order,
+     *  different streams are interleaved by chunks.
+     */
+    MuxStream* s = NULL;
+    MuxOut* o;
+    Item* i;
+
+    o = calloc(1, sizeof(MuxOut));
+    if (!o) {
+        if (release) release(ctx);
+        return FALSE;
+    }
+    o->buf = buf;
+    o->len = len;
+    o->fin = fin;
+    o->release = release;
+    o->ctx = ctx;
+
+    EnterCriticalSection(&m->cs);
+    if (m->dead || m->stop) {
+        LeaveCriticalSection(&m->cs);
+        mux_releaseOut(o);
+        return FALSE;
+    }
+
+    // Find pending stream, or create a new one at the end of round-robin queue
+    for (i = m->streams->head; i != NULL; i = i->next)
+        if (((MuxStream*) i->data)->stream_id == stream_id) {
+            s = i->data;
+            break;
+        }
+    if (!s) {
+        s = calloc(1, sizeof(MuxStream));
+        if (!s) {
+            LeaveCriticalSection(&m->cs);
+            mux_releaseOut(o);
+            return FALSE;
+        }
+        s->stream_id = stream_id;
+        s->queue = list();
+        list_append(m->streams, s);
+    }
+    list_append(s->queue, o);
+    LeaveCriticalSection(&m->cs);
+
+    SetEvent(m->ev_ready);
+    return TRUE;
+}
+
+bool mux_send(Mux* m, DWORD stream_id, const char* buf, ULONGLONG len, bool fin) {
+    /**
+     * @brief Queue a copy of data for sending
+     */
+    char* copy = NULL;
+    if (len) {
+        copy = malloc(len);
+        if (!copy) return FALSE;
+        memcpy(copy, buf, len);
+    }
+    return mux_sendref(m, stream_id, copy, len, fin, free, copy);
+}
+
+bool mux_pause(Mux* m, DWORD stream_id, const char* buf, ULONGLONG len) {
+    /**
+     * @brief Send message as the very next frame, then hold everything queued until mux_resume()
+     * @details Peer sees it as the last frame for a while: e.g. client answers /handoff with it,
+     *  so server knows nothing else of client is in flight. Message must fit one frame.
+     */
+    MuxStream* s;
+    MuxOut* o;
+
+    if (len > MUX_CHUNK_LEN) return FALSE;
+    s = calloc(1, sizeof(MuxStream));
+    o = calloc(1, sizeof(MuxOut));
+    if (!s || !o || (len && !(o->buf = malloc(len)))) {
+        free(s);
+        free(o);
+        return FALSE;
+    }
+    memcpy(o->buf, buf, len);
+    o->len = len;
+    o->fin = TRUE;
+    o->release = free;
+    o->ctx = o->buf;
+    o->pause = TRUE;
+    s->stream_id = stream_id;
+    s->queue = list();
+
+    // Own stream at the head of round-robin queue: nothing else goes before it
+    EnterCriticalSection(&m->cs);
+    if (m->dead || m->stop) {
+        LeaveCriticalSection(&m->cs);
+        free(s->queue);
+        free(s);
+        mux_releaseOut(o);
+        return FALSE;
+    }
+    list_append(s->queue, o);
+    list_push(m->streams, s);
+    m->paused = FALSE;
+    LeaveCriticalSection(&m->cs);
+
+    SetEvent(m->ev_ready);
+    return TRUE;
+}
+
+void mux_resume(Mux* m) {
+    /**
+     * @brief Send what was queued while paused
+     */
+    EnterCriticalSection(&m->cs);
+    m->paused = FALSE;
+    LeaveCriticalSection(&m->cs);
+    SetEvent(m->ev_ready);
+}
+
+static void mux_senderThread(Mux* m) {
+    /**
+     * @brief Sender loop: take one chunk from each pending stream in turn and send it as a frame
+     * @details
+     *  Consecutive small pieces of one stream are coalesced into a single frame,
+     *  frame ends early at the end of a message (FIN).
+     *  With compression on, chunk is sent compressed if it gets smaller. Compression runs after
+     *  the chunk is taken out of the queue, outside of lock: producers and timers do not wait for it.
+     */
+    char raw[FRAME_HEADER_LEN + MUX_CHUNK_LEN], lz[FRAME_HEADER_LEN + MUX_CHUNK_LEN], *frame;
+    DWORD len, raw_len, n, sent, stream_id;
+    ULONGLONG left;
+    BYTE flags;
+    bool compress;
+    MuxStream* s;
+    MuxOut* o;
+    Item* i;
+    int res;
+
+    while (TRUE) {
+        EnterCriticalSection(&m->cs);
+        while (!m->stop && (!m->streams->length || m->paused)) {
+            LeaveCriticalSection(&m->cs);
+            WaitForSingleObject(m->ev_ready, INFINITE);
+            EnterCriticalSection(&m->cs);
+        }
+        if (m->stop) {
+            LeaveCriticalSection(&m->cs);
+            return;
+        }
+
+        // Fill one chunk from the stream at the head of round-robin queue
+        s = list_pop(m->streams, 0);
+        frame = raw;
+        len = 0;
+        flags = 0;
+        while (len < MUX_CHUNK_LEN && s->queue->length) {
+            o = s->queue->head->data;
+            left = o->len - o->pos;
+            n = left < MUX_CHUNK_LEN - len ? (DWORD) left : MUX_CHUNK_LEN - len;
+            memcpy(raw + FRAME_HEADER_LEN + len, o->buf + o->pos, n);
+            o->pos += n;
+            len += n;
+
+            if (o->pos < o->len) break;
+            list_pop(s->queue, 0);
+            if (o->fin) flags |= FRAME_FIN;
+            if (o->pause) m->paused = TRUE;
+            mux_releaseOut(o);
+            if (flags & FRAME_FIN) break;
+        }
+
+        stream_id = s->stream_id;
+        compress = m->compress && len >= MUX_LZ_MIN_LEN && s->lz_fails < MUX_LZ_MAX_FAILS;
+
+        // Stream goes to the back of the queue, or is finished
+        if (s->queue->length)
+            list_append(m->streams, s);
+        else {
+            free(s->queue);
+            free(s);
+        }
+        LeaveCriticalSection(&m->cs);
+
+        // Compress chunk, give up on streams with incompressible data (e.g. images)
+        raw_len = len;
+        if (compress) {
+            n = lz_compress(raw + FRAME_HEADER_LEN, len, lz + FRAME_HEADER_LEN, len - len / 16);
+            if (n) {
+                frame = lz;
+                len = n;
+                flags |= FRAME_LZ;
+            }
+            else {
+                EnterCriticalSection(&m->cs);
+                for (i = m->streams->head; i != NULL; i = i->next)
+                    if (((MuxStream*) i->data)->stream_id == stream_id) {
+                        ((MuxStream*) i->data)->lz_fails++;
+                        break;
+                    }
+                LeaveCriticalSection(&m->cs);
+            }
+        }
+        m->bytes_raw += raw_len;
+        m->bytes_sent += len;
+
+        memcpy(frame, &stream_id, sizeof(DWORD));
+        frame[sizeof(DWORD)] = (char) flags;
+        memcpy(frame + sizeof(DWORD) + 1, &len, sizeof(DWORD));
+
+        for (sent = 0; sent < FRAME_HEADER_LEN + len; sent += res) {
+            res = send(m->sock, frame + sent, (int) (FRAME_HEADER_LEN + len - sent), 0);
+            if (res == SOCKET_ERROR || res == 0) break;
+        }
+        if (sent < FRAME_HEADER_LEN + len) {
+#ifdef DEBUG
+            fprintf(stderr, "[mux] send() failed, dropping queue\r\n");
+#endif
+            EnterCriticalSection(&m->cs);
+            m->dead = TRUE;
+            mux_dropAll(m);
+            LeaveCriticalSection(&m->cs);
+        }
+    }
+}
+
+int mux_recvframe(Mux* m, MuxFrame* f) {
+    /**
+     * @brief Receive one frame: header and payload
+     * @return  length of frame, 0 if connection closed, SOCKET_ERROR on error
+     */
+    char *hdr, *tmp;
+    int res;
+
+    res = (int) recvlen(FRAME_HEADER_LEN, &hdr, m->sock);
+    if (res <= 0) return res;
+    if (res != FRAME_HEADER_LEN) { free(hdr); return SOCKET_ERROR; }
+
+    memcpy(&f->stream_id, hdr, sizeof(DWORD));
+    f->flags = (BYTE) hdr[sizeof(DWORD)];
+    memcpy(&f->len, hdr + sizeof(DWORD) + 1, sizeof(DWORD));
+    free(hdr);
+
+    f->buf = NULL;
+    if (f->len > MUX_CHUNK_LEN) return SOCKET_ERROR;
+    if (f->len == 0) return FRAME_HEADER_LEN;
+
+    res = (int) recvlen(f->len, &f->buf, m->sock);
+    if (res <= 0) return res;
+
+    if (f->flags & FRAME_LZ) {
+        tmp = malloc(MUX_CHUNK_LEN);
+        if (!tmp) { free(f->buf); return SOCKET_ERROR; }
+        res = lz_decompress(f->buf, f->len, tmp, MUX_CHUNK_LEN);
+        free(f->buf);
+        f->buf = tmp;
+        if (res <= 0) { free(tmp); return SOCKET_ERROR; }
+        f->len = res;
+        f->flags &= ~FRAME_LZ;
+    }
+    return FRAME_HEADER_LEN + res;
+}
+
+LONGLONG mux_collect(Mux* m, MuxFrame* f, char** ptr) {
+    /**
+     * @brief Reassemble messages from frames. Takes ownership of f->buf
+     * @return
+     *  length of message and *ptr = message, if frame completes a message;
+     *  0 if message is not complete yet (or is empty);
+     *  SOCKET_ERROR once, if message on this stream exceeds MAX_BUF_LEN (rest of it is discarded)
+     */
+    MuxIn* in = NULL;
+    Item *i, *prev = NULL;
+    char* tmp;
+    LONGLONG len;
+
+    for (i = m->partial->head; i != NULL; prev = i, i = i->next)
+        if (((MuxIn*) i->data)->stream_id == f->stream_id) {
+            in = i->data;
+            break;
+        }
+
+    // Whole message in one frame: no copy
+    if (!in && (f->flags & FRAME_FIN)) {
+        *ptr = f->buf;
+        return (LONGLONG) f->len;
+    }
+
+    if (!in) {
+        in = calloc(1, sizeof(MuxIn));
+        if (!in) { free(f->buf); return SOCKET_ERROR; }
+        in->stream_id = f->stream_id;
+        list_append(m->partial, in);
+        prev = m->partial->length > 1 ? list_getitem(m->partial, m->partial->length - 2) : NULL;
+    }
+
+    if (!in->dropped && in->len + f->len > MAX_BUF_LEN) {
+        // Too large message. Deny.
+        free(in->buf);
+        in->buf = NULL;
+        in->len = in->size = 0;
+        in->dropped = TRUE;
+        free(f->buf);
+        if (f->flags & FRAME_FIN) {
+            list_popnext(m->partial, prev);
+            free(in);
+        }
+        return SOCKET_ERROR;
+    }
+
+    if (!in->dropped && f->len) {
+        if (in->len + f->len > in->size) {
+            in->size = in->size ? in->size * 2 : MUX_CHUNK_LEN;
+            while (in->size < in->len + f->len) in->size *= 2;
+            tmp = realloc(in->buf, in->size);
+            if (!tmp) { free(f->buf); return SOCKET_ERROR; }
+            in->buf = tmp;
+        }
+        memcpy(in->buf + in->len, f->buf, f->len);
+        in->len += f->len;
+    }
+    free(f->buf);
+    f->buf = NULL;
+
+    if (!(f->flags & FRAME_FIN)) return 0;
+
+    list_popnext(m->partial, prev);
+    *ptr = in->buf;
+    len = in->dropped ? 0 : (LONGLONG) in->len;
+    free(in);
+    return len;
+}
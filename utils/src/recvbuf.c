@@ -1,23 +1,77 @@
 #include <stdio.h>
 #include "../include/recvbuf.h"
+#include "../include/scan.h"
 
 #ifdef SERVER
 static thread_local char *_buf = NULL;
-static thread_local int end = 0;
-static thread_local int size = BASE_BUF_LEN;
+static thread_local ULONGLONG start = 0;
+static thread_local ULONGLONG end = 0;
+static thread_local ULONGLONG scanned = 0;
+static thread_local ULONGLONG size = BASE_BUF_LEN;
 #else
 static char *_buf = NULL;
-static int end = 0;
-static int size = BASE_BUF_LEN;
+static ULONGLONG start = 0;
+static ULONGLONG end = 0;
+static ULONGLONG scanned = 0;
+static ULONGLONG size = BASE_BUF_LEN;
 #endif
 
-int recvuntil(char delim, char **ptr, SOCKET sock) {
+// recv() takes int length
+#define RECV_MAX 0x40000000
+
+
+static LONGLONG popBuf(ULONGLONG len, char **ptr) {
+    /**
+     * @brief Copy first `len` pending bytes to 'return buffer', advance `start` past them
+     * @details
+     *  Remaining data is not moved: pipelined messages are taken one after another
+     *  from the same buffer, it is compacted only before the next recv().
+     */
+    char *ret = calloc(len ? len : 1, sizeof(char));
+    if (!ret) { free(_buf); _buf = NULL; return SOCKET_ERROR; }
+
+    memcpy(ret, _buf + start, len);
+    start += len;
+    if (start == end) start = end = 0;
+    scanned = start;
+    *ptr = ret;
+    return (LONGLONG) len;
+}
+
+static void compactBuf(ULONGLONG need) {
+    /**
+     * @brief Move pending data to the beginning of buffer, shrink buffer (if much larger than `need`)
+     */
+    ULONGLONG new_size;
+    char *tmp;
+
+    if (start) {
+        memmove(_buf, _buf + start, end - start);
+        end -= start;
+        scanned -= start;
+        start = 0;
+    }
+
+    if (need < end) need = end;
+    new_size = need + BASE_BUF_LEN - need % BASE_BUF_LEN;
+    if (new_size + BASE_BUF_LEN + 1 < size) {
+        tmp = realloc(_buf, new_size);
+        if (tmp) {
+            _buf = tmp;
+            size = new_size;
+        }
+    }
+}
+
+LONGLONG recvuntil(char delim, char **ptr, SOCKET sock) {
     /**
      * @brief Allocate buffer and receive until `delimiter` char
      * @details
      *  Uses thread-local (for server) or shared (for client) static buffer.
      *  Buffer state persists between calls.
+     *      start = index of first pending byte in buffer
      *      end = current index of last received byte in buffer
+     *      scanned = bytes before this index have no delimiter
      *      size = current buffer size
      *
      *  Algorithm
@@ -27,14 +81,15 @@ int recvuntil(char delim, char **ptr, SOCKET sock) {
      *          size = BASE_LEN
      *
      *      while True:
-     *          if delim in buf[0:end]:
+     *          if delim in buf[scanned:end]:
      *              pos = index of delim
-     *              allocate 'return buffer', copy first `pos` bytes
-     *              pop first `pos` bytes from buffer, shift remaining data
-     *              shrink buffer, decrease size
+     *              allocate 'return buffer', copy bytes from `start` to `pos`
+     *              start = pos + 1
      *              *ptr = 'return buffer'
      *              return len
      *          else:
+     *              scanned = end
+     *              move buf[start:end] to the beginning, shrink buffer
      *              n = recv( &buf[end] <- (size-end) bytes )
      *              end = end + n
      *              if end > MAX_SIZE:
@@ -42,51 +97,34 @@ int recvuntil(char delim, char **ptr, SOCKET sock) {
      *              if end >= size:
      *                  extend buffer, increase size
      *
+     *  Each byte is scanned once (SIMD, see scan.h), however many recv() it takes to get the delimiter.
+     *
      *  Illustration
      *
      *      Please refer to docs.
      */
-    int n, pos, new_size;
-    char *tmp, *ret;
+    int n;
+    ULONGLONG pos;
+    char *tmp;
 
     if (!_buf) {
         _buf = calloc(1, BASE_BUF_LEN);
         size = BASE_BUF_LEN;
-        end = 0;
+        start = end = scanned = 0;
         if (!_buf) return SOCKET_ERROR;
     }
 
     while (TRUE) {
-        tmp = memchr(_buf, delim, end);
-        if (tmp != NULL) {
-
+        pos = scanned + scan_find(_buf + scanned, end - scanned, &delim, 1);
+        if (pos < end) {
             // Delimiter is at `pos`
-            pos = tmp - _buf + 1;
-
-            // Allocate 'return buffer'
-            ret = calloc(pos, sizeof(char));
-            if (!ret) { free(_buf); _buf = NULL; return SOCKET_ERROR; }
-
-            // Cut first `pos` bytes from buf, shift buf
-            end -= pos;
-            memcpy(ret, _buf, pos);
-            memmove(_buf, _buf+pos, end);
-
-            // Shrink buf (if needed)
-            new_size = end + BASE_BUF_LEN - end % BASE_BUF_LEN;
-            if (new_size + BASE_BUF_LEN + 1 < size) {
-                tmp = realloc(_buf, new_size);
-                if (tmp) {
-                    _buf = tmp;
-                    size = new_size;
-                }
-            }
-            *ptr = ret;
-            return pos;
+            return popBuf(pos - start + 1, ptr);
         }
+        scanned = end;
 
         // No delimiter, continue receiving
-        n = recv(sock, _buf+end, size-end, 0);
+        compactBuf(0);
+        n = recv(sock, _buf+end, (int) (size-end < RECV_MAX ? size-end : RECV_MAX), 0);
         if (n == SOCKET_ERROR || n == 0) {
             if (_buf) free(_buf);
             _buf = NULL;
@@ -116,14 +154,12 @@ int recvuntil(char delim, char **ptr, SOCKET sock) {
     }
 }
 
-int recvlen(DWORD len, char **ptr, SOCKET sock) {
+LONGLONG recvlen(ULONGLONG len, char **ptr, SOCKET sock) {
     /**
      * @brief Allocate buffer and receive exactly `len` characters
      * @details
      *  Uses thread-local (for server) or shared (for client) static buffer.
-     *  Buffer state persists between calls.
-     *      end = current index of last received byte in buffer
-     *      size = current buffer size
+     *  Buffer state persists between calls (see recvuntil()).
      *
      *  Algorithm
      *
@@ -135,21 +171,23 @@ int recvlen(DWORD len, char **ptr, SOCKET sock) {
      *          allocate buf
      *          size = BASE_LEN
      *
-     *      extend if needed
-     *
      *      while True:
-     *          if end >= len:   (buffer has enough data)
-     *              allocate 'return buffer', copy first `len` bytes
-     *              pop first `len` bytes from buffer, shift remaining data
-     *              shrink buffer, decrease size
+     *          if end - start >= len:   (buffer has enough data)
+     *              allocate 'return buffer', copy `len` bytes from `start`
+     *              start = start + len
      *              *ptr = 'return buffer'
      *              return len
      *          else:
+     *              move buf[start:end] to the beginning, shrink buffer
+     *              extend if needed
      *              n = recv( &buf[end] <- (size-end) bytes )
      *              end = end + n
+     *
+     *  Frame header and payload of mux are taken this way: a recv() full of small frames
+     *  costs one copy of each frame, pending data is moved once per recv().
      */
-    int n, new_size;
-    char *ret, *tmp;
+    int n;
+    char *tmp;
 
     if (len > MAX_BUF_LEN) {
         // too large message. Deny.
@@ -160,50 +198,31 @@ int recvlen(DWORD len, char **ptr, SOCKET sock) {
     if (!_buf) {
         _buf = calloc(1, BASE_BUF_LEN);
         size = BASE_BUF_LEN;
-        end = 0;
+        start = end = scanned = 0;
         if (!_buf) return SOCKET_ERROR;
     }
 
-    // extend buffer if needed
-    if (size < len) {
-        size = len + BASE_BUF_LEN - len % BASE_BUF_LEN;
-        tmp = realloc(_buf, size);
-        if (!tmp) {
-            free(_buf);
-            _buf = NULL;
-            return SOCKET_ERROR;
-        }
-        _buf = tmp;
-    }
-
     while (TRUE) {
         // Buffer already has `len` bytes?
-        if (end >= len) {
-
-            // Allocate 'return buffer'
-            ret = calloc(len, sizeof(char));
-            if (!ret) { free(_buf); _buf = NULL; return SOCKET_ERROR; }
-
-            // Cut first `len` bytes, shift buf
-            end -= len;
-            memcpy(ret, _buf, len);
-            memmove(_buf, _buf+len, end);
-
-            // Shrink buf if needed
-            new_size = end + BASE_BUF_LEN - end % BASE_BUF_LEN;
-            if (new_size + BASE_BUF_LEN + 1 < size) {
-                tmp = realloc(_buf, new_size);
-                if (tmp) {
-                    _buf = tmp;
-                    size = new_size;
-                }
+        if (end - start >= len)
+            return popBuf(len, ptr);
+
+        // Not enough bytes received, continue
+        compactBuf(len);
+
+        // extend buffer if needed
+        if (size < len) {
+            size = len + BASE_BUF_LEN - len % BASE_BUF_LEN;
+            tmp = realloc(_buf, size);
+            if (!tmp) {
+                free(_buf);
+                _buf = NULL;
+                return SOCKET_ERROR;
             }
-            *ptr = ret;
-            return len;
+            _buf = tmp;
         }
 
-        // Not enough bytes received, continue
-        n = recv(sock, _buf+end, size-end, 0);
+        n = recv(sock, _buf+end, (int) (size-end < RECV_MAX ? size-end : RECV_MAX), 0);
         if (n == SOCKET_ERROR || n == 0) {
             if (_buf) free(_buf);
             _buf = NULL;
@@ -212,3 +231,14 @@ int recvlen(DWORD len, char **ptr, SOCKET sock) {
         end += n;
     }
 }
+
+void recvrelease() {
+    /**
+     * @brief Free receive buffer of calling thread, pending data is dropped
+     * @details Server calls it when connection ends, so the thread does not keep its buffer until it exits.
+     */
+    free(_buf);
+    _buf = NULL;
+    start = end = scanned = 0;
+    size = BASE_BUF_LEN;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/ring.h"
+
+#define RING_NAME_LEN 260
+#define RING_WAKE_MAX 0x7FFFFFFF
+
+// Writer may be filling up to size/2 bytes past head (padding and a record of at most size/4)
+#define lapped(r) ((r)->hdr->serial != (r)->serial || (r)->hdr->head - (r)->pos > (r)->hdr->size / 2)
+
+
+static ULONGLONG ring_size(HANDLE map) {
+    /**
+     * @brief Size of data from header of an existing ring, 0 if it is not one
+     */
+    RingHeader* hdr = MapViewOfFile(map, FILE_MAP_READ, 0, 0, RING_HEADER_LEN);
+    ULONGLONG size;
+
+    if (!hdr) return 0;
+    size = memcmp(hdr->magic, RING_MAGIC, sizeof(hdr->magic)) ? 0 : hdr->size;
+    UnmapViewOfFile(hdr);
+    return size;
+}
+
+static Ring* ring_map(const char* name, ULONGLONG size, bool writer) {
+    /**
+     * @brief Create (writer) or open (consumer) mappings and semaphore of ring
+     * @details Consumer maps data read-only: it can not damage what other consumers read.
+     *  A mapping that still exists (consumers of the previous run hold it) keeps its size.
+     */
+    char ctl_name[RING_NAME_LEN], wake_name[RING_NAME_LEN];
+    ULONGLONG total = RING_HEADER_LEN + size;
+    Ring* r;
+
+    snprintf(ctl_name, RING_NAME_LEN, "%s-ctl", name);
+    snprintf(wake_name, RING_NAME_LEN, "%s-wake", name);
+
+    r = calloc(1, sizeof(Ring));
+    if (!r) return NULL;
+
+    if (writer) {
+        r->map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD) (total >> 32), (DWORD) total, name);
+        if (r->map && GetLastError() == ERROR_ALREADY_EXISTS) size = ring_size(r->map);
+        r->ctl_map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(RingCtl), ctl_name);
+        r->wake = CreateSemaphoreA(NULL, 0, RING_WAKE_MAX, wake_name);
+    }
+    else {
+        r->map = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+        if (r->map) size = ring_size(r->map);
+        r->ctl_map = OpenFileMappingA(FILE_MAP_WRITE, FALSE, ctl_name);
+        r->wake = OpenSemaphoreA(SYNCHRONIZE, FALSE, wake_name);
+    }
+    if (!r->map || !r->ctl_map || !r->wake || !size) {
+        ring_close(r);
+        return NULL;
+    }
+
+    total = RING_HEADER_LEN + size;
+    r->hdr = MapViewOfFile(r->map, writer ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, total);
+    r->ctl = MapViewOfFile(r->ctl_map, FILE_MAP_WRITE, 0, 0, sizeof(RingCtl));
+    if (!r->hdr || !r->ctl) {
+        ring_close(r);
+        return NULL;
+    }
+    r->data = (char*) r->hdr + RING_HEADER_LEN;
+    return r;
+}
+
+Ring* ring_create(const char* name, ULONGLONG size) {
+    /**
+     * @brief Create ring for writing, `size` of data is rounded down to a power of 2
+     * @details If consumers of the previous run still hold the ring, it is reused as it is:
+     *  head goes on from where it was, and the new serial tells them to skip to it.
+     */
+    ULONGLONG p = RING_HEADER_LEN;
+    Ring* r;
+
+    while (p * 2 <= size) p *= 2;
+    r = ring_map(name, p, TRUE);
+    if (!r) return NULL;
+
+    if (memcmp(r->hdr->magic, RING_MAGIC, sizeof(r->hdr->magic))) {
+        r->hdr->size = p;
+        r->hdr->head = 0;
+        r->hdr->records = 0;
+    }
+    r->hdr->serial = GetTickCount64() ^ ((ULONGLONG) GetCurrentProcessId() << 32);
+    MemoryBarrier();
+    memcpy(r->hdr->magic, RING_MAGIC, sizeof(r->hdr->magic));
+    return r;
+}
+
+bool ring_write(Ring* r, RingRecord* rec, const char* body) {
+    /**
+     * @brief Publish record and `rec->body_len` bytes of body, wake sleeping consumers
+     * @details Body longer than a quarter of ring is cut (rec->msg_len keeps full length).
+     *  One writer at a time: caller serializes.
+     */
+    ULONGLONG size = r->hdr->size, head = r->hdr->head, off = head & (size - 1);
+    ULONGLONG max_body = RING_BODY_MAX(size);
+    RingRecord* pad;
+    DWORD len;
+
+    if (rec->body_len > max_body) rec->body_len = (DWORD) max_body;
+    len = (DWORD) ((sizeof(RingRecord) + rec->body_len + RING_ALIGN - 1) & ~(ULONGLONG) (RING_ALIGN - 1));
+
+    // Records are contiguous: pad the end of data if record does not fit there
+    if (off + len > size) {
+        pad = (RingRecord*) (r->data + off);
+        pad->len = (DWORD) (size - off);
+        pad->type = RING_TYPE_PAD;
+        head += size - off;
+        off = 0;
+    }
+    rec->len = len;
+    memcpy(r->data + off, rec, sizeof(RingRecord));
+    memcpy(r->data + off + sizeof(RingRecord), body, rec->body_len);
+
+    // Record is complete before head moves past it
+    MemoryBarrier();
+    r->hdr->head = head + len;
+    r->hdr->records++;
+
+    // Consumers announce themselves before they recheck head and sleep
+    MemoryBarrier();
+    if (r->ctl->waiters > 0) ReleaseSemaphore(r->wake, r->ctl->waiters, NULL);
+    return TRUE;
+}
+
+Ring* ring_open(const char* name) {
+    /**
+     * @brief Open ring for reading, first record read is the next one published
+     */
+    Ring* r = ring_map(name, 0, FALSE);
+    if (!r) return NULL;
+    r->serial = r->hdr->serial;
+    MemoryBarrier();
+    r->pos = r->hdr->head;
+    return r;
+}
+
+static void ring_skip(Ring* r) {
+    /**
+     * @brief Consumer was lapped or writer restarted: continue from head
+     * @details Bytes of records the consumer did not read (before restart too) count as lost.
+     */
+    ULONGLONG head;
+
+    r->serial = r->hdr->serial;
+    MemoryBarrier();
+    head = r->hdr->head;
+    if (head > r->pos) r->lost += head - r->pos;
+    r->pos = head;
+}
+
+const RingRecord* ring_peek(Ring* r) {
+    /**
+     * @brief Next record in place (no copy), NULL if there is none yet
+     * @details Writer may overwrite it while it is read: call ring_next() before using what was read.
+     */
+    const RingRecord* rec;
+    ULONGLONG size = r->hdr->size, off;
+
+    while (TRUE) {
+        if (lapped(r)) {
+            ring_skip(r);
+            continue;
+        }
+        if (r->pos == r->hdr->head) return NULL;
+        MemoryBarrier();
+
+        off = r->pos & (size - 1);
+        rec = (const RingRecord*) (r->data + off);
+        if (rec->type != RING_TYPE_PAD) return rec;
+
+        // Padding always ends at the end of data
+        MemoryBarrier();
+        if (!lapped(r)) r->pos += size - off;
+    }
+}
+
+bool ring_next(Ring* r) {
+    /**
+     * @brief Move past the record of ring_peek()
+     * @return FALSE if writer reached the record meanwhile: what was read of it is garbage
+     */
+    const RingRecord* rec = (const RingRecord*) (r->data + (r->pos & (r->hdr->size - 1)));
+    DWORD len = rec->len;
+
+    MemoryBarrier();
+    if (lapped(r) || len < sizeof(RingRecord) || len > r->hdr->size / 4) {
+        ring_skip(r);
+        return FALSE;
+    }
+    r->pos += len;
+    return TRUE;
+}
+
+bool ring_read(Ring* r, RingRecord* rec, char* body, DWORD cap) {
+    /**
+     * @brief Copy next record and its body out of ring and move past it, FALSE if there is none yet
+     * @details Until ring_next() confirms it, what is read may be a newer record the writer puts over it:
+     *  its body_len can be anything. Header and body are copied only up to the end of data, body is cut
+     *  to `cap` bytes (rec->body_len is what was copied). Records overwritten meanwhile are skipped.
+     */
+    const RingRecord* in;
+    ULONGLONG size = r->hdr->size, room;
+
+    while ((in = ring_peek(r)) != NULL) {
+        room = size - (r->pos & (size - 1));
+        if (room < sizeof(RingRecord)) {
+            // Writer never starts a record there: it is over this one already
+            ring_skip(r);
+            continue;
+        }
+        memcpy(rec, in, sizeof(RingRecord));
+        room -= sizeof(RingRecord);
+        if (rec->body_len > room) rec->body_len = (DWORD) room;
+        if (rec->body_len > cap) rec->body_len = cap;
+        memcpy(body, in + 1, rec->body_len);
+        if (ring_next(r)) return TRUE;
+    }
+    return FALSE;
+}
+
+void ring_wait(Ring* r, DWORD ms) {
+    /**
+     * @brief Sleep until a record is published or `ms` pass (no syscall if there is a record already)
+     */
+    InterlockedIncrement(&r->ctl->waiters);
+    if (r->pos == r->hdr->head && r->serial == r->hdr->serial)
+        WaitForSingleObject(r->wake, ms);
+    InterlockedDecrement(&r->ctl->waiters);
+}
+
+void ring_close(Ring* r) {
+    if (!r) return;
+    if (r->hdr) UnmapViewOfFile(r->hdr);
+    if (r->ctl) UnmapViewOfFile(r->ctl);
+    if (r->map) CloseHandle(r->map);
+    if (r->ctl_map) CloseHandle(r->ctl_map);
+    if (r->wake) CloseHandle(r->wake);
+    free(r);
+}
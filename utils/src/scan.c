@@ -0,0 +1,163 @@
+#include <string.h>
+#include "../include/scan.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SCAN_AVX2
+#define SCAN_AVX2_FN __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h>
+#include <immintrin.h>
+#define SCAN_AVX2
+#define SCAN_AVX2_FN
+#endif
+
+static volatile LONG scan_avx2 = -1;    // CPU and OS support AVX2 (-1 = not checked yet)
+
+
+static inline DWORD scan_ctz(DWORD mask) {
+    /**
+     * @brief Index of lowest set bit (mask != 0)
+     */
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (DWORD) i;
+#else
+    return (DWORD) __builtin_ctz(mask);
+#endif
+}
+
+static bool scan_has_avx2() {
+#if defined(SCAN_AVX2) && defined(_MSC_VER)
+    int info[4];
+    if (scan_avx2 < 0) {
+        __cpuid(info, 0);
+        scan_avx2 = 0;
+        if (info[0] >= 7) {
+            __cpuid(info, 1);
+            // OSXSAVE and AVX, OS saves YMM registers, then AVX2
+            if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+                __cpuidex(info, 7, 0);
+                scan_avx2 = (info[1] & (1 << 5)) != 0;
+            }
+        }
+    }
+#elif defined(SCAN_AVX2)
+    if (scan_avx2 < 0) scan_avx2 = __builtin_cpu_supports("avx2") != 0;
+#else
+    scan_avx2 = 0;
+#endif
+    return scan_avx2 > 0;
+}
+
+static inline bool scan_is_delim(BYTE ch, const char* delims, DWORD n_delims) {
+    for (DWORD k = 0; k < n_delims; k++)
+        if (ch == (BYTE) delims[k]) return TRUE;
+    return FALSE;
+}
+
+
+#ifdef SCAN_AVX2
+SCAN_AVX2_FN static ULONGLONG scan_avx2_mask(const BYTE* p, ULONGLONG len, const char* delims, DWORD n_delims,
+                                             ULONGLONG* offs, ULONGLONG max, ULONGLONG* found) {
+    /**
+     * @brief 64 bytes per step. Stops after `max` delimiters
+     * @return number of bytes scanned (multiple of 64, or up to the last delimiter found)
+     */
+    __m256i d[SCAN_DELIMS_MAX], v, w, eq, eq2;
+    DWORD mask;
+    ULONGLONG i;
+
+    for (DWORD k = 0; k < n_delims; k++)
+        d[k] = _mm256_set1_epi8(delims[k]);
+
+    // 64 bytes per step, one test for both halves: long runs without delimiter are the common case
+    for (i = 0; i + 64 <= len; i += 64) {
+        v = _mm256_loadu_si256((const __m256i*) (p + i));
+        w = _mm256_loadu_si256((const __m256i*) (p + i + 32));
+        eq = _mm256_cmpeq_epi8(v, d[0]);
+        eq2 = _mm256_cmpeq_epi8(w, d[0]);
+        for (DWORD k = 1; k < n_delims; k++) {
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(v, d[k]));
+            eq2 = _mm256_or_si256(eq2, _mm256_cmpeq_epi8(w, d[k]));
+        }
+        if (_mm256_testz_si256(_mm256_or_si256(eq, eq2), _mm256_or_si256(eq, eq2))) continue;
+
+        for (mask = (DWORD) _mm256_movemask_epi8(eq); mask; mask &= mask - 1) {
+            offs[(*found)++] = i + scan_ctz(mask);
+            if (*found == max) return offs[*found - 1] + 1;
+        }
+        for (mask = (DWORD) _mm256_movemask_epi8(eq2); mask; mask &= mask - 1) {
+            offs[(*found)++] = i + 32 + scan_ctz(mask);
+            if (*found == max) return offs[*found - 1] + 1;
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef SCAN_SSE2
+static ULONGLONG scan_sse2_mask(const BYTE* p, ULONGLONG len, const char* delims, DWORD n_delims,
+                                ULONGLONG* offs, ULONGLONG max, ULONGLONG* found) {
+    /**
+     * @brief 16 bytes per step. Same as scan_avx2_mask()
+     */
+    __m128i d[SCAN_DELIMS_MAX], v, eq;
+    DWORD mask;
+    ULONGLONG i;
+
+    for (DWORD k = 0; k < n_delims; k++)
+        d[k] = _mm_set1_epi8(delims[k]);
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i*) (p + i));
+        eq = _mm_cmpeq_epi8(v, d[0]);
+        for (DWORD k = 1; k < n_delims; k++)
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, d[k]));
+        for (mask = (DWORD) _mm_movemask_epi8(eq); mask; mask &= mask - 1) {
+            offs[(*found)++] = i + scan_ctz(mask);
+            if (*found == max) return offs[*found - 1] + 1;
+        }
+    }
+    return i;
+}
+#endif
+
+ULONGLONG scan_split(const char* buf, ULONGLONG len, const char* delims, DWORD n_delims, ULONGLONG* offs, ULONGLONG max) {
+    /**
+     * @brief Find offsets of delimiters in `buf`, in one pass
+     * @details Pipelined \0-terminated records are split at once, instead of a memchr() per record.
+     * @return number of offsets written to `offs` (at most `max`)
+     */
+    const BYTE* p = (const BYTE*) buf;
+    ULONGLONG i = 0, found = 0;
+
+    if (!n_delims || n_delims > SCAN_DELIMS_MAX || !max) return 0;
+
+#ifdef SCAN_AVX2
+    if (scan_has_avx2()) i = scan_avx2_mask(p, len, delims, n_delims, offs, max, &found);
+#ifdef SCAN_SSE2
+    else i = scan_sse2_mask(p, len, delims, n_delims, offs, max, &found);
+#endif
+#elif defined(SCAN_SSE2)
+    i = scan_sse2_mask(p, len, delims, n_delims, offs, max, &found);
+#endif
+
+    for (; i < len && found < max; i++)
+        if (scan_is_delim(p[i], delims, n_delims)) offs[found++] = i;
+    return found;
+}
+
+ULONGLONG scan_find(const char* buf, ULONGLONG len, const char* delims, DWORD n_delims) {
+    /**
+     * @brief Offset of the first delimiter in `buf`, `len` if there is none
+     */
+    ULONGLONG off;
+    return scan_split(buf, len, delims, n_delims, &off, 1) ? off : len;
+}